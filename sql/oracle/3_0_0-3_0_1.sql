@@ -0,0 +1,33 @@
+
+ALTER TABLE dbmail_messages ADD seq number(20) DEFAULT '0' NOT NULL;
+CREATE INDEX dbmail_messages_mbox_seq_idx ON dbmail_messages (mailbox_idnr, seq) TABLESPACE DBMAIL_TS_IDX;
+
+CREATE TABLE dbmail_bodyterms (
+  term varchar2(32) NOT NULL,
+  physmessage_id number(20) NOT NULL
+);
+CREATE UNIQUE INDEX dbmail_bodyterms_idx ON dbmail_bodyterms (term, physmessage_id) TABLESPACE DBMAIL_TS_IDX;
+ALTER TABLE dbmail_bodyterms ADD CONSTRAINT dbmail_bodyterms_pk PRIMARY KEY (term, physmessage_id) USING INDEX dbmail_bodyterms_idx;
+CREATE INDEX dbmail_bodyterms_msg_idx ON dbmail_bodyterms (physmessage_id) TABLESPACE DBMAIL_TS_IDX;
+ALTER TABLE dbmail_bodyterms ADD CONSTRAINT dbmail_bodyterms_fk1 FOREIGN KEY (physmessage_id) REFERENCES dbmail_physmessage (id) ON DELETE CASCADE;
+
+CREATE TABLE dbmail_sortkeys (
+  physmessage_id number(20) NOT NULL,
+  subject varchar2(255) default NULL,
+  fromaddr varchar2(255) default NULL,
+  toaddr varchar2(255) default NULL,
+  ccaddr varchar2(255) default NULL,
+  sentdate timestamp default NULL
+);
+CREATE UNIQUE INDEX dbmail_sortkeys_idx ON dbmail_sortkeys (physmessage_id) TABLESPACE DBMAIL_TS_IDX;
+ALTER TABLE dbmail_sortkeys ADD CONSTRAINT dbmail_sortkeys_pk PRIMARY KEY (physmessage_id) USING INDEX dbmail_sortkeys_idx;
+ALTER TABLE dbmail_sortkeys ADD CONSTRAINT dbmail_sortkeys_fk1 FOREIGN KEY (physmessage_id) REFERENCES dbmail_physmessage (id) ON DELETE CASCADE;
+
+CREATE TABLE dbmail_generations (
+  name varchar2(32) NOT NULL,
+  generation number(20) default '0' NOT NULL
+);
+CREATE UNIQUE INDEX dbmail_generations_idx ON dbmail_generations (name) TABLESPACE DBMAIL_TS_IDX;
+ALTER TABLE dbmail_generations ADD CONSTRAINT dbmail_generations_pk PRIMARY KEY (name) USING INDEX dbmail_generations_idx;
+INSERT INTO dbmail_generations (name) VALUES ('auth');
+INSERT INTO dbmail_generations (name) VALUES ('sieve');
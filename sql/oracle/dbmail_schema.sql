@@ -298,7 +298,8 @@ CREATE TABLE dbmail_messages (
   recent_flag number(1) DEFAULT '0' NOT NULL,
   draft_flag number(1) DEFAULT '0' NOT NULL,
   unique_id varchar2(70) default NULL,
-  status number(3) DEFAULT '0' NOT NULL
+  status number(3) DEFAULT '0' NOT NULL,
+  seq number(20) DEFAULT '0' NOT NULL
 );
 CREATE UNIQUE INDEX dbmail_messages_idx ON dbmail_messages (message_idnr) TABLESPACE DBMAIL_TS_IDX;
 ALTER TABLE dbmail_messages ADD CONSTRAINT dbmail_messages_pk PRIMARY KEY (message_idnr) USING INDEX dbmail_messages_idx;
@@ -320,6 +321,7 @@ CREATE INDEX dbmail_messages_seen_flag_idx ON dbmail_messages (seen_flag) TABLES
 CREATE INDEX dbmail_messages_unique_id_idx ON dbmail_messages (unique_id ) TABLESPACE DBMAIL_TS_IDX;
 CREATE INDEX dbmail_messages_status_idx ON dbmail_messages (status) TABLESPACE DBMAIL_TS_IDX;
 CREATE INDEX dbmail_messages_mbox_stat_idx ON dbmail_messages (mailbox_idnr, status) TABLESPACE DBMAIL_TS_IDX;
+CREATE INDEX dbmail_messages_mbox_seq_idx ON dbmail_messages (mailbox_idnr, seq) TABLESPACE DBMAIL_TS_IDX;
 
 
 --
@@ -444,6 +446,46 @@ END;
 
 CREATE UNIQUE INDEX dbmail_referencesfield_msg_idx ON dbmail_referencesfield (physmessage_id,referencesfield) TABLESPACE DBMAIL_TS_IDX;
 
+--
+-- Table structure for table `dbmail_bodyterms`
+--
+
+CREATE TABLE dbmail_bodyterms (
+  term varchar2(32) NOT NULL,
+  physmessage_id number(20) NOT NULL
+);
+CREATE UNIQUE INDEX dbmail_bodyterms_idx ON dbmail_bodyterms (term, physmessage_id) TABLESPACE DBMAIL_TS_IDX;
+ALTER TABLE dbmail_bodyterms ADD CONSTRAINT dbmail_bodyterms_pk PRIMARY KEY (term, physmessage_id) USING INDEX dbmail_bodyterms_idx;
+CREATE INDEX dbmail_bodyterms_msg_idx ON dbmail_bodyterms (physmessage_id) TABLESPACE DBMAIL_TS_IDX;
+
+--
+-- Table structure for table `dbmail_sortkeys`
+--
+
+CREATE TABLE dbmail_sortkeys (
+  physmessage_id number(20) NOT NULL,
+  subject varchar2(255) default NULL,
+  fromaddr varchar2(255) default NULL,
+  toaddr varchar2(255) default NULL,
+  ccaddr varchar2(255) default NULL,
+  sentdate timestamp default NULL
+);
+CREATE UNIQUE INDEX dbmail_sortkeys_idx ON dbmail_sortkeys (physmessage_id) TABLESPACE DBMAIL_TS_IDX;
+ALTER TABLE dbmail_sortkeys ADD CONSTRAINT dbmail_sortkeys_pk PRIMARY KEY (physmessage_id) USING INDEX dbmail_sortkeys_idx;
+
+--
+-- Table structure for table `dbmail_generations`
+--
+
+CREATE TABLE dbmail_generations (
+  name varchar2(32) NOT NULL,
+  generation number(20) default '0' NOT NULL
+);
+CREATE UNIQUE INDEX dbmail_generations_idx ON dbmail_generations (name) TABLESPACE DBMAIL_TS_IDX;
+ALTER TABLE dbmail_generations ADD CONSTRAINT dbmail_generations_pk PRIMARY KEY (name) USING INDEX dbmail_generations_idx;
+INSERT INTO dbmail_generations (name) VALUES ('auth');
+INSERT INTO dbmail_generations (name) VALUES ('sieve');
+
 
 --
 -- Table structure for table `dbmail_replycache`
@@ -540,6 +582,8 @@ ALTER TABLE dbmail_envelope ADD CONSTRAINT dbmail_envelope_fk1 FOREIGN KEY (phys
 ALTER TABLE dbmail_filters ADD CONSTRAINT dbmail_filters_fk1 FOREIGN KEY (user_id) REFERENCES dbmail_users (user_idnr) ON DELETE CASCADE;
 -- FK
 ALTER TABLE dbmail_header ADD CONSTRAINT dbmail_header_fk1 FOREIGN KEY (physmessage_id) REFERENCES dbmail_physmessage (id) ON DELETE CASCADE;
+ALTER TABLE dbmail_bodyterms ADD CONSTRAINT dbmail_bodyterms_fk1 FOREIGN KEY (physmessage_id) REFERENCES dbmail_physmessage (id) ON DELETE CASCADE;
+ALTER TABLE dbmail_sortkeys ADD CONSTRAINT dbmail_sortkeys_fk1 FOREIGN KEY (physmessage_id) REFERENCES dbmail_physmessage (id) ON DELETE CASCADE;
 ALTER TABLE dbmail_header ADD CONSTRAINT dbmail_header_fk2 FOREIGN KEY (headername_id) REFERENCES dbmail_headername (id) ON DELETE CASCADE;
 ALTER TABLE dbmail_header ADD CONSTRAINT dbmail_header_fk3 FOREIGN KEY (headervalue_id) REFERENCES dbmail_headervalue (id) ON DELETE CASCADE;
 -- FK
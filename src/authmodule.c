@@ -14,6 +14,208 @@ static auth_func_t *auth = NULL;
 
 extern db_param_t _db_params;
 
+/* [DBMAIL] auth_cache_ttl and auth_cache_size defaults */
+#define AUTH_CACHE_TTL 60
+#define AUTH_CACHE_SIZE 10000
+
+/*
+ * cached authentication lookups
+ *
+ * username to user_idnr, alias to delivery targets, user_idnr to
+ * maxmail_size and login to user_idnr are cached for auth_cache_ttl
+ * seconds, shared by all threads and bounded to auth_cache_size entries.
+ * Only positive answers are cached, so new users and aliases are seen
+ * right away.
+ *
+ * Credentials are kept as a salted sha256 of the password, never as
+ * plain text, and only for plain logins (not for SASL/ci->auth).
+ *
+ * Any change made through this interface flushes the local cache and
+ * bumps the "auth" generation in the database once the driver is done.
+ * Every process compares that generation at most once a second and drops
+ * its cache when it moved, so a password changed or an account removed
+ * with dbmail-users stops working everywhere within a second.
+ */
+typedef struct {
+	time_t expires;
+	u64_t id;		/* user_idnr or maxmail_size */
+	GList *userids;		/* delivery targets of an alias */
+	GList *fwds;
+	int occurences;
+	char *digest;		/* salted password digest */
+} AuthCacheEntry;
+
+static GHashTable *auth_cache = NULL;
+static GStaticMutex auth_cache_lock = G_STATIC_MUTEX_INIT;
+static char auth_cache_salt[17];
+static u64_t auth_cache_generation = 0;	/* last seen "auth" generation */
+static time_t auth_cache_checked = 0;	/* when it was last compared */
+static unsigned auth_cache_flushes = 0;	/* local flush count, see auth_cache_put */
+
+static void auth_cache_entry_free(AuthCacheEntry *E)
+{
+	g_list_destroy(E->userids);
+	g_list_destroy(E->fwds);
+	g_free(E->digest);
+	g_free(E);
+}
+
+static long auth_cache_ttl(void)
+{
+	return config_get_int("auth_cache_ttl", "DBMAIL", AUTH_CACHE_TTL);
+}
+
+static char * auth_cache_digest(const char *password)
+{
+	char *salted, *digest;
+
+	g_static_mutex_lock(&auth_cache_lock);
+	if (! auth_cache_salt[0]) {
+		int i;
+		for (i = 0; i < (int)sizeof(auth_cache_salt) - 1; i++)
+			auth_cache_salt[i] = 'a' + g_random_int_range(0, 26);
+	}
+	g_static_mutex_unlock(&auth_cache_lock);
+
+	salted = g_strconcat(auth_cache_salt, password, NULL);
+	digest = dm_sha256(salted);
+	memset(salted, 0, strlen(salted));
+	g_free(salted);
+
+	return digest;
+}
+
+/* call with auth_cache_lock held */
+static void auth_cache_clear(void)
+{
+	auth_cache_flushes++;
+	if (auth_cache) {
+		TRACE(TRACE_DEBUG, "flushing [%u] entries", g_hash_table_size(auth_cache));
+		g_hash_table_remove_all(auth_cache);
+	}
+}
+
+/* drop the cache if another process changed users or aliases; the
+ * database is asked at most once a second and never under the lock */
+static void auth_cache_sync(void)
+{
+	time_t now = time(NULL);
+	u64_t generation = 0;
+	gboolean check;
+	int t;
+
+	g_static_mutex_lock(&auth_cache_lock);
+	if ((check = (auth_cache_checked != now)))
+		auth_cache_checked = now;
+	g_static_mutex_unlock(&auth_cache_lock);
+
+	if (! check)
+		return;
+
+	t = db_generation_get("auth", &generation);
+
+	g_static_mutex_lock(&auth_cache_lock);
+	if (t != DM_SUCCESS || generation != auth_cache_generation) {
+		auth_cache_generation = generation;
+		auth_cache_clear();
+	}
+	g_static_mutex_unlock(&auth_cache_lock);
+}
+
+/* look up a live entry and copy what the caller needs
+ * while holding the lock; returns FALSE on a miss and
+ * sets mark for the auth_cache_put that follows it */
+static gboolean auth_cache_get(const char *key, u64_t *id, GList **userids, GList **fwds, 
+		int *occurences, const char *digest, unsigned *mark)
+{
+	AuthCacheEntry *E;
+	gboolean hit = FALSE;
+	GList *l;
+
+	*mark = 0;
+	if (auth_cache_ttl() <= 0)
+		return FALSE;
+
+	auth_cache_sync();
+
+	g_static_mutex_lock(&auth_cache_lock);
+	*mark = auth_cache_flushes;
+	if (auth_cache && (E = g_hash_table_lookup(auth_cache, key))) {
+		if (E->expires < time(NULL)) {
+			g_hash_table_remove(auth_cache, key);
+		} else if (! digest || (E->digest && MATCH(E->digest, digest))) {
+			if (id) *id = E->id;
+			if (occurences) *occurences = E->occurences;
+			for (l = g_list_last(E->userids); userids && l; l = g_list_previous(l)) {
+				u64_t *uid = g_new0(u64_t, 1);
+				*uid = *(u64_t *)l->data;
+				*userids = g_list_prepend(*userids, uid);
+			}
+			for (l = g_list_last(E->fwds); fwds && l; l = g_list_previous(l))
+				*fwds = g_list_prepend(*fwds, g_strdup((char *)l->data));
+			hit = TRUE;
+		}
+	}
+	g_static_mutex_unlock(&auth_cache_lock);
+
+	TRACE(TRACE_DEBUG, "[%s] [%s]", key, hit ? "hit" : "miss");
+
+	return hit;
+}
+
+static gboolean auth_cache_expired(gpointer key UNUSED, AuthCacheEntry *E, time_t *now)
+{
+	return E->expires < *now;
+}
+
+/* takes ownership of E; an answer looked up before a flush
+ * (mark no longer current) may be stale and is not stored */
+static void auth_cache_put(const char *key, AuthCacheEntry *E, unsigned mark)
+{
+	long ttl = auth_cache_ttl();
+	long size = config_get_int("auth_cache_size", "DBMAIL", AUTH_CACHE_SIZE);
+	time_t now = time(NULL);
+
+	if (ttl <= 0 || size <= 0) {
+		auth_cache_entry_free(E);
+		return;
+	}
+
+	E->expires = now + ttl;
+
+	g_static_mutex_lock(&auth_cache_lock);
+	if (mark != auth_cache_flushes) {
+		g_static_mutex_unlock(&auth_cache_lock);
+		auth_cache_entry_free(E);
+		return;
+	}
+	if (! auth_cache)
+		auth_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, 
+				(GDestroyNotify)auth_cache_entry_free);
+	if ((long)g_hash_table_size(auth_cache) >= size) {
+		g_hash_table_foreach_remove(auth_cache, (GHRFunc)auth_cache_expired, &now);
+		if ((long)g_hash_table_size(auth_cache) >= size)
+			g_hash_table_remove_all(auth_cache);
+	}
+	g_hash_table_replace(auth_cache, g_strdup(key), E);
+	g_static_mutex_unlock(&auth_cache_lock);
+}
+
+void auth_cache_flush(void)
+{
+	g_static_mutex_lock(&auth_cache_lock);
+	auth_cache_clear();
+	g_static_mutex_unlock(&auth_cache_lock);
+}
+
+/* after a change through the driver: drop the local cache
+ * and tell the other processes to drop theirs */
+static void auth_cache_changed(void)
+{
+	auth_cache_flush();
+	db_generation_bump("auth");
+}
+
 /* Returns:
  *  1 on modules unsupported
  *  0 on success
@@ -120,6 +322,7 @@ int auth_connect(void)
  * error but without a matching auth_connect before it. */
 int auth_disconnect(void)
 {
+	auth_cache_flush();
 	if (!auth) return 0;
 	auth->disconnect();
 	g_free(auth);
@@ -127,7 +330,118 @@ int auth_disconnect(void)
 }
 
 int auth_user_exists(const char *username, u64_t * user_idnr)
-	{ return auth->user_exists(username, user_idnr); }
+{
+	unsigned mark;
+	char *key;
+	int t;
+
+	if (! username)
+		return auth->user_exists(username, user_idnr);
+
+	key = g_strdup_printf("u:%s", username);
+	if (auth_cache_get(key, user_idnr, NULL, NULL, NULL, NULL, &mark)) {
+		g_free(key);
+		return TRUE;
+	}
+	if ((t = auth->user_exists(username, user_idnr)) == TRUE) {
+		AuthCacheEntry *E = g_new0(AuthCacheEntry, 1);
+		E->id = *user_idnr;
+		auth_cache_put(key, E, mark);
+	}
+	g_free(key);
+
+	return t;
+}
+
+int auth_getmaxmailsize(u64_t user_idnr, u64_t * maxmail_size)
+{
+	char *key = g_strdup_printf("m:%llu", user_idnr);
+	unsigned mark;
+	int t;
+
+	if (auth_cache_get(key, maxmail_size, NULL, NULL, NULL, NULL, &mark)) {
+		g_free(key);
+		return TRUE;
+	}
+	if ((t = auth->getmaxmailsize(user_idnr, maxmail_size)) == TRUE) {
+		AuthCacheEntry *E = g_new0(AuthCacheEntry, 1);
+		E->id = *maxmail_size;
+		auth_cache_put(key, E, mark);
+	}
+	g_free(key);
+
+	return t;
+}
+
+/* only the outer call is cached, the driver recurses on its own */
+int auth_check_user_ext(const char *username, GList **userids, GList **fwds, int checks)
+{
+	GList *u = NULL, *f = NULL, *l;
+	int occurences = 0;
+	unsigned mark;
+	char *key;
+
+	if (checks > 0 || ! username)
+		return auth->check_user_ext(username, userids, fwds, checks);
+
+	key = g_strdup_printf("a:%s", username);
+	if (auth_cache_get(key, NULL, userids, fwds, &occurences, NULL, &mark)) {
+		g_free(key);
+		return occurences;
+	}
+
+	if ((occurences = auth->check_user_ext(username, &u, &f, checks)) > 0) {
+		AuthCacheEntry *E = g_new0(AuthCacheEntry, 1);
+		E->occurences = occurences;
+		for (l = g_list_last(u); l; l = g_list_previous(l)) {
+			u64_t *uid = g_new0(u64_t, 1);
+			*uid = *(u64_t *)l->data;
+			E->userids = g_list_prepend(E->userids, uid);
+		}
+		for (l = g_list_last(f); l; l = g_list_previous(l))
+			E->fwds = g_list_prepend(E->fwds, g_strdup((char *)l->data));
+		auth_cache_put(key, E, mark);
+	}
+	g_free(key);
+
+	*userids = g_list_concat(u, *userids);
+	*fwds = g_list_concat(f, *fwds);
+
+	return occurences;
+}
+
+int auth_validate(clientbase_t *ci, const char *username, const char *password, u64_t * user_idnr)
+{
+	char *key, *digest;
+	unsigned mark;
+	int t;
+
+	if (! username || ! password || (ci && ci->auth))
+		return auth->validate(ci, username, password, user_idnr);
+
+	/* the usermap may map a login differently per server socket */
+	key = g_strdup_printf("c:%s:%s:%s", ci ? ci->dst_ip : "", ci ? ci->dst_port : "", username);
+	digest = auth_cache_digest(password);
+
+	if (auth_cache_get(key, user_idnr, NULL, NULL, NULL, digest, &mark)) {
+		db_user_log_login(*user_idnr);
+		g_free(digest);
+		g_free(key);
+		return TRUE;
+	}
+	if ((t = auth->validate(ci, username, password, user_idnr)) == TRUE) {
+		AuthCacheEntry *E = g_new0(AuthCacheEntry, 1);
+		E->id = *user_idnr;
+		E->digest = digest;
+		digest = NULL;
+		auth_cache_put(key, E, mark);
+	}
+	g_free(digest);
+	g_free(key);
+
+	return t;
+}
+
 char *auth_get_userid(u64_t user_idnr)
 	{ return auth->get_userid(user_idnr); }
 int auth_check_userid(u64_t user_idnr)
@@ -138,29 +452,23 @@ GList * auth_get_known_aliases(void)
 	{ return auth->get_known_aliases(); }
 int auth_getclientid(u64_t user_idnr, u64_t * client_idnr)
 	{ return auth->getclientid(user_idnr, client_idnr); }
-int auth_getmaxmailsize(u64_t user_idnr, u64_t * maxmail_size)
-	{ return auth->getmaxmailsize(user_idnr, maxmail_size); }
 char *auth_getencryption(u64_t user_idnr)
 	{ return auth->getencryption(user_idnr); }
-int auth_check_user_ext(const char *username, GList **userids, GList **fwds, int checks)
-	{ return auth->check_user_ext(username, userids, fwds, checks); }
 int auth_adduser(const char *username, const char *password, const char *enctype,
 		u64_t clientid, u64_t maxmail, u64_t * user_idnr)
-	{ return auth->adduser(username, password, enctype,
-			clientid, maxmail, user_idnr); }
+	{ int t = auth->adduser(username, password, enctype,
+			clientid, maxmail, user_idnr); auth_cache_changed(); return t; }
 int auth_delete_user(const char *username)
-	{ return auth->delete_user(username); }
+	{ int t = auth->delete_user(username); auth_cache_changed(); return t; }
 int auth_change_username(u64_t user_idnr, const char *new_name)
-	{ return auth->change_username(user_idnr, new_name); }
+	{ int t = auth->change_username(user_idnr, new_name); auth_cache_changed(); return t; }
 int auth_change_password(u64_t user_idnr,
 		const char *new_pass, const char *enctype)
-	{ return auth->change_password(user_idnr, new_pass, enctype); }
+	{ int t = auth->change_password(user_idnr, new_pass, enctype); auth_cache_changed(); return t; }
 int auth_change_clientid(u64_t user_idnr, u64_t new_cid)
-	{ return auth->change_clientid(user_idnr, new_cid); }
+	{ int t = auth->change_clientid(user_idnr, new_cid); auth_cache_changed(); return t; }
 int auth_change_mailboxsize(u64_t user_idnr, u64_t new_size)
-	{ return auth->change_mailboxsize(user_idnr, new_size); }
-int auth_validate(clientbase_t *ci, const char *username, const char *password, u64_t * user_idnr)
-	{ return auth->validate(ci, username, password, user_idnr); }
+	{ int t = auth->change_mailboxsize(user_idnr, new_size); auth_cache_changed(); return t; }
 u64_t auth_md5_validate(clientbase_t *ci, char *username,
 		unsigned char *md5_apop_he, char *apop_stamp)
 	{ return auth->md5_validate(ci, username,
@@ -170,14 +478,14 @@ GList * auth_get_user_aliases(u64_t user_idnr)
 GList * auth_get_aliases_ext(const char *alias)
 	{ return auth->get_aliases_ext(alias); }
 int auth_addalias(u64_t user_idnr, const char *alias, u64_t clientid)
-	{ return auth->addalias(user_idnr, alias, clientid); }
+	{ int t = auth->addalias(user_idnr, alias, clientid); auth_cache_changed(); return t; }
 int auth_addalias_ext(const char *alias, const char *deliver_to,
 		u64_t clientid)
-	{ return auth->addalias_ext(alias, deliver_to, clientid); }
+	{ int t = auth->addalias_ext(alias, deliver_to, clientid); auth_cache_changed(); return t; }
 int auth_removealias(u64_t user_idnr, const char *alias)
-	{ return auth->removealias(user_idnr, alias); }
+	{ int t = auth->removealias(user_idnr, alias); auth_cache_changed(); return t; }
 int auth_removealias_ext(const char *alias, const char *deliver_to)
-	{ return auth->removealias_ext(alias, deliver_to); }
+	{ int t = auth->removealias_ext(alias, deliver_to); auth_cache_changed(); return t; }
 gboolean auth_requires_shadow_user(void)
 	{ return auth->requires_shadow_user(); }
 
@@ -47,4 +47,7 @@ typedef struct {
 	gboolean (*requires_shadow_user)(void);
 } auth_func_t;
 
+/* drop all cached authentication lookups */
+void auth_cache_flush(void);
+
 #endif
@@ -149,6 +149,9 @@ clientbase_t * client_init(client_sock *c)
 
 	client->cb_error        = client_error_cb;
 
+	/* stay on the event loop that accepted the connection */
+	client->reactor		= c ? c->reactor : dm_reactor_current();
+
 	/* set byte counters to 0 */
 	client->bytes_rx = 0;
 	client->bytes_tx = 0;
@@ -214,6 +217,81 @@ void ci_uncork(clientbase_t *s)
 	event_add(s->wev, NULL);
 }
 
+/*
+ * TLS handshakes
+ *
+ * the key exchange is by far the most expensive part of a connection,
+ * so clients that run on a reactor leave SSL_accept to a small pool of
+ * threads. The client is corked while its handshake is in the pool, so
+ * nothing else touches its SSL object in the mean time.
+ */
+
+static GOnce tls_pool_once = G_ONCE_INIT;
+static GThreadPool *tls_pool = NULL;
+
+static void ci_starttls_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	clientbase_t *self = (clientbase_t *)D->data;
+
+	D->data = NULL;
+
+	ci_uncork(self);
+
+	if (D->status > 0) {
+		TRACE(TRACE_INFO,"[%p] SSL handshake successful using %s", self->ssl, SSL_get_cipher(self->ssl));
+		self->ssl_state = TRUE;
+		ci_write(self,NULL);
+	} else if (D->status < 0) {
+		/* let the read callback find out */
+		self->client_state |= CLIENT_ERR;
+		event_active(self->rev, EV_READ, 1);
+	}
+}
+
+static void ci_starttls_enter(gpointer data, gpointer user_data UNUSED)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	clientbase_t *self = (clientbase_t *)D->data;
+	int e;
+
+	if ((e = SSL_accept(self->ssl)) == 1)
+		D->status = 1;
+	else if (self->cb_error(self->rx, e, (void *)self))
+		D->status = -1;
+
+	dm_reactor_push(self->reactor, D);
+}
+
+static gpointer ci_starttls_pool(gpointer data UNUSED)
+{
+	GError *err = NULL;
+	int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (! (tls_pool = g_thread_pool_new((GFunc)ci_starttls_enter, NULL, max(threads, 1), TRUE, &err)))
+		TRACE(TRACE_EMERG, "tls thread pool creation failed [%s]", err->message);
+
+	return tls_pool;
+}
+
+static void ci_starttls_push(clientbase_t *self)
+{
+	GError *err = NULL;
+	dm_thread_data *D;
+
+	g_once(&tls_pool_once, ci_starttls_pool, NULL);
+
+	ci_cork(self);
+
+	D = g_new0(dm_thread_data, 1);
+	D->cb_leave = ci_starttls_leave;
+	D->data = self;
+
+	g_thread_pool_push(tls_pool, D, &err);
+
+	if (err) TRACE(TRACE_EMERG,"g_thread_pool_push failed [%s]", err->message);
+}
+
 int ci_starttls(clientbase_t *self)
 {
 	int e;
@@ -230,6 +308,10 @@ int ci_starttls(clientbase_t *self)
 		}
 	}
 	if (! self->ssl_state) {
+		/* the handshake is started from ci_read_cb */
+		if (self->reactor)
+			return DM_SUCCESS;
+
 		if ((e = SSL_accept(self->ssl)) != 1) {
 			int e2;
 			if ((e2 = self->cb_error(self->rx, e, (void *)self))) {
@@ -280,6 +362,14 @@ int ci_write(clientbase_t *self, char * msg, ...)
 		return 0;
 	}
 
+	/* output is flushed once the handshake is done */
+	if (self->ssl && ! self->ssl_state)
+		return 0;
+
+	/* or once the worker is done with the client */
+	if (self->deferred)
+		return 0;
+
 	n = self->write_buffer->len - self->write_buffer_offset;
 
 	while (n > 0) {
@@ -289,11 +379,14 @@ int ci_write(clientbase_t *self, char * msg, ...)
 
 
 		if (self->ssl) {
-			if (! self->tls_wbuf_n) {
-				strncpy(self->tls_wbuf, s, n);
+			/* write straight from the buffer; the write buffer may
+			 * move, but a write that has to be retried must be
+			 * retried with the same length */
+			if (self->tls_wbuf_n)
+				n = self->tls_wbuf_n;
+			else
 				self->tls_wbuf_n = n;
-			}
-			t = SSL_write(self->ssl, (gconstpointer)self->tls_wbuf, self->tls_wbuf_n);
+			t = SSL_write(self->ssl, (gconstpointer)s, n);
 			e = t;
 		} else {
 			t = write(self->tx, (gconstpointer)s, n);
@@ -317,10 +410,8 @@ int ci_write(clientbase_t *self, char * msg, ...)
 			self->write_buffer_offset += t;
 			client_wbuf_scale(self);
 
-			if (self->ssl) {
-				memset(self->tls_wbuf, '\0', TLS_SEGMENT);
+			if (self->ssl)
 				self->tls_wbuf_n = 0;
-			}
 		}
 
 		n = self->write_buffer->len - self->write_buffer_offset;
@@ -341,8 +432,14 @@ void ci_read_cb(clientbase_t *self)
 
 	TRACE(TRACE_DEBUG,"[%p] reset timeout [%ld]", self, self->timeout->tv_sec); 
 
+	if (self->client_state & CLIENT_ERR)
+		return;
+
 	if (self->ssl && self->ssl_state == FALSE) {
-		ci_starttls(self);
+		if (self->reactor)
+			ci_starttls_push(self);
+		else
+			ci_starttls(self);
 		return;
 	}
 
@@ -496,6 +593,14 @@ void ci_close(clientbase_t *self)
 	g_free(self->rev); self->rev = NULL;
 	g_free(self->wev); self->wev = NULL;
 
+	if (self->ssl) {
+		/* a clean shutdown keeps the session resumable */
+		if (self->ssl_state)
+			SSL_shutdown(self->ssl);
+		SSL_free(self->ssl);
+		self->ssl = NULL;
+	}
+
 	if (self->tx > 0) {
 		shutdown(self->tx, SHUT_RDWR);
 		close(self->tx);
@@ -50,6 +50,10 @@ ClientSession_t * client_session_new(client_sock *c)
 
         event_set(ci->rev, ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
         event_set(ci->wev, ci->tx, EV_WRITE, socket_write_cb, (void *)session);
+	if (ci->reactor) {
+		event_base_set(ci->reactor->base, ci->rev);
+		event_base_set(ci->reactor->base, ci->wev);
+	}
 
 	session->ci = ci;
 	session->rbuff = g_string_new("");
@@ -65,6 +69,12 @@ void client_session_reset(ClientSession_t * session)
 	g_list_destroy(session->from);
 	session->from = NULL;
 
+	if (session->spool) {
+		g_object_unref(session->spool);
+		session->spool = NULL;
+	}
+	session->spool_size = 0;
+
 	if (session->apop_stamp) {
 		g_free(session->apop_stamp);
 		session->apop_stamp = NULL;
@@ -107,6 +117,13 @@ void client_session_bailout(ClientSession_t **session)
 	if (! c) return;
 	TRACE(TRACE_DEBUG,"[%p]", c);
 
+	if (c->busy || c->detached) {
+		/* a worker still has the session */
+		ci_cork(c->ci);
+		c->closing = TRUE;
+		return;
+	}
+
 	// brute force:
 	if (server_conf->no_daemonize == 1) _exit(0);
 
@@ -118,6 +135,99 @@ void client_session_bailout(ClientSession_t **session)
 	c = NULL;
 }
 
+/*
+ * worker pool offload
+ *
+ * commands that do database work run on the worker pool, so they don't
+ * hold up the event loop. A session has one command out at a time: the
+ * client is corked and its output buffered until the reactor gets the
+ * job back, so the replies go out in the order the commands came in.
+ *
+ * A detached job doesn't use the session at all and leaves the client
+ * running; it hands back its replies as a string in D->data, and these
+ * are put in front of whatever the session wrote in the mean time.
+ */
+
+static void client_session_resume(ClientSession_t *session, int status)
+{
+	clientbase_t *ci = session->ci;
+
+	if (status == -3)
+		session->closing = TRUE;
+
+	ci->deferred = session->busy || session->detached;
+	if (session->busy)
+		return;
+
+	if (session->closing) {
+		if (session->detached)
+			return;
+		ci_write(ci, NULL);
+		client_session_bailout(&session);
+		return;
+	}
+
+	ci_uncork(ci);
+	ci_write(ci, NULL);
+	session->handle_input(session);
+}
+
+static void client_session_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ClientSession_t *session = D->client;
+
+	TRACE(TRACE_DEBUG,"[%p] status [%d]", session, D->status);
+	session->busy = FALSE;
+	client_session_resume(session, D->status);
+}
+
+static void client_session_detach_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ClientSession_t *session = D->client;
+
+	TRACE(TRACE_DEBUG,"[%p] status [%d]", session, D->status);
+	session->detached = FALSE;
+	if (D->status >= 0 && D->data)
+		g_string_insert(session->ci->write_buffer, session->hold, (char *)D->data);
+	client_session_resume(session, D->status);
+}
+
+void client_session_dispatch(ClientSession_t *session, void (*cb_enter)(gpointer), gpointer data)
+{
+	dm_thread_data *D = g_new0(dm_thread_data, 1);
+
+	D->cb_enter = cb_enter;
+	D->cb_leave = client_session_leave;
+	D->client = session;
+	D->data = data;
+
+	ci_cork(session->ci);
+	session->busy = TRUE;
+	session->ci->deferred = TRUE;
+
+	dm_thread_pool_push(D);
+}
+
+void client_session_detach(ClientSession_t *session, void (*cb_enter)(gpointer), gpointer data)
+{
+	dm_thread_data *D = g_new0(dm_thread_data, 1);
+
+	assert(! session->detached);
+
+	D->cb_enter = cb_enter;
+	D->cb_leave = client_session_detach_leave;
+	D->client = session;
+	D->data = data;
+
+	session->detached = TRUE;
+	session->hold = session->ci->write_buffer->len;
+	session->ci->deferred = TRUE;
+
+	dm_thread_pool_push(D);
+}
+
 void client_session_read(void *arg)
 {
 	int state;
@@ -27,6 +27,10 @@ void client_session_reset_parser(ClientSession_t *session);
 void client_session_bailout(ClientSession_t **session);
 void client_session_set_timeout(ClientSession_t *session, int timeout);
 
+/* run a command on the worker pool; the job gets the session as D->client */
+void client_session_dispatch(ClientSession_t *session, void (*cb_enter)(gpointer), gpointer data);
+void client_session_detach(ClientSession_t *session, void (*cb_enter)(gpointer), gpointer data);
+
 void socket_read_cb(int fd, short what, void *arg);
 void socket_write_cb(int fd, short what, void *arg);
  
@@ -45,39 +45,26 @@ extern const char *imap_flag_desc[];
 extern const char *imap_flag_desc_escaped[];
 extern volatile sig_atomic_t alarm_occured;
 
-extern int selfpipe[2];
-extern GAsyncQueue *queue;
 extern serverConfig_t *server_conf;
 
 /*
  * send_data()
  *
- * sends cnt bytes from a MEM structure to a FILE stream
- * uses a simple buffering system
+ * sends cnt bytes from the message cache to the client write buffer
+ * in bounded chunks
  */
-static void send_data(ImapSession *self, Mem_T M, int cnt)
+static void send_data(ImapSession *self, const char *data, u64_t cnt)
 {
-	char buf[SEND_BUF_SIZE];
 	size_t l;
-	int got = 0, want = cnt;
 
-	assert(M);
-	TRACE(TRACE_DEBUG,"[%p] C [%p] M [%p] cnt [%d]", self, self->cache, M, cnt);
-	while (cnt >= SEND_BUF_SIZE) {
-		memset(buf,0,sizeof(buf));
-		l = Mem_read(M, buf, SEND_BUF_SIZE-1);
-		if (l>0) dbmail_imap_session_buff_printf(self, "%s", buf);
-		cnt -= l;
-	}
-
-	if (cnt > 0) {
-		memset(buf,0,sizeof(buf));
-		l = Mem_read(M, buf, cnt);
-		if (l>0) dbmail_imap_session_buff_printf(self, "%s", buf);
+	assert(data);
+	TRACE(TRACE_DEBUG,"[%p] C [%p] data [%p] cnt [%llu]", self, self->cache, data, cnt);
+	while (cnt > 0) {
+		l = (size_t)min(cnt, SEND_BUF_SIZE);
+		dbmail_imap_session_buff_append(self, data, l);
+		data += l;
 		cnt -= l;
 	}
-	got = want - cnt;
-	if (got != want) TRACE(TRACE_EMERG,"[%p] want [%d] <> got [%d]", self, want, got);
 }
 
 static void mailboxstate_destroy(MailboxState_T M)
@@ -106,6 +93,7 @@ ImapSession * dbmail_imap_session_new(void)
 	Capa_remove(self->preauth_capa, "SORT");
 	Capa_remove(self->preauth_capa, "QUOTA");
 	Capa_remove(self->preauth_capa, "THREAD=ORDEREDSUBJECT");
+	Capa_remove(self->preauth_capa, "THREAD=REFERENCES");
 	Capa_remove(self->preauth_capa, "UNSELECT");
 	Capa_remove(self->preauth_capa, "IDLE");
 	if (MATCH(_db_params.authdriver, "LDAP")) {
@@ -122,12 +110,10 @@ ImapSession * dbmail_imap_session_new(void)
 	return self;
 }
 
-static u64_t dbmail_imap_session_message_load(ImapSession *self, int filter)
+static u64_t dbmail_imap_session_physid(ImapSession *self)
 {
 	u64_t *physid = NULL;
 
-	TRACE(TRACE_DEBUG,"[%llu]", self->msg_idnr);
-
 	if (! (physid = g_tree_lookup(self->physids, &(self->msg_idnr)))) {
 		u64_t *uid;
 		physid = g_new0(u64_t,1);
@@ -141,19 +127,29 @@ static u64_t dbmail_imap_session_message_load(ImapSession *self, int filter)
 		*uid = self->msg_idnr;
 		g_tree_insert(self->physids, uid, physid);
 	}
+
+	return *physid;
+}
+
+static u64_t dbmail_imap_session_message_load(ImapSession *self, int filter)
+{
+	u64_t physid;
+
+	TRACE(TRACE_DEBUG,"[%llu]", self->msg_idnr);
+
+	if (! (physid = dbmail_imap_session_physid(self)))
+		return 0;
 		
 	if (self->message && GMIME_IS_MESSAGE(self->message->content)) {
-		if (*physid != self->message->id) {
+		if (physid != self->message->id) {
 			dbmail_message_free(self->message);
 			self->message = NULL;
 		}
 	}
 
-	assert(physid);
-
 	if (! self->message) {
 		DbmailMessage *msg = dbmail_message_new();
-		if ((msg = dbmail_message_retrieve(msg, *physid, filter)) != NULL)
+		if ((msg = dbmail_message_retrieve(msg, physid, filter)) != NULL)
 			self->message = msg;
 	}
 
@@ -165,6 +161,24 @@ static u64_t dbmail_imap_session_message_load(ImapSession *self, int filter)
 	return Cache_update(self->cache, self->message, filter);
 }
 
+/*
+ * like dbmail_imap_session_message_load, but only the rendered message
+ * is required, so a copy in the shared message cache will do and the
+ * message doesn't have to be retrieved and parsed.
+ */
+static u64_t dbmail_imap_session_message_cached(ImapSession *self, int filter)
+{
+	u64_t physid, size = 0;
+
+	if (! (physid = dbmail_imap_session_physid(self)))
+		return 0;
+
+	if (Cache_lookup(self->cache, physid, filter, &size))
+		return size;
+
+	return dbmail_imap_session_message_load(self, filter);
+}
+
 
     
 ImapSession * dbmail_imap_session_set_tag(ImapSession * self, char * tag)
@@ -893,24 +907,36 @@ static void _imap_show_body_sections(ImapSession *self)
 	dbmail_imap_session_bodyfetch_rewind(self);
 }
 
-static int _fetch_get_items(ImapSession *self, u64_t *uid)
+/*
+ * the parsed message is only needed for body structures and
+ * body sections. Everything else can be served from the
+ * shared message cache.
+ */
+static gboolean _fetch_needs_message(ImapSession *self)
 {
-	int result;
-	u64_t actual_cnt, tmpdumpsize;
-	gchar *s = NULL;
-	u64_t *id = uid;
-	gboolean reportflags = FALSE;
+	GList *l;
 
-	MessageInfo *msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), uid);
+	if (self->fi->getMIME_IMB || self->fi->getMIME_IMB_noextension)
+		return TRUE;
 
-	if (! msginfo) {
-		TRACE(TRACE_INFO, "[%p] failed to lookup msginfo struct for message [%llu]", self, *uid);
-		return 0;
+	l = g_list_first(self->fi->bodyfetch);
+	while (l) {
+		if (((body_fetch_t *)l->data)->itemtype >= 0)
+			return TRUE;
+		l = g_list_next(l);
 	}
-	
-	id = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate),uid);
 
-	g_return_val_if_fail(id,-1);
+	return FALSE;
+}
+
+static int _fetch_info_items(ImapSession *self, u64_t *uid, MessageInfo *msginfo)
+{
+	int result;
+	u64_t actual_cnt, size = 0;
+	const char *data;
+	gchar *s = NULL;
+	u64_t *id = &msginfo->msn;
+	gboolean reportflags = FALSE;
 
 	dbmail_imap_session_buff_printf(self, "* %llu FETCH (", *id);
 
@@ -918,7 +944,12 @@ static int _fetch_get_items(ImapSession *self, u64_t *uid)
 	self->fi->isfirstfetchout = 1;
 
 	if (self->fi->msgparse_needed) {
-		if (! (dbmail_imap_session_message_load(self, DBMAIL_MESSAGE_FILTER_FULL))) {
+		u64_t loaded;
+		if (_fetch_needs_message(self))
+			loaded = dbmail_imap_session_message_load(self, DBMAIL_MESSAGE_FILTER_FULL);
+		else
+			loaded = dbmail_imap_session_message_cached(self, DBMAIL_MESSAGE_FILTER_FULL);
+		if (! loaded) {
 			dbmail_imap_session_buff_clear(self);
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE error loading message\r\n");
 			return -1;
@@ -985,8 +1016,9 @@ static int _fetch_get_items(ImapSession *self, u64_t *uid)
 
 	if (self->fi->getRFC822 || self->fi->getRFC822Peek) {
 		SEND_SPACE;
-		dbmail_imap_session_buff_printf(self, "RFC822 {%llu}\r\n", Cache_get_size(self->cache) );
-		send_data(self, Cache_get_memdump(self->cache), Cache_get_size(self->cache) );
+		data = Cache_get_data(self->cache, DBMAIL_MESSAGE_FILTER_FULL, &size);
+		dbmail_imap_session_buff_printf(self, "RFC822 {%llu}\r\n", size);
+		send_data(self, data, size);
 		if (self->fi->getRFC822)
 			self->fi->setseen = 1;
 
@@ -994,21 +1026,17 @@ static int _fetch_get_items(ImapSession *self, u64_t *uid)
 
 	if (self->fi->getBodyTotal || self->fi->getBodyTotalPeek) {
 		SEND_SPACE;
+		data = Cache_get_data(self->cache, DBMAIL_MESSAGE_FILTER_FULL, &size);
 		if (dbmail_imap_session_bodyfetch_get_last_octetcnt(self) == 0) {
-			dbmail_imap_session_buff_printf(self, "BODY[] {%llu}\r\n", Cache_get_size(self->cache) );
-			send_data(self, Cache_get_memdump(self->cache), Cache_get_size(self->cache) );
+			dbmail_imap_session_buff_printf(self, "BODY[] {%llu}\r\n", size);
+			send_data(self, data, size);
 		} else {
-			u64_t size = Cache_get_size(self->cache);
-			Mem_T M = Cache_get_memdump(self->cache);
-			Mem_seek(M, dbmail_imap_session_bodyfetch_get_last_octetstart(self), SEEK_SET);
-			actual_cnt = (dbmail_imap_session_bodyfetch_get_last_octetcnt(self) >
-			     (((long long)size) - dbmail_imap_session_bodyfetch_get_last_octetstart(self)))
-			    ? (((long long)size) - dbmail_imap_session_bodyfetch_get_last_octetstart(self)) 
-			    : dbmail_imap_session_bodyfetch_get_last_octetcnt(self);
+			u64_t start = min(dbmail_imap_session_bodyfetch_get_last_octetstart(self), size);
+			actual_cnt = min(dbmail_imap_session_bodyfetch_get_last_octetcnt(self), size - start);
 
 			dbmail_imap_session_buff_printf(self, "BODY[]<%llu> {%llu}\r\n", 
 					dbmail_imap_session_bodyfetch_get_last_octetstart(self), actual_cnt);
-			send_data(self, M, actual_cnt);
+			send_data(self, data + start, actual_cnt);
 		}
 		if (self->fi->getBodyTotal)
 			self->fi->setseen = 1;
@@ -1016,16 +1044,26 @@ static int _fetch_get_items(ImapSession *self, u64_t *uid)
 
 	if (self->fi->getRFC822Header) {
 		SEND_SPACE;
-		tmpdumpsize = dbmail_imap_session_message_load(self,DBMAIL_MESSAGE_FILTER_HEAD);
-		dbmail_imap_session_buff_printf(self, "RFC822.HEADER {%llu}\r\n", tmpdumpsize);
-		send_data(self, Cache_get_tmpdump(self->cache), tmpdumpsize);
+		if (! dbmail_imap_session_message_cached(self, DBMAIL_MESSAGE_FILTER_FULL)) {
+			dbmail_imap_session_buff_clear(self);
+			dbmail_imap_session_buff_printf(self, "\r\n* BYE error loading message\r\n");
+			return -1;
+		}
+		data = Cache_get_data(self->cache, DBMAIL_MESSAGE_FILTER_HEAD, &size);
+		dbmail_imap_session_buff_printf(self, "RFC822.HEADER {%llu}\r\n", size);
+		send_data(self, data, size);
 	}
 
 	if (self->fi->getRFC822Text) {
 		SEND_SPACE;
-		tmpdumpsize = dbmail_imap_session_message_load(self,DBMAIL_MESSAGE_FILTER_BODY);
-		dbmail_imap_session_buff_printf(self, "RFC822.TEXT {%llu}\r\n", tmpdumpsize);
-		send_data(self, Cache_get_tmpdump(self->cache), tmpdumpsize);
+		if (! dbmail_imap_session_message_cached(self, DBMAIL_MESSAGE_FILTER_FULL)) {
+			dbmail_imap_session_buff_clear(self);
+			dbmail_imap_session_buff_printf(self, "\r\n* BYE error loading message\r\n");
+			return -1;
+		}
+		data = Cache_get_data(self->cache, DBMAIL_MESSAGE_FILTER_BODY, &size);
+		dbmail_imap_session_buff_printf(self, "RFC822.TEXT {%llu}\r\n", size);
+		send_data(self, data, size);
 		self->fi->setseen = 1;
 	}
 
@@ -1054,6 +1092,7 @@ static int _fetch_get_items(ImapSession *self, u64_t *uid)
 				dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
 				return -1;
 			}
+			MailboxState_setInfo(self->mailbox->mbstate, msginfo);
 			db_mailbox_seq_update(MailboxState_getId(self->mailbox->mbstate));
 		}
 
@@ -1075,6 +1114,22 @@ static int _fetch_get_items(ImapSession *self, u64_t *uid)
 	return 0;
 }
 
+static int _fetch_get_items(ImapSession *self, u64_t *uid)
+{
+	int result;
+	MessageInfo msginfo;
+
+	if (! MailboxState_getInfo(self->mailbox->mbstate, *uid, &msginfo)) {
+		TRACE(TRACE_INFO, "[%p] failed to lookup msginfo struct for message [%llu]", self, *uid);
+		return 0;
+	}
+
+	result = _fetch_info_items(self, uid, &msginfo);
+	MessageInfo_clear(&msginfo);
+
+	return result;
+}
+
 static gboolean _do_fetch(u64_t *uid, gpointer UNUSED value, ImapSession *self)
 {
 	/* go fetch the items */
@@ -1178,9 +1233,7 @@ void dbmail_imap_session_buff_flush(ImapSession *self)
 	g_string_free(self->buff, FALSE);
 	self->buff = g_string_new("");
 
-        g_async_queue_push(queue, (gpointer)D);
-        if (selfpipe[1] > -1)
-		if (write(selfpipe[1], "Q", 1) != 1) { /* ignore */; } 
+	dm_queue_push(D);
 }
 
 #define IMAP_BUF_SIZE 4096
@@ -1205,6 +1258,12 @@ int dbmail_imap_session_buff_printf(ImapSession * self, char * message, ...)
         return (int)(l-j);
 }
 
+void dbmail_imap_session_buff_append(ImapSession *self, const char *data, size_t len)
+{
+	g_string_append_len(self->buff, data, len);
+	if (self->buff->len >= IMAP_BUF_SIZE) dbmail_imap_session_buff_flush(self);
+}
+
 int dbmail_imap_session_handle_auth(ImapSession * self, const char * username, const char * password)
 {
 	u64_t userid = 0;
@@ -1293,47 +1352,49 @@ int dbmail_imap_session_mailbox_get_selectable(ImapSession * self, u64_t idnr)
 
 static void notify_fetch(ImapSession *self, MailboxState_T N, u64_t *uid)
 {
-	u64_t *msn;
+	u64_t msn;
 	char *oldflags = NULL, *newflags = NULL;
-	MessageInfo *old = NULL, *new = NULL;
+	MessageInfo old, new;
 	MailboxState_T M = self->mailbox->mbstate;
 
 	assert(uid);
 
-	if (! (MailboxState_getMsginfo(N) && *uid && (new = g_tree_lookup(MailboxState_getMsginfo(N), uid))))
+	if (! (*uid && MailboxState_getInfo(N, *uid, &new)))
 		return;
 
-	if (! (msn = g_tree_lookup(MailboxState_getIds(M), uid))) {
+	if (! (msn = MailboxState_uidToMsn(M, *uid))) {
 		TRACE(TRACE_DEBUG,"[%p] can't find uid [%llu]", self, *uid);
+		MessageInfo_clear(&new);
 		return;
 	}
 
-	old = g_tree_lookup(MailboxState_getMsginfo(M), uid);
-
 	// FETCH
-	if (old)
-		oldflags = imap_flags_as_string(M, old);
-	newflags = imap_flags_as_string(M, new);
+	if (MailboxState_getInfo(M, *uid, &old)) {
+		oldflags = imap_flags_as_string(M, &old);
+		MessageInfo_clear(&old);
+	}
+	newflags = imap_flags_as_string(M, &new);
 
 	if ((! oldflags) || (! MATCH(oldflags,newflags))) {
 		char *t = NULL;
 		if (self->use_uid) t = g_strdup_printf(" UID %llu", *uid);
-		dbmail_imap_session_buff_printf(self,"* %llu FETCH (FLAGS %s%s)\r\n", *msn, newflags, t?t:"");
+		dbmail_imap_session_buff_printf(self,"* %llu FETCH (FLAGS %s%s)\r\n", msn, newflags, t?t:"");
 
-		if (new->flags[IMAP_FLAG_RECENT])
+		if (new.flags[IMAP_FLAG_RECENT])
 			self->recent = g_list_prepend(self->recent, g_strdup_printf("%llu", *uid));
 		if (t) g_free(t);
 	}
 
 	if (oldflags) g_free(oldflags);
 	g_free(newflags);
+	MessageInfo_clear(&new);
 }
 
 static gboolean notify_expunge(ImapSession *self, u64_t *uid)
 {
-	u64_t *msn = NULL, m = 0;
+	u64_t msn = 0;
 
-	if (! (msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), uid))) {
+	if (! (msn = MailboxState_uidToMsn(self->mailbox->mbstate, *uid))) {
 		TRACE(TRACE_DEBUG,"[%p] can't find uid [%llu]", self, *uid);
 		return TRUE;
 	}
@@ -1344,9 +1405,8 @@ static gboolean notify_expunge(ImapSession *self, u64_t *uid)
 		case IMAP_COMM_SEARCH:
 			break;
 		default:
-			m = *msn;
 			if (MailboxState_removeUid(self->mailbox->mbstate, *uid) == DM_SUCCESS)
-				dbmail_imap_session_buff_printf(self, "* %llu EXPUNGE\r\n", m);
+				dbmail_imap_session_buff_printf(self, "* %llu EXPUNGE\r\n", msn);
 			else
 				return TRUE;
 		break;
@@ -1357,63 +1417,70 @@ static gboolean notify_expunge(ImapSession *self, u64_t *uid)
 
 static void mailbox_notify_expunge(ImapSession *self, MailboxState_T N)
 {
-	u64_t *uid, *msn;
+	u64_t uid, msn;
 	MailboxState_T M;
 	GList *ids;
 	if (! N) return;
 
 	M = self->mailbox->mbstate;
 
-	ids  = g_tree_keys(MailboxState_getIds(M));
-	ids = g_list_reverse(ids);
+	if (MailboxState_isPartial(N)) {
+		// only the uids that left the mailbox
+		ids = g_list_copy(MailboxState_getExpunged(N));
+		ids = g_list_sort(ids, (GCompareFunc)ucmp);
+		ids = g_list_reverse(ids);
+		while (ids) {
+			notify_expunge(self, (u64_t *)ids->data);
+			if (! g_list_next(ids)) break;
+			ids = g_list_next(ids);
+		}
+		g_list_free(g_list_first(ids));
+		return;
+	}
 
 	// send expunge updates
 	
-	if (ids) {
-		uid = (u64_t *)ids->data;
-		msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), uid);
-		if (msn && (*msn > MailboxState_getExists(N))) {
-			TRACE(TRACE_DEBUG,"exists new [%d] old: [%d]", MailboxState_getExists(N), MailboxState_getExists(M)); 
-			dbmail_imap_session_buff_printf(self, "* %d EXISTS\r\n", MailboxState_getExists(M));
-		}
+	msn = MailboxState_count(M);
+	if (msn && (msn > MailboxState_getExists(N))) {
+		TRACE(TRACE_DEBUG,"exists new [%d] old: [%d]", MailboxState_getExists(N), MailboxState_getExists(M)); 
+		dbmail_imap_session_buff_printf(self, "* %d EXISTS\r\n", MailboxState_getExists(M));
 	}
 
-	while (ids) {
-		uid = (u64_t *)ids->data;
-		if (! g_tree_lookup(MailboxState_getIds(N), uid)) {
-			notify_expunge(self, uid);
-		}
-
-		if (! g_list_next(ids)) break;
-		ids = g_list_next(ids);
+	// highest msn first, so an expunge leaves the ones still to visit in place
+	for (; msn > 0; msn--) {
+		uid = MailboxState_msnToUid(M, msn);
+		if (! MailboxState_uidToMsn(N, uid))
+			notify_expunge(self, &uid);
 	}
-	ids = g_list_first(ids);
-	g_list_free(ids);
 }
 
 static void mailbox_notify_update(ImapSession *self, MailboxState_T N)
 {
-	u64_t *uid, *id;
-	MailboxState_T M;
-	GList *ids;
+	u64_t uid, msn, count, *id;
+	MailboxState_T M, S;
 	if (! N) return;
 
 	M = self->mailbox->mbstate;
 
-	ids  = g_tree_keys(MailboxState_getIds(M));
+	// a partial state only holds the messages that changed
+	if (MailboxState_isPartial(N))
+		S = N;
+	else
+		S = M;
 
 	// send fetch updates
-	ids = g_list_first(ids);
-	while (ids) {
-		uid = (u64_t *)ids->data;
-
-		notify_fetch(self, N, uid);
+	count = MailboxState_count(S);
+	for (msn = 1; msn <= count; msn++) {
+		uid = MailboxState_msnToUid(S, msn);
+		notify_fetch(self, N, &uid);
+	}
 
-		if (! g_list_next(ids)) break;
-		ids = g_list_next(ids);
+	if (MailboxState_isPartial(N)) {
+		MailboxState_merge(M, N);
+		MailboxState_free(&N);
+		dbmail_imap_session_mailbox_update_recent(self);
+		return;
 	}
-	ids = g_list_first(ids);
-	g_list_free(ids);
 
 	dbmail_imap_session_mailbox_update_recent(self);
 
@@ -1449,21 +1516,21 @@ int dbmail_imap_session_mailbox_status(ImapSession * self, gboolean update)
 	if (self->state != CLIENTSTATE_SELECTED) return FALSE;
 
 	if (update) {
-		unsigned oldseq, oldrecent;
+		unsigned oldrecent;
 		u64_t olduidnext;
 		char *oldflags, *newflags;
 
 		M = self->mailbox->mbstate;
-		oldseq = MailboxState_getSeq(M);
 		oldflags = MailboxState_flags(M);
 		oldexists = MailboxState_getExists(M);
 		oldrecent = MailboxState_getRecent(M);
 		olduidnext = MailboxState_getUidnext(M);
 
-                // re-read flags and counters
-		N = MailboxState_new(self->mailbox->id);
+		// re-read flags and counters, and whatever changed
+		// since the last update
+		N = MailboxState_update(M);
 
-		if (oldseq != MailboxState_getSeq(N)) {
+		if (N) {
 			// rebuild uid/msn trees
 			// ATTN: new messages shouldn't be visible in any way to a 
 			// client session until it has been announced with EXISTS
@@ -1497,7 +1564,7 @@ int dbmail_imap_session_mailbox_status(ImapSession * self, gboolean update)
 
 		case IMAP_COMM_APPEND:
 			showrecent = FALSE;
-			TRACE(TRACE_DEBUG,"exists new: [%d] old: [%d]", MailboxState_getExists(N), MailboxState_getExists(M)); 
+			if (N) TRACE(TRACE_DEBUG,"exists new: [%d] old: [%d]", MailboxState_getExists(N), MailboxState_getExists(M)); 
 			break;
 		case IMAP_COMM_NOOP:
 		case IMAP_COMM_FETCH:
@@ -1570,15 +1637,17 @@ static int db_update_recent(GList *slices)
 	INIT_QUERY;
 	C c;
 	volatile int t = FALSE;
+	char *seq;
 
 	if (! (slices = g_list_first(slices)))
 		return t;
 
+	seq = db_message_seq();
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
 		while (slices) {
-			db_exec(c, "UPDATE %smessages SET recent_flag = 0 WHERE message_idnr IN (%s) AND recent_flag = 1", DBPFX, (gchar *)slices->data);
+			db_exec(c, "UPDATE %smessages SET recent_flag = 0, %s WHERE message_idnr IN (%s) AND recent_flag = 1", DBPFX, seq, (gchar *)slices->data);
 			if (! g_list_next(slices)) break;
 			slices = g_list_next(slices);
 		}
@@ -1592,6 +1661,8 @@ static int db_update_recent(GList *slices)
 		g_list_destroy(slices);
 	END_TRY;
 
+	g_free(seq);
+
 	return t;
 }
 
@@ -1600,7 +1671,6 @@ int dbmail_imap_session_mailbox_update_recent(ImapSession *self)
 	GList *recent;
 	char query[DEF_QUERYSIZE];
 	memset(query,0,DEF_QUERYSIZE);
-	MessageInfo *msginfo = NULL;
 	gchar *uid = NULL;
 	u64_t id = 0;
 
@@ -1624,8 +1694,8 @@ int dbmail_imap_session_mailbox_update_recent(ImapSession *self)
 		uid = (gchar *)recent->data;
 		id = strtoull(uid, NULL, 10);
 		assert(id);
-		if ( (msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), &id)) != NULL) {
-			msginfo->flags[IMAP_FLAG_RECENT] = 0;
+		if (MailboxState_uidToMsn(self->mailbox->mbstate, id)) {
+			MailboxState_setFlag(self->mailbox->mbstate, id, IMAP_FLAG_RECENT, FALSE);
 		} else {
 			TRACE(TRACE_WARNING,"[%p] can't find msginfo for [%llu]", self, id);
 		}
@@ -1679,14 +1749,20 @@ int dbmail_imap_session_set_state(ImapSession *self, clientstate_t state)
 	return 0;
 }
 
-static gboolean _do_expunge(u64_t *id, ImapSession *self)
+static gboolean _do_expunge(u64_t *id, ImapSession *self, S s)
 {
-	MessageInfo *msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), id);
-	assert(msginfo);
+	volatile gboolean t = FALSE;
 
-	if (! msginfo->flags[IMAP_FLAG_DELETED]) return FALSE;
+	if (! MailboxState_hasFlag(self->mailbox->mbstate, *id, IMAP_FLAG_DELETED)) return FALSE;
 
-	if (db_exec(self->c, "UPDATE %smessages SET status=%d WHERE message_idnr=%llu ", DBPFX, MESSAGE_STATUS_DELETE, *id) == DM_EQUERY)
+	TRY
+		db_stmt_set_u64(s, 1, *id);
+		db_stmt_exec(s);
+		t = TRUE;
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	END_TRY;
+	if (! t)
 		return TRUE;
 
 	return notify_expunge(self, id);
@@ -1694,31 +1770,40 @@ static gboolean _do_expunge(u64_t *id, ImapSession *self)
 
 int dbmail_imap_session_mailbox_expunge(ImapSession *self)
 {
-	u64_t mailbox_size;
-	int i;
-	GList *ids;
+	u64_t mailbox_size, msn, uid;
+	unsigned i;
+	char *seq;
+	volatile S s = NULL;
 	MailboxState_T M = self->mailbox->mbstate;
 
-	if (! (i = g_tree_nnodes(MailboxState_getMsginfo(M))))
+	if (! (i = MailboxState_count(M)))
 		return DM_SUCCESS;
 
 	if (db_get_mailbox_size(self->mailbox->id, 1, &mailbox_size) == DM_EQUERY)
 		return DM_EQUERY;
 
-	ids = g_tree_keys(MailboxState_getMsginfo(M));
-	ids = g_list_reverse(ids);
-
 	self->c = db_con_get();
 	db_begin_transaction(self->c);
-	g_list_foreach(ids, (GFunc) _do_expunge, self);
+
+	/* the same update for every message, so prepare it only once */
+	seq = db_message_seq();
+	TRY
+		s = db_stmt_prepare(self->c, "UPDATE %smessages SET status=%d, %s WHERE message_idnr=?",
+				DBPFX, MESSAGE_STATUS_DELETE, seq);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	END_TRY;
+	g_free(seq);
+
+	for (msn = i; s && msn > 0; msn--) {
+		uid = MailboxState_msnToUid(M, msn);
+		_do_expunge(&uid, self, s);
+	}
 	db_commit_transaction(self->c);
 	db_con_close(self->c);
 	self->c = NULL;
 
-	ids = g_list_first(ids);
-	g_list_free(ids);
-
-	if (i > g_tree_nnodes(MailboxState_getMsginfo(M))) {
+	if (i > MailboxState_count(M)) {
 		db_mailbox_seq_update(self->mailbox->id);
 		if (! dm_quota_user_dec(self->userid, mailbox_size))
 			return DM_EQUERY;
@@ -35,6 +35,8 @@ typedef struct {
 	u64_t args_idx;
 
 	int loop; // idle loop counter
+	u64_t idle_mailbox; // mailbox watched while idling
+	int idle_refresh; // 1: refresh running, 2: and another one wanted
 	fetch_items_t *fi;
 
 	DbmailMailbox *mailbox;	/* currently selected mailbox */
@@ -69,6 +71,8 @@ typedef struct {
 	void (* cb_enter)(gpointer);		/* callback on thread entry		*/
 	void (* cb_leave)(gpointer);		/* callback on thread exit		*/
 	ImapSession *session;
+	ClientSession_t *client;		/* or the pop3, lmtp or sieve session	*/
+	dm_reactor *reactor;			/* or the reactor to report back to	*/
 	clientbase_t ci;
 	gpointer data;				/* payload				*/
 	int status;				/* command result 			*/
@@ -89,6 +93,7 @@ void dbmail_imap_session_delete(ImapSession ** self);
 void dbmail_imap_session_buff_clear(ImapSession *self);
 void dbmail_imap_session_buff_flush(ImapSession *self);
 int dbmail_imap_session_buff_printf(ImapSession * self, char * message, ...);
+void dbmail_imap_session_buff_append(ImapSession *self, const char *data, size_t len);
 
 int dbmail_imap_session_set_state(ImapSession *self, clientstate_t state);
 int client_is_authenticated(ImapSession * self);
@@ -141,9 +146,17 @@ int imap4_tokenizer_main(ImapSession *self, const char *buffer);
  *
  */
 void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave, gpointer data);
+void dm_thread_pool_push(dm_thread_data *D);
+void dm_thread_job_push(ImapSession *session, gpointer cb_enter, gpointer cb_leave, gpointer data);
+void dm_queue_push(dm_thread_data *D);
+void dm_reactor_push(dm_reactor *r, dm_thread_data *D);
+void dm_queue_broadcast(void (*cb_leave)(gpointer), gconstpointer data, guint size);
 
 void dm_thread_data_sendmessage(gpointer data);
 void _ic_cb_leave(gpointer data);
 
+void imap_idle_start(ImapSession *session);
+void imap_idle_stop(ImapSession *session);
+
 #endif
 
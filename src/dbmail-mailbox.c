@@ -48,14 +48,14 @@ DbmailMailbox * dbmail_mailbox_new(u64_t id)
 static gboolean _node_free(GNode *node, gpointer dummy UNUSED)
 {
 	search_key_t *s = (search_key_t *)node->data;
-	if (s->found) g_tree_destroy(s->found);
+	if (s->found) Bitset_free(&s->found);
 	g_free(s);
 	return FALSE;
 }
 
 void dbmail_mailbox_free(DbmailMailbox *self)
 {
-	if (self->found) g_tree_destroy(self->found);
+	if (self->found) Bitset_free(&self->found);
 	if (self->sorted) g_list_destroy(self->sorted);
 	if (self->search) {
 		g_node_traverse(g_node_get_root(self->search), G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)_node_free, NULL);
@@ -164,13 +164,10 @@ static int _mimeparts_dump(DbmailMailbox *self, GMimeStream *ostream)
 	GList *ids = NULL;
 	u64_t msgid, physid, *id;
 	DbmailMessage *m;
-	GTree *uids;
 	int count = 0;
 	C c; R r; volatile int t = FALSE;
 	INIT_QUERY;
 
-	uids = MailboxState_getIds(self->mbstate);
-
 	snprintf(query,DEF_QUERYSIZE,"SELECT id,message_idnr FROM %sphysmessage p "
 		"LEFT JOIN %smessages m ON p.id=m.physmessage_id "
 		"LEFT JOIN %smailboxes b ON b.mailbox_idnr=m.mailbox_idnr "
@@ -183,7 +180,7 @@ static int _mimeparts_dump(DbmailMailbox *self, GMimeStream *ostream)
 		while (db_result_next(r)) {
 			physid = db_result_get_u64(r,0);
 			msgid = db_result_get_u64(r,1);
-			if (g_tree_lookup(uids,&msgid)) {
+			if (MailboxState_uidToMsn(self->mbstate, msgid)) {
 				id = g_new0(u64_t,1);
 				*id = physid;
 				ids = g_list_prepend(ids,id);
@@ -226,15 +223,11 @@ int dbmail_mailbox_dump(DbmailMailbox *self, FILE *file)
 
 	dbmail_mailbox_open(self);
 
-	GTree *ids = self->found;
-
-	if (ids==NULL || g_tree_nnodes(ids) == 0) {
+	if (self->found == NULL || Bitset_len(self->found) == 0) {
 		TRACE(TRACE_DEBUG,"cannot dump empty mailbox");
 		return 0;
 	}
 	
-	assert(ids);
-
 	ostream = g_mime_stream_file_new(file);
 	g_mime_stream_file_set_owner ((GMimeStreamFile *)ostream, FALSE);
 	
@@ -245,138 +238,80 @@ int dbmail_mailbox_dump(DbmailMailbox *self, FILE *file)
 	return count;
 }
 
-static gboolean _tree_foreach(gpointer key UNUSED, gpointer value, GString * data)
+/*
+ * the msn of a message in the search result, or 0 if it wasn't found
+ */
+static u64_t _found_msn(DbmailMailbox *self, u64_t uid)
 {
-	gboolean res = FALSE;
-	u64_t *id;
-	GList *sublist = g_list_first((GList *)value);
-	GString *t = g_string_new("");
-	int m = g_list_length(sublist);
-	
-	sublist = g_list_first(sublist);
-	while(sublist) {
-		id = sublist->data;
-		g_string_append_printf(t, "(%llu)", *id);
-		
-		if (! g_list_next(sublist))
-			break;
-		sublist = g_list_next(sublist);
-	}
-	if (m > 1)
-		g_string_append_printf(data, "(%s)", t->str);
-	else
-		g_string_append_printf(data, "%s", t->str);
+	u64_t msn;
 
-	g_string_free(t,TRUE);
+	if (! (self->found && self->mbstate))
+		return 0;
+	if (! (msn = MailboxState_uidToMsn(self->mbstate, uid)))
+		return 0;
 
-	return res;
+	return Bitset_has(self->found, msn) ? msn : 0;
 }
 
-char * dbmail_mailbox_orderedsubject(DbmailMailbox *self)
+/*
+ * the search result as a tree of uid to the number shown to the client
+ */
+static GTree * _found_ids(DbmailMailbox *self)
 {
-	GList *sublist = NULL;
-	volatile u64_t i = 0, idnr = 0;
-	char *subj;
-	char *res = NULL;
-	u64_t *id, *msn;
-	GTree *tree;
-	GString *threads;
-	C c; R r; volatile int t = FALSE;
-	INIT_QUERY;
-	
-	/* thread-roots (ordered) */
-	snprintf(query, DEF_QUERYSIZE, "SELECT min(m.message_idnr),v.sortfield "
-			"FROM %smessages m "
-			"LEFT JOIN %sheader h USING (physmessage_id) "
-			"LEFT JOIN %sheadername n ON h.headername_id = n.id "
-			"LEFT JOIN %sheadervalue v ON h.headervalue_id = v.id "
-			"WHERE m.mailbox_idnr=%llu "
-			"AND n.headername = 'subject' AND m.status IN (%d,%d) "
-			"GROUP BY v.sortfield",
-			DBPFX, DBPFX, DBPFX, DBPFX,
-			dbmail_mailbox_get_id(self),
-			MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
-
-	tree = g_tree_new_full((GCompareDataFunc)dm_strcmpdata,NULL,(GDestroyNotify)g_free, NULL);
-
-	t = FALSE;
-	c = db_con_get();
-	TRY
-		i=0;
-		r = db_query(c,query);
-		while (db_result_next(r)) {
-			i++;
-			idnr = db_result_get_u64(r,0);
-			if (! g_tree_lookup(self->found,(gconstpointer)&idnr))
-				continue;
-			subj = (char *)db_result_get(r,1);
-			g_tree_insert(tree,g_strdup(subj), NULL);
+	GTree *ids;
+	u64_t *k, *v;
+	size_t msn;
+
+	ids = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+	if (! (self->found && self->mbstate))
+		return ids;
+
+	for (msn = 1; Bitset_next(self->found, &msn); msn++) {
+		k = g_new0(u64_t,1);
+		v = g_new0(u64_t,1);
+		if (! (*k = MailboxState_msnToUid(self->mbstate, msn))) {
+			g_free(k); g_free(v);
+			continue;
 		}
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		t = DM_EQUERY;
-	END_TRY;
-
-	if ( ( t == DM_EQUERY ) || ( ! i ) ) {
-		g_tree_destroy(tree);
-		db_con_close(c);
-		return res;
+		*v = dbmail_mailbox_get_uid(self) ? *k : (u64_t)msn;
+		g_tree_insert(ids, k, v);
 	}
 
-	db_con_clear(c);
-		
-	memset(query,0,DEF_QUERYSIZE);
-	/* full threads (unordered) */
-	snprintf(query, DEF_QUERYSIZE, "SELECT m.message_idnr,v.sortfield "
-			"FROM %smessages m "
-			"LEFT JOIN %sheader h USING (physmessage_id) "
-			"LEFT JOIN %sheadername n ON h.headername_id = n.id "
-			"LEFT JOIN %sheadervalue v ON h.headervalue_id = v.id "
-			"WHERE m.mailbox_idnr = %llu "
-			"AND n.headername = 'subject' AND m.status IN (%d,%d) "
-			"ORDER BY v.sortfield, v.datefield",
-			DBPFX, DBPFX, DBPFX, DBPFX,
-			dbmail_mailbox_get_id(self),
-			MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
-		
-	TRY
-		i=0;
-		r = db_query(c,query);
-		while (db_result_next(r)) {
-			i++;
-			idnr = db_result_get_u64(r,0);
-			if (! (msn = g_tree_lookup(self->found, (gconstpointer)&idnr)))
-				continue;
-			subj = (char *)db_result_get(r,1);
-			
-			id = g_new0(u64_t,1);
-			if (dbmail_mailbox_get_uid(self))
-				*id = idnr;
-			else
-				*id = *msn;
-			
-			sublist = g_tree_lookup(tree,(gconstpointer)subj);
-			sublist = g_list_append(sublist,id);
-			g_tree_insert(tree,g_strdup(subj),sublist);
-		}
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		t = DM_EQUERY;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	return ids;
+}
 
-	if ( ( t == DM_EQUERY ) || ( ! i ) ) {
-		g_tree_destroy(tree);
-		return res;
-	}
+/*
+ * THREAD=ORDEREDSUBJECT and THREAD=REFERENCES, from the thread graph
+ * cached in the mailbox state
+ */
+char * dbmail_mailbox_orderedsubject(DbmailMailbox *self)
+{
+	Thread_T threads;
+	GTree *ids;
+	char *res;
 
-	threads = g_string_new("");
-	g_tree_foreach(tree,(GTraverseFunc)_tree_foreach,threads);
-	res = threads->str;
+	if (! (self->mbstate && (threads = MailboxState_getThreads(self->mbstate))))
+		return NULL;
 
-	g_string_free(threads,FALSE);
-	g_tree_destroy(tree);
+	ids = _found_ids(self);
+	res = Thread_orderedsubject(threads, ids);
+	g_tree_destroy(ids);
+
+	return res;
+}
+
+char * dbmail_mailbox_references(DbmailMailbox *self)
+{
+	Thread_T threads;
+	GTree *ids;
+	char *res;
+
+	if (! (self->mbstate && (threads = MailboxState_getThreads(self->mbstate))))
+		return NULL;
+
+	ids = _found_ids(self);
+	res = Thread_references(threads, ids);
+	g_tree_destroy(ids);
 
 	return res;
 }
@@ -388,32 +323,22 @@ char * dbmail_mailbox_ids_as_string(DbmailMailbox *self, gboolean uid, const cha
 {
 	GString *t;
 	gchar *s = NULL;
-	GList *l = NULL, *h = NULL;
+	size_t msn;
 
-	if ((self->found == NULL) || g_tree_nnodes(self->found) <= 0) {
+	if ((self->found == NULL) || Bitset_len(self->found) == 0) {
 		TRACE(TRACE_DEBUG,"no ids found");
 		return s;
 	}
 
 	t = g_string_new("");
-	if (uid || dbmail_mailbox_get_uid(self)) {
-		l = g_tree_keys(self->found);
-	} else {
-		l = g_tree_values(self->found);
-	}
-
-	h = l;
+	uid = uid || dbmail_mailbox_get_uid(self);
 
-	while(l->data) {
-		g_string_append_printf(t,"%llu", *(u64_t *)l->data);
-		if (! g_list_next(l))
-			break;
-		g_string_append_printf(t,"%s", sep);
-		l = g_list_next(l);
+	for (msn = 1; Bitset_next(self->found, &msn); msn++) {
+		if (t->len)
+			g_string_append_printf(t,"%s", sep);
+		g_string_append_printf(t,"%llu", uid ? MailboxState_msnToUid(self->mbstate, msn) : (u64_t)msn);
 	}
 
-	g_list_free(h);
-
 	s = t->str;
 	g_string_free(t,FALSE);
 	
@@ -426,7 +351,7 @@ char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self)
 	gchar *s = NULL;
 	GList *l = NULL;
 	gboolean uid;
-	u64_t *msn;
+	u64_t msn;
 
 	l = g_list_first(self->sorted);
 	if (! g_list_length(l)>0)
@@ -436,12 +361,12 @@ char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self)
 	uid = dbmail_mailbox_get_uid(self);
 
 	while(l->data) {
-		msn = g_tree_lookup(self->found, l->data);
+		msn = _found_msn(self, *(u64_t *)l->data);
 		if (msn) {
 			if (uid)
 				g_string_append_printf(t,"%llu ", *(u64_t *)l->data);
 			else
-				g_string_append_printf(t,"%llu ", *(u64_t *)msn);
+				g_string_append_printf(t,"%llu ", msn);
 		}
 		if (! g_list_next(l))
 			break;
@@ -476,22 +401,16 @@ static int append_search(DbmailMailbox *self, search_key_t *value, gboolean desc
 	return 0;
 }
 
-static void _append_join(char *join, char *table)
+static void _append_sort(search_key_t *value, sort_key_t key, gboolean reverse)
 {
-        char *tmp;
-        TRACE(TRACE_DEBUG,"%s", table);
-        tmp = g_strdup_printf("LEFT JOIN %s%s ON m.physmessage_id=%s%s.physmessage_id ", DBPFX, table, DBPFX, table);
-        g_strlcat(join, tmp, MAX_SEARCH_LEN);
-        g_free(tmp);
-}
+	size_t n = 0;
 
-static void _append_sort(char *order, char *field, gboolean reverse)
-{
-	char *tmp;
-	tmp = g_strdup_printf("%s%s,", field, reverse ? " DESC" : "");
-	TRACE(TRACE_DEBUG,"%s", tmp);
-	g_strlcat(order, tmp, MAX_SEARCH_LEN);
-	g_free(tmp);
+	while (value->sort[n]) n++;
+	if (n >= SORT_MAX_KEYS)
+		return;
+
+	TRACE(TRACE_DEBUG,"key [%d] reverse [%d]", key, reverse);
+	value->sort[n] = key | (reverse ? SORT_REVERSE : 0);
 }
 
 static int _handle_sort_args(DbmailMailbox *self, char **search_keys, search_key_t *value, u64_t *idx)
@@ -512,42 +431,37 @@ static int _handle_sort_args(DbmailMailbox *self, char **search_keys, search_key
 	} 
 	
 	if ( MATCH(key, "arrival") ) {
-		_append_sort(value->order, "internal_date", reverse);
+		_append_sort(value, SORT_ARRIVAL, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "size") ) {
-		_append_sort(value->order, "messagesize", reverse);
+		_append_sort(value, SORT_SIZE, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "from") ) {
-		_append_join(value->table, "fromfield");
-		_append_sort(value->order, "fromfield", reverse);
+		_append_sort(value, SORT_FROM, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "subject") ) {
-		_append_join(value->table, "subjectfield");
-		_append_sort(value->order, "subjectfield", reverse);
+		_append_sort(value, SORT_SUBJECT, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "cc") ) {
-		_append_join(value->table, "ccfield");
-		_append_sort(value->order, "ccfield", reverse);
+		_append_sort(value, SORT_CC, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "to") ) {
-		_append_join(value->table, "tofield");
-		_append_sort(value->order, "tofield", reverse);
+		_append_sort(value, SORT_TO, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "date") ) {
-		_append_join(value->table, "datefield");
-		_append_sort(value->order, "datefield", reverse);
+		_append_sort(value, SORT_DATE, reverse);
 		(*idx)++;
 	}	
 
@@ -623,81 +537,84 @@ static int _handle_search_args(DbmailMailbox *self, char **search_keys, u64_t *i
 
 	else if ( MATCH(key, "answered") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "answered_flag=1", MAX_SEARCH_LEN);
+		value->flags_set = 1 << IMAP_FLAG_ANSWERED;
 		(*idx)++;
 		
 	} else if ( MATCH(key, "deleted") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "deleted_flag=1", MAX_SEARCH_LEN);
+		value->flags_set = 1 << IMAP_FLAG_DELETED;
 		(*idx)++;
 		
 	} else if ( MATCH(key, "flagged") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "flagged_flag=1", MAX_SEARCH_LEN);
+		value->flags_set = 1 << IMAP_FLAG_FLAGGED;
 		(*idx)++;
 		
 	} else if ( MATCH(key, "recent") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "recent_flag=1", MAX_SEARCH_LEN);
+		value->flags_set = 1 << IMAP_FLAG_RECENT;
 		(*idx)++;
 		
 	} else if ( MATCH(key, "seen") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "seen_flag=1", MAX_SEARCH_LEN);
+		value->flags_set = 1 << IMAP_FLAG_SEEN;
 		(*idx)++;
 		
 	} else if ( MATCH(key, "keyword") ) {
 		g_return_val_if_fail(search_keys[*idx + 1], -1);
-		value->type = IST_SET;
+		value->type = IST_KEYWORD;
+		value->match = TRUE;
 		(*idx)++;
-		strcpy(value->search, "0");
+		strncpy(value->search, search_keys[(*idx)], MAX_SEARCH_LEN);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "draft") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "draft_flag=1", MAX_SEARCH_LEN);
+		value->flags_set = 1 << IMAP_FLAG_DRAFT;
 		(*idx)++;
 		
 	} else if ( MATCH(key, "new") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "(seen_flag=0 AND recent_flag=1)", MAX_SEARCH_LEN);
+		value->flags_set = 1 << IMAP_FLAG_RECENT;
+		value->flags_unset = 1 << IMAP_FLAG_SEEN;
 		(*idx)++;
 		
 	} else if ( MATCH(key, "old") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "recent_flag=0", MAX_SEARCH_LEN);
+		value->flags_unset = 1 << IMAP_FLAG_RECENT;
 		(*idx)++;
 		
 	} else if ( MATCH(key, "unanswered") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "answered_flag=0", MAX_SEARCH_LEN);
+		value->flags_unset = 1 << IMAP_FLAG_ANSWERED;
 		(*idx)++;
 
 	} else if ( MATCH(key, "undeleted") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "deleted_flag=0", MAX_SEARCH_LEN);
+		value->flags_unset = 1 << IMAP_FLAG_DELETED;
 		(*idx)++;
 	
 	} else if ( MATCH(key, "unflagged") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "flagged_flag=0", MAX_SEARCH_LEN);
+		value->flags_unset = 1 << IMAP_FLAG_FLAGGED;
 		(*idx)++;
 	
 	} else if ( MATCH(key, "unseen") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "seen_flag=0", MAX_SEARCH_LEN);
+		value->flags_unset = 1 << IMAP_FLAG_SEEN;
 		(*idx)++;
 	
 	} else if ( MATCH(key, "unkeyword") ) {
 		g_return_val_if_fail(search_keys[(*idx) + 1],-1);
-		value->type = IST_SET;
+		value->type = IST_KEYWORD;
+		value->match = FALSE;
 		(*idx)++;
-		strcpy(value->search, "1:*");
+		strncpy(value->search, search_keys[(*idx)], MAX_SEARCH_LEN);
 		(*idx)++;
 	
 	} else if ( MATCH(key, "undraft") ) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "draft_flag=0", MAX_SEARCH_LEN);
+		value->flags_unset = 1 << IMAP_FLAG_DRAFT;
 		(*idx)++;
 	
 	}
@@ -781,38 +698,27 @@ static int _handle_search_args(DbmailMailbox *self, char **search_keys, u64_t *i
 	 */
 
 	else if ( MATCH(key, "before") ) {
-		char *s;
 		g_return_val_if_fail(search_keys[*idx + 1], -1);
 		g_return_val_if_fail(check_date(search_keys[*idx + 1]),-1);
-		value->type = IST_IDATE;
+		value->type = IST_IDATE_BEFORE;
 		(*idx)++;
-		s = date_imap2sql(search_keys[*idx]);
-		g_snprintf(value->search, MAX_SEARCH_LEN, "p.internal_date < '%s'", s);
-		g_free(s);
+		strncpy(value->search, search_keys[(*idx)], MAX_SEARCH_LEN);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "on") ) {
-		char *s, *d;
 		g_return_val_if_fail(search_keys[*idx + 1], -1);
 		g_return_val_if_fail(check_date(search_keys[*idx + 1]),-1);
-		value->type = IST_IDATE;
+		value->type = IST_IDATE_ON;
 		(*idx)++;
-		s = date_imap2sql(search_keys[*idx]);
-		d = g_strdup_printf(db_get_sql(SQL_TO_DATE), "p.internal_date");
-		g_snprintf(value->search, MAX_SEARCH_LEN, "%s = '%s'", d, s);
-		g_free(s);
-		g_free(d);
+		strncpy(value->search, search_keys[(*idx)], MAX_SEARCH_LEN);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "since") ) {
-		char *s;
 		g_return_val_if_fail(search_keys[*idx + 1], -1);
 		g_return_val_if_fail(check_date(search_keys[*idx + 1]),-1);
-		value->type = IST_IDATE;
+		value->type = IST_IDATE_SINCE;
 		(*idx)++;
-		s = date_imap2sql(search_keys[*idx]);
-		g_snprintf(value->search, MAX_SEARCH_LEN, "p.internal_date > '%s'", s);
-		g_free(s);
+		strncpy(value->search, search_keys[(*idx)], MAX_SEARCH_LEN);
 		(*idx)++;
 	}
 
@@ -863,42 +769,37 @@ static int _handle_search_args(DbmailMailbox *self, char **search_keys, u64_t *i
 
 		if ( MATCH(nextkey, "answered") ) {
 			value->type = IST_FLAG;
-			strncpy(value->search, "answered_flag=0", MAX_SEARCH_LEN);
+			value->flags_unset = 1 << IMAP_FLAG_ANSWERED;
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "deleted") ) {
 			value->type = IST_FLAG;
-			strncpy(value->search, "deleted_flag=0", MAX_SEARCH_LEN);
+			value->flags_unset = 1 << IMAP_FLAG_DELETED;
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "flagged") ) {
 			value->type = IST_FLAG;
-			strncpy(value->search, "flagged_flag=0", MAX_SEARCH_LEN);
+			value->flags_unset = 1 << IMAP_FLAG_FLAGGED;
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "recent") ) {
 			value->type = IST_FLAG;
-			strncpy(value->search, "recent_flag=0", MAX_SEARCH_LEN);
+			value->flags_unset = 1 << IMAP_FLAG_RECENT;
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "seen") ) {
 			value->type = IST_FLAG;
-			strncpy(value->search, "seen_flag=0", MAX_SEARCH_LEN);
+			value->flags_unset = 1 << IMAP_FLAG_SEEN;
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "draft") ) {
 			value->type = IST_FLAG;
-			strncpy(value->search, "draft_flag=0", MAX_SEARCH_LEN);
-			(*idx)+=2;
-			
-		} else if ( MATCH(nextkey, "new") ) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "(seen_flag=1 AND recent_flag=0)", MAX_SEARCH_LEN);
+			value->flags_unset = 1 << IMAP_FLAG_DRAFT;
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "old") ) {
 			value->type = IST_FLAG;
-			strncpy(value->search, "recent_flag=1", MAX_SEARCH_LEN);
+			value->flags_set = 1 << IMAP_FLAG_RECENT;
 			(*idx)+=2;
 			
 		} else {
@@ -1038,12 +939,7 @@ int dbmail_mailbox_build_imap_search(DbmailMailbox *self, char **search_keys, u6
 
 static gboolean _do_sort(GNode *node, DbmailMailbox *self)
 {
-	GString *q;
-	u64_t tid, *id;
-	unsigned i;
-	C c; R r; volatile int t = FALSE;
 	search_key_t *s = (search_key_t *)node->data;
-	GTree *z;
 	
 	TRACE(TRACE_DEBUG,"type [%d]", s->type);
 
@@ -1051,62 +947,89 @@ static gboolean _do_sort(GNode *node, DbmailMailbox *self)
 	
 	if (s->searched) return FALSE;
 
-	q = g_string_new("");
-	g_string_printf(q, "SELECT message_idnr FROM %smessages m "
-			"LEFT JOIN %sphysmessage p ON m.physmessage_id=p.id "
-			"%s"
-			"WHERE m.mailbox_idnr = %llu AND m.status IN (%d,%d) "
-			"ORDER BY %smessage_idnr", DBPFX, DBPFX, s->table,
-			dbmail_mailbox_get_id(self), MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN, s->order);
-
-        if (self->sorted) {
-                g_list_destroy(self->sorted);
-                self->sorted = NULL;
-        }
-
-	z = g_tree_new((GCompareFunc)ucmp);
-	c = db_con_get();
-	TRY
-		i = 0;
-		r = db_query(c,q->str);
-		while (db_result_next(r)) {
-			tid = db_result_get_u64(r,0);
-			if (g_tree_lookup(self->found,&tid) && (! g_tree_lookup(z, &tid))) {
-				id = g_new0(u64_t,1);
-				*id = tid;
-				g_tree_insert(z, id, id);
-				self->sorted = g_list_prepend(self->sorted,id);
-			}
-		}
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		t = DM_EQUERY;
-	FINALLY
-		db_con_close(c);
-		g_tree_destroy(z);
-	END_TRY;
-
-	if (t == DM_EQUERY) return TRUE;
+	if (self->sorted) {
+		g_list_destroy(self->sorted);
+		self->sorted = NULL;
+	}
 
-        self->sorted = g_list_reverse(self->sorted);
+	if (! (self->found && self->mbstate))
+		return TRUE;
 
-	g_string_free(q,TRUE);
+	/* sort keys are cached in the mailbox state */
+	if (MailboxState_sort(self->mbstate, self->found, s->sort, &self->sorted) != DM_SUCCESS)
+		return TRUE;
 
 	s->searched = TRUE;
 	
 	return FALSE;
 }
-static GTree * mailbox_search(DbmailMailbox *self, search_key_t *s)
+/* beyond this many messages the index doesn't know yet
+ * (before dbmail-util -F), BODY and TEXT don't use it */
+#define FTS_PENDING_MAX 200
+
+/*
+ * BODY and TEXT from the full-text index. NULL if the index
+ * isn't enabled, or can't answer for this search string.
+ *
+ * The index only answers for messages that were indexed; the uids of
+ * the others go in pending (NULL if none), to be scanned with LIKE.
+ */
+static Bitset_T mailbox_search_fts(DbmailMailbox *self, search_key_t *s, char **pending)
+{
+	GList *uids = NULL, *l;
+	GString *ids;
+	Bitset_T found;
+	u64_t msn;
+
+	*pending = NULL;
+
+	if (! dm_fts_enabled())
+		return NULL;
+
+	if (dm_fts_unindexed(dbmail_mailbox_get_id(self), &uids) != DM_SUCCESS) {
+		g_list_destroy(uids);
+		return NULL;
+	}
+	if (g_list_length(uids) > FTS_PENDING_MAX) {
+		TRACE(TRACE_DEBUG, "[%u] messages not indexed, not using the index", g_list_length(uids));
+		g_list_destroy(uids);
+		return NULL;
+	}
+	if (uids) {
+		ids = g_string_new("");
+		for (l = g_list_first(uids); l; l = g_list_next(l))
+			g_string_append_printf(ids, "%s%llu", ids->len ? "," : "", *(u64_t *)l->data);
+		g_list_destroy(uids);
+		uids = NULL;
+		*pending = g_string_free(ids, FALSE);
+	}
+
+	if (dm_fts_search(dbmail_mailbox_get_id(self), s->search, &uids) != DM_SUCCESS) {
+		g_free(*pending);
+		*pending = NULL;
+		return NULL;
+	}
+
+	found = Bitset_new(MailboxState_count(self->mbstate) + 1);
+	for (l = g_list_first(uids); l; l = g_list_next(l)) {
+		if ((msn = MailboxState_uidToMsn(self->mbstate, *(u64_t *)l->data)))
+			Bitset_add(found, msn);
+	}
+	g_list_destroy(uids);
+
+	return found;
+}
+
+static Bitset_T mailbox_search(DbmailMailbox *self, search_key_t *s)
 {
 	char *qs, *date, *field, *d;
-	u64_t *k, *v, *w;
+	u64_t w;
 	u64_t id;
-	char gt_lt = 0;
 	const char *op;
 	char partial[DEF_FRAGSIZE];
-	C c; R r; S st;
-	GTree *ids;
-	char *inset = NULL;
+	C c; R r; S st = NULL;
+	char *inset = NULL, *pending = NULL;
+	Bitset_T body = NULL;
 	
 	GString *t;
 	GString *q;
@@ -1114,12 +1037,27 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key_t *s)
 	if (!s->search)
 		return NULL;
 
-	if (self->found && g_tree_nnodes(self->found) <= 200) {
+	if (s->type == IST_DATA_BODY || s->type == IST_DATA_TEXT)
+		body = mailbox_search_fts(self, s, &pending);
+
+	if (body && ! pending && s->type == IST_DATA_BODY) {
+		s->found = body;
+		return s->found;
+	}
+
+	if (self->found && Bitset_len(self->found) <= 200) {
 		char *setlist = dbmail_mailbox_ids_as_string(self, TRUE, ",");
 		inset = g_strdup_printf("AND m.message_idnr IN (%s)", setlist);
 		g_free(setlist);
 	}
 
+	if (pending && s->type == IST_DATA_BODY) {
+		/* scan only what the index doesn't know */
+		char *tmp = g_strdup_printf("%s AND m.message_idnr IN (%s)", inset ? inset : "", pending);
+		g_free(inset);
+		inset = tmp;
+	}
+
 	c = db_con_get();
 	t = g_string_new("");
 	q = g_string_new("");
@@ -1192,6 +1130,38 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key_t *s)
 
 			case IST_DATA_TEXT:
 
+			if (body && ! pending) {
+				/* the body is covered by the index */
+				g_string_printf(q,"SELECT DISTINCT m.message_idnr FROM %smessages m "
+						"LEFT JOIN %sheader h USING (physmessage_id) "
+						"LEFT JOIN %sheadervalue v ON h.headervalue_id=v.id "
+						"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
+						"%s "
+						"AND v.headervalue %s ? "
+						"ORDER BY m.message_idnr",
+						DBPFX, DBPFX, DBPFX,
+						inset?inset:"",
+						db_get_sql(SQL_INSENSITIVE_LIKE));
+
+				st = db_stmt_prepare(c,q->str);
+				db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
+				db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
+				db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
+				memset(partial,0,sizeof(partial));
+				snprintf(partial, DEF_FRAGSIZE, "%%%s%%", s->search);
+				db_stmt_set_str(st, 4, partial);
+
+				break;
+			}
+
+			/* with the index, only the bodies it doesn't know are scanned */
+			if (pending)
+				g_string_printf(t, "(m.message_idnr IN (%s) AND k.data %s ?)", 
+						pending, db_get_sql(SQL_SENSITIVE_LIKE));
+			else
+				g_string_printf(t, "k.data %s ?", 
+						db_get_sql(SQL_SENSITIVE_LIKE)); // pgsql will trip over ilike against bytea 
+
 			g_string_printf(q,"SELECT DISTINCT m.message_idnr "
 					"FROM %smimeparts k "
 					"LEFT JOIN %spartlists l ON k.id=l.part_id "
@@ -1201,12 +1171,11 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key_t *s)
 					"LEFT JOIN %smessages m ON m.physmessage_id=p.id "
 					"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
 					"%s "
-					"AND (v.headervalue %s ? OR k.data %s ?) "
+					"AND (v.headervalue %s ? OR %s) "
 					"ORDER BY m.message_idnr",
 					DBPFX, DBPFX, DBPFX, DBPFX, DBPFX, DBPFX,
 					inset?inset:"",
-					db_get_sql(SQL_INSENSITIVE_LIKE), 
-					db_get_sql(SQL_SENSITIVE_LIKE)); // pgsql will trip over ilike against bytea 
+					db_get_sql(SQL_INSENSITIVE_LIKE), t->str);
 
 			st = db_stmt_prepare(c,q->str);
 			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
@@ -1219,23 +1188,6 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key_t *s)
 
 			break;
 				
-			case IST_IDATE:
-			g_string_printf(q, "SELECT message_idnr FROM %smessages m "
-					"LEFT JOIN %sphysmessage p ON m.physmessage_id=p.id "
-					"WHERE mailbox_idnr = ? AND status IN (?,?) "
-					"%s "
-					"AND %s "
-					"ORDER BY message_idnr", 
-					DBPFX, DBPFX, 
-					inset?inset:"",
-					s->search);
-
-			st = db_stmt_prepare(c,q->str);
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
-			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
-			break;
-			
 			case IST_DATA_BODY:
 			g_string_printf(t,db_get_sql(SQL_ENCODE_ESCAPE), "p.data");
 			g_string_printf(q,"SELECT DISTINCT m.message_idnr FROM %smimeparts p "
@@ -1262,71 +1214,38 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key_t *s)
 
 			break;
 
-			case IST_SIZE_LARGER:
-				gt_lt = '>';
-			case IST_SIZE_SMALLER:
-				if (!gt_lt) gt_lt = '<';
-
-			g_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
-				"LEFT JOIN %sphysmessage p ON m.physmessage_id = p.id "
-				"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
-				"%s "
-				"AND p.messagesize %c ? "
-				"ORDER BY message_idnr", 
-				DBPFX, DBPFX, 
-				inset?inset:"",
-				gt_lt);
-
-			st = db_stmt_prepare(c,q->str);
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
-			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
-			db_stmt_set_u64(st, 4, s->size);
-
-			break;
-
 			default:
-			g_string_printf(q, "SELECT message_idnr FROM %smessages "
-				"WHERE mailbox_idnr = ? AND status IN (?,?) AND %s "
-				"ORDER BY message_idnr", DBPFX, 
-				s->search); // FIXME: Sometimes s->search is ""
-
-			st = db_stmt_prepare(c,q->str);
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
-			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
+			/* not a text key, see MailboxState_search */
+			THROW(SQLException, "search key [%d] not supported in sql", s->type);
 			break;
 			
 		}
 
 		r = db_stmt_query(st);
 
-		s->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free, (GDestroyNotify)g_free);
+		s->found = Bitset_new(MailboxState_count(self->mbstate) + 1);
 
-		ids = MailboxState_getIds(self->mbstate);
 		while (db_result_next(r)) {
 			id = db_result_get_u64(r,0);
-			if (! (w = g_tree_lookup(ids, &id))) {
+			if (! (w = MailboxState_uidToMsn(self->mbstate, id))) {
 				TRACE(TRACE_ERR, "key missing in ids: [%llu]\n", id);
 				continue;
 			}
-			assert(w);
-			
-			k = g_new0(u64_t,1);
-			v = g_new0(u64_t,1);
-			*k = id;
-			*v = *w;
-
-			g_tree_insert(s->found, k, v);
+			Bitset_add(s->found, w);
 		}
+		if (body)
+			Bitset_or(s->found, body);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
+	if (body)
+		Bitset_free(&body);
 	if (inset)
 		g_free(inset);
+	g_free(pending);
 
 	g_string_free(q,TRUE);
 	g_string_free(t,TRUE);
@@ -1334,87 +1253,55 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key_t *s)
 	return s->found;
 }
 
-struct filter_helper {  
-        gboolean uid;   
-        u64_t min;      
-        u64_t max;      
-        GTree *a;       
-};                      
-                        
-static int filter_range(gpointer key, gpointer value, gpointer data)
-{                       
-	u64_t *k, *v;   
-	struct filter_helper *d = (struct filter_helper *)data;
-
-	if (*(u64_t *)key < d->min) return FALSE; // skip
-	if (*(u64_t *)key > d->max) return TRUE; // done
-
-	k = g_new0(u64_t,1);
-	v = g_new0(u64_t,2);
-
-	*k = *(u64_t *)key;
-	*v = *(u64_t *)value;
-
-	if (d->uid)     
-		g_tree_insert(d->a, k, v);
-	else            
-		g_tree_insert(d->a, v, k);
-
-	return FALSE;   
-}                       
-
-static void find_range(GTree *c, u64_t l, u64_t r, GTree *a, gboolean uid)
-{                       
-	struct filter_helper data;
-
-	data.uid = uid; 
-	data.min = l;   
-	data.max = r;   
-	data.a = a;     
-
-	g_tree_foreach(c, (GTraverseFunc)filter_range, &data);
+/*
+ * add the messages with a uid (or msn) between l and r to a
+ */
+static void find_range(MailboxState_T M, u64_t l, u64_t r, Bitset_T a, gboolean uid)
+{
+	u64_t first, last;
+
+	if (uid) {
+		if (! MailboxState_uidRange(M, l, r, &first, &last))
+			return;
+	} else {
+		first = max(l, 1);
+		last = min(r, MailboxState_count(M));
+	}
+
+	Bitset_fill(a, first, last);
 }
 
-GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean uid)
+static Bitset_T mailbox_get_set(DbmailMailbox *self, const char *set, gboolean uid)
 {
-	GList *ids = NULL, *sets = NULL;
+	GList *sets = NULL;
 	GString *t;
-	GTree *uids;
 	char *rest;
 	u64_t l, r, lo = 0, hi = 0, maxmsn = 0;
-	GTree *a, *b, *c;
+	Bitset_T b;
 	gboolean error = FALSE;
 	
-	b = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
-
 	if (! self->mbstate)
-		return b;
-
+		return Bitset_new(0);
 
 	assert (self && self->mbstate && set);
 
+	b = Bitset_new(MailboxState_count(self->mbstate) + 1);
+
 	if (MailboxState_getExists(self->mbstate) == 0) // empty mailbox
 		return b;
 
 	maxmsn = MailboxState_getExists(self->mbstate);
-	uids = MailboxState_getIds(self->mbstate);
-	ids = g_tree_keys(uids);
-	assert(ids);
-	ids = g_list_last(ids);
-	hi = *((u64_t *)ids->data);
-	ids = g_list_first(ids);
-	lo = *((u64_t *)ids->data);
-	g_list_free(g_list_first(ids));
+	lo = MailboxState_msnToUid(self->mbstate, 1);
+	hi = MailboxState_msnToUid(self->mbstate, MailboxState_count(self->mbstate));
+	assert(lo && hi);
 
 	if (! uid) {
 		lo = 1;
 		hi = maxmsn;
-		if (hi != (u64_t)g_tree_nnodes(uids))
+		if (hi != (u64_t)MailboxState_count(self->mbstate))
 			TRACE(TRACE_WARNING, "[%p] mailbox info out of sync: exists [%llu] ids [%u]", 
-				self->mbstate, hi, g_tree_nnodes(uids));
+				self->mbstate, hi, MailboxState_count(self->mbstate));
 	}
-	
-	a = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
 
 	t = g_string_new(set);
 	
@@ -1465,19 +1352,8 @@ GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean ui
 	
 		if (! (l && r)) break;
 
-		if (uid)
-			c = MailboxState_getIds(self->mbstate);
-		else
-			c = MailboxState_getMsn(self->mbstate);
+		find_range(self->mbstate, min(l,r), max(l,r), b, uid);
 
-		find_range(c, min(l,r), max(l,r), a, uid);
-
-		if (g_tree_merge(b,a,IST_SUBSEARCH_OR)) {
-			error = TRUE;
-			TRACE(TRACE_ERR, "cannot compare null trees");
-			break;
-		}
-		
 		if (! g_list_next(sets)) break;
 		sets = g_list_next(sets);
 	}
@@ -1485,31 +1361,35 @@ GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean ui
 	g_list_destroy(sets);
 	g_string_free(t,TRUE);
 
-	if (a) g_tree_destroy(a);
-
-	if (error) {
-		g_tree_destroy(b);
-		b = NULL;
-	}
+	if (error)
+		Bitset_free(&b);
 
 	return b;
 }
 
-static gboolean _found_tree_copy(u64_t *key, u64_t *val, GTree *tree)
+GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean uid)
 {
-	u64_t *a,*b;
-	a = g_new0(u64_t,1);
-	b = g_new0(u64_t,1);
-	*a = *key;
-	*b = *val;
-	g_tree_insert(tree, a, b);
-	return FALSE;
-}
+	Bitset_T b;
+	GTree *a;
+	size_t msn;
+	u64_t *k, *v;
 
-static gboolean _shallow_tree_copy(u64_t *key, u64_t *val, GTree *tree)
-{
-	g_tree_insert(tree, key, val);
-	return FALSE;
+	if (! (b = mailbox_get_set(self, set, uid)))
+		return NULL;
+
+	a = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+
+	for (msn = 1; Bitset_next(b, &msn); msn++) {
+		k = g_new0(u64_t,1);
+		v = g_new0(u64_t,1);
+		*k = MailboxState_msnToUid(self->mbstate, msn);
+		*v = msn;
+		g_tree_insert(a, k, v);
+	}
+
+	Bitset_free(&b);
+
+	return a;
 }
 
 static gboolean _prescan_search(GNode *node, DbmailMailbox *self)
@@ -1520,11 +1400,22 @@ static gboolean _prescan_search(GNode *node, DbmailMailbox *self)
 	
 	switch (s->type) {
 		case IST_SET:
-			if (! (s->found = dbmail_mailbox_get_set(self, (const char *)s->search, 0)))
+			if (! (s->found = mailbox_get_set(self, (const char *)s->search, 0)))
 				return TRUE;
 			break;
 		case IST_UIDSET:
-			if (! (s->found = dbmail_mailbox_get_set(self, (const char *)s->search, 1)))
+			if (! (s->found = mailbox_get_set(self, (const char *)s->search, 1)))
+				return TRUE;
+			break;
+		/* cheap enough to narrow down the text searches that follow */
+		case IST_FLAG:
+		case IST_KEYWORD:
+		case IST_SIZE_LARGER:
+		case IST_SIZE_SMALLER:
+		case IST_IDATE_BEFORE:
+		case IST_IDATE_ON:
+		case IST_IDATE_SINCE:
+			if (! (s->found = MailboxState_search(self->mbstate, s)))
 				return TRUE;
 			break;
 		default:
@@ -1533,14 +1424,13 @@ static gboolean _prescan_search(GNode *node, DbmailMailbox *self)
 	}
 	s->searched = TRUE;
 
-	g_tree_merge(self->found, s->found, IST_SUBSEARCH_AND);
+	Bitset_and(self->found, s->found);
 	s->merged = TRUE;
 
-	TRACE(TRACE_DEBUG,"[%p] depth [%d] type [%d] rows [%d]\n",
-		s, g_node_depth(node), s->type, s->found ? g_tree_nnodes(s->found): 0);
+	TRACE(TRACE_DEBUG,"[%p] depth [%d] type [%d] rows [%zu]\n",
+		s, g_node_depth(node), s->type, Bitset_len(s->found));
 
-	g_tree_destroy(s->found);
-	s->found = NULL;
+	Bitset_free(&s->found);
 
 	return FALSE;
 }
@@ -1557,21 +1447,28 @@ static gboolean _do_search(GNode *node, DbmailMailbox *self)
 			break;
 			
 		case IST_SET:
-			if (! (s->found = dbmail_mailbox_get_set(self, (const char *)s->search, 0)))
+			if (! (s->found = mailbox_get_set(self, (const char *)s->search, 0)))
 				return TRUE;
 			break;
 		case IST_UIDSET:
-			if (! (s->found = dbmail_mailbox_get_set(self, (const char *)s->search, 1)))
+			if (! (s->found = mailbox_get_set(self, (const char *)s->search, 1)))
 				return TRUE;
 			break;
 
+		/* everything these need is in the mailbox state */
+		case IST_FLAG:
+		case IST_KEYWORD:
 		case IST_SIZE_LARGER:
 		case IST_SIZE_SMALLER:
+		case IST_IDATE_BEFORE:
+		case IST_IDATE_ON:
+		case IST_IDATE_SINCE:
+			s->found = MailboxState_search(self->mbstate, s);
+			break;
+
 		case IST_HDRDATE_BEFORE:
 		case IST_HDRDATE_SINCE:
 		case IST_HDRDATE_ON:
-		case IST_IDATE:
-		case IST_FLAG:
 		case IST_HDR:
 		case IST_DATA_TEXT:
 		case IST_DATA_BODY:
@@ -1582,7 +1479,6 @@ static gboolean _do_search(GNode *node, DbmailMailbox *self)
 		case IST_SUBSEARCH_AND:
 		case IST_SUBSEARCH_OR:
 			g_node_children_foreach(node, G_TRAVERSE_ALL, (GNodeForeachFunc)_do_search, (gpointer)self);
-			s->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free, (GDestroyNotify)g_free);
 			break;
 
 
@@ -1592,25 +1488,24 @@ static gboolean _do_search(GNode *node, DbmailMailbox *self)
 
 	s->searched = TRUE;
 	
-	TRACE(TRACE_DEBUG,"[%p] depth [%d] type [%d] rows [%d]\n",
-		s, g_node_depth(node), s->type, s->found ? g_tree_nnodes(s->found): 0);
+	TRACE(TRACE_DEBUG,"[%p] depth [%d] type [%d] rows [%zu]\n",
+		s, g_node_depth(node), s->type, s->found ? Bitset_len(s->found): 0);
 
 	return FALSE;
 }	
 
 
-static gboolean _merge_search(GNode *node, GTree *found)
+/*
+ * narrow found down to the messages matching node and its subkeys
+ */
+static void _merge_search(GNode *node, Bitset_T found)
 {
 	search_key_t *s = (search_key_t *)node->data;
-	search_key_t *a, *b;
-	GNode *x, *y;
+	Bitset_T a, b;
+	GNode *x;
 
 	if (s->type == IST_SORT)
-		return FALSE;
-
-	if (s->merged == TRUE)
-		return FALSE;
-
+		return;
 
 	switch(s->type) {
 		case IST_SUBSEARCH_AND:
@@ -1618,61 +1513,43 @@ static gboolean _merge_search(GNode *node, GTree *found)
 			break;
 			
 		case IST_SUBSEARCH_NOT:
-			g_tree_foreach(found, (GTraverseFunc)_found_tree_copy, s->found);
-			g_node_children_foreach(node, G_TRAVERSE_ALL, (GNodeForeachFunc)_merge_search, (gpointer) s->found);
-			g_tree_merge(found, s->found, IST_SUBSEARCH_NOT);
-			s->merged = TRUE;
-			g_tree_destroy(s->found);
-			s->found = NULL;
-
+			a = Bitset_copy(found);
+			g_node_children_foreach(node, G_TRAVERSE_ALL, (GNodeForeachFunc)_merge_search, (gpointer) a);
+			Bitset_not(found, a);
+			Bitset_free(&a);
 			break;
 			
 		case IST_SUBSEARCH_OR:
-			x = g_node_nth_child(node,0);
-			y = g_node_nth_child(node,1);
-			a = (search_key_t *)x->data;
-			b = (search_key_t *)y->data;
-
-			if (a->type == IST_SUBSEARCH_AND) {
-				g_tree_foreach(found, (GTraverseFunc)_found_tree_copy, a->found);
-				g_node_children_foreach(x, G_TRAVERSE_ALL, (GNodeForeachFunc)_merge_search, (gpointer)a->found);
-			}
-
-			if (b->type == IST_SUBSEARCH_AND) {
-				g_tree_foreach(found, (GTraverseFunc)_found_tree_copy, b->found);
-				g_node_children_foreach(y, G_TRAVERSE_ALL, (GNodeForeachFunc)_merge_search, (gpointer)b->found);
+			a = Bitset_new(Bitset_size(found));
+			for (x = g_node_first_child(node); x; x = g_node_next_sibling(x)) {
+				b = Bitset_copy(found);
+				_merge_search(x, b);
+				Bitset_or(a, b);
+				Bitset_free(&b);
 			}
-		
-			g_tree_merge(a->found, b->found,IST_SUBSEARCH_OR);
-			b->merged = TRUE;
-			g_tree_destroy(b->found);
-			b->found = NULL;
-
-			g_tree_merge(s->found, a->found,IST_SUBSEARCH_OR);
-			a->merged = TRUE;
-			g_tree_destroy(a->found);
-			a->found = NULL;
-
-			g_tree_merge(found, s->found, IST_SUBSEARCH_AND);
-			s->merged = TRUE;
-			g_tree_destroy(s->found);
-			s->found = NULL;
-
+			Bitset_and(found, a);
+			Bitset_free(&a);
 			break;
 			
 		default:
-			g_tree_merge(found, s->found, IST_SUBSEARCH_AND);
-			s->merged = TRUE;
-			g_tree_destroy(s->found);
-			s->found = NULL;
-
+			/* keys already applied by _prescan_search are merged */
+			if (! s->merged) {
+				if (s->found)
+					Bitset_and(found, s->found);
+				else
+					Bitset_not(found, found);
+			}
+			/* keys following the initial set are ANDed */
+			g_node_children_foreach(node, G_TRAVERSE_ALL, (GNodeForeachFunc)_merge_search, (gpointer) found);
 			break;
 	}
 
-	TRACE(TRACE_DEBUG,"[%p] leaf [%d] depth [%d] type [%d] found [%d]", 
-			s, G_NODE_IS_LEAF(node), g_node_depth(node), s->type, found ? g_tree_nnodes(found): 0);
+	s->merged = TRUE;
+	if (s->found)
+		Bitset_free(&s->found);
 
-	return FALSE;
+	TRACE(TRACE_DEBUG,"[%p] leaf [%d] depth [%d] type [%d] found [%zu]", 
+			s, G_NODE_IS_LEAF(node), g_node_depth(node), s->type, Bitset_len(found));
 }
 	
 int dbmail_mailbox_sort(DbmailMailbox *self) 
@@ -1688,18 +1565,15 @@ int dbmail_mailbox_sort(DbmailMailbox *self)
 
 int dbmail_mailbox_search(DbmailMailbox *self) 
 {
-	GTree *ids;
 	if (! self->search) return 0;
 	
 	if (! self->mbstate)
 		dbmail_mailbox_open(self);
 
-	if (self->found) g_tree_destroy(self->found);
-	self->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
+	if (self->found) Bitset_free(&self->found);
+	self->found = Bitset_new(MailboxState_count(self->mbstate) + 1);
 
-	ids = MailboxState_getIds(self->mbstate);
-
-	g_tree_foreach(ids, (GTraverseFunc)_shallow_tree_copy, self->found);
+	find_range(self->mbstate, 1, MailboxState_count(self->mbstate), self->found, FALSE);
  
 	g_node_traverse(g_node_get_root(self->search), G_LEVEL_ORDER, G_TRAVERSE_ALL, 2, 
 			(GNodeTraverseFunc)_prescan_search, (gpointer)self);
@@ -1707,13 +1581,9 @@ int dbmail_mailbox_search(DbmailMailbox *self)
 	g_node_traverse(g_node_get_root(self->search), G_PRE_ORDER, G_TRAVERSE_ALL, -1, 
 			(GNodeTraverseFunc)_do_search, (gpointer)self);
 
-	g_node_traverse(g_node_get_root(self->search), G_PRE_ORDER, G_TRAVERSE_ALL, -1, 
-			(GNodeTraverseFunc)_merge_search, (gpointer)self->found);
+	_merge_search(g_node_get_root(self->search), self->found);
 
-	if (self->found == NULL)
-		TRACE(TRACE_DEBUG,"found no ids\n");
-	else
-		TRACE(TRACE_DEBUG,"found [%d] ids\n", self->found ? g_tree_nnodes(self->found): 0);
+	TRACE(TRACE_DEBUG,"found [%zu] ids\n", Bitset_len(self->found));
 	
 	return 0;
 }
@@ -44,7 +44,7 @@ typedef struct {
 	MailboxState_T mbstate;	// cache mailbox metadata;
 
 	GList *sorted;		// ordered list of UID values
-	GTree *found;		// search result (key: uid, value: msn)
+	Bitset_T found;		// search result (indexed by msn)
 	GNode *search;
 	gchar *charset;		// charset used during search/sort
 
@@ -70,6 +70,7 @@ void dbmail_mailbox_free(DbmailMailbox *self);
 char * dbmail_mailbox_ids_as_string(DbmailMailbox *self, gboolean uid, const char *sep);
 char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self);
 char * dbmail_mailbox_orderedsubject(DbmailMailbox *self);
+char * dbmail_mailbox_references(DbmailMailbox *self);
 
 int dbmail_mailbox_build_imap_search(DbmailMailbox *self, char **search_keys, u64_t *idx, search_order_t order);
 
@@ -50,6 +50,7 @@ static gboolean _header_cache(const char *header, const char *value, gpointer us
 
 static DbmailMessage * _retrieve(DbmailMessage *self, const char *query_template);
 static void _map_headers(DbmailMessage *self);
+static void insert_physmessage(DbmailMessage *self, C c);
 static int _message_insert(DbmailMessage *self, 
 		u64_t user_idnr, 
 		const char *mailbox, 
@@ -259,9 +260,377 @@ static u64_t blob_store(const char *buf)
 	return 0;
 }
 
-static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
-{
+/*
+ * MIME parts are not written to the database as they are encountered
+ * while walking the mime tree. Instead they are collected on the message
+ * and flushed in one go by store_mime_parts: a single connection, a single
+ * transaction, one dedup query per MIMEPARTS_BATCH parts and multi-row
+ * mimeparts and partlists inserts.
+ */
+#define MIMEPARTS_BATCH 64
+
+typedef struct mimepart {
+	char *data;
+	size_t size;
+	char *hash;
 	u64_t id;
+	gboolean is_header;
+	int part_key;
+	int part_depth;
+	int part_order;
+	struct mimepart *same; // identical part earlier in the same message
+} mimepart_t;
+
+static void mimepart_free(mimepart_t *part)
+{
+	g_free(part->data);
+	g_free(part->hash);
+	g_free(part);
+}
+
+static void mimeparts_free(DbmailMessage *m)
+{
+	GList *l = g_list_first(m->mimeparts);
+	while (l) {
+		mimepart_free((mimepart_t *)l->data);
+		l = g_list_next(l);
+	}
+	g_list_free(m->mimeparts);
+	m->mimeparts = NULL;
+}
+
+static gboolean mimepart_equal(const mimepart_t *a, const mimepart_t *b)
+{
+	if (a->size != b->size) return FALSE;
+	if (strcmp(a->hash, b->hash)) return FALSE;
+	return memcmp(a->data, b->data, a->size) ? FALSE : TRUE;
+}
+
+/* number of rows per multi-row statement. SQLite runs in-process, so there
+ * is no round trip to save and single-row statements keep older releases
+ * without multi-row VALUES support working. Oracle has no multi-row VALUES.
+ */
+static int mimeparts_batch(void)
+{
+	switch (_db_params.db_driver) {
+		case DM_DRIVER_SQLITE:
+		case DM_DRIVER_ORACLE:
+			return 1;
+		default:
+			return MIMEPARTS_BATCH;
+	}
+}
+
+static gboolean mimepart_is(const mimepart_t *part, const char *hash, u64_t size)
+{
+	return (part->size == size && strcmp(part->hash, hash) == 0);
+}
+
+/*
+ * resolve the ids of already stored copies of parts
+ *
+ * The hash IN (...) clause lets the index on hash do the work. A hash
+ * is no proof of identity, so the data of every candidate is compared
+ * before a part is linked to it.
+ */
+static void mimeparts_lookup(C c, GList *parts)
+{
+	while (parts) {
+		GList *slice = parts, *l;
+		GString *q = g_string_new("");
+		int i, n;
+		S s; R r;
+
+		for (n = 0; parts && n < MIMEPARTS_BATCH; n++)
+			parts = g_list_next(parts);
+
+		g_string_printf(q, "SELECT id, hash, %ssize%s, data FROM %smimeparts WHERE hash IN (", 
+				db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), DBPFX);
+		for (i = 0; i < n; i++)
+			g_string_append_printf(q, "%s?", i ? "," : "");
+		g_string_append(q, ")");
+
+		s = db_stmt_prepare(c, "%s", q->str);
+		g_string_free(q, TRUE);
+
+		for (i = 0, l = slice; i < n; i++, l = g_list_next(l))
+			db_stmt_set_str(s, i+1, ((mimepart_t *)l->data)->hash);
+
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			u64_t id = db_result_get_u64(r, 0);
+			const char *hash = db_result_get(r, 1);
+			u64_t size = db_result_get_u64(r, 2);
+			const void *data = NULL;
+			int len = -1;
+			for (i = 0, l = slice; i < n; i++, l = g_list_next(l)) {
+				mimepart_t *part = (mimepart_t *)l->data;
+				if (part->id || ! mimepart_is(part, hash, size))
+					continue;
+				if (len < 0)
+					data = db_result_get_blob(r, 3, &len);
+				if ((size_t)len != part->size || memcmp(part->data, data, part->size))
+					continue;
+				part->id = id;
+			}
+		}
+	}
+}
+
+/*
+ * find the ids MySQL gave to a multi-row insert
+ *
+ * Only the first id is reported. The ids of one statement go up in
+ * VALUES order, but other transactions may have been handed ids in
+ * between; if such a row has the same hash and size as one of ours,
+ * the data decides.
+ */
+static void mimeparts_claim(C c, GList *slice, int n, u64_t first)
+{
+	GString *q = g_string_new("");
+	GList *l, *k, *rows = NULL;
+	int i;
+	S s; R r;
+
+	g_string_printf(q, "SELECT id, hash, %ssize%s FROM %smimeparts WHERE id >= ? AND hash IN (", 
+			db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), DBPFX);
+	for (i = 0; i < n; i++)
+		g_string_append_printf(q, "%s?", i ? "," : "");
+	g_string_append(q, ") ORDER BY id");
+
+	s = db_stmt_prepare(c, "%s", q->str);
+	g_string_free(q, TRUE);
+	db_stmt_set_u64(s, 1, first);
+	for (i = 0, l = slice; i < n; i++, l = g_list_next(l))
+		db_stmt_set_str(s, i+2, ((mimepart_t *)l->data)->hash);
+
+	r = db_stmt_query(s);
+	while (db_result_next(r)) {
+		mimepart_t *row = g_new0(mimepart_t, 1);
+		row->id = db_result_get_u64(r, 0);
+		row->hash = g_strdup(db_result_get(r, 1));
+		row->size = db_result_get_u64(r, 2);
+		rows = g_list_prepend(rows, row);
+	}
+	rows = g_list_reverse(rows);
+
+	for (i = 0, l = slice; i < n; i++, l = g_list_next(l)) {
+		mimepart_t *part = (mimepart_t *)l->data;
+		int mine = 0, found = 0, j;
+
+		/* rows left for this hash and size, and our parts still
+		 * waiting for one */
+		for (j = i, k = l; j < n; j++, k = g_list_next(k))
+			if (mimepart_is((mimepart_t *)k->data, part->hash, part->size))
+				mine++;
+		for (k = rows; k; k = g_list_next(k))
+			if (mimepart_is((mimepart_t *)k->data, part->hash, part->size))
+				found++;
+
+		for (k = rows; k; k = g_list_next(k)) {
+			mimepart_t *row = (mimepart_t *)k->data;
+			const void *data;
+			int len;
+
+			if (! mimepart_is(row, part->hash, part->size))
+				continue;
+			if (found > mine) {
+				/* not all of these are ours */
+				s = db_stmt_prepare(c, "SELECT data FROM %smimeparts WHERE id = ?", DBPFX);
+				db_stmt_set_u64(s, 1, row->id);
+				r = db_stmt_query(s);
+				if (! db_result_next(r))
+					continue;
+				data = db_result_get_blob(r, 0, &len);
+				if ((size_t)len != part->size || memcmp(part->data, data, part->size))
+					continue;
+			}
+			part->id = row->id;
+			mimepart_free(row);
+			rows = g_list_delete_link(rows, k);
+			break;
+		}
+	}
+
+	g_list_foreach(rows, (GFunc)mimepart_free, NULL);
+	g_list_free(rows);
+}
+
+/* 
+ * insert the new parts, mimeparts_batch() rows per INSERT, so every
+ * blob is sent to the server exactly once. PostgreSQL returns the ids
+ * of all rows in VALUES order, MySQL only the first one.
+ */
+static void mimeparts_insert(C c, GList *parts, const char *frag)
+{
+	int batch = mimeparts_batch();
+
+	while (parts) {
+		GList *slice = parts, *l;
+		GString *q = g_string_new("");
+		int i, n;
+		S s; R r;
+
+		for (n = 0; parts && n < batch; n++)
+			parts = g_list_next(parts);
+
+		g_string_printf(q, "INSERT INTO %smimeparts (hash, data, %ssize%s) VALUES ", 
+				DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN));
+		for (i = 0; i < n; i++)
+			g_string_append_printf(q, "%s(?, ?, ?)", i ? "," : "");
+		g_string_append_printf(q, " %s", frag);
+
+		s = db_stmt_prepare(c, "%s", q->str);
+		g_string_free(q, TRUE);
+
+		for (i = 0, l = slice; i < n; i++, l = g_list_next(l)) {
+			mimepart_t *part = (mimepart_t *)l->data;
+			db_stmt_set_str(s, (i*3)+1, part->hash);
+			db_stmt_set_blob(s, (i*3)+2, part->data, part->size);
+			db_stmt_set_u64(s, (i*3)+3, part->size);
+		}
+		r = db_stmt_query(s);
+
+		if (n == 1) {
+			((mimepart_t *)slice->data)->id = db_insert_result(c, r);
+		} else if (_db_params.db_driver == DM_DRIVER_POSTGRESQL) {
+			for (i = 0, l = slice; i < n && db_result_next(r); i++, l = g_list_next(l))
+				((mimepart_t *)l->data)->id = db_result_get_u64(r, 0);
+		} else {
+			mimeparts_claim(c, slice, n, db_insert_result(c, r));
+		}
+	}
+}
+
+static void partlists_insert(C c, DbmailMessage *m, GList *parts)
+{
+	int batch = mimeparts_batch();
+	u64_t physid = dbmail_message_get_physid(m);
+
+	while (parts) {
+		GString *q = g_string_new("");
+		int n;
+
+		g_string_printf(q, "INSERT INTO %spartlists (physmessage_id, is_header, "
+				"part_key, part_depth, part_order, part_id) VALUES ", DBPFX);
+		for (n = 0; parts && n < batch; n++, parts = g_list_next(parts)) {
+			mimepart_t *part = (mimepart_t *)parts->data;
+			g_string_append_printf(q, "%s(%llu,%d,%d,%d,%d,%llu)", n ? "," : "",
+					physid, part->is_header, part->part_key, 
+					part->part_depth, part->part_order, part->id);
+		}
+		db_exec(c, "%s", q->str);
+		g_string_free(q, TRUE);
+	}
+}
+
+static int store_mime_parts(DbmailMessage *m)
+{
+	GList *l, *u, *unique = NULL, *missing = NULL;
+	volatile int t = DM_SUCCESS;
+	char *frag;
+	C c;
+
+	m->mimeparts = g_list_reverse(m->mimeparts);
+
+	/* store parts that occur more than once in this message only once */
+	for (l = g_list_first(m->mimeparts); l; l = g_list_next(l)) {
+		mimepart_t *part = (mimepart_t *)l->data;
+		for (u = g_list_first(unique); u; u = g_list_next(u)) {
+			if (mimepart_equal((mimepart_t *)u->data, part)) {
+				part->same = (mimepart_t *)u->data;
+				break;
+			}
+		}
+		if (! part->same)
+			unique = g_list_prepend(unique, part);
+	}
+	unique = g_list_reverse(unique);
+
+	frag = db_returning("id");
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		mimeparts_lookup(c, unique);
+
+		for (l = g_list_first(unique); l; l = g_list_next(l)) {
+			if (! ((mimepart_t *)l->data)->id)
+				missing = g_list_prepend(missing, l->data);
+		}
+		missing = g_list_reverse(missing);
+
+		if (missing)
+			mimeparts_insert(c, missing, frag);
+
+		for (l = g_list_first(m->mimeparts); l; l = g_list_next(l)) {
+			mimepart_t *part = (mimepart_t *)l->data;
+			if (part->same)
+				part->id = part->same->id;
+			if (! part->id) {
+				TRACE(TRACE_ERR, "unable to store mimepart [%s]", part->hash);
+				t = DM_EQUERY;
+				break;
+			}
+		}
+
+		if (t == DM_SUCCESS) {
+			partlists_insert(c, m, m->mimeparts);
+			db_commit_transaction(c);
+		} else {
+			db_rollback_transaction(c);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	TRACE(TRACE_DEBUG, "physid [%llu] parts [%u] unique [%u] new [%u]", 
+			dbmail_message_get_physid(m), g_list_length(m->mimeparts), 
+			g_list_length(unique), g_list_length(missing));
+
+	g_free(frag);
+	g_list_free(unique);
+	g_list_free(missing);
+
+	return t;
+}
+
+/*
+ * Oracle can't compare lobs larger than DM_ORA_MAX_BYTES_LOB_CMP in a query
+ * and has no multi-row VALUES, so parts are stored one by one there.
+ */
+static int store_mime_parts_serial(DbmailMessage *m)
+{
+	GList *l;
+
+	m->mimeparts = g_list_reverse(m->mimeparts);
+
+	for (l = g_list_first(m->mimeparts); l; l = g_list_next(l)) {
+		mimepart_t *part = (mimepart_t *)l->data;
+		u64_t id;
+
+		if (! (id = blob_store(part->data)))
+			return DM_EQUERY;
+
+		m->part_key = part->part_key;
+		m->part_depth = part->part_depth;
+		m->part_order = part->part_order;
+
+		// register this message fragment
+		if (! register_blob(m, id, part->is_header))
+			return DM_EQUERY;
+	}
+
+	return DM_SUCCESS;
+}
+
+/* queue a message fragment for storage; takes ownership of buf */
+static int store_part(DbmailMessage *m, char *buf, gboolean is_header)
+{
+	mimepart_t *part;
 
 	if (! buf) return 0;
 
@@ -273,17 +642,29 @@ static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
 	dprint("<blob is_header=\"%d\" part_depth=\"%d\" part_key=\"%d\" part_order=\"%d\">\n%s\n</blob>\n", 
 			is_header, m->part_depth, m->part_key, m->part_order, buf);
 
-	if (! (id = blob_store(buf)))
+	part = g_new0(mimepart_t, 1);
+	part->data = buf;
+	part->size = strlen(buf);
+	if (! (part->hash = dm_get_hash_for_string(buf))) {
+		mimepart_free(part);
 		return DM_EQUERY;
+	}
+	part->is_header = is_header;
+	part->part_key = m->part_key;
+	part->part_depth = m->part_depth;
+	part->part_order = m->part_order;
 
-	// register this message fragment
-	if (! register_blob(m, id, is_header))
-		return DM_EQUERY;
+	m->mimeparts = g_list_prepend(m->mimeparts, part);
 
 	m->part_order++;
 
 	return 0;
+}
 
+static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
+{
+	if (! buf) return 0;
+	return store_part(m, g_strdup(buf), is_header);
 }
 
 static GMimeContentType *find_type(const char *s)
@@ -461,8 +842,7 @@ static int store_head(GMimeObject *object, DbmailMessage *m)
 {
 	int r;
 	char *head = g_mime_object_get_headers(object);
-	r = store_blob(m, head, 1);
-	g_free(head);
+	r = store_part(m, head, 1);
 	return r;
 }
 
@@ -471,8 +851,7 @@ static int store_body(GMimeObject *object, DbmailMessage *m)
 	int r;
 	char *text = g_mime_object_get_body(object);
 	if (! text) return 0;
-	r = store_blob(m, text, 0);
-	g_free(text);
+	r = store_part(m, text, 0);
 	return r;
 }
 
@@ -595,7 +974,20 @@ gboolean store_mime_object(GMimeObject *parent, GMimeObject *object, DbmailMessa
 
 gboolean dm_message_store(DbmailMessage *m)
 {
-	return store_mime_object(NULL, (GMimeObject *)m->content, m);
+	gboolean r;
+
+	mimeparts_free(m);
+
+	if ((r = store_mime_object(NULL, (GMimeObject *)m->content, m)) == FALSE) {
+		if (_db_params.db_driver == DM_DRIVER_ORACLE)
+			r = (store_mime_parts_serial(m) != DM_SUCCESS);
+		else
+			r = (store_mime_parts(m) != DM_SUCCESS);
+	}
+
+	mimeparts_free(m);
+
+	return r;
 }
 
 
@@ -635,10 +1027,6 @@ DbmailMessage * dbmail_message_new(void)
 	/* provide quick case-sensitive header value searches */
 	self->header_value = g_tree_new((GCompareFunc)strcmp);
 	
-	/* internal cache: header_dict[headername.name] = headername.id */
-	self->header_dict = g_hash_table_new_full((GHashFunc)g_str_hash,
-			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
-	
 	dbmail_message_set_class(self, DBMAIL_MESSAGE);
 	
 	return self;
@@ -665,9 +1053,10 @@ void dbmail_message_free(DbmailMessage *self)
 		g_free(self->charset);
 		self->charset = NULL;
 	}
+	if (self->mimeparts)
+		mimeparts_free(self);
 
 	g_string_free(self->envelope_recipient,TRUE);
-	g_hash_table_destroy(self->header_dict);
 	g_tree_destroy(self->header_name);
 	g_tree_destroy(self->header_value);
 	
@@ -712,27 +1101,49 @@ int dbmail_message_get_class(const DbmailMessage *self)
  * \return the filled DbmailMessage
  */
 DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const GString *str)
+{
+	GMimeStream *stream;
+
+	stream = g_mime_stream_mem_new_with_buffer(str->str, str->len);
+	self = dbmail_message_init_with_stream(self, stream);
+	g_object_unref(stream);
+
+	return self;
+}
+
+/* \brief initialize a previously created DbmailMessage using a GMimeStream
+ * \param the empty DbmailMessage
+ * \param GMimeStream *stream positioned at the start of the raw message
+ * \return the filled DbmailMessage
+ *
+ * the parser keeps a reference to a seekable stream, and leaves the
+ * content of the parts there instead of copying it.
+ */
+DbmailMessage * dbmail_message_init_with_stream(DbmailMessage *self, GMimeStream *stream)
 {
 	GMimeObject *content;
 	GMimeParser *parser;
 	gchar *from = NULL;
-	GMimeStream *stream;
+	char buf[81];
+	ssize_t n;
 
 	assert(self->content == NULL);
 
-	stream = g_mime_stream_mem_new_with_buffer(str->str, str->len);
-	parser = g_mime_parser_new_with_stream(stream);
-	g_object_unref(stream);
+	memset(buf, 0, sizeof(buf));
+	n = g_mime_stream_read(stream, buf, sizeof(buf)-1);
+	g_mime_stream_reset(stream);
 
-	if (strncmp(str->str, "From ", 5) == 0) {
+	if (n >= 5 && strncmp(buf, "From ", 5) == 0) {
 		/* don't use gmime's from scanner since body lines may begin with 'From ' */
 		char *end;
-		if ((end = g_strstr_len(str->str, 80, "\n"))) {
-			size_t l = end - str->str;
-			from = g_strndup(str->str, l);
+		if ((end = strchr(buf, '\n'))) {
+			size_t l = end - buf;
+			from = g_strndup(buf, l);
 		}
 	}
 
+	parser = g_mime_parser_new_with_stream(stream);
+
 	content = GMIME_OBJECT(g_mime_parser_construct_message(parser));
 	if (content) {
 		dbmail_message_set_class(self, DBMAIL_MESSAGE);
@@ -1098,7 +1509,7 @@ DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, u64_t physid, int f
  *     - -1 on error
  *     -  1 on success
  */
-static int _update_message(DbmailMessage *self)
+static int _update_physmessage(DbmailMessage *self)
 {
 	u64_t size    = (u64_t)dbmail_message_get_size(self,FALSE);
 	u64_t rfcsize = (u64_t)dbmail_message_get_size(self,TRUE);
@@ -1107,8 +1518,23 @@ static int _update_message(DbmailMessage *self)
 			DBPFX, size, rfcsize, self->physid))
 		return DM_EQUERY;
 
-	if (! db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %llu", 
-			DBPFX, MESSAGE_STATUS_NEW, self->id))
+	return DM_SUCCESS;
+}
+
+static int _update_message(DbmailMessage *self)
+{
+	u64_t size    = (u64_t)dbmail_message_get_size(self,FALSE);
+	char *seq;
+	gboolean t;
+
+	if (_update_physmessage(self) == DM_EQUERY)
+		return DM_EQUERY;
+
+	seq = db_message_seq();
+	t = db_update("UPDATE %smessages SET status = %d, %s WHERE message_idnr = %llu", 
+			DBPFX, MESSAGE_STATUS_NEW, seq, self->id);
+	g_free(seq);
+	if (! t)
 		return DM_EQUERY;
 
 	if (! dm_quota_user_inc(db_get_useridnr(self->id), size))
@@ -1118,24 +1544,24 @@ static int _update_message(DbmailMessage *self)
 }
 
 
-int dbmail_message_store(DbmailMessage *self)
+/*
+ * store the message as a temporary message owned by user_idnr. A
+ * placeholder keeps MESSAGE_STATUS_INSERT and doesn't count against
+ * the quota; it only keeps the physmessage from looking orphaned
+ * until the real message records are in.
+ */
+static int _message_store(DbmailMessage *self, u64_t user_idnr, gboolean placeholder)
 {
-	u64_t user_idnr;
 	char unique_id[UID_SIZE];
 	int res = 0, i = 1, retry = 10, delay = 200;
 	int step = 0;
 	
-	if (! auth_user_exists(DBMAIL_DELIVERY_USERNAME, &user_idnr)) {
-		TRACE(TRACE_ERR, "unable to find user_idnr for user [%s]. Make sure this system user is in the database!", DBMAIL_DELIVERY_USERNAME);
-		return DM_EQUERY;
-	}
-	
 	create_unique_id(unique_id, user_idnr);
 
 	while (i++ < retry) {
 		if (step == 0) {
 			/* create a message record */
-			if(_message_insert(self, user_idnr, DBMAIL_TEMPMBOX, unique_id) < 0) {
+			if ((res = _message_insert(self, user_idnr, DBMAIL_TEMPMBOX, unique_id)) < 0) {
 				usleep(delay*i);
 				continue;
 			}
@@ -1143,7 +1569,7 @@ int dbmail_message_store(DbmailMessage *self)
 		}
 		if (step == 1) {
 			/* update message meta-data and owner quota */
-			if ((res = _update_message(self) < 0)) {
+			if ((res = (placeholder ? _update_physmessage(self) : _update_message(self)) < 0)) {
 				usleep(delay*i);
 				continue;
 			}
@@ -1169,6 +1595,12 @@ int dbmail_message_store(DbmailMessage *self)
 
 			dbmail_message_cache_referencesfield(self);
 			dbmail_message_cache_envelope(self);
+			dbmail_message_cache_sortkeys(self);
+
+			/* not fatal, dbmail-util -F will pick it up */
+			if (dm_fts_index(self) != DM_SUCCESS)
+				TRACE(TRACE_WARNING, "failed to index physmessage [%llu]", 
+						dbmail_message_get_physid(self));
 
 			step++;
 		}
@@ -1180,6 +1612,28 @@ int dbmail_message_store(DbmailMessage *self)
 	return res;
 }
 
+static int _message_store_delivery(DbmailMessage *self, gboolean placeholder)
+{
+	u64_t user_idnr;
+
+	if (! auth_user_exists(DBMAIL_DELIVERY_USERNAME, &user_idnr)) {
+		TRACE(TRACE_ERR, "unable to find user_idnr for user [%s]. Make sure this system user is in the database!", DBMAIL_DELIVERY_USERNAME);
+		return DM_EQUERY;
+	}
+
+	return _message_store(self, user_idnr, placeholder);
+}
+
+int dbmail_message_store(DbmailMessage *self)
+{
+	return _message_store_delivery(self, FALSE);
+}
+
+int dbmail_message_store_physmessage(DbmailMessage *self)
+{
+	return _message_store_delivery(self, TRUE);
+}
+
 static void insert_physmessage(DbmailMessage *self, C c)
 {
 	R r;
@@ -1289,54 +1743,64 @@ int _message_insert(DbmailMessage *self,
 	return t;
 }
 
-int dbmail_message_cache_headers(const DbmailMessage *self)
+#define CACHE_WIDTH 255
+
+/* headername ids never change once assigned, so they are shared
+ * by all messages handled by this process */
+static GHashTable *headernames = NULL;
+static GStaticMutex headernames_lock = G_STATIC_MUTEX_INIT;
+
+static u64_t _header_name_cached(const char *name)
 {
-	assert(self);
-	assert(self->physid);
+	u64_t *id, result = 0;
 
-	if (! GMIME_IS_MESSAGE(self->content)) {
-		TRACE(TRACE_ERR,"self->content is not a message");
-		return -1;
-	}
+	g_static_mutex_lock(&headernames_lock);
+	if (headernames && (id = g_hash_table_lookup(headernames, name)))
+		result = *id;
+	g_static_mutex_unlock(&headernames_lock);
 
-	g_tree_foreach(self->header_name, (GTraverseFunc)_header_cache, (gpointer)self);
-	
-	return DM_SUCCESS;
+	return result;
 }
 
-#define CACHE_WIDTH 255
+static void _header_name_register(const char *name, u64_t id)
+{
+	u64_t *tmp = g_new0(u64_t,1);
+	*tmp = id;
 
+	g_static_mutex_lock(&headernames_lock);
+	if (! headernames)
+		headernames = g_hash_table_new_full((GHashFunc)g_str_hash,
+				(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+	g_hash_table_replace(headernames, g_strdup(name), tmp);
+	g_static_mutex_unlock(&headernames_lock);
+}
 
-static int _header_name_get_id(const DbmailMessage *self, const char *header, u64_t *id)
+static int _header_name_get_id(const char *header, u64_t *id)
 {
-	u64_t *tmp = NULL;
-	gpointer cacheid;
 	gchar *case_header, *safe_header, *frag;
 	C c; R r; S s;
+	volatile u64_t tmp = 0;
 	volatile int t = FALSE;
 
 	// rfc822 headernames are case-insensitive
 	safe_header = g_ascii_strdown(header,-1);
-	if ((cacheid = g_hash_table_lookup(self->header_dict, (gconstpointer)safe_header)) != NULL) {
-		*id = *(u64_t *)cacheid;
+	if ((*id = _header_name_cached(safe_header)) != 0) {
 		g_free(safe_header);
 		return 1;
 	}
 
 	case_header = g_strdup_printf(db_get_sql(SQL_STRCASE),"headername");
-	tmp = g_new0(u64_t,1);
 
 	c = db_con_get();
 
 	TRY
 		db_begin_transaction(c);
-		*tmp = 0;
 		s = db_stmt_prepare(c, "SELECT id FROM %sheadername WHERE %s=?", DBPFX, case_header);
 		db_stmt_set_str(s,1,safe_header);
 		r = db_stmt_query(s);
 
 		if (db_result_next(r)) {
-			*tmp = db_result_get_u64(r,0);
+			tmp = db_result_get_u64(r,0);
 		} else {
 			db_con_clear(c);
 
@@ -1349,10 +1813,10 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, u6
 
 			if (_db_params.db_driver == DM_DRIVER_ORACLE) {
 				db_stmt_exec(s);
-				*tmp = db_get_pk(c, "headername");
+				tmp = db_get_pk(c, "headername");
 			} else {
 				r = db_stmt_query(s);
-				*tmp = db_insert_result(c, r);
+				tmp = db_insert_result(c, r);
 			}
 		}
 		t = TRUE;
@@ -1368,45 +1832,147 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, u6
 
 	g_free(case_header);
 
-	if (t == DM_EQUERY) {
+	if (t == DM_EQUERY || ! tmp) {
 		g_free(safe_header);
-		g_free(tmp);
-		return t;
+		return DM_EQUERY;
 	}
 
-	*id = *tmp;
-	g_hash_table_insert(self->header_dict, (gpointer)(safe_header), (gpointer)(tmp));
+	*id = tmp;
+	_header_name_register(safe_header, tmp);
+	g_free(safe_header);
 	return 1;
 }
 
-static u64_t _header_value_exists(C c, const char *value, const char *hash)
+static gboolean _header_name_uncached(const char UNUSED *key, const char *header, GList **names)
 {
-	R r; S s;
-	u64_t id = 0;
-	char blob_cmp[DEF_FRAGSIZE];
-	memset(blob_cmp, 0, sizeof(blob_cmp));
+	gchar *safe_header;
 
-	if (_db_params.db_driver == DM_DRIVER_ORACLE && strlen(value) > DM_ORA_MAX_BYTES_LOB_CMP) {
-		/** Value greater then DM_ORA_MAX_BYTES_LOB_CMP will cause SQL exception */
-		return 0;
-	}
-	db_con_clear(c);
-	snprintf(blob_cmp, DEF_FRAGSIZE, db_get_sql(SQL_COMPARE_BLOB), "headervalue");
+	/* skip headernames with spaces like From_ */
+	if (strchr(header, ' '))
+		return FALSE;
 
-	s = db_stmt_prepare(c, "SELECT id FROM %sheadervalue WHERE hash=? AND %s", DBPFX, blob_cmp);
-	db_stmt_set_str(s, 1, hash);
-	db_stmt_set_blob(s, 2, value, strlen(value));
+	safe_header = g_ascii_strdown(header,-1);
+	if (_header_name_cached(safe_header) || g_list_find_custom(*names, safe_header, (GCompareFunc)strcmp))
+		g_free(safe_header);
+	else
+		*names = g_list_prepend(*names, safe_header);
 
-	r = db_stmt_query(s);
-	if (db_result_next(r))
-		id = db_result_get_u64(r,0);
+	return FALSE;
+}
 
-	return id;
+/*
+ * resolve all headernames of a message the cache doesn't know yet
+ * in one transaction: one lookup, and an insert for each new name
+ * that hands back its id. Whatever fails here is retried name by
+ * name by _header_name_get_id.
+ */
+static void _header_names_prefetch(const DbmailMessage *self)
+{
+	GList *names = NULL, *l;
+	GHashTable *ids;
+	gchar *case_header, *frag;
+	GString *q;
+	int i;
+	volatile int t = DM_SUCCESS;
+	C c; R r; S s;
 
-}
+	g_tree_foreach(self->header_name, (GTraverseFunc)_header_name_uncached, &names);
+	if (! names)
+		return;
 
-static u64_t _header_value_insert(C c, const char *value, const char *sortfield, const char *datefield, const char *hash)
-{
+	case_header = g_strdup_printf(db_get_sql(SQL_STRCASE),"headername");
+	frag = db_returning("id");
+
+	q = g_string_new("");
+	g_string_printf(q, "SELECT id, %s FROM %sheadername WHERE %s IN (", case_header, DBPFX, case_header);
+	for (l = names, i = 0; l; l = g_list_next(l), i++)
+		g_string_append_printf(q, "%s?", i ? "," : "");
+	g_string_append(q, ")");
+
+	/* only share the ids once they are committed */
+	ids = g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal, 
+			(GDestroyNotify)g_free, (GDestroyNotify)g_free);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		s = db_stmt_prepare(c, "%s", q->str);
+		for (l = names, i = 1; l; l = g_list_next(l), i++)
+			db_stmt_set_str(s, i, (char *)l->data);
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			u64_t *id = g_new0(u64_t,1);
+			*id = db_result_get_u64(r, 0);
+			g_hash_table_replace(ids, g_strdup(db_result_get(r, 1)), id);
+		}
+
+		for (l = names; l; l = g_list_next(l)) {
+			u64_t *id;
+			if (g_hash_table_lookup(ids, l->data))
+				continue;
+			s = db_stmt_prepare(c, "INSERT %s INTO %sheadername (headername) VALUES (?) %s",
+					db_get_sql(SQL_IGNORE), DBPFX, frag);
+			db_stmt_set_str(s, 1, (char *)l->data);
+			r = db_stmt_query(s);
+			id = g_new0(u64_t,1);
+			*id = db_insert_result(c, r);
+			g_hash_table_replace(ids, g_strdup((char *)l->data), id);
+		}
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_SUCCESS) {
+		for (l = names; l; l = g_list_next(l)) {
+			u64_t *id = g_hash_table_lookup(ids, l->data);
+			if (id && *id)
+				_header_name_register((char *)l->data, *id);
+		}
+	}
+
+	TRACE(TRACE_DEBUG, "resolved [%u] headernames", g_hash_table_size(ids));
+
+	g_hash_table_destroy(ids);
+
+	g_string_free(q, TRUE);
+	g_free(case_header);
+	g_free(frag);
+	g_list_destroy(names);
+}
+
+static u64_t _header_value_exists(C c, const char *value, const char *hash)
+{
+	R r; S s;
+	u64_t id = 0;
+	char blob_cmp[DEF_FRAGSIZE];
+	memset(blob_cmp, 0, sizeof(blob_cmp));
+
+	if (_db_params.db_driver == DM_DRIVER_ORACLE && strlen(value) > DM_ORA_MAX_BYTES_LOB_CMP) {
+		/** Value greater then DM_ORA_MAX_BYTES_LOB_CMP will cause SQL exception */
+		return 0;
+	}
+	db_con_clear(c);
+	snprintf(blob_cmp, DEF_FRAGSIZE, db_get_sql(SQL_COMPARE_BLOB), "headervalue");
+
+	s = db_stmt_prepare(c, "SELECT id FROM %sheadervalue WHERE hash=? AND %s", DBPFX, blob_cmp);
+	db_stmt_set_str(s, 1, hash);
+	db_stmt_set_blob(s, 2, value, strlen(value));
+
+	r = db_stmt_query(s);
+	if (db_result_next(r))
+		id = db_result_get_u64(r,0);
+
+	return id;
+
+}
+
+static u64_t _header_value_insert(C c, const char *value, const char *sortfield, const char *datefield, const char *hash)
+{
 	R r; S s;
 	u64_t id = 0;
 	char *frag;
@@ -1494,12 +2060,151 @@ static gboolean _header_insert(u64_t physmessage_id, u64_t headername_id, u64_t
 	return t;
 }
 
-	
+
+/*
+ * header values are collected for the whole message by _header_cache and
+ * written by _header_cache_store in a single transaction
+ */
+#define HEADER_BATCH 64
+
+typedef struct header_value {
+	u64_t headername_id;
+	u64_t id;
+	gchar *value;
+	gchar *hash;
+	gchar *sortfield;
+	gchar *datefield;
+	struct header_value *same; // identical value earlier in the same message
+} header_value_t;
+
+typedef struct {
+	const DbmailMessage *message;
+	GList *values;
+	gboolean error;
+} header_batch_t;
+
+static gboolean _header_value_new(header_batch_t *batch, u64_t headername_id, gchar *value, gchar *sortfield, gchar *datefield)
+{
+	header_value_t *v = g_new0(header_value_t,1);
+
+	v->headername_id = headername_id;
+	v->value = value;
+	v->sortfield = sortfield;
+	v->datefield = datefield;
+	v->hash = dm_get_hash_for_string(value);
+
+	batch->values = g_list_prepend(batch->values, v);
+
+	return v->hash ? TRUE : FALSE;
+}
+
+static void _header_value_free(header_value_t *v)
+{
+	g_free(v->value);
+	g_free(v->hash);
+	g_free(v->sortfield);
+	g_free(v->datefield);
+	g_free(v);
+}
+
+static int _header_batch(void)
+{
+	switch (_db_params.db_driver) {
+		case DM_DRIVER_SQLITE:
+		case DM_DRIVER_ORACLE:
+			return 1;
+		default:
+			return HEADER_BATCH;
+	}
+}
+
+/* values are looked up by hash; a candidate is only taken when the
+ * stored value itself is the same */
+static void _header_values_lookup(C c, GList *values)
+{
+	while (values) {
+		GList *slice = values, *l;
+		GString *q = g_string_new("");
+		int i, n;
+		S s; R r;
+
+		for (n = 0; values && n < HEADER_BATCH; n++)
+			values = g_list_next(values);
+
+		g_string_printf(q, "SELECT id, hash, headervalue FROM %sheadervalue WHERE hash IN (", DBPFX);
+		for (i = 0; i < n; i++)
+			g_string_append_printf(q, "%s?", i ? "," : "");
+		g_string_append(q, ")");
+
+		s = db_stmt_prepare(c, "%s", q->str);
+		g_string_free(q, TRUE);
+
+		for (i = 0, l = slice; i < n; i++, l = g_list_next(l))
+			db_stmt_set_str(s, i+1, ((header_value_t *)l->data)->hash);
+
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			u64_t id = db_result_get_u64(r, 0);
+			const char *hash = db_result_get(r, 1);
+			const void *value = NULL;
+			int len = -1;
+			for (i = 0, l = slice; i < n; i++, l = g_list_next(l)) {
+				header_value_t *v = (header_value_t *)l->data;
+				if (v->id || strcmp(v->hash, hash))
+					continue;
+				if (len < 0)
+					value = db_result_get_blob(r, 2, &len);
+				if ((size_t)len != strlen(v->value) || memcmp(v->value, value, len))
+					continue;
+				v->id = id;
+			}
+		}
+	}
+}
+
+/* the id of every new value comes straight from its INSERT */
+static void _header_values_insert(C c, GList *values, const char *frag)
+{
+	S s; R r;
+
+	for (; values; values = g_list_next(values)) {
+		header_value_t *v = (header_value_t *)values->data;
+
+		s = db_stmt_prepare(c, "INSERT INTO %sheadervalue (hash, headervalue, sortfield, datefield) "
+				"VALUES (?,?,?,?) %s", DBPFX, frag);
+		db_stmt_set_str(s, 1, v->hash);
+		db_stmt_set_blob(s, 2, v->value, strlen(v->value));
+		db_stmt_set_str(s, 3, v->sortfield);
+		db_stmt_set_str(s, 4, v->datefield);
+		r = db_stmt_query(s);
+		v->id = db_insert_result(c, r);
+	}
+}
+
+static void _headers_insert(C c, u64_t physid, GList *values)
+{
+	int batch = _header_batch();
+
+	while (values) {
+		GString *q = g_string_new("");
+		int n;
+
+		g_string_printf(q, "INSERT INTO %sheader (physmessage_id, headername_id, headervalue_id) VALUES ", DBPFX);
+		for (n = 0; values && n < batch; n++, values = g_list_next(values)) {
+			header_value_t *v = (header_value_t *)values->data;
+			g_string_append_printf(q, "%s(%llu,%llu,%llu)", n ? "," : "",
+					physid, v->headername_id, v->id);
+		}
+		db_exec(c, "%s", q->str);
+		g_string_free(q, TRUE);
+	}
+}
+
 static gboolean _header_cache(const char UNUSED *key, const char *header, gpointer user_data)
 {
 	u64_t headername_id;
-	u64_t headervalue_id;
-	DbmailMessage *self = (DbmailMessage *)user_data;
+	header_batch_t *batch = (header_batch_t *)user_data;
+	DbmailMessage *self = (DbmailMessage *)batch->message;
 	GTuples *values;
 	unsigned char *raw;
 	unsigned i;
@@ -1516,8 +2221,10 @@ static gboolean _header_cache(const char UNUSED *key, const char *header, gpoint
 
 	TRACE(TRACE_DEBUG,"headername [%s]", header);
 
-	if ((_header_name_get_id(self, header, &headername_id) < 0))
+	if ((_header_name_get_id(header, &headername_id) < 0)) {
+		batch->error = TRUE;
 		return TRUE;
+	}
 
 	if (g_ascii_strcasecmp(header,"From")==0)
 		isaddr=1;
@@ -1590,27 +2297,169 @@ static gboolean _header_cache(const char UNUSED *key, const char *header, gpoint
 		if (strlen(sortfield) > CACHE_WIDTH)
 			sortfield[CACHE_WIDTH-1] = '\0';
 
-		/* Fetch header value id if exists, else insert, and return new id */
-		_header_value_get_id(value, sortfield, datefield, &headervalue_id);
+		/* queue the value; the database is only hit once all
+		 * headers are collected */
+		if (! _header_value_new(batch, headername_id, value, sortfield, datefield)) {
+			batch->error = TRUE;
+			g_tuples_destroy(values);
+			return TRUE;
+		}
 
-		g_free(value);
+		sortfield = NULL;
+		datefield = NULL;
+		emaillist=NULL;
+		date=0;
+	}
+	
+	g_tuples_destroy(values);
+	return FALSE;
+}
+
+static int _header_cache_store(header_batch_t *batch)
+{
+	GList *l, *u, *unique = NULL, *missing = NULL, *rows = NULL;
+	volatile int t = DM_SUCCESS;
+	char *frag;
+	C c;
+
+	/* store values that occur more than once in this message only once */
+	for (l = g_list_first(batch->values); l; l = g_list_next(l)) {
+		header_value_t *v = (header_value_t *)l->data;
+		for (u = g_list_first(unique); u; u = g_list_next(u)) {
+			header_value_t *w = (header_value_t *)u->data;
+			if (strcmp(w->hash, v->hash) == 0 && strcmp(w->value, v->value) == 0) {
+				v->same = w;
+				break;
+			}
+		}
+		if (! v->same)
+			unique = g_list_prepend(unique, v);
+	}
+	unique = g_list_reverse(unique);
+
+	frag = db_returning("id");
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		_header_values_lookup(c, unique);
+
+		for (l = g_list_first(unique); l; l = g_list_next(l)) {
+			if (! ((header_value_t *)l->data)->id)
+				missing = g_list_prepend(missing, l->data);
+		}
+		missing = g_list_reverse(missing);
+
+		if (missing)
+			_header_values_insert(c, missing, frag);
+
+		/* the header table has a (physmessage_id, headername_id,
+		 * headervalue_id) primary key, so repeated headers with the
+		 * same value get a single row */
+		for (l = g_list_first(batch->values); l; l = g_list_next(l)) {
+			header_value_t *v = (header_value_t *)l->data;
+			if (v->same)
+				v->id = v->same->id;
+			if (! v->id) {
+				TRACE(TRACE_ERR, "unable to store headervalue [%s]", v->hash);
+				t = DM_EQUERY;
+				break;
+			}
+			for (u = g_list_first(rows); u; u = g_list_next(u)) {
+				header_value_t *w = (header_value_t *)u->data;
+				if (w->headername_id == v->headername_id && w->id == v->id)
+					break;
+			}
+			if (! u)
+				rows = g_list_prepend(rows, v);
+		}
+		rows = g_list_reverse(rows);
+
+		if (t == DM_SUCCESS) {
+			_headers_insert(c, batch->message->physid, rows);
+			db_commit_transaction(c);
+		} else {
+			db_rollback_transaction(c);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	TRACE(TRACE_DEBUG, "physid [%llu] values [%u] unique [%u] new [%u]", 
+			batch->message->physid, g_list_length(batch->values), 
+			g_list_length(unique), g_list_length(missing));
+
+	g_free(frag);
+	g_list_free(unique);
+	g_list_free(missing);
+	g_list_free(rows);
+
+	return t;
+}
+
+/*
+ * Oracle can't compare lobs larger than DM_ORA_MAX_BYTES_LOB_CMP in a query
+ * and has no multi-row VALUES, so values are stored one by one there.
+ */
+static int _header_cache_store_serial(header_batch_t *batch)
+{
+	GList *l;
+
+	for (l = g_list_first(batch->values); l; l = g_list_next(l)) {
+		header_value_t *v = (header_value_t *)l->data;
+		u64_t headervalue_id = 0;
+
+		/* Fetch header value id if exists, else insert, and return new id */
+		_header_value_get_id(v->value, v->sortfield, v->datefield, &headervalue_id);
 
 		/* Insert relation between physmessage, header name and header value */
 		if (headervalue_id)
-			_header_insert(self->physid, headername_id, headervalue_id);
+			_header_insert(batch->message->physid, v->headername_id, headervalue_id);
 		else
 			TRACE(TRACE_INFO, "error inserting headervalue. skipping.");
+	}
 
-		headervalue_id=0;
+	return DM_SUCCESS;
+}
 
-		g_free(sortfield); sortfield = NULL;
-		g_free(datefield); datefield = NULL;
-		emaillist=NULL;
-		date=0;
+int dbmail_message_cache_headers(const DbmailMessage *self)
+{
+	header_batch_t batch;
+	int t = DM_SUCCESS;
+	GList *l;
+
+	assert(self);
+	assert(self->physid);
+
+	if (! GMIME_IS_MESSAGE(self->content)) {
+		TRACE(TRACE_ERR,"self->content is not a message");
+		return -1;
 	}
-	
-	g_tuples_destroy(values);
-	return FALSE;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.message = self;
+
+	if (_db_params.db_driver != DM_DRIVER_ORACLE)
+		_header_names_prefetch(self);
+
+	g_tree_foreach(self->header_name, (GTraverseFunc)_header_cache, (gpointer)&batch);
+	batch.values = g_list_reverse(batch.values);
+
+	if (batch.error)
+		t = DM_EQUERY;
+	else if (_db_params.db_driver == DM_DRIVER_ORACLE)
+		t = _header_cache_store_serial(&batch);
+	else if (batch.values)
+		t = _header_cache_store(&batch);
+
+	for (l = g_list_first(batch.values); l; l = g_list_next(l))
+		_header_value_free((header_value_t *)l->data);
+	g_list_free(batch.values);
+
+	return t;
 }
 
 static void insert_field_cache(u64_t physid, const char *field, const char *value)
@@ -1710,6 +2559,104 @@ void dbmail_message_cache_envelope(const DbmailMessage *self)
 	envelope = NULL;
 }
 
+/*
+ * first address in an address header, for SORT FROM, TO and CC
+ */
+static char * _sortkey_address(const DbmailMessage *self, const char *header, const char *charset)
+{
+	InternetAddressList *emaillist;
+	InternetAddress *ia;
+	const char *raw, *addr;
+	char *value, *key = NULL;
+
+	if (! (raw = dbmail_message_get_header(self, header)))
+		return g_strdup("");
+
+	if ((value = dbmail_iconv_decode_field(raw, charset, TRUE))) {
+		if ((emaillist = internet_address_list_parse_string(value))) {
+			if (internet_address_list_length(emaillist) > 0) {
+				ia = internet_address_list_get_address(emaillist, 0);
+				if (ia && INTERNET_ADDRESS_IS_MAILBOX(ia)) {
+					addr = internet_address_mailbox_get_addr((InternetAddressMailbox *)ia);
+					key = g_strndup(addr ? addr : "", CACHE_WIDTH);
+				}
+			}
+			g_object_unref(emaillist);
+		}
+		g_free(value);
+	}
+
+	return key ? key : g_strdup("");
+}
+
+/*
+ * store the SORT keys of the message in a single row: base subject,
+ * first From, To and Cc address, and the sent date
+ */
+void dbmail_message_cache_sortkeys(const DbmailMessage *self)
+{
+	const char *charset = dbmail_message_get_charset((DbmailMessage *)self);
+	const char *raw;
+	char *subject = NULL, *from, *to, *cc, *value, *t;
+	char sentdate[20];
+	time_t date = (time_t)-1;
+	struct tm gmt;
+	C c; S s;
+
+	if ((raw = dbmail_message_get_header(self, "Subject")) && 
+			(value = dbmail_iconv_decode_field(raw, charset, FALSE))) {
+		t = dm_base_subject(value);
+		subject = dbmail_iconv_str_to_db(t, charset);
+		g_free(t);
+		g_free(value);
+	}
+	if (! subject)
+		subject = g_strdup("");
+	if (strlen(subject) > CACHE_WIDTH)
+		subject[CACHE_WIDTH-1] = '\0';
+
+	from = _sortkey_address(self, "From", charset);
+	to = _sortkey_address(self, "To", charset);
+	cc = _sortkey_address(self, "Cc", charset);
+
+	memset(sentdate, 0, sizeof(sentdate));
+	if ((raw = dbmail_message_get_header(self, "Date")))
+		date = g_mime_utils_header_decode_date(raw, NULL);
+	if ((date != (time_t)-1) && gmtime_r(&date, &gmt))
+		strftime(sentdate, sizeof(sentdate), "%Y-%m-%d %H:%M:%S", &gmt);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		if (sentdate[0])
+			s = db_stmt_prepare(c, "INSERT INTO %ssortkeys (physmessage_id, subject, fromaddr, toaddr, ccaddr, sentdate) "
+					"VALUES (?,?,?,?,?,?)", DBPFX);
+		else
+			s = db_stmt_prepare(c, "INSERT INTO %ssortkeys (physmessage_id, subject, fromaddr, toaddr, ccaddr) "
+					"VALUES (?,?,?,?,?)", DBPFX);
+		db_stmt_set_u64(s, 1, self->physid);
+		db_stmt_set_str(s, 2, subject);
+		db_stmt_set_str(s, 3, from);
+		db_stmt_set_str(s, 4, to);
+		db_stmt_set_str(s, 5, cc);
+		if (sentdate[0])
+			db_stmt_set_str(s, 6, sentdate);
+		db_stmt_exec(s);
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		TRACE(TRACE_ERR, "insert sortkeys failed [%llu]", self->physid);
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_free(subject);
+	g_free(from);
+	g_free(to);
+	g_free(cc);
+}
+
 // 
 // construct a new message where only sender, recipient, subject and 
 // a body are known. The body can be any kind of charset. Make sure
@@ -1854,6 +2801,306 @@ static int get_mailbox_from_filters(DbmailMessage *message, u64_t useridnr, cons
 	return t;
 }
 
+/*
+ * batched delivery
+ *
+ * insert_messages() stores the physmessage once. Sorting it for a user
+ * then only picks the mailbox it goes into; the message records and
+ * quota updates for all recipients are inserted together, in a single
+ * transaction, once every user has been sorted.
+ *
+ * Nothing of the batch is visible in the database before that, so
+ * suppress_duplicates checks the pending deliveries as well.
+ */
+#define DELIVERY_BATCH 128
+
+typedef struct {
+	u64_t useridnr;
+	u64_t mailbox_idnr;
+	int flags[IMAP_NFLAGS];
+	dsn_class_t result;
+} delivery_t;
+
+struct delivery_batch {
+	GList *deliveries;
+	GTree *inboxes;		/* useridnr -> INBOX, looked up in one go */
+};
+
+/* message records per INSERT; see mimeparts_batch for the single-row drivers */
+static int delivery_batch_rows(void)
+{
+	switch (_db_params.db_driver) {
+		case DM_DRIVER_SQLITE:
+		case DM_DRIVER_ORACLE:
+			return 1;
+		default:
+			return DELIVERY_BATCH;
+	}
+}
+
+static char * delivery_ids(GList *ids)
+{
+	GString *s = g_string_new("");
+	while (ids) {
+		g_string_append_printf(s, "%s%llu", s->len ? "," : "", *(u64_t *)ids->data);
+		ids = g_list_next(ids);
+	}
+	return g_string_free(s, FALSE);
+}
+
+static struct delivery_batch * delivery_batch_new(GList *dsnusers)
+{
+	struct delivery_batch *batch = g_new0(struct delivery_batch, 1);
+	GList *userids = NULL, *l;
+	char *ids;
+	C c; R r;
+
+	batch->inboxes = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free,(GDestroyNotify)g_free);
+
+	for (dsnusers = g_list_first(dsnusers); dsnusers; dsnusers = g_list_next(dsnusers)) {
+		deliver_to_user_t *delivery = (deliver_to_user_t *)dsnusers->data;
+		for (l = g_list_first(delivery->userids); l; l = g_list_next(l))
+			userids = g_list_prepend(userids, l->data);
+	}
+
+	if (! userids)
+		return batch;
+
+	ids = delivery_ids(userids);
+	g_list_free(userids);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT owner_idnr, mailbox_idnr FROM %smailboxes "
+				"WHERE name %s 'INBOX' AND owner_idnr IN (%s)", 
+				DBPFX, db_get_sql(SQL_INSENSITIVE_LIKE), ids);
+		while (db_result_next(r)) {
+			u64_t *k = g_new0(u64_t,1);
+			u64_t *v = g_new0(u64_t,1);
+			*k = db_result_get_u64(r, 0);
+			*v = db_result_get_u64(r, 1);
+			g_tree_replace(batch->inboxes, k, v);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_free(ids);
+
+	return batch;
+}
+
+static void delivery_batch_free(struct delivery_batch *batch)
+{
+	g_list_destroy(batch->deliveries);
+	g_tree_destroy(batch->inboxes);
+	g_free(batch);
+}
+
+static void delivery_batch_add(struct delivery_batch *batch, u64_t useridnr, u64_t mailbox_idnr, int *msgflags)
+{
+	delivery_t *delivery = g_new0(delivery_t, 1);
+
+	delivery->useridnr = useridnr;
+	delivery->mailbox_idnr = mailbox_idnr;
+	delivery->result = DSN_CLASS_TEMP;
+	if (msgflags)
+		memcpy(delivery->flags, msgflags, sizeof(delivery->flags));
+
+	batch->deliveries = g_list_append(batch->deliveries, delivery);
+}
+
+static gboolean delivery_batch_has(struct delivery_batch *batch, u64_t mailbox_idnr)
+{
+	GList *l;
+	for (l = batch->deliveries; l; l = g_list_next(l)) {
+		if (((delivery_t *)l->data)->mailbox_idnr == mailbox_idnr)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static gboolean delivery_seq_update(u64_t *mailbox_idnr, gpointer value UNUSED, gpointer data UNUSED)
+{
+	db_mailbox_seq_update(*mailbox_idnr);
+	return FALSE;
+}
+
+/*
+ * insert the collected message records. Users that would go over
+ * their quota get DSN_CLASS_QUOTA, all others DSN_CLASS_OK, or
+ * DSN_CLASS_TEMP when the transaction fails.
+ */
+static int delivery_batch_commit(DbmailMessage *message)
+{
+	struct delivery_batch *batch = message->batch;
+	u64_t size = (u64_t)dbmail_message_get_size(message, FALSE);
+	u64_t physid = dbmail_message_get_physid(message);
+	GTree *maxmail, *curmail, *added, *mailboxes;
+	GList *users = NULL, *l;
+	int rows = delivery_batch_rows();
+	volatile int t = DM_SUCCESS;
+	char *ids;
+	C c; R r; S s;
+
+	if (! batch->deliveries)
+		return t;
+
+	maxmail = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,(GDestroyNotify)g_free);
+	curmail = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free,(GDestroyNotify)g_free);
+	added = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,(GDestroyNotify)g_free);
+	mailboxes = g_tree_new((GCompareFunc)ucmp);
+
+	/* quota limits can live in the authentication backend;
+	 * a user without one is left out */
+	for (l = batch->deliveries; l; l = g_list_next(l)) {
+		delivery_t *d = (delivery_t *)l->data;
+		u64_t *max;
+		if (g_tree_lookup(added, &d->useridnr))
+			continue;
+		g_tree_insert(added, &d->useridnr, g_new0(u64_t,1));
+		users = g_list_prepend(users, &d->useridnr);
+
+		max = g_new0(u64_t,1);
+		if (auth_getmaxmailsize(d->useridnr, max) == -1) {
+			TRACE(TRACE_ERR, "auth_getmaxmailsize() failed for user [%llu]", d->useridnr);
+			g_free(max);
+			continue;
+		}
+		g_tree_insert(maxmail, &d->useridnr, max);
+	}
+
+	ids = delivery_ids(users);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+
+		r = db_query(c, "SELECT user_idnr, curmail_size FROM %susers WHERE user_idnr IN (%s)", 
+				DBPFX, ids);
+		while (db_result_next(r)) {
+			u64_t *k = g_new0(u64_t,1);
+			u64_t *v = g_new0(u64_t,1);
+			*k = db_result_get_u64(r, 0);
+			*v = db_result_get_u64(r, 1);
+			g_tree_replace(curmail, k, v);
+		}
+
+		l = batch->deliveries;
+		while (l) {
+			GString *q = g_string_new("");
+			int n = 0;
+
+			g_string_printf(q, "INSERT INTO %smessages (mailbox_idnr, physmessage_id, "
+					"seen_flag, answered_flag, deleted_flag, flagged_flag, "
+					"recent_flag, draft_flag, unique_id, status) VALUES ", DBPFX);
+
+			for (; l && n < rows; l = g_list_next(l)) {
+				delivery_t *d = (delivery_t *)l->data;
+				u64_t *max = g_tree_lookup(maxmail, &d->useridnr);
+				u64_t *cur = g_tree_lookup(curmail, &d->useridnr);
+				u64_t *inc = g_tree_lookup(added, &d->useridnr);
+				char unique_id[UID_SIZE];
+
+				if (! max)
+					continue;
+				if (*max > 0 && (cur ? *cur : 0) + *inc + size > *max) {
+					TRACE(TRACE_INFO, "user [%llu] would exceed quotum", d->useridnr);
+					d->result = DSN_CLASS_QUOTA;
+					continue;
+				}
+				*inc += size;
+
+				memset(unique_id, 0, sizeof(unique_id));
+				create_unique_id(unique_id, physid);
+				g_string_append_printf(q, "%s(%llu,%llu,%d,%d,%d,%d,1,%d,'%s',%d)", n++ ? "," : "",
+						d->mailbox_idnr, physid, 
+						d->flags[IMAP_FLAG_SEEN], d->flags[IMAP_FLAG_ANSWERED],
+						d->flags[IMAP_FLAG_DELETED], d->flags[IMAP_FLAG_FLAGGED],
+						d->flags[IMAP_FLAG_DRAFT], unique_id, MESSAGE_STATUS_NEW);
+				d->result = DSN_CLASS_OK;
+				g_tree_replace(mailboxes, &d->mailbox_idnr, &d->mailbox_idnr);
+			}
+			if (n)
+				db_exec(c, "%s", q->str);
+			g_string_free(q, TRUE);
+		}
+
+		for (l = users; l; l = g_list_next(l)) {
+			u64_t *inc = g_tree_lookup(added, l->data);
+			if (! *inc)
+				continue;
+			s = db_stmt_prepare(c, "UPDATE %susers SET curmail_size = curmail_size + ? WHERE user_idnr = ?", DBPFX);
+			db_stmt_set_u64(s, 1, *inc);
+			db_stmt_set_u64(s, 2, *(u64_t *)l->data);
+			db_stmt_exec(s);
+		}
+
+		/* the real records take over from the placeholder */
+		if (message->id)
+			db_exec(c, "DELETE FROM %smessages WHERE message_idnr = %llu", DBPFX, message->id);
+
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY) {
+		for (l = batch->deliveries; l; l = g_list_next(l))
+			((delivery_t *)l->data)->result = DSN_CLASS_TEMP;
+	} else {
+		message->id = 0;
+		g_tree_foreach(mailboxes, (GTraverseFunc)delivery_seq_update, NULL);
+	}
+
+	g_free(ids);
+	g_list_free(users);
+	g_tree_destroy(mailboxes);
+	g_tree_destroy(maxmail);
+	g_tree_destroy(curmail);
+	g_tree_destroy(added);
+
+	return t;
+}
+
+/* the outcome for a user: delivered somewhere, over quota or failed */
+static dsn_class_t delivery_batch_result(struct delivery_batch *batch, u64_t useridnr)
+{
+	dsn_class_t result = DSN_CLASS_NONE;
+	GList *l;
+
+	for (l = batch->deliveries; l; l = g_list_next(l)) {
+		delivery_t *d = (delivery_t *)l->data;
+		if (d->useridnr != useridnr)
+			continue;
+		if (d->result == DSN_CLASS_OK)
+			return DSN_CLASS_OK;
+		if (result != DSN_CLASS_TEMP)
+			result = d->result;
+	}
+
+	return result;
+}
+
+/* did any message record make it into the database */
+static gboolean delivery_batch_stored(struct delivery_batch *batch)
+{
+	GList *l;
+
+	for (l = batch->deliveries; l; l = g_list_next(l)) {
+		if (((delivery_t *)l->data)->result == DSN_CLASS_OK)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 /* Figure out where to deliver the message, then deliver it.
  * */
 dsn_class_t sort_and_deliver(DbmailMessage *message,
@@ -1960,13 +3207,18 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
 		u64_t useridnr, const char *mailbox, mailbox_source_t source,
 		int *msgflags)
 {
-	u64_t mboxidnr, newmsgidnr;
+	u64_t mboxidnr, newmsgidnr, *inbox = NULL;
 	field_t val;
 	size_t msgsize = (u64_t)dbmail_message_get_size(message, FALSE);
 
 	TRACE(TRACE_INFO,"useridnr [%llu] mailbox [%s]", useridnr, mailbox);
 
-	if (db_find_create_mailbox(mailbox, source, useridnr, &mboxidnr) != 0) {
+	if (message->batch && MATCH(mailbox, "INBOX"))
+		inbox = g_tree_lookup(message->batch->inboxes, &useridnr);
+
+	if (inbox)
+		mboxidnr = *inbox;
+	else if (db_find_create_mailbox(mailbox, source, useridnr, &mboxidnr) != 0) {
 		TRACE(TRACE_ERR, "mailbox [%s] not found", mailbox);
 		return DSN_CLASS_FAIL;
 	}
@@ -2013,17 +3265,25 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
 		}
 	}
 
-	// if the mailbox already holds this message we're done
+	// if the mailbox already holds this message we're done; a batched
+	// delivery to it isn't in the database yet
 	GETCONFIGVALUE("suppress_duplicates", "DELIVERY", val);
 	if (strcasecmp(val,"yes")==0) {
 		const char *messageid = dbmail_message_get_header(message, "message-id");
-		if ( messageid && ((db_mailbox_has_message_id(mboxidnr, messageid)) > 0) ) {
+		if ( messageid && ((message->batch && delivery_batch_has(message->batch, mboxidnr))
+					|| (db_mailbox_has_message_id(mboxidnr, messageid)) > 0) ) {
 			TRACE(TRACE_INFO, "suppress_duplicate: [%s]", messageid);
 			return DSN_CLASS_OK;
 		}
 	}
 
 	// Ok, we have the ACL right, time to deliver the message.
+	if (message->batch) {
+		TRACE(TRACE_INFO, "message for user [%llu] queued for mailbox [%llu]", useridnr, mboxidnr);
+		delivery_batch_add(message->batch, useridnr, mboxidnr, msgflags);
+		return DSN_CLASS_OK;
+	}
+
 	switch (db_copymsg(message->id, mboxidnr, useridnr, &newmsgidnr)) {
 	case -2:
 		TRACE(TRACE_ERR, "error copying message to user [%llu],"
@@ -2488,7 +3748,7 @@ int send_forward_list(DbmailMessage *message, GList *targets, const char *from)
  *         sorting rules might not store the message anyways
  *   - Send out the no such user bounces
  *   - Send out the external forwards
- *   - Delete the temporary message from the database
+ *   - Insert the message records for all local deliveries at once
  * What we return:
  *   - 0 on success
  *   - -1 on full failure
@@ -2496,26 +3756,52 @@ int send_forward_list(DbmailMessage *message, GList *targets, const char *from)
 
 int insert_messages(DbmailMessage *message, GList *dsnusers)
 {
-	u64_t tmpid;
+	GHashTable *sorted;
+	GList *l;
 	int result=0;
 
  	delivery_status_t final_dsn;
 
-	/* first start a new database transaction */
-
-	if ((result = dbmail_message_store(message)) == DM_EQUERY) {
+	/* store the message once; users only get a message record. Until
+	 * then a placeholder record keeps the physmessage from being
+	 * cleaned up as an orphan */
+	if ((result = dbmail_message_store_physmessage(message)) == DM_EQUERY) {
 		TRACE(TRACE_ERR,"storing message failed");
 		return result;
 	} 
 
-	TRACE(TRACE_DEBUG, "temporary msgidnr is [%llu]", message->id);
-
-	tmpid = message->id; // for later removal
+	TRACE(TRACE_DEBUG, "physmessage is [%llu], placeholder [%llu]", dbmail_message_get_physid(message), message->id);
 
 	// TODO: Run a Sieve script associated with the internal delivery user.
 	// Code would go here, after we've stored the message 
 	// before we've started delivering it
 
+	message->batch = delivery_batch_new(dsnusers);
+
+	/* Sort for every local user; this only picks the mailboxes. */
+	sorted = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (l = g_list_first(dsnusers); l; l = g_list_next(l)) {
+		deliver_to_user_t *delivery = (deliver_to_user_t *) l->data;
+		GList *userids;
+
+		for (userids = g_list_first(delivery->userids); userids; userids = g_list_next(userids)) {
+			u64_t *useridnr = (u64_t *) userids->data;
+
+			TRACE(TRACE_DEBUG, "calling sort_and_deliver for useridnr [%llu]", *useridnr);
+			g_hash_table_insert(sorted, useridnr, GINT_TO_POINTER(sort_and_deliver(message,
+						delivery->address, *useridnr, delivery->mailbox, delivery->source)));
+
+			/* Automatic reply and notification */
+			if (execute_auto_ran(message, *useridnr) < 0) {
+				TRACE(TRACE_ERR, "error in execute_auto_ran(), but continuing delivery normally.");
+			}   
+		}
+	}
+
+	/* Then deliver to all of them in one go. */
+	if (delivery_batch_commit(message) == DM_EQUERY)
+		TRACE(TRACE_ERR, "storing message records failed");
+
 	/* Loop through the users list. */
 	dsnusers = g_list_first(dsnusers);
 	while (dsnusers) {
@@ -2531,9 +3817,16 @@ int insert_messages(DbmailMessage *message, GList *dsnusers)
 		userids = g_list_first(delivery->userids);
 		while (userids) {
 			u64_t *useridnr = (u64_t *) userids->data;
+			dsn_class_t status = GPOINTER_TO_INT(g_hash_table_lookup(sorted, useridnr));
 
-			TRACE(TRACE_DEBUG, "calling sort_and_deliver for useridnr [%llu]", *useridnr);
-			switch (sort_and_deliver(message, delivery->address, *useridnr, delivery->mailbox, delivery->source)) {
+			/* a message kept by the sorting may still bounce on quota */
+			if (status == DSN_CLASS_OK) {
+				dsn_class_t stored = delivery_batch_result(message->batch, *useridnr);
+				if (stored != DSN_CLASS_NONE)
+					status = stored;
+			}
+
+			switch (status) {
 			case DSN_CLASS_OK:
 				TRACE(TRACE_INFO, "successful sort_and_deliver for useridnr [%llu]", *useridnr);
 				has_2 = 1;
@@ -2553,11 +3846,6 @@ int insert_messages(DbmailMessage *message, GList *dsnusers)
 				break;
 			}
 
-			/* Automatic reply and notification */
-			if (execute_auto_ran(message, *useridnr) < 0) {
-				TRACE(TRACE_ERR, "error in execute_auto_ran(), but continuing delivery normally.");
-			}   
-
 			if (! g_list_next(userids))
 				break;
 			userids = g_list_next(userids);
@@ -2603,7 +3891,7 @@ int insert_messages(DbmailMessage *message, GList *dsnusers)
 			TRACE(TRACE_DEBUG, "delivering to external addresses");
 			const char *from = dbmail_message_get_header(message, "Return-Path");
 
-			/* Forward using the temporary stored message. */
+			/* Forward using the stored message. */
 			if (send_forward_list(message, delivery->forwards, from)) {
 				/* If forward fails, tell the sender that we're
 				 * having a transient error. They'll resend. */
@@ -2617,12 +3905,22 @@ int insert_messages(DbmailMessage *message, GList *dsnusers)
 
 	}
 
-	/* Always delete the temporary message, even if the delivery failed.
+	/* the placeholder is still there when the batch wasn't committed */
+	if (message->id && ! db_update("DELETE FROM %smessages WHERE message_idnr = %llu", DBPFX, message->id))
+		TRACE(TRACE_ERR, "failed to delete placeholder message [%llu]", message->id);
+	message->id = 0;
+
+	/* Nobody got a copy: don't leave the physmessage behind.
 	 * It is the MTA's job to requeue or bounce the message,
 	 * and our job to keep a tidy database ;-) */
-	if (! db_delete_message(tmpid)) 
-		TRACE(TRACE_ERR, "failed to delete temporary message [%llu]", message->id);
-	TRACE(TRACE_DEBUG, "temporary message deleted from database. Done.");
+	if (! delivery_batch_stored(message->batch)) {
+		TRACE(TRACE_DEBUG, "no message records, deleting physmessage [%llu]", dbmail_message_get_physid(message));
+		db_update("DELETE FROM %sphysmessage WHERE id = %llu", DBPFX, dbmail_message_get_physid(message));
+	}
+
+	delivery_batch_free(message->batch);
+	message->batch = NULL;
+	g_hash_table_destroy(sorted);
 
 	return 0;
 }
@@ -48,6 +48,7 @@
 
 DbmailMessage * dbmail_message_new(void);
 DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const GString *content);
+DbmailMessage * dbmail_message_init_with_stream(DbmailMessage *self, GMimeStream *stream);
 DbmailMessage * dbmail_message_construct(DbmailMessage *self, 
 		const gchar *sender, const gchar *recipient, 
 		const gchar *subject, const gchar *body);
@@ -57,6 +58,7 @@ DbmailMessage * dbmail_message_construct(DbmailMessage *self,
  */
 
 int dbmail_message_store(DbmailMessage *message);
+int dbmail_message_store_physmessage(DbmailMessage *message);
 int dbmail_message_cache_headers(const DbmailMessage *message);
 gboolean dm_message_store(DbmailMessage *m);
 
@@ -100,6 +102,7 @@ GTuples * dbmail_message_get_header_repeated(const DbmailMessage *self, const ch
 
 void dbmail_message_cache_referencesfield(const DbmailMessage *self);
 void dbmail_message_cache_envelope(const DbmailMessage *self);
+void dbmail_message_cache_sortkeys(const DbmailMessage *self);
 
 /*
  * destructor
@@ -105,6 +105,7 @@ typedef struct {
 	field_t driver;         /**< database driver: mysql, pgsql, sqlite */
 	field_t authdriver;     /**< authentication driver: sql, ldap */
 	field_t sortdriver;     /**< sort driver: sieve or nothing at all */
+	field_t ftsdriver;      /**< full-text index driver: sql or nothing at all */
 	field_t host;		/**< hostname or ip address of database server */
 	field_t user;		/**< username to connect with */
 	field_t pass;		/**< password of user */
@@ -113,6 +114,7 @@ typedef struct {
 	field_t sock;		/**< path to local unix socket (local connection) */
 	field_t pfx;		/**< prefix for tables e.g. dbmail_ */
 	unsigned int max_db_connections; /**< maximum connections the pool will create with the database */
+	unsigned int max_db_wait; /**< seconds to wait for a free connection when the pool is exhausted */
 	unsigned int serverid;	/**< unique id for dbmail instance used in clusters */
 	field_t encoding;	/**< character encoding to use */
 	unsigned int query_time_info;
@@ -149,14 +151,15 @@ typedef struct {
 	GMimeObject *content;
 	gchar *raw_content;
 	GRelation *headers;
-	GHashTable *header_dict;
 	GTree *header_name;
 	GTree *header_value;
 	gchar *charset;
 	int part_key;
 	int part_depth;
 	int part_order;
+	GList *mimeparts;
 	FILE *tmp;
+	struct delivery_batch *batch;	/* deliveries collected by insert_messages */
 } DbmailMessage;
 
 /**********************************************************************
@@ -300,6 +303,19 @@ enum BODY_FETCH_ITEM_TYPES {
 // thread manager structures 
 //
 
+// event loop
+//
+// every reactor runs its own event base: reactor 0 in the main thread,
+// any others in dedicated I/O threads. Clients are pinned to the reactor
+// that accepted them, and their completions are queued back to it.
+typedef struct {
+	struct event_base *base;	/* event base owned by this reactor */
+	GThread *thread;		/* I/O thread, NULL for the main thread */
+	int selfpipe[2];		/* self-pipe used to wake up the event loop */
+	GAsyncQueue *queue;		/* completions and connections to handle */
+	struct event *pev;		/* self-pipe event */
+} dm_reactor;
+
 // client_thread
 typedef struct  {
 	int sock;
@@ -309,6 +325,7 @@ typedef struct  {
 	socklen_t caddr_len;
 	struct sockaddr *saddr;
 	socklen_t saddr_len;
+	dm_reactor *reactor;		/* reactor that will handle this client */
 	void (*cb_close) (void *);	/* termination callback */
 } client_sock;
 
@@ -327,10 +344,12 @@ typedef struct {
 	SSL *ssl;                       /* SSL/TLS context for this client */
 	gboolean ssl_state;		/* SSL_accept done or not */
 	int client_state;		/* CLIENT_OK, CLIENT_AGAIN, CLIENT_EOF */
+	gboolean deferred;		/* only buffer output, a worker has the client */
 
 	struct event *pev;		/* self-pipe event */
 	void (*cb_pipe) (void *);	/* callback for self-pipe events */
 
+	dm_reactor *reactor;		/* event loop running this client */
 	struct event *rev, *wev;  	/* read event, write event */
 	void (*cb_time) (void *);
 	void (*cb_write) (void *);
@@ -351,8 +370,7 @@ typedef struct {
 
 	int service_before_smtp;
 
-	char tls_wbuf[TLS_SEGMENT];	/* buffer to write during tls session */
-	size_t tls_wbuf_n;		/* number of octets to write during tls session */
+	size_t tls_wbuf_n;		/* length of the SSL_write to retry, if any */
 
 	size_t rbuff_size;              /* size of string-literals */
 	GString *read_buffer;		/* input buffer */
@@ -399,6 +417,15 @@ typedef struct {
 	GList *messagelst;		/** list of messages */
 	GList *from;			// lmtp senders
 	GList *rcpt;			// lmtp recipients
+	GMimeStream *spool;		// lmtp message being received
+	size_t spool_size;		// octets received, stored or not
+	size_t spool_limit;		// SIZE limit of this transaction, 0 for none
+	int spool_error;		// errno of a failed spool write
+
+	gboolean busy;			/**< a command is out on the worker pool */
+	gboolean detached;		/**< a detached job holds back the output */
+	size_t hold;			/**< where the output of the detached job goes */
+	gboolean closing;		/**< bail out once the jobs are back */
 } ClientSession_t;
 
 typedef struct {
@@ -419,6 +446,7 @@ typedef struct {
 	gboolean authlog;
 	gboolean ssl;
 	int backlog;
+	int io_threads;			/* number of reactors */
 	int resolveIP;
 	struct evhttp *evh;		// http server
 	field_t service_name, process_name;
@@ -430,6 +458,7 @@ typedef struct {
         field_t tls_cert;
         field_t tls_key;
         field_t tls_ciphers;
+        field_t tls_ticket_key;
 	int (*ClientHandler) (client_sock *);
 	void (*cb) (struct evhttp_request *, void *);
 } serverConfig_t;
@@ -464,19 +493,22 @@ enum IMAP_SEARCH_TYPES {
 	IST_SET = 1, 		/* 1 */
 	IST_UIDSET, 		/* 2 */
 	IST_FLAG,  		/* 3 */
-	IST_SORT,  		/* 4 */
-	IST_HDR,  		/* 5 */
-	IST_HDRDATE_BEFORE,  	/* 6 */
-	IST_HDRDATE_ON,  	/* 7 */
-	IST_HDRDATE_SINCE, 	/* 8 */
-	IST_IDATE,  		/* 9 */
-	IST_DATA_BODY,  	/* 10 */
-	IST_DATA_TEXT, 		/* 11 */
-	IST_SIZE_LARGER,  	/* 12 */
-	IST_SIZE_SMALLER,  	/* 13 */
-	IST_SUBSEARCH_AND, 	/* 14 */
-	IST_SUBSEARCH_OR,  	/* 15 */
-	IST_SUBSEARCH_NOT 	/* 16 */
+	IST_KEYWORD,  		/* 4 */
+	IST_SORT,  		/* 5 */
+	IST_HDR,  		/* 6 */
+	IST_HDRDATE_BEFORE,  	/* 7 */
+	IST_HDRDATE_ON,  	/* 8 */
+	IST_HDRDATE_SINCE, 	/* 9 */
+	IST_IDATE_BEFORE,  	/* 10 */
+	IST_IDATE_ON,  		/* 11 */
+	IST_IDATE_SINCE,  	/* 12 */
+	IST_DATA_BODY,  	/* 13 */
+	IST_DATA_TEXT, 		/* 14 */
+	IST_SIZE_LARGER,  	/* 15 */
+	IST_SIZE_SMALLER,  	/* 16 */
+	IST_SUBSEARCH_AND, 	/* 17 */
+	IST_SUBSEARCH_OR,  	/* 18 */
+	IST_SUBSEARCH_NOT 	/* 19 */
 };
 
 typedef enum {
@@ -486,16 +518,32 @@ typedef enum {
 	SEARCH_THREAD_REFERENCES
 } search_order_t;
 
+/* SORT criteria (RFC 5256) */
+typedef enum {
+	SORT_NONE = 0,
+	SORT_ARRIVAL,
+	SORT_CC,
+	SORT_DATE,
+	SORT_FROM,
+	SORT_SIZE,
+	SORT_SUBJECT,
+	SORT_TO
+} sort_key_t;
+
+#define SORT_REVERSE 0x80
+#define SORT_MAX_KEYS 16
+
 typedef struct {
 	int type;
 	u64_t size;
-	char table[MAX_SEARCH_LEN];
-	char order[MAX_SEARCH_LEN];
+	guint8 sort[SORT_MAX_KEYS + 1];	// IST_SORT: 0-terminated sort_key_t list, or'ed with SORT_REVERSE
 	char field[MAX_SEARCH_LEN];
 	char search[MAX_SEARCH_LEN];
 	char hdrfld[MIME_FIELD_MAX];
-	int match;
-	GTree *found;
+	int match;		// IST_KEYWORD: FALSE for UNKEYWORD
+	guint8 flags_set;	// IST_FLAG: bits (1 << IMAP_FLAG_*) that must be set
+	guint8 flags_unset;	// IST_FLAG: bits that must be clear
+	Bitset_T found;		// indexed by msn
 	gboolean reverse;
 	gboolean searched;
 	gboolean merged;
@@ -549,7 +597,7 @@ typedef struct {
  ***********************************************************************/
 
 /*
- * cached message info
+ * message info, a snapshot of one message in a MailboxState_T
  */
 #define IMAP_NFLAGS 6
 typedef struct { // map dbmail_messages
@@ -663,6 +711,7 @@ typedef enum {
 	SQL_RETURNING,
 	SQL_TABLE_EXISTS,
 	SQL_ESCAPE_COLUMN,
-	SQL_COMPARE_BLOB
+	SQL_COMPARE_BLOB,
+	SQL_CONCAT
 } sql_fragment_t;
 #endif
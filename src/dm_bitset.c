@@ -0,0 +1,185 @@
+/*
+  
+ Copyright (c) 2010-2011 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or 
+ modify it under the terms of the GNU General Public License 
+ as published by the Free Software Foundation; either 
+ version 2 of the License, or (at your option) any later 
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "dm_bitset.h"
+
+#define THIS_MODULE "BITSET"
+
+/*
+ * implements the Bitset interface as a plain array of 64 bit words.
+ * The set operations are simple loops over whole words the compiler
+ * is free to vectorize.
+ */
+
+#define T Bitset_T
+
+#define WORDBITS 64
+#define WORDS(n) (((n) + WORDBITS - 1) / WORDBITS)
+#define WORD(i) ((i) / WORDBITS)
+#define BIT(i) ((uint64_t)1 << ((i) % WORDBITS))
+
+struct T {
+	size_t size;	// number of bits
+	size_t words;
+	uint64_t *bits;
+};
+
+T Bitset_new(size_t size)
+{
+	T S;
+	S = calloc(1, sizeof(*S));
+	S->size = size;
+	S->words = WORDS(size);
+	S->bits = calloc(S->words ? S->words : 1, sizeof(uint64_t));
+	return S;
+}
+
+T Bitset_copy(T S)
+{
+	T c = Bitset_new(S->size);
+	memcpy(c->bits, S->bits, S->words * sizeof(uint64_t));
+	return c;
+}
+
+size_t Bitset_size(T S)
+{
+	return S->size;
+}
+
+int Bitset_has(T S, size_t i)
+{
+	if (i >= S->size)
+		return 0;
+	return (S->bits[WORD(i)] & BIT(i)) ? 1 : 0;
+}
+
+void Bitset_add(T S, size_t i)
+{
+	assert(i < S->size);
+	S->bits[WORD(i)] |= BIT(i);
+}
+
+void Bitset_del(T S, size_t i)
+{
+	if (i < S->size)
+		S->bits[WORD(i)] &= ~BIT(i);
+}
+
+void Bitset_fill(T S, size_t lo, size_t hi)
+{
+	size_t i;
+
+	if (hi >= S->size)
+		hi = S->size - 1;
+	if ((! S->size) || lo > hi)
+		return;
+
+	/* partial words at both ends, whole words in between */
+	for (i = lo; i <= hi && (i % WORDBITS); i++)
+		S->bits[WORD(i)] |= BIT(i);
+	for (; i + WORDBITS - 1 <= hi; i += WORDBITS)
+		S->bits[WORD(i)] = ~(uint64_t)0;
+	for (; i <= hi; i++)
+		S->bits[WORD(i)] |= BIT(i);
+}
+
+static size_t popcount(uint64_t w)
+{
+	w = w - ((w >> 1) & 0x5555555555555555ULL);
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (size_t)((w * 0x0101010101010101ULL) >> 56);
+}
+
+size_t Bitset_len(T S)
+{
+	size_t i, n = 0;
+	for (i = 0; i < S->words; i++)
+		n += popcount(S->bits[i]);
+	return n;
+}
+
+int Bitset_next(T S, size_t *pos)
+{
+	size_t i = *pos, w;
+	uint64_t word;
+
+	if (i >= S->size)
+		return 0;
+
+	w = WORD(i);
+	word = S->bits[w] & (~(uint64_t)0 << (i % WORDBITS));
+	while (! word) {
+		if (++w >= S->words)
+			return 0;
+		word = S->bits[w];
+	}
+
+	i = w * WORDBITS;
+	while (! (word & 1)) {
+		word >>= 1;
+		i++;
+	}
+	if (i >= S->size)
+		return 0;
+
+	*pos = i;
+	return 1;
+}
+
+void Bitset_free(T *S)
+{
+	T s = *S;
+	if (s) {
+		free(s->bits);
+		s->bits = NULL;
+		free(s);
+	}
+	*S = NULL;
+}
+
+void Bitset_or(T a, T b) // a + b
+{
+	size_t i, n = a->words < b->words ? a->words : b->words;
+	for (i = 0; i < n; i++)
+		a->bits[i] |= b->bits[i];
+}
+
+void Bitset_and(T a, T b) // a * b
+{
+	size_t i, n = a->words < b->words ? a->words : b->words;
+	for (i = 0; i < n; i++)
+		a->bits[i] &= b->bits[i];
+	for (; i < a->words; i++)
+		a->bits[i] = 0;
+}
+
+void Bitset_not(T a, T b) // a - b
+{
+	size_t i, n = a->words < b->words ? a->words : b->words;
+	for (i = 0; i < n; i++)
+		a->bits[i] &= ~b->bits[i];
+}
+
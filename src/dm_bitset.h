@@ -0,0 +1,56 @@
+/*
+  
+ Copyright (c) 2010-2011 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or 
+ modify it under the terms of the GNU General Public License 
+ as published by the Free Software Foundation; either 
+ version 2 of the License, or (at your option) any later 
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/* 
+ * ADT interface for a fixed size set of small integers
+ *
+ * optimized for combining dense sets, like search results
+ * indexed by message sequence number
+ */
+
+
+#ifndef BITSET_H
+#define BITSET_H
+
+#include <stddef.h>
+
+#define T Bitset_T
+
+typedef struct T *T;
+
+extern T               Bitset_new(size_t); // holds 0 .. size-1, all clear
+extern T               Bitset_copy(T);
+extern size_t          Bitset_size(T);
+extern int             Bitset_has(T, size_t);
+extern void            Bitset_add(T, size_t);
+extern void            Bitset_del(T, size_t);
+extern void            Bitset_fill(T, size_t lo, size_t hi); // add lo .. hi
+extern size_t          Bitset_len(T);
+extern int             Bitset_next(T, size_t *); // first member >= *pos
+extern void            Bitset_free(T *);
+
+/* in place: the result is left in a */
+extern void            Bitset_or(T a, T b); // a + b
+extern void            Bitset_and(T a, T b); // a * b
+extern void            Bitset_not(T a, T b); // a - b
+
+#undef T
+
+#endif
@@ -22,188 +22,305 @@
 #include "dm_cache.h"
 
 #define THIS_MODULE "Cache"
+
+/* log the cache counters every CACHE_STATS_INTERVAL lookups */
+#define CACHE_STATS_INTERVAL 1000
+
 /*
  * cached raw message data
+ *
+ * rendered (crlf-encoded) messages are shared by all sessions in
+ * the process through a memory-bounded LRU keyed by physmessage_id.
+ * Message content is immutable so entries are never invalidated,
+ * only evicted. Entries are refcounted: a session keeps its current
+ * message alive even after it has been evicted from the LRU.
  */
 #define T Cache_T
 
-struct T {
+typedef struct {
 	u64_t id;
+	gchar *data;
 	u64_t size;
-	Mem_T memdump;
-	Mem_T tmpdump;
-	int file_dumped;
+	u64_t hdrsize;		/* octets up to and including the header/body separator */
+	int refcount;
+	GList *link;		/* position in the lru queue, NULL if not shared */
+} CacheEntry;
+
+static struct {
+	GHashTable *entries;	/* physmessage_id -> CacheEntry */
+	GQueue *lru;		/* most recently used at the head */
+	gboolean init;
+	CacheStats_t stats;
+} cache;
+
+static GStaticMutex cache_lock = G_STATIC_MUTEX_INIT;
+
+struct T {
+	u64_t id;
+	CacheEntry *entry;
 };
 
-/* */
-T Cache_new(void)
+/*
+ * shared LRU store. All _store_* functions must be called holding 
+ * cache_lock
+ */
+static void _store_init(void)
 {
-	int serr;
-	T C;
-	
-	C = g_malloc0(sizeof(*C));
+	field_t val;
+	int size = CACHE_DEFAULT_SIZE;
 
-	C->id = 0;
-	if (! (C->memdump = Mem_open())) {
-		serr = errno;
-		TRACE(TRACE_ERR,"Mem_open() failed [%s]", strerror(serr));
-		g_free(C);
-		errno = serr;
-		return NULL;
-	}
-	
-	if (! (C->tmpdump = Mem_open())) {
-		serr = errno;
-		TRACE(TRACE_ERR,"Mem_open() failed [%s]", strerror(serr));
-		errno = serr;
-		Mem_close(&C->memdump);
-		g_free(C);
-		return NULL;
+	if (cache.init) return;
+
+	config_get_value("message_cache_size", "IMAP", val);
+	if (strlen(val) && ((size = atoi(val)) < 0)) {
+		TRACE(TRACE_ERR, "illegal value for message_cache_size [%s]", val);
+		size = CACHE_DEFAULT_SIZE;
 	}
 
-	return C;
+	cache.entries = g_hash_table_new((GHashFunc)g_int64_hash, (GEqualFunc)g_int64_equal);
+	cache.lru = g_queue_new();
+	cache.stats.max = (u64_t)size * 1024 * 1024;
+	cache.init = TRUE;
+
+	TRACE(TRACE_DEBUG, "message cache size [%llu]", cache.stats.max);
 }
 
-u64_t Cache_set_dump(T C, char *buf, int dumptype)
+static void _entry_unref(CacheEntry *E)
 {
-	u64_t outcnt = 0;
-	Mem_T M;
-
-	switch (dumptype) {
-		case IMAP_CACHE_MEMDUMP:
-			M = Cache_get_memdump(C);
-		break;
-		case IMAP_CACHE_TMPDUMP:
-			M = Cache_get_tmpdump(C);
-		break;
-		default:
-			assert(0);
-		break;
+	if (! E) return;
+	if (--E->refcount > 0) return;
+	g_free(E->data);
+	g_free(E);
+}
+
+static void _store_log_stats(void)
+{
+	TRACE(TRACE_INFO, "hits [%llu] misses [%llu] evictions [%llu] entries [%llu] used [%llu/%llu]",
+			cache.stats.hits, cache.stats.misses, cache.stats.evictions,
+			cache.stats.entries, cache.stats.used, cache.stats.max);
+}
+
+static void _store_evict(u64_t needed)
+{
+	CacheEntry *E;
+
+	while ((cache.stats.used + needed > cache.stats.max) && (! g_queue_is_empty(cache.lru))) {
+		E = (CacheEntry *)g_queue_pop_tail(cache.lru);
+		E->link = NULL;
+		g_hash_table_remove(cache.entries, &E->id);
+		cache.stats.used -= E->size;
+		cache.stats.entries--;
+		cache.stats.evictions++;
+		TRACE(TRACE_DEBUG, "evict [%llu] size [%llu]", E->id, E->size);
+		_entry_unref(E);
 	}
-	
-	assert(M);
-	assert(buf);
+}
 
-	outcnt = strlen(buf);
+static CacheEntry * _store_get(u64_t id)
+{
+	CacheEntry *E;
+
+	if ((E = g_hash_table_lookup(cache.entries, &id))) {
+		cache.stats.hits++;
+		g_queue_unlink(cache.lru, E->link);
+		g_queue_push_head_link(cache.lru, E->link);
+		E->refcount++;
+	} else {
+		cache.stats.misses++;
+	}
 
-	Mem_rewind(M);
-	Mem_write(M, buf, outcnt);
-	Mem_rewind(M);
+	if (((cache.stats.hits + cache.stats.misses) % CACHE_STATS_INTERVAL) == 0)
+		_store_log_stats();
 
-	return outcnt;
+	return E;
 }
 
-void Cache_clear(T C)
+static void _store_put(CacheEntry *E)
 {
-	C->id = 0;
-	C->size = 0;
-	Mem_close(&C->memdump);
-	C->memdump = Mem_open();
+	if (E->size > cache.stats.max) return;
+	if (g_hash_table_lookup(cache.entries, &E->id)) return;
 
-	Mem_close(&C->tmpdump);
-	C->tmpdump = Mem_open();
-}
+	_store_evict(E->size);
 
+	E->refcount++;
+	g_queue_push_head(cache.lru, E);
+	E->link = g_queue_peek_head_link(cache.lru);
+	g_hash_table_insert(cache.entries, &E->id, E);
+	cache.stats.used += E->size;
+	cache.stats.entries++;
+}
 
-u64_t Cache_update(T C, DbmailMessage *message, int filter)
+/*
+ * render the raw message crlf-encoded into a new entry. The output 
+ * is sized up front so the message is copied exactly once.
+ */
+static CacheEntry * _entry_new(DbmailMessage *message)
 {
-	u64_t tmpcnt = 0, outcnt = 0;
-	char *crlf = NULL, *buf = NULL;
+	CacheEntry *E;
+	char *buf = NULL, *raw, *t;
+	char prev = 0, curr;
+	size_t i, l, h, nl = 0;
 
-	TRACE(TRACE_DEBUG,"[%p] C->id[%llu] message->id[%llu]", C, C->id, message->id);
+	if (! (raw = message->raw_content))
+		raw = buf = dbmail_message_to_string(message);
 
-	if (C->id != message->id) {
+	for (l = 0; raw[l]; l++) {
+		if (ISLF(raw[l]) && (! (l && ISCR(raw[l-1]))))
+			nl++;
+	}
+	h = min(find_end_of_header(raw), l);
+
+	E = g_new0(CacheEntry, 1);
+	E->id = message->id;
+	E->refcount = 1;
+	E->data = g_new0(char, l + nl + 1);
+
+	t = E->data;
+	for (i = 0; i < l; i++) {
+		if (i == h) E->hdrsize = t - E->data;
+		curr = raw[i];
+		if (ISLF(curr) && (! ISCR(prev)))
+			*t++ = '\r';
+		*t++ = curr;
+		prev = curr;
+	}
+	E->size = t - E->data;
+	if (h >= l) E->hdrsize = E->size;
 
-		Cache_clear(C);
+	if (buf) g_free(buf);
 
-		buf = dbmail_message_to_string(message);
-		crlf = get_crlf_encoded(buf);
+	return E;
+}
 
-		outcnt = Cache_set_dump(C,crlf,IMAP_CACHE_MEMDUMP);
-		tmpcnt = Cache_set_dump(C,crlf,IMAP_CACHE_TMPDUMP);
+/* */
+T Cache_new(void)
+{
+	T C;
+	
+	C = g_malloc0(sizeof(*C));
+	C->id = 0;
+	C->entry = NULL;
 
-		assert(tmpcnt==outcnt);
-		
-		C->size = outcnt;
-		C->id = message->id;
-		
-		g_free(buf);
-		g_free(crlf);
+	return C;
+}
 
+void Cache_clear(T C)
+{
+	C->id = 0;
+	if (C->entry) {
+		g_static_mutex_lock(&cache_lock);
+		_entry_unref(C->entry);
+		g_static_mutex_unlock(&cache_lock);
+		C->entry = NULL;
 	}
-	
+}
+
+static u64_t Cache_get_dumpsize(T C, int filter)
+{
+	assert(C->entry);
 	switch (filter) {
-		/* for these two update the temp MEM buffer */	
 		case DBMAIL_MESSAGE_FILTER_HEAD:
-			buf = dbmail_message_hdrs_to_string(message);
-			crlf = get_crlf_encoded(buf);
-			outcnt = Cache_set_dump(C,crlf,IMAP_CACHE_TMPDUMP);
-			g_free(buf);
-			g_free(crlf);
-		break;
+			return C->entry->hdrsize;
 		case DBMAIL_MESSAGE_FILTER_BODY:
-			buf = dbmail_message_body_to_string(message);
-			crlf = get_crlf_encoded(buf);
-			outcnt = Cache_set_dump(C,crlf,IMAP_CACHE_TMPDUMP);
-			g_free(buf);
-			g_free(crlf);
-		break;
+			return C->entry->size - C->entry->hdrsize;
 		case DBMAIL_MESSAGE_FILTER_FULL:
-			outcnt = C->size;
-			Mem_rewind(C->memdump);
-			Mem_rewind(C->tmpdump);
-			/* done */
-		break;
+		default:
+			return C->entry->size;
+	}
+}
+
+/*
+ * attach the session to the shared copy of message [id] if there is
+ * one. Returns FALSE on a cache miss.
+ */
+gboolean Cache_lookup(T C, u64_t id, int filter, u64_t *size)
+{
+	CacheEntry *E;
 
+	if (C->id != id || ! C->entry) {
+		g_static_mutex_lock(&cache_lock);
+		_store_init();
+		E = _store_get(id);
+		g_static_mutex_unlock(&cache_lock);
+
+		if (! E) return FALSE;
+
+		Cache_clear(C);
+		C->entry = E;
+		C->id = id;
 	}
 
-	TRACE(TRACE_DEBUG,"C->size[%llu], outcnt[%llu]", C->size, outcnt);	
+	*size = Cache_get_dumpsize(C, filter);
 
-	return outcnt;
+	return TRUE;
 }
 
-
-void Cache_set_memdump(T C, Mem_T M)
+u64_t Cache_update(T C, DbmailMessage *message, int filter)
 {
-	assert(C);
-	assert(M);
-	C->memdump = M;
+	u64_t outcnt = 0;
+	CacheEntry *E;
+
+	TRACE(TRACE_DEBUG,"[%p] C->id[%llu] message->id[%llu]", C, C->id, message->id);
+
+	if (Cache_lookup(C, message->id, filter, &outcnt))
+		return outcnt;
+
+	E = _entry_new(message);
+
+	g_static_mutex_lock(&cache_lock);
+	_store_put(E);
+	g_static_mutex_unlock(&cache_lock);
+
+	Cache_clear(C);
+	C->entry = E;
+	C->id = message->id;
+
+	outcnt = Cache_get_dumpsize(C, filter);
+
+	TRACE(TRACE_DEBUG,"C->size[%llu], outcnt[%llu]", C->entry->size, outcnt);	
+
+	return outcnt;
 }
 
 u64_t Cache_get_size(T C)
 {
 	assert(C);
-	return C->size;
-}
-Mem_T Cache_get_memdump(T C)
-{
-	return C->memdump;
+	if (! C->entry) return 0;
+	return C->entry->size;
 }
 
-void Cache_set_tmpdump(T C, Mem_T M)
+/*
+ * return a pointer into the shared message data for the 
+ * requested filter. The data stays valid until the next
+ * Cache_update/Cache_lookup/Cache_clear on this Cache_T
+ */
+const char * Cache_get_data(T C, int filter, u64_t *size)
 {
-	assert(C);
-	assert(M);
-	C->tmpdump = M;
+	assert(C && C->entry);
+
+	*size = Cache_get_dumpsize(C, filter);
+	if (filter == DBMAIL_MESSAGE_FILTER_BODY)
+		return C->entry->data + C->entry->hdrsize;
+	return C->entry->data;
 }
 
-Mem_T Cache_get_tmpdump(T C)
+void Cache_get_stats(CacheStats_t *stats)
 {
-	return C->tmpdump;
+	g_static_mutex_lock(&cache_lock);
+	_store_init();
+	*stats = cache.stats;
+	g_static_mutex_unlock(&cache_lock);
 }
 
-
 /*
  * closes the msg cache
  */
 void Cache_free(T *C)
 {
 	T c = *C;
+	Cache_clear(c);
 	c->id = -1;
-	Mem_close(&c->memdump);
-	Mem_close(&c->tmpdump);
 	g_free(c);
-	
+	*C = NULL;
 }
 
-
@@ -21,25 +21,30 @@
 #ifndef DM_CACHE_H
 #define DM_CACHE_H
 
-#include "dm_memblock.h"
-
-#define IMAP_CACHE_MEMDUMP 1
-#define IMAP_CACHE_TMPDUMP 2
+/* default size of the process-wide message cache in MB */
+#define CACHE_DEFAULT_SIZE 64
 
 #define T Cache_T
 
 typedef struct T *T;
 
-extern T     Cache_new(void);
-extern u64_t Cache_set_dump(T C, char *buf, int dumptype);
-extern void  Cache_clear(T C);
-extern u64_t Cache_update(T C, DbmailMessage *message, int filter);
-extern u64_t Cache_get_size(T C);
-extern void  Cache_set_memdump(T C, Mem_T M);
-extern Mem_T Cache_get_memdump(T C);
-extern void  Cache_set_tmpdump(T C, Mem_T M);
-extern Mem_T Cache_get_tmpdump(T C);
-extern void  Cache_free(T *C);
+typedef struct {
+	u64_t hits;
+	u64_t misses;
+	u64_t evictions;
+	u64_t entries;
+	u64_t used;		/* octets held by cached messages */
+	u64_t max;		/* configured upper bound in octets */
+} CacheStats_t;
+
+extern T           Cache_new(void);
+extern void        Cache_clear(T C);
+extern u64_t       Cache_update(T C, DbmailMessage *message, int filter);
+extern gboolean    Cache_lookup(T C, u64_t id, int filter, u64_t *size);
+extern u64_t       Cache_get_size(T C);
+extern const char *Cache_get_data(T C, int filter, u64_t *size);
+extern void        Cache_get_stats(CacheStats_t *stats);
+extern void        Cache_free(T *C);
 
 #undef T
 #endif
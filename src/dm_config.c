@@ -30,67 +30,222 @@
 
 db_param_t _db_params;
 
-/** dictionary which holds the configuration */
-static GKeyFile *config_dict = NULL;
+/*
+ * the configuration is parsed once into a snapshot: a table of values
+ * keyed by "section.key", both lowercased, so a lookup is a single hash
+ * probe per section. Reloading the config file builds a new snapshot
+ * and swaps it in; readers never lock. A reader only holds on to a
+ * snapshot for the length of one lookup, so a snapshot that was swapped
+ * out is freed by a later reload once CONFIG_RETIRE_GRACE seconds have
+ * passed. Reloads come from the main thread only.
+ */
+typedef struct {
+	char *value;			/* stripped, trailing comment removed */
+	long integer;			/* value as a number, 0 if it isn't one */
+	gboolean boolean;		/* value is yes, true, on or 1 */
+} config_value_t;
+
+typedef struct {
+	GHashTable *values;
+	time_t retired;			/* when it was swapped out */
+} config_snapshot_t;
+
+#define CONFIG_RETIRE_GRACE 60
+
+static config_snapshot_t *config_snapshot = NULL;
+static GList *config_retired = NULL;
 static int configured = 0;
 
+static void config_value_free(config_value_t *v)
+{
+	g_free(v->value);
+	g_free(v);
+}
+
+static void config_snapshot_free(config_snapshot_t *snapshot)
+{
+	if (! snapshot) return;
+	g_hash_table_destroy(snapshot->values);
+	g_free(snapshot);
+}
+
+/* build the lookup key for section and name into buf */
+static const char * config_key(char *buf, size_t len, const char *section, const char *name)
+{
+	char *c;
+	g_snprintf(buf, len, "%s.%s", section, name);
+	for (c = buf; *c; c++)
+		*c = g_ascii_tolower(*c);
+	return buf;
+}
+
+static config_snapshot_t * config_snapshot_new(GKeyFile *dict)
+{
+	config_snapshot_t *snapshot = g_new0(config_snapshot_t, 1);
+	char **groups, **keys;
+	char buf[FIELDSIZE];
+	int i, j;
+
+	snapshot->values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)config_value_free);
+
+	groups = g_key_file_get_groups(dict, NULL);
+	for (i = 0; groups[i]; i++) {
+		keys = g_key_file_get_keys(dict, groups[i], NULL, NULL);
+		for (j = 0; keys && keys[j]; j++) {
+			config_value_t *v;
+			char *value, *end;
+
+			config_key(buf, sizeof(buf), groups[i], keys[j]);
+			/* keys differing only in case: the first one wins */
+			if (g_hash_table_lookup(snapshot->values, buf))
+				continue;
+			if (! (value = g_key_file_get_value(dict, groups[i], keys[j], NULL)))
+				continue;
+
+			end = g_strstr_len(value, FIELDSIZE, "#");
+			if (end) *end = '\0';
+			g_strstrip(value);
+			if (strlen(value) >= FIELDSIZE)
+				value[FIELDSIZE-1] = '\0';
+
+			v = g_new0(config_value_t, 1);
+			v->value = value;
+			v->integer = strtol(value, NULL, 10);
+			v->boolean = (MATCH(value, "yes") || MATCH(value, "true") || 
+					MATCH(value, "on") || MATCH(value, "1"));
+
+			g_hash_table_insert(snapshot->values, g_strdup(buf), v);
+		}
+		g_strfreev(keys);
+	}
+	g_strfreev(groups);
+
+	return snapshot;
+}
+
+/* make snapshot the current one, retiring the one it replaces */
+static void config_snapshot_swap(config_snapshot_t *snapshot)
+{
+	config_snapshot_t *old = g_atomic_pointer_get(&config_snapshot);
+	time_t now = time(NULL);
+	GList *l, *next;
+
+	g_atomic_pointer_set(&config_snapshot, snapshot);
+
+	/* nobody can still be reading these */
+	for (l = config_retired; l; l = next) {
+		config_snapshot_t *retired = (config_snapshot_t *)l->data;
+		next = g_list_next(l);
+		if (now - retired->retired < CONFIG_RETIRE_GRACE)
+			continue;
+		config_snapshot_free(retired);
+		config_retired = g_list_delete_link(config_retired, l);
+	}
+
+	if (old) {
+		old->retired = now;
+		config_retired = g_list_prepend(config_retired, old);
+	}
+}
+
+static config_snapshot_t * config_load(const char *config_filename)
+{
+	GKeyFile *config_dict;
+	config_snapshot_t *snapshot;
+
+	assert(config_filename != NULL);
+        config_dict = g_key_file_new();
+	if (! g_key_file_load_from_file(config_dict, config_filename, G_KEY_FILE_NONE, NULL)) {
+		g_key_file_free(config_dict);
+		return NULL;
+	}
+	// silence the glib logger
+	g_log_set_default_handler((GLogFunc)null_logger, NULL);
+
+	snapshot = config_snapshot_new(config_dict);
+	g_key_file_free(config_dict);
+
+	return snapshot;
+}
+
 /**
  * read the configuration file and stores the configuration
  * directives in an internal structure.
  */
 int config_read(const char *config_filename)
 {
+	config_snapshot_t *snapshot;
+
 	if (configured) return 0;
-	assert(config_filename != NULL);
-        config_dict = g_key_file_new();
-	if (! g_key_file_load_from_file(config_dict, config_filename, G_KEY_FILE_NONE, NULL)) {
-		g_key_file_free(config_dict);
+	if (! (snapshot = config_load(config_filename))) {
                 TRACE(TRACE_EMERG, "error reading config file %s", config_filename);
 		_exit(1);
 		return -1;
 	}
-	// silence the glib logger
-	g_log_set_default_handler((GLogFunc)null_logger, NULL);
+
+	config_snapshot_swap(snapshot);
+
 	configured = 1;
         return 0;
 }
 
+/**
+ * read the configuration file again and swap it in, without a moment
+ * in between where there is no configuration. A config file that can't
+ * be read leaves the current configuration in place.
+ */
+int config_reload(const char *config_filename)
+{
+	config_snapshot_t *snapshot;
+
+	if (! configured)
+		return config_read(config_filename);
+
+	if (! (snapshot = config_load(config_filename))) {
+		TRACE(TRACE_ERR, "error reading config file %s, keeping the current configuration", config_filename);
+		return -1;
+	}
+
+	config_snapshot_swap(snapshot);
+	return 0;
+}
+
 /**
  * free all memory related to config 
  */
 void config_free(void) 
 {
+	GList *l;
+
 	if (!configured) return;
-	g_key_file_free(config_dict);
-	config_dict = NULL;
+	config_snapshot_swap(NULL);
+
+	l = g_list_first(config_retired);
+	while (l) {
+		config_snapshot_free((config_snapshot_t *)l->data);
+		l = g_list_next(l);
+	}
+	g_list_free(config_retired);
+	config_retired = NULL;
+
 	configured = 0;
 }
 
-/* Return 1 if found, 0 if not. */
-/* This function also strips any... # Trailing comments. */
-/* value is not modified unless something is found. */
-static int config_get_value_once(const field_t field_name,
-		const char * const service_name,
-		field_t value)
+/* find a value in the service section, then in the DBMAIL section */
+static config_value_t * config_lookup(const char * const field_name,
+		const char * const service_name)
 {
-	char *dict_value;
-	int retval = 0;
+	config_snapshot_t *snapshot = g_atomic_pointer_get(&config_snapshot);
+	config_value_t *v;
+	char buf[FIELDSIZE];
 
 	assert(service_name);
-	assert(config_dict);
-
-	dict_value = g_key_file_get_value(config_dict, service_name, field_name, NULL);
-        if (dict_value) {
-		char *end;
-		end = g_strstr_len(dict_value, FIELDSIZE, "#");
-		if (end) *end = '\0';
-		g_strstrip(dict_value);
-                g_strlcpy(value, dict_value, FIELDSIZE);
-		g_free(dict_value);
-		retval = 1;
-	}
+	assert(snapshot);
 
-	return retval;
+	if ((v = g_hash_table_lookup(snapshot->values, config_key(buf, sizeof(buf), service_name, field_name))))
+		return v;
+
+	return g_hash_table_lookup(snapshot->values, config_key(buf, sizeof(buf), "DBMAIL", field_name));
 }
 
 /* FIXME: Always returns 0, which is dandy for debugging. */
@@ -98,58 +253,40 @@ int config_get_value(const field_t field_name,
                      const char * const service_name,
                      field_t value)
 {
-	char *key;
-	gssize field_len;
-
-	field_len = strlen(field_name);
-	
-	// First look in the SERVICE section.
-	// For each attempt, try as-is, upper, lower.
-	       
-	key = NULL;
-	if (config_get_value_once(field_name, service_name, value))
-		goto config_get_value_done;
-	
-	key = g_ascii_strup(field_name, field_len);
-	if (config_get_value_once(key, service_name, value))
-		goto config_get_value_done;
-	g_free(key);
-
-	key = g_ascii_strdown(field_name, field_len);
-	if (config_get_value_once(key, service_name, value))
-		goto config_get_value_done;
-	g_free(key);
-
-	// if not found, get the DBMAIL section.
-	// For each attempt, try as-is, upper, lower.
-	       
-	key = NULL;
-	if (config_get_value_once(field_name, "DBMAIL", value))
-		goto config_get_value_done;
-	
-	key = g_ascii_strup(field_name, field_len);
-	if (config_get_value_once(key, "DBMAIL", value))
-		goto config_get_value_done;
-	g_free(key);
-
-	key = g_ascii_strdown(field_name, field_len);
-	if (config_get_value_once(key, "DBMAIL", value))
-		goto config_get_value_done;
-	g_free(key);
-	
-	/* give up */
-        value[0] = '\0';
-	return 0;
+	config_value_t *v;
+
+	if ((v = config_lookup(field_name, service_name)))
+		g_strlcpy(value, v->value, FIELDSIZE);
+	else
+		value[0] = '\0';
 
-config_get_value_done:
-	g_free(key);
 	return 0;
 }
 
+long config_get_int(const char * const field_name, const char * const service_name, long fallback)
+{
+	config_value_t *v;
+
+	if ((v = config_lookup(field_name, service_name)) && strlen(v->value))
+		return v->integer;
+
+	return fallback;
+}
+
+gboolean config_get_bool(const char * const field_name, const char * const service_name)
+{
+	config_value_t *v;
+
+	if ((v = config_lookup(field_name, service_name)))
+		return v->boolean;
+
+	return FALSE;
+}
+
 void SetTraceLevel(const char *service_name)
 {
 	trace_t trace_stderr_int, trace_syslog_int;
-	field_t trace_level, trace_syslog, trace_stderr, syslog_logging_levels, file_logging_levels;
+	field_t trace_level, trace_syslog, trace_stderr, syslog_logging_levels, file_logging_levels, file_logging_format;
 
 	/* Warn about the deprecated "trace_level" config item,
 	 * but we will use this value for trace_syslog if needed. */
@@ -236,12 +373,15 @@ void SetTraceLevel(const char *service_name)
 	}
 
 	configure_debug(trace_syslog_int, trace_stderr_int);
+
+	config_get_value("file_logging_format", service_name, file_logging_format);
+	configure_debug_json(MATCH(file_logging_format, "json"));
 }
 
 void GetDBParams(void)
 {
 	field_t port_string, sock_string, serverid_string, query_time;
-	field_t max_db_connections;
+	field_t max_db_connections, max_db_wait;
 
 	if (config_get_value("driver", "DBMAIL", _db_params.driver) < 0)
 		TRACE(TRACE_EMERG, "error getting config! [driver]");
@@ -261,6 +401,8 @@ void GetDBParams(void)
 		TRACE(TRACE_EMERG, "error getting config! [authdriver]");
 	if (config_get_value("sortdriver", "DBMAIL", _db_params.sortdriver) < 0)
 		TRACE(TRACE_EMERG, "error getting config! [sortdriver]");
+	if (config_get_value("ftsdriver", "DBMAIL", _db_params.ftsdriver) < 0)
+		TRACE(TRACE_EMERG, "error getting config! [ftsdriver]");
 	if (config_get_value("host", "DBMAIL", _db_params.host) < 0)
 		TRACE(TRACE_EMERG, "error getting config! [host]");
 	if (config_get_value("db", "DBMAIL", _db_params.db) < 0) 
@@ -281,6 +423,8 @@ void GetDBParams(void)
 		TRACE(TRACE_EMERG, "error getting config! [table_prefix]");
 	if (config_get_value("max_db_connections", "DBMAIL", max_db_connections) < 0)
 		TRACE(TRACE_EMERG, "error getting config! [max_db_connections]");
+	if (config_get_value("max_db_wait", "DBMAIL", max_db_wait) < 0)
+		TRACE(TRACE_EMERG, "error getting config! [max_db_wait]");
 
 	if (config_get_value("query_time_info", "DBMAIL", query_time) < 0)
 		TRACE(TRACE_EMERG, "error getting config! [query_time_info]");
@@ -362,6 +506,14 @@ void GetDBParams(void)
 	} else {
 		_db_params.max_db_connections = 10;
 	}
+	/* max_db_wait */
+	if (strlen(max_db_wait) != 0) {
+		_db_params.max_db_wait = (unsigned int) strtoul(max_db_wait, NULL, 10);
+		if (errno == EINVAL || errno == ERANGE)
+			TRACE(TRACE_EMERG, "max_db_wait invalid in config file");
+	} else {
+		_db_params.max_db_wait = 30;
+	}
 
 }
 
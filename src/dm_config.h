@@ -29,6 +29,16 @@
  */
 int config_read(const char *config_filename);
 
+/**
+ * \brief read the configuration file again and replace the
+ * current configuration with it
+ * \param cfilename name of configuration file
+ * \return
+ *     - -1 on error, the current configuration is kept
+ *     -  0 on success
+ */
+int config_reload(const char *config_filename);
+
 /**
  * free all memory taken up by config.
  */
@@ -46,6 +56,18 @@ void config_free(void);
 int config_get_value(const field_t name, const char *service_name,
                      /*@out@*/ field_t value);
 
+/**
+ * \brief get configuration item as a number
+ * \return fallback if the item is not set
+ */
+long config_get_int(const char * const name, const char * const service_name, long fallback);
+
+/**
+ * \brief get configuration item as a boolean
+ * \return TRUE if the item is set to yes, true, on or 1
+ */
+gboolean config_get_bool(const char * const name, const char * const service_name);
+
 /* some common used functions reading config options */
 /**
  \brief get parameters for database connection
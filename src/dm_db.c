@@ -144,6 +144,32 @@ P pool = NULL;
 U url = NULL;
 int db_connected = 0; // 0 = not called, 1 = new url but not pool, 2 = new url and pool, but not tested, 3 = tested and ok
 
+/*
+ * prepared statements per connection, keyed by their SQL text.
+ *
+ * libzdb owns the statements and frees them when the connection is
+ * cleared, which the pool also does when a connection is returned. The
+ * entries of a connection therefore last as long as its lease, and are
+ * dropped by db_con_close, db_con_clear and db_rollback_transaction.
+ *
+ * A cached statement is only handed out when nobody can still be using
+ * it: after db_stmt_exec, once its result set has been read to the end,
+ * or once db_insert_result has taken the id from it. Otherwise a fresh
+ * statement is prepared and left out of the cache.
+ */
+typedef struct {
+	S s;
+	R r;			/* result set still open, if any */
+	gboolean busy;
+} stmt_cache_t;
+
+static GStaticMutex stmt_cache_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *stmt_cache = NULL;		/* C -> SQL text -> stmt_cache_t */
+static GHashTable *stmt_cache_stmts = NULL;	/* S -> stmt_cache_t */
+static GHashTable *stmt_cache_results = NULL;	/* R -> stmt_cache_t */
+static u64_t stmt_cache_hits = 0;
+static u64_t stmt_cache_misses = 0;
+
 /* This is the first db_* call anybody should make. */
 int db_connect(void)
 {
@@ -223,6 +249,15 @@ int db_connect(void)
  * error but without a matching db_connect before it. */
 int db_disconnect(void)
 {
+	u64_t saturated, timeouts, hits, misses;
+	u64_t waits[DB_CON_WAIT_BUCKETS];
+
+	db_con_stats(waits, &saturated, &timeouts);
+	TRACE(TRACE_DEBUG, "connection waits <1ms [%llu] <10ms [%llu] <100ms [%llu] <1s [%llu] <10s [%llu] >=10s [%llu] saturated [%llu] timeouts [%llu]",
+			waits[0], waits[1], waits[2], waits[3], waits[4], waits[5], saturated, timeouts);
+	db_stmt_cache_stats(&hits, &misses);
+	TRACE(TRACE_DEBUG, "prepared statements hits [%llu] misses [%llu]", hits, misses);
+
 	if(db_connected >= 3) ConnectionPool_stop(pool);
 	if(db_connected >= 2) ConnectionPool_free(&pool);
 	if(db_connected >= 1) URL_free(&url);
@@ -230,33 +265,150 @@ int db_disconnect(void)
 	return 0;
 }
 
-C db_con_get(void)
+/*
+ * threads that find the pool exhausted queue up here and are woken in
+ * arrival order as soon as a connection is returned, or give up when
+ * max_db_wait runs out. The lock only guards the queue and counters;
+ * connections are never fetched or reaped while holding it.
+ */
+static GStaticMutex pool_wait_lock = G_STATIC_MUTEX_INIT;
+static GQueue *pool_waiters = NULL;
+static u64_t pool_wait_histogram[DB_CON_WAIT_BUCKETS];
+static u64_t pool_saturated = 0;
+static u64_t pool_timeouts = 0;
+static u64_t pool_released = 0;
+
+static void db_con_wait_account(struct timeval *before)
 {
-	int i=0, k=0; C c;
-	while (i++<30) {
-		c = ConnectionPool_getConnection(pool);
-		if (c) break;
-		if((int)(i % 5)==0) {
-			TRACE(TRACE_ALERT, "Thread is having trouble obtaining a database connection. Try [%d]", i);
-			k = ConnectionPool_reapConnections(pool);
-			TRACE(TRACE_INFO, "Database reaper closed [%d] stale connections", k);
+	/* bucket limits in milliseconds */
+	static const u64_t limits[DB_CON_WAIT_BUCKETS-1] = { 1, 10, 100, 1000, 10000 };
+	struct timeval after;
+	u64_t elapsed;
+	int i = 0;
+
+	if (before) {
+		gettimeofday(&after, NULL);
+		elapsed = ((after.tv_sec - before->tv_sec) * 1000) + ((after.tv_usec - before->tv_usec) / 1000);
+		while (i < DB_CON_WAIT_BUCKETS-1 && elapsed >= limits[i])
+			i++;
+	}
+	pool_wait_histogram[i]++;
+}
+
+static C db_con_wait(void)
+{
+	GTimeVal deadline, slice;
+	struct timeval before;
+	GCond *cond;
+	C c = NULL;
+	u64_t released;
+	int k;
+
+	gettimeofday(&before, NULL);
+	g_get_current_time(&deadline);
+	g_time_val_add(&deadline, (glong)_db_params.max_db_wait * G_USEC_PER_SEC);
+
+	g_static_mutex_lock(&pool_wait_lock);
+	if (! pool_waiters)
+		pool_waiters = g_queue_new();
+
+	cond = g_cond_new();
+	g_queue_push_tail(pool_waiters, cond);
+	pool_saturated++;
+
+	TRACE(TRACE_INFO, "database connection pool exhausted, [%u] threads waiting", g_queue_get_length(pool_waiters));
+
+	while (TRUE) {
+		if (g_queue_peek_head(pool_waiters) == cond) {
+			released = pool_released;
+			g_static_mutex_unlock(&pool_wait_lock);
+			c = ConnectionPool_getConnection(pool);
+			g_static_mutex_lock(&pool_wait_lock);
+			if (c)
+				break;
+			/* a connection came back while we were looking */
+			if (released != pool_released)
+				continue;
+		}
+
+		g_get_current_time(&slice);
+		if ((slice.tv_sec > deadline.tv_sec) || (slice.tv_sec == deadline.tv_sec && slice.tv_usec >= deadline.tv_usec))
+			break;
+
+		/* wake up now and then to reap connections that went stale */
+		g_time_val_add(&slice, 5 * G_USEC_PER_SEC);
+		if ((slice.tv_sec > deadline.tv_sec) || (slice.tv_sec == deadline.tv_sec && slice.tv_usec > deadline.tv_usec))
+			slice = deadline;
+
+		if (! g_cond_timed_wait(cond, g_static_mutex_get_mutex(&pool_wait_lock), &slice)) {
+			if (g_queue_peek_head(pool_waiters) == cond) {
+				g_static_mutex_unlock(&pool_wait_lock);
+				TRACE(TRACE_ALERT, "Thread is having trouble obtaining a database connection");
+				k = ConnectionPool_reapConnections(pool);
+				TRACE(TRACE_INFO, "Database reaper closed [%d] stale connections", k);
+				g_static_mutex_lock(&pool_wait_lock);
+			}
 		}
-		sleep(1);
 	}
+
+	g_queue_remove(pool_waiters, cond);
+	g_cond_free(cond);
+
+	/* let the next in line have a go */
+	if ((cond = g_queue_peek_head(pool_waiters)))
+		g_cond_signal(cond);
+
+	if (c)
+		db_con_wait_account(&before);
+	else
+		pool_timeouts++;
+	g_static_mutex_unlock(&pool_wait_lock);
+
+	return c;
+}
+
+C db_con_get(void)
+{
+	C c = NULL;
+	gboolean queued;
+
+	/* don't jump the queue */
+	g_static_mutex_lock(&pool_wait_lock);
+	queued = (pool_waiters && g_queue_get_length(pool_waiters));
+	g_static_mutex_unlock(&pool_wait_lock);
+
+	if (! queued && (c = ConnectionPool_getConnection(pool))) {
+		g_static_mutex_lock(&pool_wait_lock);
+		db_con_wait_account(NULL);
+		g_static_mutex_unlock(&pool_wait_lock);
+	} else {
+		c = db_con_wait();
+	}
+
 	if (! c) {
-		TRACE(TRACE_EMERG,"[%p] can't get a database connection from the pool! max [%d] size [%d] active [%d]", 
+		TRACE(TRACE_ERR,"[%p] can't get a database connection from the pool after [%u] seconds! max [%d] size [%d] active [%d]", 
 			pool,
+			_db_params.max_db_wait,
 			ConnectionPool_getMaxConnections(pool),
 			ConnectionPool_size(pool),
 			ConnectionPool_active(pool));
+		THROW(SQLException, "no database connection available after [%u] seconds", _db_params.max_db_wait);
 	}
 
-	assert(c);
 	Connection_setQueryTimeout(c, (int)_db_params.query_timeout);
 	TRACE(TRACE_DATABASE,"[%p] connection from pool", c);
 	return c;
 }
 
+void db_con_stats(u64_t histogram[DB_CON_WAIT_BUCKETS], u64_t *saturated, u64_t *timeouts)
+{
+	g_static_mutex_lock(&pool_wait_lock);
+	memcpy(histogram, pool_wait_histogram, sizeof(pool_wait_histogram));
+	*saturated = pool_saturated;
+	*timeouts = pool_timeouts;
+	g_static_mutex_unlock(&pool_wait_lock);
+}
+
 gboolean dm_db_ping(void)
 {
 	C c; gboolean t;
@@ -269,16 +421,65 @@ gboolean dm_db_ping(void)
 	return t;
 }
 
+static void stmt_cache_forget(gpointer UNUSED key, stmt_cache_t *E, gpointer UNUSED data)
+{
+	g_hash_table_remove(stmt_cache_stmts, E->s);
+	if (E->r)
+		g_hash_table_remove(stmt_cache_results, E->r);
+}
+
+static void db_stmt_cache_drop(C c)
+{
+	GHashTable *stmts;
+
+	g_static_mutex_lock(&stmt_cache_lock);
+	if (stmt_cache && (stmts = g_hash_table_lookup(stmt_cache, c))) {
+		g_hash_table_foreach(stmts, (GHFunc)stmt_cache_forget, NULL);
+		g_hash_table_remove(stmt_cache, c);
+	}
+	g_static_mutex_unlock(&stmt_cache_lock);
+}
+
+/* the statement is free for the next user */
+static void db_stmt_cache_release(S s, R r)
+{
+	stmt_cache_t *E = NULL;
+
+	g_static_mutex_lock(&stmt_cache_lock);
+	if (s && stmt_cache_stmts)
+		E = g_hash_table_lookup(stmt_cache_stmts, s);
+	else if (r && stmt_cache_results)
+		E = g_hash_table_lookup(stmt_cache_results, r);
+	if (E) {
+		if (E->r)
+			g_hash_table_remove(stmt_cache_results, E->r);
+		E->r = NULL;
+		E->busy = FALSE;
+	}
+	g_static_mutex_unlock(&stmt_cache_lock);
+}
+
 void db_con_close(C c)
 {
+	GCond *cond;
+
 	TRACE(TRACE_DATABASE,"[%p] connection to pool", c);
+	db_stmt_cache_drop(c);
 	Connection_close(c);
+
+	g_static_mutex_lock(&pool_wait_lock);
+	pool_released++;
+	if (pool_waiters && (cond = g_queue_peek_head(pool_waiters)))
+		g_cond_signal(cond);
+	g_static_mutex_unlock(&pool_wait_lock);
+
 	return;
 }
 
 void db_con_clear(C c)
 {
 	TRACE(TRACE_DATABASE,"[%p] connection cleared", c);
+	db_stmt_cache_drop(c);
 	Connection_clear(c);
 	Connection_setQueryTimeout(c, (int)_db_params.query_timeout);
 	return;
@@ -390,19 +591,69 @@ S db_stmt_prepare(C c, const char *q, ...)
 {
 	va_list ap, cp;
 	char *query;
-	S s;
+	GHashTable *stmts;
+	stmt_cache_t *E;
+	S s = NULL;
 
 	va_start(ap, q);
 	va_copy(cp, ap);
         query = g_strdup_vprintf(q, cp);
         va_end(cp);
 
+	g_static_mutex_lock(&stmt_cache_lock);
+	if (! stmt_cache) {
+		stmt_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_hash_table_destroy);
+		stmt_cache_stmts = g_hash_table_new(g_direct_hash, g_direct_equal);
+		stmt_cache_results = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	if (! (stmts = g_hash_table_lookup(stmt_cache, c))) {
+		stmts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		g_hash_table_insert(stmt_cache, c, stmts);
+	}
+	if ((E = g_hash_table_lookup(stmts, query)) && ! E->busy) {
+		E->busy = TRUE;
+		s = E->s;
+		stmt_cache_hits++;
+	} else {
+		stmt_cache_misses++;
+	}
+	g_static_mutex_unlock(&stmt_cache_lock);
+
+	if (s) {
+		TRACE(TRACE_DATABASE,"[%p] cached [%s]", c, query);
+		g_free(query);
+		return s;
+	}
+
 	TRACE(TRACE_DATABASE,"[%p] [%s]", c, query);
 	s = Connection_prepareStatement(c, "%s", (const char *)query);
-	g_free(query);
+
+	if (E) {
+		/* still in use: this one stays out of the cache */
+		g_free(query);
+		return s;
+	}
+
+	E = g_new0(stmt_cache_t, 1);
+	E->s = s;
+	E->busy = TRUE;
+
+	g_static_mutex_lock(&stmt_cache_lock);
+	g_hash_table_insert(stmts, query, E);
+	g_hash_table_insert(stmt_cache_stmts, s, E);
+	g_static_mutex_unlock(&stmt_cache_lock);
+
 	return s;
 }
 
+void db_stmt_cache_stats(u64_t *hits, u64_t *misses)
+{
+	g_static_mutex_lock(&stmt_cache_lock);
+	*hits = stmt_cache_hits;
+	*misses = stmt_cache_misses;
+	g_static_mutex_unlock(&stmt_cache_lock);
+}
+
 int db_stmt_set_str(S s, int index, const char *x)
 {
 	TRACE(TRACE_DATABASE,"[%p] %d:[%s]", s, index, x);
@@ -433,18 +684,36 @@ int db_stmt_set_blob(S s, int index, const void *x, int size)
 gboolean db_stmt_exec(S s)
 {
 	PreparedStatement_execute(s);
+	db_stmt_cache_release(s, NULL);
 	return TRUE;
 }
 R db_stmt_query(S s)
 {
-	return PreparedStatement_executeQuery(s);
+	stmt_cache_t *E;
+	R r = PreparedStatement_executeQuery(s);
+
+	g_static_mutex_lock(&stmt_cache_lock);
+	if (stmt_cache_stmts && (E = g_hash_table_lookup(stmt_cache_stmts, s))) {
+		if (E->r)
+			g_hash_table_remove(stmt_cache_results, E->r);
+		E->r = r;
+		if (r)
+			g_hash_table_insert(stmt_cache_results, r, E);
+		else
+			E->busy = FALSE;
+	}
+	g_static_mutex_unlock(&stmt_cache_lock);
+
+	return r;
 }
 int db_result_next(R r)
 {
-	if (r)
-		return ResultSet_next(r);
-	else
+	if (! r)
 		return FALSE;
+	if (ResultSet_next(r))
+		return TRUE;
+	db_stmt_cache_release(NULL, r);
+	return FALSE;
 }
 unsigned db_num_fields(R r)
 {
@@ -494,6 +763,7 @@ u64_t db_insert_result(C c, R r)
 		if ((id = (u64_t )Connection_lastRowId(c)) == 0) // sqlite
 			id = db_result_get_u64(r, 0); // postgresql
 	}
+	db_stmt_cache_release(NULL, r);
 	assert(id);
 	return id;
 }
@@ -527,6 +797,7 @@ int db_commit_transaction(C c)
 int db_rollback_transaction(C c)
 {
 	TRACE(TRACE_DATABASE,"ROLLBACK");
+	db_stmt_cache_drop(c);
 	Connection_rollback(c);
 	return DM_SUCCESS;
 }
@@ -593,6 +864,9 @@ static const char * db_get_sqlite_sql(sql_fragment_t frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_CONCAT:
+			return "%s||%s";
+		break;
 	}
 	return NULL;
 }
@@ -646,6 +920,9 @@ static const char * db_get_mysql_sql(sql_fragment_t frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_CONCAT:
+			return "CONCAT(%s,%s)";
+		break;
 	}
 	return NULL;
 }
@@ -702,6 +979,9 @@ static const char * db_get_pgsql_sql(sql_fragment_t frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_CONCAT:
+			return "%s||%s";
+		break;
 	}
 	return NULL;
 }
@@ -755,6 +1035,9 @@ static const char * db_get_oracle_sql(sql_fragment_t frag)
 		case SQL_COMPARE_BLOB:
 			return "DBMS_LOB.COMPARE(%s,?) = 0";
 		break;
+		case SQL_CONCAT:
+			return "%s||%s";
+		break;
 	}
 	return NULL;
 }
@@ -813,6 +1096,10 @@ int db_check_version(void)
 		check_table_exists(c, "envelope", "2.1+ database incompatible. You need to add the envelopes table and run dbmail-util -by");
 		check_table_exists(c, "mimeparts", "3.x database incompatible.");
 		check_table_exists(c, "header", "3.x database incompatible - single instance header storage missing.");
+		if (! db_query(c, "SELECT seq FROM %smessages WHERE 1=0", DBPFX))
+			TRACE(TRACE_EMERG, "3.0.1 database incompatible - message seq missing. You need to run the 3_0_0-3_0_1 upgrade script.");
+		check_table_exists(c, "sortkeys", "3.0.1 database incompatible - sortkeys table missing. You need to run the 3_0_0-3_0_1 upgrade script and dbmail-util -by");
+		check_table_exists(c, "generations", "3.0.1 database incompatible - generations table missing. You need to run the 3_0_0-3_0_1 upgrade script");
 		ok = 1;
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -1553,10 +1840,70 @@ int db_icheck_envelope(GList **lost)
 }
 
 
+int db_set_sortkeys(GList *lost)
+{
+	u64_t pmsgid;
+	u64_t *id;
+	DbmailMessage *msg;
+	if (! lost)
+		return DM_SUCCESS;
+
+	lost = g_list_first(lost);
+	while (lost) {
+		id = (u64_t *)lost->data;
+		pmsgid = *id;
+		
+		msg = dbmail_message_new();
+		if (! msg)
+			return DM_EQUERY;
+
+		if (! (msg = dbmail_message_retrieve(msg, pmsgid, DBMAIL_MESSAGE_FILTER_HEAD))) {
+			TRACE(TRACE_WARNING,"error retrieving physmessage: [%llu]", pmsgid);
+			fprintf(stderr,"E");
+		} else {
+			dbmail_message_cache_sortkeys(msg);
+			fprintf(stderr,".");
+		}
+		dbmail_message_free(msg);
+		if (! g_list_next(lost)) break;
+		lost = g_list_next(lost);
+	}
+	return DM_SUCCESS;
+}
+
+int db_icheck_sortkeys(GList **lost)
+{
+	C c; R r; volatile int t = DM_SUCCESS;
+	u64_t *id;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT p.id FROM %sphysmessage p LEFT JOIN %ssortkeys k "
+			"ON p.id = k.physmessage_id WHERE k.physmessage_id IS NULL", DBPFX, DBPFX);
+		while (db_result_next(r)) {
+			id = g_new0(u64_t,1);
+			*id = db_result_get_u64(r, 0);
+			*(GList **)lost = g_list_prepend(*(GList **)lost,id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+
 int db_set_message_status(u64_t message_idnr, MessageStatus_t status)
 {
-	return db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %llu", 
-			DBPFX, status, message_idnr);
+	int t;
+	char *seq = db_message_seq();
+	t = db_update("UPDATE %smessages SET status = %d, %s WHERE message_idnr = %llu", 
+			DBPFX, status, seq, message_idnr);
+	g_free(seq);
+	return t;
 }
 
 int db_delete_message(u64_t message_idnr)
@@ -1705,6 +2052,8 @@ int db_update_pop(ClientSession_t * session_ptr)
 	C c; volatile int t = DM_SUCCESS;
 	GList *messagelst = NULL;
 	u64_t user_idnr = 0;
+	volatile u64_t changed = 0;
+	char *seq = db_message_seq();
 	INIT_QUERY;
 
 	/* get first element in list */
@@ -1720,14 +2069,20 @@ int db_update_pop(ClientSession_t * session_ptr)
 				if (user_idnr == 0) user_idnr = db_get_useridnr(msg->realmessageid);
 
 				/* yes they need an update, do the query */
-				db_exec(c, "UPDATE %smessages set status=%d WHERE message_idnr=%llu AND status < %d",
-						DBPFX, msg->virtual_messagestatus, msg->realmessageid, 
+				db_exec(c, "UPDATE %smessages set status=%d, %s WHERE message_idnr=%llu AND status < %d",
+						DBPFX, msg->virtual_messagestatus, seq, msg->realmessageid, 
 						MESSAGE_STATUS_DELETE);
+				changed = msg->realmessageid;
 			}
 
 			if (! g_list_next(messagelst)) break;
 			messagelst = g_list_next(messagelst);
 		}
+		/* all messages in a pop3 session live in the same mailbox */
+		if (changed)
+			db_exec(c, "UPDATE %smailboxes SET seq=seq+1 WHERE mailbox_idnr="
+					"(SELECT mailbox_idnr FROM %smessages WHERE message_idnr=%llu)",
+					DBPFX, DBPFX, changed);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		t = DM_EQUERY;
@@ -1735,6 +2090,8 @@ int db_update_pop(ClientSession_t * session_ptr)
 		db_con_close(c);
 	END_TRY;
 
+	g_free(seq);
+
 	if (t == DM_EQUERY) return t;
 
 	/* because the status of some messages might have changed (for instance
@@ -2522,8 +2879,12 @@ int db_movemsg(u64_t mailbox_to, u64_t mailbox_from)
 	C c; volatile int t = DM_SUCCESS;
 	c = db_con_get();
 	TRY
-		db_exec(c, "UPDATE %smessages SET mailbox_idnr=%llu WHERE mailbox_idnr=%llu", 
-				DBPFX, mailbox_to, mailbox_from);
+		/* the rows arrive in mailbox_to with uids below its uidnext,
+		 * so they must carry its next seq to be noticed there */
+		db_exec(c, "UPDATE %smessages SET mailbox_idnr=%llu, "
+				"seq=(SELECT b.seq+1 FROM %smailboxes b WHERE b.mailbox_idnr=%llu) "
+				"WHERE mailbox_idnr=%llu", 
+				DBPFX, mailbox_to, DBPFX, mailbox_to, mailbox_from);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		t = DM_EQUERY;
@@ -2873,15 +3234,15 @@ static void db_set_msgkeywords(C c, u64_t msg_idnr, GList *keywords, int action_
 	}
 }
 
-int db_set_msgflag(u64_t msg_idnr, int *flags, GList *keywords, int action_type, MessageInfo *msginfo)
+/*
+ * build the SET clause for a flag change; the message is always stamped,
+ * keyword changes need announcing too
+ */
+static char * db_msgflag_clause(int *flags, int action_type, MessageInfo *msginfo)
 {
-	C c; int t = DM_SUCCESS;
-	size_t i, pos = 0;
-	volatile int seen = 0;
-	INIT_QUERY;
-
-	memset(query,0,DEF_QUERYSIZE);
-	pos += snprintf(query, DEF_QUERYSIZE, "UPDATE %smessages SET ", DBPFX);
+	GString *clause = g_string_new("");
+	char *frag;
+	size_t i;
 
 	for (i = 0; i < IMAP_NFLAGS; i++) {
 
@@ -2889,39 +3250,56 @@ int db_set_msgflag(u64_t msg_idnr, int *flags, GList *keywords, int action_type,
 		case IMAPFA_ADD:
 			if (flags[i]) {
 				if (msginfo && msginfo->flags) msginfo->flags[i] = 1;
-				pos += snprintf(query + pos, DEF_QUERYSIZE - pos, "%s%s=1", seen?",":"", db_flag_desc[i]); 
-				seen++;
+				g_string_append_printf(clause, "%s=1,", db_flag_desc[i]);
 			}
 			break;
 		case IMAPFA_REMOVE:
 			if (flags[i]) {
 				if (msginfo && msginfo->flags) msginfo->flags[i] = 0;
-				pos += snprintf(query + pos, DEF_QUERYSIZE - pos, "%s%s=0", seen?",":"", db_flag_desc[i]); 
-				seen++;
+				g_string_append_printf(clause, "%s=0,", db_flag_desc[i]);
 			}
 			break;
 
 		case IMAPFA_REPLACE:
+			// \Recent is not a client settable flag
+			if (i == IMAP_FLAG_RECENT)
+				break;
 			if (flags[i]) {
 				if (msginfo && msginfo->flags) msginfo->flags[i] = 1;
-				pos += snprintf(query + pos, DEF_QUERYSIZE - pos, "%s%s=1", seen?",":"", db_flag_desc[i]); 
+				g_string_append_printf(clause, "%s=1,", db_flag_desc[i]);
 			} else {
 				if (msginfo && msginfo->flags) msginfo->flags[i] = 0;
-				pos += snprintf(query + pos, DEF_QUERYSIZE - pos, "%s%s=0", seen?",":"", db_flag_desc[i]); 
+				g_string_append_printf(clause, "%s=0,", db_flag_desc[i]);
 			}
-			seen++;
 			break;
 		}
 	}
 
-	snprintf(query + pos, DEF_QUERYSIZE - pos,
-			" WHERE message_idnr = %llu AND status < %d",
-			msg_idnr, MESSAGE_STATUS_DELETE);
+	frag = db_message_seq();
+	g_string_append(clause, frag);
+	g_free(frag);
+
+	frag = clause->str;
+	g_string_free(clause, FALSE);
+
+	return frag;
+}
+
+int db_set_msgflag(u64_t msg_idnr, int *flags, GList *keywords, int action_type, MessageInfo *msginfo)
+{
+	C c; int t = DM_SUCCESS;
+	char *clause;
+	INIT_QUERY;
+
+	clause = db_msgflag_clause(flags, action_type, msginfo);
+	snprintf(query, DEF_QUERYSIZE, "UPDATE %smessages SET %s WHERE message_idnr = %llu AND status < %d",
+			DBPFX, clause, msg_idnr, MESSAGE_STATUS_DELETE);
+	g_free(clause);
 
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
-		if (seen) db_exec(c, query);
+		db_exec(c, query);
 		db_set_msgkeywords(c, msg_idnr, keywords, action_type, msginfo);
 		db_commit_transaction(c);
 	CATCH(SQLException)
@@ -2936,6 +3314,314 @@ int db_set_msgflag(u64_t msg_idnr, int *flags, GList *keywords, int action_type,
 	return DM_SUCCESS;
 }
 
+struct ranges_helper {
+	const char *column;
+	u64_t lo, hi;
+	GList *ranges;
+	GList *single;
+};
+
+static void ids_range_flush(struct ranges_helper *h)
+{
+	u64_t *id;
+	if (! h->lo) return;
+	if (h->lo == h->hi) {
+		id = g_new0(u64_t,1);
+		*id = h->lo;
+		h->single = g_list_prepend(h->single, id);
+	} else {
+		h->ranges = g_list_prepend(h->ranges, 
+				g_strdup_printf("%s BETWEEN %llu AND %llu", h->column, h->lo, h->hi));
+	}
+	h->lo = h->hi = 0;
+}
+
+static gboolean ids_range(u64_t *uid, gpointer UNUSED msn, struct ranges_helper *h)
+{
+	if (h->lo && (*uid != h->hi + 1))
+		ids_range_flush(h);
+	if (! h->lo)
+		h->lo = *uid;
+	h->hi = *uid;
+	return FALSE;
+}
+
+/*
+ * turn ids (uid -> msn) into WHERE fragments on column: a uid range for
+ * every run of consecutive uids, IN lists for the loners. Every uid a
+ * fragment matches is one of ids, so nothing the session hasn't seen
+ * is touched; callers still restrict them to the mailbox and to
+ * visible messages.
+ */
+static GList * db_ids_ranges(GTree *ids, const char *column)
+{
+	struct ranges_helper h;
+	GList *slices;
+
+	memset(&h, 0, sizeof(h));
+	h.column = column;
+	g_tree_foreach(ids, (GTraverseFunc)ids_range, &h);
+	ids_range_flush(&h);
+
+	if (h.single) {
+		h.single = g_list_reverse(h.single);
+		slices = g_list_first(g_list_slices_u64(h.single, 100));
+		while (slices) {
+			h.ranges = g_list_prepend(h.ranges, g_strdup_printf("%s IN (%s)", column, (char *)slices->data));
+			if (! g_list_next(slices)) break;
+			slices = g_list_next(slices);
+		}
+		g_list_destroy(slices);
+		g_list_destroy(h.single);
+	}
+
+	return g_list_reverse(h.ranges);
+}
+
+int db_set_msgflags(u64_t mailbox_idnr, GTree *ids, int *flags, GList *keywords, int action_type)
+{
+	C c; S s; volatile int t = DM_SUCCESS;
+	GList *ranges, *r, *k;
+	GString *inlist;
+	char *clause, *range;
+	const char *ignore = db_get_sql(SQL_IGNORE);
+	int i, n;
+
+	if (! (ranges = db_ids_ranges(ids, "message_idnr")))
+		return DM_SUCCESS;
+
+	clause = db_msgflag_clause(flags, action_type, NULL);
+
+	n = g_list_length(keywords);
+	inlist = g_string_new("");
+	for (i = 0; i < n; i++)
+		g_string_append_printf(inlist, "%s?", i ? "," : "");
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		r = ranges;
+		while (r) {
+			range = (char *)r->data;
+
+			db_exec(c, "UPDATE %smessages SET %s WHERE mailbox_idnr = %llu AND status < %d AND %s",
+					DBPFX, clause, mailbox_idnr, MESSAGE_STATUS_DELETE, range);
+
+			if (action_type == IMAPFA_REPLACE) {
+				db_exec(c, "DELETE FROM %skeywords WHERE message_idnr IN "
+						"(SELECT message_idnr FROM %smessages WHERE mailbox_idnr = %llu AND status < %d AND %s)",
+						DBPFX, DBPFX, mailbox_idnr, MESSAGE_STATUS_DELETE, range);
+			} else if (n && action_type == IMAPFA_REMOVE) {
+				s = db_stmt_prepare(c, "DELETE FROM %skeywords WHERE keyword IN (%s) AND message_idnr IN "
+						"(SELECT message_idnr FROM %smessages WHERE mailbox_idnr = %llu AND status < %d AND %s)",
+						DBPFX, inlist->str, DBPFX, mailbox_idnr, MESSAGE_STATUS_DELETE, range);
+				i = 1;
+				k = g_list_first(keywords);
+				while (k) {
+					db_stmt_set_str(s, i++, (char *)k->data);
+					if (! g_list_next(k)) break;
+					k = g_list_next(k);
+				}
+				db_stmt_exec(s);
+			}
+
+			if (n && (action_type == IMAPFA_ADD || action_type == IMAPFA_REPLACE)) {
+				s = db_stmt_prepare(c, "INSERT %s INTO %skeywords (message_idnr, keyword) "
+						"SELECT message_idnr, ? FROM %smessages "
+						"WHERE mailbox_idnr = %llu AND status < %d AND %s AND NOT EXISTS "
+						"(SELECT 1 FROM %skeywords k WHERE k.message_idnr = %smessages.message_idnr AND k.keyword = ?)",
+						ignore, DBPFX, DBPFX, mailbox_idnr, MESSAGE_STATUS_DELETE, range,
+						DBPFX, DBPFX);
+				k = g_list_first(keywords);
+				while (k) {
+					db_stmt_set_str(s, 1, (char *)k->data);
+					db_stmt_set_str(s, 2, (char *)k->data);
+					db_stmt_exec(s);
+					if (! g_list_next(k)) break;
+					k = g_list_next(k);
+				}
+			}
+
+			if (! g_list_next(r)) break;
+			r = g_list_next(r);
+		}
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_list_destroy(ranges);
+	g_string_free(inlist, TRUE);
+	g_free(clause);
+
+	return t;
+}
+
+/*
+ * copies are inserted with a temporary unique_id of '<token>:<source message_idnr>'
+ * so the new ids and keywords can be matched with their source afterwards. The tag
+ * is replaced by a regular unique_id before the copy is committed.
+ */
+static gboolean copymsgs_tag(const char *unique_id, const char *token, u64_t *source)
+{
+	size_t l = strlen(token);
+	if (strncmp(unique_id, token, l) || unique_id[l] != ':')
+		return FALSE;
+	*source = strtoull(unique_id + l + 1, NULL, 10);
+	return (*source > 0);
+}
+
+int db_copymsgs(u64_t mailbox_from, GTree *ids, u64_t mailbox_to, u64_t user_idnr, GTree **newids)
+{
+	C c; R r; S s; volatile int t = DM_SUCCESS;
+	GList *ranges, *kranges, *l, *kl;
+	volatile u64_t size = 0;
+	u64_t source, *k, *v;
+	int valid;
+	char token[UID_SIZE], unique_id[UID_SIZE], *tag;
+	field_t copy_uid, copy_key;
+
+	*newids = NULL;
+
+	if (! (ranges = db_ids_ranges(ids, "message_idnr")))
+		return DM_SUCCESS;
+	kranges = db_ids_ranges(ids, "k.message_idnr");
+
+	/* Get the size of the messages to be copied. */
+	c = db_con_get();
+	TRY
+		l = g_list_first(ranges);
+		while (l) {
+			r = db_query(c, "SELECT COALESCE(SUM(p.messagesize),0) FROM %smessages "
+					"LEFT JOIN %sphysmessage p ON p.id = physmessage_id "
+					"WHERE mailbox_idnr = %llu AND status < %d AND %s",
+					DBPFX, DBPFX, mailbox_from, MESSAGE_STATUS_DELETE, (char *)l->data);
+			if (db_result_next(r))
+				size += db_result_get_u64(r, 0);
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY) {
+		g_list_destroy(ranges);
+		g_list_destroy(kranges);
+		return t;
+	}
+
+	/* Check to see if the user has room for the messages. */
+	if ((valid = dm_quota_user_validate(user_idnr, size)) != TRUE) {
+		g_list_destroy(ranges);
+		g_list_destroy(kranges);
+		if (valid == DM_EQUERY)
+			return DM_EQUERY;
+		TRACE(TRACE_INFO, "user [%llu] would exceed quotum", user_idnr);
+		return -2;
+	}
+
+	memset(token, 0, sizeof(token));
+	create_unique_id(token, mailbox_to);
+	tag = g_strdup_printf("'%s:'", token);
+	snprintf(copy_uid, sizeof(field_t), db_get_sql(SQL_CONCAT), tag, "message_idnr");
+	snprintf(copy_key, sizeof(field_t), db_get_sql(SQL_CONCAT), tag, "k.message_idnr");
+	g_free(tag);
+
+	*newids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free,(GDestroyNotify)g_free);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+
+		/* Copy the message table entries of the messages. */
+		l = g_list_first(ranges);
+		while (l) {
+			db_exec(c, "INSERT INTO %smessages ("
+				"mailbox_idnr,physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,recent_flag,draft_flag,unique_id,status)"
+				" SELECT %llu,physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,1,draft_flag,%s,status"
+				" FROM %smessages WHERE mailbox_idnr = %llu AND status < %d AND %s",
+				DBPFX, mailbox_to, copy_uid, DBPFX, mailbox_from, MESSAGE_STATUS_DELETE, (char *)l->data);
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+
+		/* map the copies onto their source */
+		r = db_query(c, "SELECT message_idnr, unique_id FROM %smessages "
+				"WHERE mailbox_idnr = %llu AND unique_id LIKE '%s:%%'",
+				DBPFX, mailbox_to, token);
+		while (db_result_next(r)) {
+			if (! copymsgs_tag(db_result_get(r, 1), token, &source))
+				continue;
+			k = g_new0(u64_t,1);
+			v = g_new0(u64_t,1);
+			*k = source;
+			*v = db_result_get_u64(r, 0);
+			g_tree_insert(*newids, k, v);
+		}
+
+		/* Copy the message keywords, joined on the tags */
+		l = g_list_first(kranges);
+		while (l) {
+			db_exec(c, "INSERT INTO %skeywords (message_idnr, keyword) "
+				"SELECT m.message_idnr, k.keyword FROM %skeywords k "
+				"JOIN %smessages m ON m.unique_id = %s "
+				"WHERE m.mailbox_idnr = %llu AND %s",
+				DBPFX, DBPFX, DBPFX, copy_key, mailbox_to, (char *)l->data);
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+
+		/* replace the temporary tags */
+		s = db_stmt_prepare(c, "UPDATE %smessages SET unique_id = ? WHERE message_idnr = ?", DBPFX);
+		kl = g_list_first(g_tree_values(*newids));
+		l = kl;
+		while (l) {
+			v = (u64_t *)l->data;
+			memset(unique_id, 0, sizeof(unique_id));
+			create_unique_id(unique_id, *v);
+			db_stmt_set_str(s, 1, unique_id);
+			db_stmt_set_u64(s, 2, *v);
+			db_stmt_exec(s);
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+		g_list_free(kl);
+
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_list_destroy(ranges);
+	g_list_destroy(kranges);
+
+	if (t == DM_EQUERY) {
+		g_tree_destroy(*newids);
+		*newids = NULL;
+		return t;
+	}
+
+	db_mailbox_seq_update(mailbox_to);
+
+	/* update quotum */
+	if (! dm_quota_user_inc(user_idnr, size))
+		return DM_EQUERY;
+
+	return DM_SUCCESS;
+}
+
 static int db_acl_has_acl(u64_t userid, u64_t mboxid)
 {
 	C c; R r; volatile int t = FALSE;
@@ -3533,10 +4219,130 @@ int db_user_log_login(u64_t user_idnr)
 	return db_update("UPDATE %susers SET last_login = '%s' WHERE user_idnr = %llu",DBPFX, timestring, user_idnr);
 }
 
+/*
+ * Changed messages are stamped with the seq their mailbox will have after
+ * the db_mailbox_seq_update that announces the change. MailboxState_update
+ * then only needs the rows stamped at or beyond the seq it last saw.
+ */
+char * db_message_seq(void)
+{
+	return g_strdup_printf("seq=(SELECT b.seq+1 FROM %smailboxes b "
+			"WHERE b.mailbox_idnr=%smessages.mailbox_idnr)", DBPFX, DBPFX);
+}
+
+/*
+ * a process can register a listener to hear about every mailbox whose seq
+ * it bumps itself; changes made by other processes only show up in the
+ * database, see db_getmailbox_seqs.
+ */
+static void (*mailbox_seq_listener)(u64_t) = NULL;
+
+void db_mailbox_seq_listen(void (*listener)(u64_t mailbox_id))
+{
+	mailbox_seq_listener = listener;
+}
+
 int db_mailbox_seq_update(u64_t mailbox_id)
 {
-	return db_update("UPDATE %s %smailboxes SET seq=seq+1 WHERE mailbox_idnr=%llu", 
+	int result = db_update("UPDATE %s %smailboxes SET seq=seq+1 WHERE mailbox_idnr=%llu", 
 		db_get_sql(SQL_IGNORE), DBPFX, mailbox_id);
+
+	if ((result != DM_EQUERY) && mailbox_seq_listener)
+		mailbox_seq_listener(mailbox_id);
+
+	return result;
+}
+
+/*
+ * shared generations
+ *
+ * caches are kept per process, so they don't see changes made by other
+ * processes. Whoever changes users, aliases or sieve scripts bumps the
+ * counter of that name in the generations table; a cache that finds the
+ * counter moved drops its entries.
+ */
+int db_generation_get(const char *name, u64_t *generation)
+{
+	C c; R r; S s; volatile int t = DM_SUCCESS;
+
+	*generation = 0;
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT generation FROM %sgenerations WHERE name = ?", DBPFX);
+		db_stmt_set_str(s, 1, name);
+		r = db_stmt_query(s);
+		if (db_result_next(r))
+			*generation = db_result_get_u64(r, 0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+int db_generation_bump(const char *name)
+{
+	C c; S s; volatile int t = DM_SUCCESS;
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "UPDATE %sgenerations SET generation = generation + 1 WHERE name = ?", DBPFX);
+		db_stmt_set_str(s, 1, name);
+		db_stmt_exec(s);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+/*
+ * look up the current seq of every mailbox in seqs (u64_t mailbox_idnr keys
+ * mapping to u64_t seq values), updating the values in place.
+ */
+int db_getmailbox_seqs(GTree *seqs)
+{
+	C c; R r; volatile int t = DM_SUCCESS;
+	GList *ids, *slices, *l;
+	u64_t id, *seq;
+
+	if (! g_tree_nnodes(seqs))
+		return DM_SUCCESS;
+
+	ids = g_tree_keys(seqs);
+	slices = g_list_slices_u64(ids, 100);
+	g_list_free(g_list_first(ids));
+
+	c = db_con_get();
+	TRY
+		l = g_list_first(slices);
+		while (l) {
+			r = db_query(c, "SELECT mailbox_idnr, seq FROM %smailboxes WHERE mailbox_idnr IN (%s)",
+					DBPFX, (gchar *)l->data);
+			while (db_result_next(r)) {
+				id = db_result_get_u64(r, 0);
+				if ((seq = g_tree_lookup(seqs, &id)))
+					*seq = db_result_get_u64(r, 1);
+			}
+			l = g_list_next(l);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_list_destroy(slices);
+
+	return t;
 }
 
 int db_rehash_store(void)
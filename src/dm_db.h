@@ -61,9 +61,15 @@ int db_connect(void);
  */
 int db_check_version(void);
 
-/* get a connection from the pool */
+/* get a connection from the pool, waiting at most max_db_wait seconds
+ * for one to be returned. Throws SQLException when none comes free,
+ * which fails the current command. */
 C db_con_get(void);
 
+/* connection wait times: <1ms <10ms <100ms <1s <10s >=10s */
+#define DB_CON_WAIT_BUCKETS 6
+void db_con_stats(u64_t histogram[DB_CON_WAIT_BUCKETS], u64_t *saturated, u64_t *timeouts);
+
 gboolean dm_db_ping(void);
 void db_con_close(C c);
 void db_con_clear(C c);
@@ -84,6 +90,9 @@ int db_stmt_set_blob(S stmt, int index, const void *x, int size);
 gboolean db_stmt_exec(S stmt);
 R db_stmt_query(S stmt);
 
+/* prepared statement cache hits and misses since startup */
+void db_stmt_cache_stats(u64_t *hits, u64_t *misses);
+
 /**
  * \brief execute a database query
  * \param the_query the SQL query to execute
@@ -387,6 +396,8 @@ int db_update_rfcsize(GList *lost);
 
 int db_icheck_envelope(GList **lost);
 int db_set_envelope(GList *lost);
+int db_icheck_sortkeys(GList **lost);
+int db_set_sortkeys(GList *lost);
 
 /**
  * \brief set status of a message
@@ -609,6 +620,21 @@ int db_movemsg(u64_t mailbox_to, u64_t mailbox_from);
 int db_copymsg(u64_t msg_idnr, u64_t mailbox_to,
 	       u64_t user_idnr, u64_t * newmsg_idnr);
 
+/**
+ * \brief copy a set of messages to a mailbox in one transaction
+ * \param mailbox_from mailbox holding the messages
+ * \param ids tree of uid to msn, see dbmail_mailbox_get_set
+ * \param mailbox_to mailbox to copy to
+ * \param user_idnr user to copy the messages for.
+ * \param newids on success a tree of source uid to new uid
+ * \return 
+ * 		- -2 if the quotum is exceeded
+ * 		- -1 on failure
+ * 		- 0 on success
+ */
+int db_copymsgs(u64_t mailbox_from, GTree *ids, u64_t mailbox_to,
+		u64_t user_idnr, GTree **newids);
+
 /**
  * \brief check if mailbox already holds message with message-id
  * \param mailbox_idnr
@@ -690,6 +716,18 @@ int db_get_msgflag(const char *flag_name, u64_t msg_idnr);
  */
 int db_set_msgflag(u64_t msg_idnr, int *flags, GList *keywords, int action_type, MessageInfo *msginfo);
 
+/**
+ * \brief set flags and keywords for a set of messages in one transaction
+ * \param mailbox_idnr mailbox holding the messages
+ * \param ids tree of uid to msn, see dbmail_mailbox_get_set. Runs of
+ *        consecutive msns are updated as one uid range.
+ * \param flags, keywords, action_type see db_set_msgflag
+ * \return 
+ * 		- -1 on failure
+ * 		-  0 on success
+ */
+int db_set_msgflags(u64_t mailbox_idnr, GTree *ids, int *flags, GList *keywords, int action_type);
+
 /**
  * \brief set one right in an acl for a user
  * \param userid id of user
@@ -760,7 +798,18 @@ int db_replycache_unregister(const char *to, const char *from, const char *handl
 const char * db_get_sql(sql_fragment_t frag);
 char * db_returning(const char *s);
 
+/* SET clause stamping a dbmail_messages row for incremental state refreshes */
+char * db_message_seq(void);
 int db_mailbox_seq_update(u64_t mailbox_id);
+/* called with the mailbox_idnr after each successful db_mailbox_seq_update */
+void db_mailbox_seq_listen(void (*listener)(u64_t mailbox_id));
+/* refresh the seq values in a tree of mailbox_idnr to seq */
+int db_getmailbox_seqs(GTree *seqs);
+
+/* counters in the generations table ("auth", "sieve") that tell
+ * the caches of other processes to drop what they have */
+int db_generation_get(const char *name, u64_t *generation);
+int db_generation_bump(const char *name);
 
 int db_rehash_store(void);
 
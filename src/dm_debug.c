@@ -34,6 +34,7 @@ char		hostname[16];
 /* the debug variables */
 static trace_t TRACE_SYSLOG = TRACE_EMERG | TRACE_ALERT | TRACE_CRIT | TRACE_ERR | TRACE_WARNING;  /* default: emerg, alert, crit, err, warning */
 static trace_t TRACE_STDERR = TRACE_EMERG | TRACE_ALERT | TRACE_CRIT | TRACE_ERR | TRACE_WARNING;  /* default: emerg, alert, crit, err, warning */
+static gboolean TRACE_JSON = FALSE;
 
 /*
  * configure the debug settings
@@ -44,6 +45,14 @@ void configure_debug(trace_t trace_syslog, trace_t trace_stderr)
 	TRACE_STDERR = trace_stderr;
 }
 
+/*
+ * write stderr lines as json objects instead of plain text
+ */
+void configure_debug_json(gboolean json)
+{
+	TRACE_JSON = json;
+}
+
 /* Make sure that these match trace_t. */
 void null_logger(const char UNUSED *log_domain, GLogLevelFlags UNUSED log_level, const char UNUSED *message, gpointer UNUSED data)
 {
@@ -67,6 +76,333 @@ static const char * trace_to_text(trace_t level)
 	return trace_text[ilogb((double) level)];
 }
 
+/*
+ * asynchronous logging
+ *
+ * once trace_start_flusher has been called, trace() no longer writes
+ * anything itself. Until then, and in programs that never call it, all
+ * messages are written synchronously. Servers start the flusher after
+ * daemonizing, so a fork never leaves it behind.
+ * Each thread formats its messages into a ring of its own, and a single
+ * flusher thread writes them to stderr and syslog. A ring has only one
+ * writer and one reader, so the head and tail counters are all the
+ * synchronisation they need. When a ring is full the message is dropped
+ * and counted; the flusher reports the number of dropped messages.
+ *
+ * Fatal messages are written synchronously, after flushing the rings.
+ */
+
+#define TRACE_RING_SIZE 256		/* messages per thread */
+#define TRACE_MESSAGE_SIZE 512		/* longer messages are allocated */
+#define TRACE_FLUSH_INTERVAL 50000	/* microseconds */
+
+typedef struct {
+	trace_t level;
+	gboolean to_stderr, to_syslog;
+	time_t time;
+	const char *module;
+	const char *function;
+	int line;
+	gpointer thread;
+	char *message;			/* points to buffer, or allocated */
+	char buffer[TRACE_MESSAGE_SIZE];
+} trace_entry_t;
+
+typedef struct {
+	trace_entry_t entries[TRACE_RING_SIZE];
+	gint head;			/* written by the owning thread */
+	gint tail;			/* written by the flusher */
+	gint dropped;			/* written by the owning thread */
+	gint reported;			/* written by the flusher */
+	gint orphan;			/* owning thread has exited */
+	gpointer thread;
+} trace_ring_t;
+
+static GStaticMutex rings_lock = G_STATIC_MUTEX_INIT;
+static GStaticPrivate ring_key = G_STATIC_PRIVATE_INIT;
+static GList *rings = NULL;
+static gint flusher = 0;
+
+static void trace_format(trace_entry_t *E, trace_t level, const char *module, const char *function, int line, const char *formatstring, va_list ap)
+{
+	va_list cp;
+	int l;
+
+	E->level = level;
+	E->to_stderr = (level & TRACE_STDERR) ? TRUE : FALSE;
+	E->to_syslog = (level & TRACE_SYSLOG) ? TRUE : FALSE;
+	E->time = time(NULL);
+	E->module = module;
+	E->function = function;
+	E->line = line;
+	E->thread = g_thread_self();
+
+	va_copy(cp, ap);
+	l = g_vsnprintf(E->buffer, sizeof(E->buffer), formatstring, cp);
+	va_end(cp);
+
+	if (l < (int)sizeof(E->buffer)) {
+		E->message = E->buffer;
+	} else {
+		va_copy(cp, ap);
+		E->message = g_strdup_vprintf(formatstring, cp);
+		va_end(cp);
+		l = strlen(E->message);
+	}
+
+	if (l > 0 && E->message[l-1] == '\n')
+		E->message[l-1] = '\0';
+}
+
+static void trace_entry_clear(trace_entry_t *E)
+{
+	if (E->message != E->buffer)
+		g_free(E->message);
+	E->message = NULL;
+}
+
+/* timestamps only change once a second, so only format them that often */
+static const char * trace_date(time_t now, gboolean iso)
+{
+	static time_t cached[2] = { 0, 0 };
+	static char date[2][32];
+	struct tm tmp;
+
+	if (cached[iso] != now) {
+		memset(date[iso],0,sizeof(date[iso]));
+		localtime_r(&now, &tmp);
+		strftime(date[iso],32,iso ? "%Y-%m-%dT%H:%M:%S%z" : "%b %d %H:%M:%S", &tmp);
+		cached[iso] = now;
+	}
+	return date[iso];
+}
+
+static void trace_json_string(GString *s, const char *value)
+{
+	const unsigned char *c;
+
+	g_string_append_c(s, '"');
+	for (c = (const unsigned char *)value; *c; c++) {
+		switch (*c) {
+			case '"': g_string_append(s, "\\\""); break;
+			case '\\': g_string_append(s, "\\\\"); break;
+			case '\n': g_string_append(s, "\\n"); break;
+			case '\r': g_string_append(s, "\\r"); break;
+			case '\t': g_string_append(s, "\\t"); break;
+			default:
+				if (*c < 0x20)
+					g_string_append_printf(s, "\\u%04x", *c);
+				else
+					g_string_append_c(s, *c);
+				break;
+		}
+	}
+	g_string_append_c(s, '"');
+}
+
+#define SYSLOGFORMAT "[%p] %s:[%s] %s(+%d): %s"
+#define STDERRFORMAT "%s %s %s[%d]: [%p] %s:[%s] %s(+%d): %s\n"
+
+static void trace_stderr(trace_entry_t *E)
+{
+	static int configured=0;
+
+	if (! configured) {
+		memset(hostname,'\0',sizeof(hostname));
+		gethostname(hostname,15);
+		configured=1;
+	}
+
+	if (TRACE_JSON) {
+		GString *s = g_string_new("{\"time\":");
+		trace_json_string(s, trace_date(E->time, TRUE));
+		g_string_append(s, ",\"host\":");
+		trace_json_string(s, hostname);
+		g_string_append(s, ",\"program\":");
+		trace_json_string(s, __progname?__progname:"");
+		g_string_append_printf(s, ",\"pid\":%d,\"thread\":\"%p\",\"level\":", getpid(), E->thread);
+		trace_json_string(s, trace_to_text(E->level));
+		g_string_append(s, ",\"module\":");
+		trace_json_string(s, E->module);
+		g_string_append(s, ",\"function\":");
+		trace_json_string(s, E->function);
+		g_string_append_printf(s, ",\"line\":%d,\"message\":", E->line);
+		trace_json_string(s, E->message);
+		g_string_append(s, "}\n");
+		fputs(s->str, stderr);
+		g_string_free(s, TRUE);
+	} else {
+		fprintf(stderr, STDERRFORMAT, trace_date(E->time, FALSE), hostname, __progname?__progname:"", getpid(), 
+			E->thread, trace_to_text(E->level), E->module, E->function, E->line, E->message);
+	}
+}
+
+static void trace_syslog(trace_entry_t *E)
+{
+	trace_t syslog_level;
+
+	/* Convert our extended log levels (>128) to syslog levels */
+	switch((int)ilogb((double) E->level))
+	{
+		case 0:
+			syslog_level = LOG_EMERG;
+			break;
+		case 1:
+			syslog_level = LOG_ALERT;
+			break;
+		case 2:
+			syslog_level = LOG_CRIT;
+			break;
+		case 3:
+			syslog_level = LOG_ERR;
+			break;
+		case 4:
+			syslog_level = LOG_WARNING;
+			break;
+		case 5:
+			syslog_level = LOG_NOTICE;
+			break;
+		case 6:
+			syslog_level = LOG_INFO;
+			break;
+		case 7:
+			syslog_level = LOG_DEBUG;
+			break;
+		case 8:
+			syslog_level = LOG_DEBUG;
+			break;
+		default:
+			syslog_level = LOG_DEBUG;
+			break;
+	}
+	syslog(syslog_level, SYSLOGFORMAT, E->thread, trace_to_text(E->level), E->module, E->function, E->line, E->message);
+}
+
+static void trace_write(trace_entry_t *E)
+{
+	if (E->to_stderr)
+		trace_stderr(E);
+
+	if (E->to_syslog) {
+		size_t maxlen=120;
+		if (strlen(E->message) > maxlen)
+			E->message[maxlen] = '\0';
+		trace_syslog(E);
+	}
+}
+
+/* write all queued messages; caller holds rings_lock */
+static void trace_drain(void)
+{
+	GList *l = g_list_first(rings);
+	gboolean written = FALSE;
+
+	while (l) {
+		trace_ring_t *R = (trace_ring_t *)l->data;
+		gint head = g_atomic_int_get(&R->head);
+		gint dropped = g_atomic_int_get(&R->dropped);
+		GList *next = g_list_next(l);
+
+		while (R->tail != head) {
+			trace_entry_t *E = &R->entries[(guint)R->tail % TRACE_RING_SIZE];
+			trace_write(E);
+			trace_entry_clear(E);
+			g_atomic_int_set(&R->tail, (gint)((guint)R->tail + 1));
+			written = TRUE;
+		}
+
+		if (dropped != R->reported) {
+			trace_entry_t E;
+			memset(&E, 0, sizeof(E));
+			E.level = TRACE_WARNING;
+			E.to_stderr = (TRACE_WARNING & TRACE_STDERR) ? TRUE : FALSE;
+			E.to_syslog = (TRACE_WARNING & TRACE_SYSLOG) ? TRUE : FALSE;
+			E.time = time(NULL);
+			E.module = "debug";
+			E.function = __func__;
+			E.line = __LINE__;
+			E.thread = R->thread;
+			g_snprintf(E.buffer, sizeof(E.buffer), "log overload: dropped [%u] messages", 
+					(guint)dropped - (guint)R->reported);
+			E.message = E.buffer;
+			trace_write(&E);
+			R->reported = dropped;
+			written = TRUE;
+		}
+
+		if (g_atomic_int_get(&R->orphan) && R->tail == g_atomic_int_get(&R->head)) {
+			rings = g_list_delete_link(rings, l);
+			g_free(R);
+		}
+
+		l = next;
+	}
+
+	if (written)
+		fflush(stderr);
+}
+
+static void trace_flush(void)
+{
+	g_static_mutex_lock(&rings_lock);
+	trace_drain();
+	g_static_mutex_unlock(&rings_lock);
+}
+
+static gpointer trace_flusher(gpointer data UNUSED)
+{
+	while (TRUE) {
+		g_usleep(TRACE_FLUSH_INTERVAL);
+		trace_flush();
+	}
+	return NULL;
+}
+
+static void trace_ring_orphan(gpointer data)
+{
+	trace_ring_t *R = (trace_ring_t *)data;
+	g_atomic_int_set(&R->orphan, 1);
+}
+
+void trace_start_flusher(void)
+{
+	GError *err = NULL;
+
+	g_static_mutex_lock(&rings_lock);
+	if (! g_atomic_int_get(&flusher)) {
+		if (g_thread_create((GThreadFunc)trace_flusher, NULL, FALSE, &err)) {
+			atexit(trace_flush);
+			g_atomic_int_set(&flusher, 1);
+		} else {
+			fprintf(stderr, "trace: flusher thread creation failed [%s]\n", err->message);
+			g_error_free(err);
+		}
+	}
+	g_static_mutex_unlock(&rings_lock);
+}
+
+/* the ring of the calling thread, NULL while logging synchronously */
+static trace_ring_t * trace_ring(void)
+{
+	trace_ring_t *R;
+
+	if (! g_atomic_int_get(&flusher))
+		return NULL;
+
+	if ((R = g_static_private_get(&ring_key)))
+		return R;
+
+	g_static_mutex_lock(&rings_lock);
+	R = g_new0(trace_ring_t, 1);
+	R->thread = g_thread_self();
+	rings = g_list_prepend(rings, R);
+	g_static_mutex_unlock(&rings_lock);
+
+	g_static_private_set(&ring_key, R, trace_ring_orphan);
+
+	return R;
+}
+
 /* Call me like this:
  *
  * TRACE(TRACE_ERR, "Something happened with error code [%d]", resultvar);
@@ -78,98 +414,44 @@ static const char * trace_to_text(trace_t level)
  *
  */
 
-#define SYSLOGFORMAT "[%p] %s:[%s] %s(+%d): %s"
-#define STDERRFORMAT "%s %s %s[%d]: [%p] %s:[%s] %s(+%d): %s"
 void trace(trace_t level, const char * module, const char * function, int line, const char *formatstring, ...)
 {
-	trace_t syslog_level;
-	va_list ap, cp;
-
-	gchar *message = NULL;
-	static int configured=0;
-	size_t l, maxlen=120;
+	trace_ring_t *R;
+	trace_entry_t E;
+	va_list ap;
 
 	/* Return now if we're not logging anything. */
 	if ( !(level & TRACE_STDERR) && !(level & TRACE_SYSLOG))
 		return;
 
 	va_start(ap, formatstring);
-	va_copy(cp, ap);
-	message = g_strdup_vprintf(formatstring, cp);
-	va_end(cp);
 
-	l = strlen(message);
-	
-	if (message[l] == '\n')
-		message[l] = '\0';
-
-	if (level & TRACE_STDERR) {
-		time_t now = time(NULL);
-		struct tm tmp;
-		char date[32];
-
- 		if (! configured) {
- 			memset(hostname,'\0',sizeof(hostname));
- 			gethostname(hostname,15);
- 			configured=1;
- 		}
- 
-		memset(date,0,sizeof(date));
-		localtime_r(&now, &tmp);
-		strftime(date,32,"%b %d %H:%M:%S", &tmp);
+	if ((level != TRACE_EMERG) && (R = trace_ring())) {
+		gint head = R->head;
+		if ((guint)head - (guint)g_atomic_int_get(&R->tail) >= TRACE_RING_SIZE) {
+			g_atomic_int_set(&R->dropped, (gint)((guint)R->dropped + 1));
+		} else {
+			trace_format(&R->entries[(guint)head % TRACE_RING_SIZE], level, module, function, line, formatstring, ap);
+			g_atomic_int_set(&R->head, (gint)((guint)head + 1));
+		}
+		va_end(ap);
+		return;
+	}
 
- 		fprintf(stderr, STDERRFORMAT, date, hostname, __progname?__progname:"", getpid(), 
-			g_thread_self(), trace_to_text(level), module, function, line, message);
- 
-		if (message[l] != '\n')
-			fprintf(stderr, "\n");
+	trace_format(&E, level, module, function, line, formatstring, ap);
+	va_end(ap);
+
+	/* keep the order with anything still queued */
+	g_static_mutex_lock(&rings_lock);
+	trace_drain();
+	trace_write(&E);
+	if (E.to_stderr)
 		fflush(stderr);
-	}
+	g_static_mutex_unlock(&rings_lock);
 
-	if (level & TRACE_SYSLOG) {
-		/* Convert our extended log levels (>128) to syslog levels */
-		switch((int)ilogb((double) level))
-		{
-			case 0:
-				syslog_level = LOG_EMERG;
-				break;
-			case 1:
-				syslog_level = LOG_ALERT;
-				break;
-			case 2:
-				syslog_level = LOG_CRIT;
-				break;
-			case 3:
-				syslog_level = LOG_ERR;
-				break;
-			case 4:
-				syslog_level = LOG_WARNING;
-				break;
-			case 5:
-				syslog_level = LOG_NOTICE;
-				break;
-			case 6:
-				syslog_level = LOG_INFO;
-				break;
-			case 7:
-				syslog_level = LOG_DEBUG;
-				break;
-			case 8:
-				syslog_level = LOG_DEBUG;
-				break;
-			default:
-				syslog_level = LOG_DEBUG;
-				break;
-		}
-		size_t w = min(l,maxlen);
-		message[w] = '\0';
-		syslog(syslog_level, SYSLOGFORMAT, g_thread_self(), trace_to_text(level), module, function, line, message);
-	}
-	g_free(message);
+	trace_entry_clear(&E);
 
 	/* Bail out on fatal errors. */
 	if (level == TRACE_EMERG)
 		exit(EX_TEMPFAIL);
 }
-
-
@@ -58,5 +58,9 @@ void trace(trace_t level, const char * module, const char * function, int line,
 
 void configure_debug(trace_t trace_syslog, trace_t trace_stderr);
 
+/* switch to asynchronous logging; call after daemonizing */
+void trace_start_flusher(void);
+void configure_debug_json(gboolean json);
+
 void null_logger(const char UNUSED *log_domain, GLogLevelFlags UNUSED log_level, const char UNUSED *message, gpointer UNUSED data);
 #endif
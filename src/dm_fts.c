@@ -0,0 +1,469 @@
+/*
+ Copyright (c) 2004-2011 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or 
+ modify it under the terms of the GNU General Public License 
+ as published by the Free Software Foundation; either 
+ version 2 of the License, or (at your option) any later 
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ 
+*/
+
+#include "dbmail.h"
+
+#define THIS_MODULE "fts"
+
+#define FTS_TERM_MIN 2		// shorter words are not indexed
+#define FTS_TERM_MAX 32		// longer words are truncated, matching the column
+#define FTS_TERMS_MAX 10000	// per message
+#define FTS_BATCH 100
+
+/* every indexed message gets this term, so messages without any
+ * words in them aren't picked up by dbmail-util again */
+#define FTS_INDEXED "."
+
+extern db_param_t _db_params;
+#define DBPFX _db_params.pfx
+
+static fts_driver_t fts_sql;
+
+static fts_driver_t *fts = NULL;
+static gboolean fts_loaded = FALSE;
+
+static void fts_load_driver(void)
+{
+	if (fts_loaded)
+		return;
+
+	if (MATCH(_db_params.ftsdriver, "sql"))
+		fts = &fts_sql;
+	else if (strlen(_db_params.ftsdriver))
+		TRACE(TRACE_ERR, "ftsdriver [%s] not supported. Full-text index disabled", 
+				_db_params.ftsdriver);
+
+	if (fts)
+		TRACE(TRACE_DEBUG, "full-text index using [%s]", fts->name);
+
+	fts_loaded = TRUE;
+}
+
+gboolean dm_fts_enabled(void)
+{
+	fts_load_driver();
+	return fts ? TRUE : FALSE;
+}
+
+/*
+ * tokenizer
+ */
+
+static gboolean is_term_char(unsigned char c)
+{
+	return (g_ascii_isalnum(c) || c >= 0x80);
+}
+
+GList * dm_fts_terms(const char *text, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)text, *end = p + len, *start;
+	GTree *seen;
+	GList *terms;
+	char *word, *term, *e;
+	int count = 0;
+
+	seen = g_tree_new((GCompareFunc)strcmp);
+
+	while (p < end && count < FTS_TERMS_MAX) {
+		while (p < end && ! is_term_char(*p))
+			p++;
+		start = p;
+		while (p < end && is_term_char(*p))
+			p++;
+
+		if ((size_t)(p - start) < FTS_TERM_MIN)
+			continue;
+
+		word = g_strndup((const char *)start, p - start);
+		if (! g_utf8_validate(word, -1, NULL)) {
+			g_free(word);
+			continue;
+		}
+		term = g_utf8_strdown(word, -1);
+		g_free(word);
+
+		if (strlen(term) > FTS_TERM_MAX) {
+			e = term + FTS_TERM_MAX;
+			if ((*e & 0xC0) == 0x80) // don't split a character
+				e = g_utf8_find_prev_char(term, e);
+			*e = '\0';
+		}
+
+		if (g_tree_lookup(seen, term)) {
+			g_free(term);
+			continue;
+		}
+		g_tree_insert(seen, term, term);
+		count++;
+	}
+
+	terms = g_tree_keys(seen);
+	g_tree_destroy(seen);
+
+	return terms;
+}
+
+/* 
+ * collect the decoded text of all text/ parts
+ */
+static void fts_part_text(GMimeObject UNUSED *parent, GMimeObject *part, gpointer data)
+{
+	GString *text = (GString *)data;
+	GMimeContentType *type;
+	GMimeDataWrapper *wrapper;
+	GMimeStream *stream;
+	GByteArray *buf;
+	char *raw, *utf8;
+
+	if (! GMIME_IS_PART(part))
+		return;
+
+	type = g_mime_object_get_content_type(part);
+	if (! g_mime_content_type_is_type(type, "text", "*"))
+		return;
+
+	if (! (wrapper = g_mime_part_get_content_object(GMIME_PART(part))))
+		return;
+
+	stream = g_mime_stream_mem_new();
+	g_mime_data_wrapper_write_to_stream(wrapper, stream);
+	buf = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(stream));
+
+	raw = g_strndup((const char *)buf->data, buf->len);
+	if ((utf8 = dbmail_iconv_str_to_utf8(raw, g_mime_object_get_content_type_parameter(part, "charset")))) {
+		g_string_append(text, utf8);
+		g_string_append_c(text, ' ');
+		g_free(utf8);
+	}
+	g_free(raw);
+
+	g_object_unref(stream);
+}
+
+int dm_fts_index(const DbmailMessage *message)
+{
+	GString *text;
+	GList *terms;
+	int t;
+
+	if (! dm_fts_enabled())
+		return DM_SUCCESS;
+
+	if (! GMIME_IS_MESSAGE(message->content)) {
+		TRACE(TRACE_ERR,"message->content is not a message");
+		return DM_EGENERAL;
+	}
+
+	text = g_string_new("");
+	g_mime_message_foreach(GMIME_MESSAGE(message->content), fts_part_text, text);
+	terms = dm_fts_terms(text->str, text->len);
+	g_string_free(text, TRUE);
+
+	TRACE(TRACE_DEBUG, "physmessage [%llu] terms [%d]", 
+			dbmail_message_get_physid(message), g_list_length(terms));
+
+	t = fts->store(dbmail_message_get_physid(message), terms);
+
+	g_list_destroy(terms);
+
+	return t;
+}
+
+/*
+ * both lists are in ascending order; the result is too
+ */
+static GList * fts_intersect(GList *a, GList *b)
+{
+	GList *r = NULL, *x = g_list_first(a), *y = g_list_first(b);
+	u64_t i, j;
+
+	while (x && y) {
+		i = *(u64_t *)x->data;
+		j = *(u64_t *)y->data;
+		if (i < j)
+			x = g_list_next(x);
+		else if (i > j)
+			y = g_list_next(y);
+		else {
+			r = g_list_prepend(r, x->data);
+			x->data = NULL;
+			x = g_list_next(x);
+			y = g_list_next(y);
+		}
+	}
+
+	g_list_destroy(a);
+	g_list_destroy(b);
+
+	return g_list_reverse(r);
+}
+
+int dm_fts_search(u64_t mailbox_idnr, const char *text, GList **uids)
+{
+	GList *terms, *l, *found = NULL;
+	int t = DM_SUCCESS;
+
+	if (! dm_fts_enabled())
+		return DM_EGENERAL;
+
+	if (! (terms = dm_fts_terms(text, strlen(text))))
+		return DM_EGENERAL;
+
+	/* a message has to match every word */
+	for (l = g_list_first(terms); l; l = g_list_next(l)) {
+		GList *match = NULL;
+		if ((t = fts->lookup(mailbox_idnr, (const char *)l->data, &match)) != DM_SUCCESS) {
+			g_list_destroy(match);
+			break;
+		}
+		found = (l == g_list_first(terms)) ? match : fts_intersect(found, match);
+		if (! found)
+			break;
+	}
+
+	g_list_destroy(terms);
+
+	if (t != DM_SUCCESS) {
+		g_list_destroy(found);
+		return t;
+	}
+
+	*uids = found;
+
+	return DM_SUCCESS;
+}
+
+int dm_fts_unindexed(u64_t mailbox_idnr, GList **uids)
+{
+	if (! dm_fts_enabled())
+		return DM_EGENERAL;
+	return fts->unindexed(mailbox_idnr, uids);
+}
+
+int dm_fts_missing(GList **lost)
+{
+	if (! dm_fts_enabled())
+		return DM_EGENERAL;
+	return fts->missing(lost);
+}
+
+int dm_fts_backfill(GList *lost)
+{
+	u64_t pmsgid;
+	DbmailMessage *msg;
+
+	if (! dm_fts_enabled())
+		return DM_EGENERAL;
+
+	lost = g_list_first(lost);
+	while (lost) {
+		pmsgid = *(u64_t *)lost->data;
+
+		msg = dbmail_message_new();
+		if (! (msg = dbmail_message_retrieve(msg, pmsgid, DBMAIL_MESSAGE_FILTER_FULL))) {
+			TRACE(TRACE_WARNING, "error retrieving physmessage: [%llu]", pmsgid);
+			fprintf(stderr,"E");
+		} else {
+			if (dm_fts_index(msg) != DM_SUCCESS) {
+				TRACE(TRACE_WARNING,"error indexing physmessage: [%llu]", pmsgid);
+				fprintf(stderr,"E");
+			} else {
+				fprintf(stderr,".");
+			}
+			dbmail_message_free(msg);
+		}
+		if (! g_list_next(lost)) break;
+		lost = g_list_next(lost);
+	}
+	return DM_SUCCESS;
+}
+
+/*
+ * ftsdriver = sql
+ *
+ * word -> physmessage rows in the bodyterms table
+ */
+
+static int fts_sql_batch(void)
+{
+	if (_db_params.db_driver == DM_DRIVER_SQLITE || _db_params.db_driver == DM_DRIVER_ORACLE)
+		return 1;
+	return FTS_BATCH;
+}
+
+static int fts_sql_store(u64_t physmessage_id, GList *terms)
+{
+	C c; S s; volatile int t = DM_SUCCESS;
+	int batch = fts_sql_batch();
+
+	c = db_con_get();
+	TRY
+		GList *l = g_list_first(terms);
+
+		db_begin_transaction(c);
+		db_exec(c, "DELETE FROM %sbodyterms WHERE physmessage_id=%llu", DBPFX, physmessage_id);
+
+		s = db_stmt_prepare(c, "INSERT INTO %sbodyterms (term, physmessage_id) VALUES (?,?)", DBPFX);
+		db_stmt_set_str(s, 1, FTS_INDEXED);
+		db_stmt_set_u64(s, 2, physmessage_id);
+		db_stmt_exec(s);
+
+		while (l) {
+			GString *q = g_string_new("");
+			GList *slice = l;
+			int i, n;
+
+			for (n = 0; l && n < batch; n++)
+				l = g_list_next(l);
+
+			g_string_printf(q, "INSERT INTO %sbodyterms (term, physmessage_id) VALUES ", DBPFX);
+			for (i = 0; i < n; i++)
+				g_string_append_printf(q, "%s(?,%llu)", i ? "," : "", physmessage_id);
+
+			s = db_stmt_prepare(c, "%s", q->str);
+			g_string_free(q, TRUE);
+
+			for (i = 0; i < n; i++, slice = g_list_next(slice))
+				db_stmt_set_str(s, i + 1, (const char *)slice->data);
+			db_stmt_exec(s);
+		}
+
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+static int fts_sql_lookup(u64_t mailbox_idnr, const char *prefix, GList **uids)
+{
+	C c; S s; R r; volatile int t = DM_SUCCESS;
+	GList * volatile found = NULL;
+	char *pattern;
+	u64_t *id;
+
+	pattern = g_strdup_printf("%s%%", prefix);
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT DISTINCT m.message_idnr FROM %sbodyterms t "
+				"JOIN %smessages m ON m.physmessage_id = t.physmessage_id "
+				"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
+				"AND t.term LIKE ? "
+				"ORDER BY m.message_idnr", DBPFX, DBPFX);
+		db_stmt_set_u64(s, 1, mailbox_idnr);
+		db_stmt_set_int(s, 2, MESSAGE_STATUS_NEW);
+		db_stmt_set_int(s, 3, MESSAGE_STATUS_SEEN);
+		db_stmt_set_str(s, 4, pattern);
+
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			id = g_new0(u64_t, 1);
+			*id = db_result_get_u64(r, 0);
+			found = g_list_prepend(found, id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_free(pattern);
+
+	*uids = g_list_reverse(found);
+
+	return t;
+}
+
+static int fts_sql_missing(GList **lost)
+{
+	C c; R r; volatile int t = DM_SUCCESS;
+	u64_t *id;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT p.id FROM %sphysmessage p "
+				"LEFT JOIN %sbodyterms t ON p.id = t.physmessage_id AND t.term = '%s' "
+				"WHERE t.physmessage_id IS NULL", DBPFX, DBPFX, FTS_INDEXED);
+		while (db_result_next(r)) {
+			id = g_new0(u64_t,1);
+			*id = db_result_get_u64(r, 0);
+			*(GList **)lost = g_list_prepend(*(GList **)lost,id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+static int fts_sql_unindexed(u64_t mailbox_idnr, GList **uids)
+{
+	C c; S s; R r; volatile int t = DM_SUCCESS;
+	GList * volatile found = NULL;
+	u64_t *id;
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT m.message_idnr FROM %smessages m "
+				"LEFT JOIN %sbodyterms t ON t.physmessage_id = m.physmessage_id AND t.term = ? "
+				"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
+				"AND t.physmessage_id IS NULL "
+				"ORDER BY m.message_idnr", DBPFX, DBPFX);
+		db_stmt_set_str(s, 1, FTS_INDEXED);
+		db_stmt_set_u64(s, 2, mailbox_idnr);
+		db_stmt_set_int(s, 3, MESSAGE_STATUS_NEW);
+		db_stmt_set_int(s, 4, MESSAGE_STATUS_SEEN);
+
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			id = g_new0(u64_t, 1);
+			*id = db_result_get_u64(r, 0);
+			found = g_list_prepend(found, id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	*uids = g_list_reverse(found);
+
+	return t;
+}
+
+static fts_driver_t fts_sql = {
+	"sql",
+	fts_sql_store,
+	fts_sql_lookup,
+	fts_sql_missing,
+	fts_sql_unindexed
+};
+
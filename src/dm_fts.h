@@ -0,0 +1,61 @@
+/*
+ Copyright (c) 2004-2011 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or 
+ modify it under the terms of the GNU General Public License 
+ as published by the Free Software Foundation; either 
+ version 2 of the License, or (at your option) any later 
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ 
+*/
+#ifndef _DM_FTS_H
+#define _DM_FTS_H
+
+/*
+ * full-text index for SEARCH BODY and TEXT
+ *
+ * message bodies are split into lower-cased words at delivery time,
+ * and stored as word -> physmessage by the configured ftsdriver.
+ */
+
+#include "dbmail.h"
+
+typedef struct {
+	const char *name;
+	/* replace the words indexed for a physmessage */
+	int (* store)(u64_t physmessage_id, GList *terms);
+	/* uids in a mailbox with a word starting with prefix, ascending */
+	int (* lookup)(u64_t mailbox_idnr, const char *prefix, GList **uids);
+	/* physmessages that were never indexed */
+	int (* missing)(GList **physids);
+	/* uids in a mailbox whose physmessage was never indexed, ascending */
+	int (* unindexed)(u64_t mailbox_idnr, GList **uids);
+} fts_driver_t;
+
+gboolean dm_fts_enabled(void);
+
+/* unique lower-cased words in text */
+GList * dm_fts_terms(const char *text, size_t len);
+
+int dm_fts_index(const DbmailMessage *message);
+
+/* DM_EGENERAL if the index can't answer for this text */
+int dm_fts_search(u64_t mailbox_idnr, const char *text, GList **uids);
+
+/* messages dm_fts_search can't see, until dbmail-util indexes them */
+int dm_fts_unindexed(u64_t mailbox_idnr, GList **uids);
+
+/* dbmail-util */
+int dm_fts_missing(GList **lost);
+int dm_fts_backfill(GList *lost);
+
+#endif
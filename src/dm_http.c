@@ -259,23 +259,20 @@ void Http_getMailboxes(T R)
 		 */
 
 		MailboxState_T b = MailboxState_new(id);
-		GTree *msns = MailboxState_getMsn(b);
-		GList *ids = g_tree_keys(msns);
-		GTree *msginfo = MailboxState_getMsginfo(b);
+		u64_t msn, count = MailboxState_count(b);
+		MessageInfo info;
 
 		evbuffer_add_printf(buf, "{\"messages\": {\n");
-		while (ids && ids->data) {
-			u64_t *msn = (u64_t *)ids->data;
-			u64_t *uid = (u64_t *)g_tree_lookup(msns, msn);
-			MessageInfo *info = (MessageInfo *)g_tree_lookup(msginfo, uid);
-			evbuffer_add_printf(buf, "    \"%llu\":{\"size\":%llu}", *uid, info->rfcsize);
-			if (! g_list_next(ids)) break;
-			ids = g_list_next(ids);
-			evbuffer_add_printf(buf,",\n");
+		for (msn = 1; msn <= count; msn++) {
+			if (! MailboxState_getInfo(b, MailboxState_msnToUid(b, msn), &info))
+				continue;
+			evbuffer_add_printf(buf, "    \"%llu\":{\"size\":%llu}", info.uid, info.rfcsize);
+			MessageInfo_clear(&info);
+			if (msn < count)
+				evbuffer_add_printf(buf,",\n");
 		}
 		evbuffer_add_printf(buf, "\n}}\n");
 	
-		if (ids) g_list_free(g_list_first(ids));
 		MailboxState_free(&b);
 	}
 
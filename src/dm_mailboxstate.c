@@ -30,6 +30,34 @@ extern db_param_t _db_params;
 
 #define T MailboxState_T
 
+/*
+ * SORT keys of a message, loaded from the sortkeys table on the first
+ * SORT. The strings live in the same allocation as the struct.
+ */
+typedef struct {
+	const char *subject;	// base subject
+	const char *from;	// first address of each header
+	const char *to;
+	const char *cc;
+	gint64 sentdate;
+} sortkeys_t;
+
+/*
+ * message state, one column per attribute, sorted by uid so the
+ * message sequence number of a message is its index plus one
+ */
+typedef struct {
+	gboolean loaded;
+	unsigned count;
+	unsigned size;
+	u64_t *uid;
+	u64_t *rfcsize;
+	gint64 *internaldate;	// seconds since the epoch
+	guint8 *flags;		// bit i holds IMAP flag i
+	guint32 **keywords;	// NULL or a 0-terminated list of keyword ids
+	sortkeys_t **sortkeys;	// NULL until needed by MailboxState_sort
+} msgstate_t;
+
 struct T {
 	u64_t id;
 	u64_t uidnext;
@@ -50,47 +78,282 @@ struct T {
 	//
 	char *name;
 	GTree *keywords;
-	GTree *msginfo;
-	GTree *ids;
-	GTree *msn;
+	msgstate_t messages;
+	//
+	gboolean partial;	// messages only holds those changed since the last update
+	GList *expunged;	// uids that left the mailbox since the last update
+	Thread_T threads;	// NULL until the first THREAD
 };
 
-/* */
+static int db_getmailbox_seq(T M);
+
+/*
+ * keyword names are shared by all mailbox states, messages only carry
+ * their ids. Names are never released, so the pointers handed out stay
+ * valid for the lifetime of the process.
+ */
+static GStaticMutex keywords_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *keyword_ids = NULL;
+static GPtrArray *keyword_names = NULL;
+
+static guint32 keyword_intern(const char *keyword)
+{
+	char *key;
+	guint32 id;
+
+	key = g_ascii_strdown(keyword, -1);
+
+	g_static_mutex_lock(&keywords_lock);
+	if (! keyword_ids) {
+		keyword_ids = g_hash_table_new(g_str_hash, g_str_equal);
+		keyword_names = g_ptr_array_new();
+		g_ptr_array_add(keyword_names, NULL); // id 0 ends a list
+	}
+	if (! (id = GPOINTER_TO_UINT(g_hash_table_lookup(keyword_ids, key)))) {
+		id = keyword_names->len;
+		g_ptr_array_add(keyword_names, g_strdup(keyword));
+		g_hash_table_insert(keyword_ids, key, GUINT_TO_POINTER(id));
+		key = NULL;
+	}
+	g_static_mutex_unlock(&keywords_lock);
+
+	g_free(key);
+
+	return id;
+}
+
+static guint32 keyword_lookup(const char *keyword)
+{
+	char *key;
+	guint32 id = 0;
+
+	key = g_ascii_strdown(keyword, -1);
+	g_static_mutex_lock(&keywords_lock);
+	if (keyword_ids)
+		id = GPOINTER_TO_UINT(g_hash_table_lookup(keyword_ids, key));
+	g_static_mutex_unlock(&keywords_lock);
+	g_free(key);
+
+	return id;
+}
+
+static const char * keyword_name(guint32 id)
+{
+	const char *name;
+	g_static_mutex_lock(&keywords_lock);
+	name = g_ptr_array_index(keyword_names, id);
+	g_static_mutex_unlock(&keywords_lock);
+	return name;
+}
+
+static guint32 * keywords_pack(GList *keywords)
+{
+	guint32 *ids, id;
+	unsigned i = 0, j;
+
+	if (! keywords) return NULL;
+
+	keywords = g_list_first(keywords);
+	ids = g_new0(guint32, g_list_length(keywords) + 1);
+	while (keywords) {
+		id = keyword_intern((const char *)keywords->data);
+		for (j = 0; j < i; j++)
+			if (ids[j] == id) break;
+		if (j == i)
+			ids[i++] = id;
+		if (! g_list_next(keywords)) break;
+		keywords = g_list_next(keywords);
+	}
+
+	return ids;
+}
+
+static GList * keywords_unpack(const guint32 *ids)
+{
+	GList *keywords = NULL;
+	while (ids && *ids)
+		keywords = g_list_append(keywords, g_strdup(keyword_name(*ids++)));
+	return keywords;
+}
+
+/*
+ * internal dates arrive as 'YYYY-MM-DD HH:MM:SS' (see date2char_str)
+ */
+#define INTERNALDATE_UNKNOWN G_MININT64
+
+static gint64 internaldate_pack(const char *date)
+{
+	int y, m, d, H, M, S, era, yoe, doy, doe;
+
+	if ((! date) || sscanf(date, "%d-%d-%d %d:%d:%d", &y, &m, &d, &H, &M, &S) != 6)
+		return INTERNALDATE_UNKNOWN;
+
+	/* days since 1970-01-01 in the proleptic gregorian calendar */
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
 
-static void MailboxState_uid_msn_new(T M)
+	return ((gint64)era * 146097 + doe - 719468) * 86400 + H * 3600 + M * 60 + S;
+}
+
+static void internaldate_unpack(gint64 date, char *buf)
 {
-	if (M->msn) g_tree_destroy(M->msn);
-	M->msn = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
+	struct tm tm;
+	time_t t = (time_t)date;
 
-	if (M->ids) g_tree_destroy(M->ids);
-	M->ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,(GDestroyNotify)g_free);
+	if ((date == INTERNALDATE_UNKNOWN) || (! gmtime_r(&t, &tm))) {
+		g_strlcpy(buf, "01-Jan-1970 00:00:01 +0100", IMAP_INTERNALDATE_LEN);
+		return;
+	}
+	strftime(buf, IMAP_INTERNALDATE_LEN, "%Y-%m-%d %H:%M:%S", &tm);
 }
-static void MessageInfo_free(MessageInfo *m)
+
+static void messages_free(msgstate_t *s)
 {
-	g_list_destroy(m->keywords);
-	g_free(m);
+	unsigned i;
+	for (i = 0; i < s->count; i++) {
+		g_free(s->keywords[i]);
+		g_free(s->sortkeys[i]);
+	}
+	g_free(s->uid);
+	g_free(s->rfcsize);
+	g_free(s->internaldate);
+	g_free(s->flags);
+	g_free(s->keywords);
+	g_free(s->sortkeys);
+	memset(s, 0, sizeof(msgstate_t));
+}
+
+/*
+ * binary search for uid; pos is set to its index, or to the index
+ * it should be inserted at
+ */
+static gboolean messages_find(msgstate_t *s, u64_t uid, unsigned *pos)
+{
+	unsigned lo = 0, hi = s->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s->uid[mid] < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (pos) *pos = lo;
+
+	return (lo < s->count && s->uid[lo] == uid);
+}
+
+/*
+ * open up an empty slot for uid at pos
+ */
+static void messages_insert(msgstate_t *s, unsigned pos, u64_t uid)
+{
+	unsigned tail;
+
+	if (s->count == s->size) {
+		s->size = s->size ? s->size * 2 : 64;
+		s->uid = g_renew(u64_t, s->uid, s->size);
+		s->rfcsize = g_renew(u64_t, s->rfcsize, s->size);
+		s->internaldate = g_renew(gint64, s->internaldate, s->size);
+		s->flags = g_renew(guint8, s->flags, s->size);
+		s->keywords = g_renew(guint32 *, s->keywords, s->size);
+		s->sortkeys = g_renew(sortkeys_t *, s->sortkeys, s->size);
+	}
+
+	if ((tail = s->count - pos)) {
+		memmove(s->uid + pos + 1, s->uid + pos, tail * sizeof(u64_t));
+		memmove(s->rfcsize + pos + 1, s->rfcsize + pos, tail * sizeof(u64_t));
+		memmove(s->internaldate + pos + 1, s->internaldate + pos, tail * sizeof(gint64));
+		memmove(s->flags + pos + 1, s->flags + pos, tail * sizeof(guint8));
+		memmove(s->keywords + pos + 1, s->keywords + pos, tail * sizeof(guint32 *));
+		memmove(s->sortkeys + pos + 1, s->sortkeys + pos, tail * sizeof(sortkeys_t *));
+	}
+
+	s->uid[pos] = uid;
+	s->rfcsize[pos] = 0;
+	s->internaldate[pos] = INTERNALDATE_UNKNOWN;
+	s->flags[pos] = 0;
+	s->keywords[pos] = NULL;
+	s->sortkeys[pos] = NULL;
+	s->count++;
+}
+
+static void messages_remove(msgstate_t *s, unsigned pos)
+{
+	unsigned tail = s->count - pos - 1;
+
+	g_free(s->keywords[pos]);
+	g_free(s->sortkeys[pos]);
+
+	if (tail) {
+		memmove(s->uid + pos, s->uid + pos + 1, tail * sizeof(u64_t));
+		memmove(s->rfcsize + pos, s->rfcsize + pos + 1, tail * sizeof(u64_t));
+		memmove(s->internaldate + pos, s->internaldate + pos + 1, tail * sizeof(gint64));
+		memmove(s->flags + pos, s->flags + pos + 1, tail * sizeof(guint8));
+		memmove(s->keywords + pos, s->keywords + pos + 1, tail * sizeof(guint32 *));
+		memmove(s->sortkeys + pos, s->sortkeys + pos + 1, tail * sizeof(sortkeys_t *));
+	}
+	s->count--;
+}
+
+static void messages_add_keyword(msgstate_t *s, unsigned pos, const char *keyword)
+{
+	guint32 id = keyword_intern(keyword);
+	guint32 *ids = s->keywords[pos];
+	unsigned n = 0;
+
+	while (ids && ids[n]) {
+		if (ids[n] == id) return;
+		n++;
+	}
+
+	ids = g_renew(guint32, ids, n + 2);
+	ids[n] = id;
+	ids[n + 1] = 0;
+	s->keywords[pos] = ids;
 }
 
-static T MailboxState_getMessageState(T M)
+/*
+ * load the message state of mailbox M
+ *
+ * if since is given only the messages stamped at or after since->seq, or
+ * added at or after since->uidnext, are loaded. Messages among those that
+ * are no longer visible end up on M->expunged instead.
+ */
+static int MailboxState_getMessageState(T M, T since)
 {
-	unsigned nrows = 0, i = 0, j;
-	const char *query_result, *keyword;
-	MessageInfo *result;
-	GTree *msginfo;
+	unsigned nrows = 0, i = 0, j, pos;
+	const char *keyword;
 	u64_t *uid, id = 0;
-	C c; R r; volatile int t = FALSE;
+	msgstate_t s;
+	C c; R r; volatile int t = DM_SUCCESS;
 	field_t frag;
+	char filter[DEF_FRAGSIZE];
 	INIT_QUERY;
 
+	memset(filter, 0, sizeof(filter));
+	if (since)
+		/* the current seq is included: a change may have been stamped
+		 * with it before the bump announcing it was committed */
+		snprintf(filter, DEF_FRAGSIZE, "AND (m.seq >= %llu OR m.message_idnr >= %llu)",
+				since->seq, since->uidnext);
+	else
+		snprintf(filter, DEF_FRAGSIZE, "AND m.status IN (%d,%d)",
+				MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+
 	date2char_str("internal_date", &frag);
 	snprintf(query, DEF_QUERYSIZE,
 			"SELECT seen_flag, answered_flag, deleted_flag, flagged_flag, "
-			"draft_flag, recent_flag, %s, rfcsize, message_idnr FROM %smessages m "
+			"draft_flag, recent_flag, %s, rfcsize, message_idnr, status FROM %smessages m "
 			"LEFT JOIN %sphysmessage p ON p.id = m.physmessage_id "
-			"WHERE m.mailbox_idnr = %llu AND m.status IN (%d,%d) ORDER BY message_idnr ASC",
-			frag, DBPFX, DBPFX, M->id, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+			"WHERE m.mailbox_idnr = %llu %s ORDER BY message_idnr ASC",
+			frag, DBPFX, DBPFX, M->id, filter);
 
-	msginfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,(GDestroyNotify)g_free,(GDestroyNotify)MessageInfo_free);
+	memset(&s, 0, sizeof(msgstate_t));
 
 	c = db_con_get();
 	TRY
@@ -103,32 +366,28 @@ static T MailboxState_getMessageState(T M)
 
 			id = db_result_get_u64(r,IMAP_NFLAGS + 2);
 
-			uid = g_new0(u64_t,1); *uid = id;
-
-			result = g_new0(MessageInfo,1);
-
-			/* id */
-			result->uid = id;
+			if (db_result_get_int(r,IMAP_NFLAGS + 3) >= MESSAGE_STATUS_DELETE) {
+				if (since && messages_find(&since->messages, id, NULL)) {
+					uid = g_new0(u64_t,1); *uid = id;
+					M->expunged = g_list_prepend(M->expunged, uid);
+				}
+				continue;
+			}
 
-			/* mailbox_id */
-			result->mailbox_id = M->id;
+			/* rows arrive in uid order */
+			messages_insert(&s, s.count, id);
+			pos = s.count - 1;
 
 			/* flags */
 			for (j = 0; j < IMAP_NFLAGS; j++)
-				result->flags[j] = db_result_get_bool(r,j);
+				if (db_result_get_bool(r,j))
+					s.flags[pos] |= (1 << j);
 
 			/* internal date */
-			query_result = db_result_get(r,IMAP_NFLAGS);
-			strncpy(result->internaldate,
-					(query_result) ? query_result :
-					"01-Jan-1970 00:00:01 +0100",
-					IMAP_INTERNALDATE_LEN);
+			s.internaldate[pos] = internaldate_pack(db_result_get(r,IMAP_NFLAGS));
 
 			/* rfcsize */
-			result->rfcsize = db_result_get_u64(r,IMAP_NFLAGS + 1);
-
-			g_tree_insert(msginfo, uid, result); 
-
+			s.rfcsize[pos] = db_result_get_u64(r,IMAP_NFLAGS + 1);
 		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -137,55 +396,53 @@ static T MailboxState_getMessageState(T M)
 
 	if (t == DM_EQUERY) {
 		db_con_close(c);
-		return M;
+		messages_free(&s);
+		return t;
 	}
 
-	if (! i) { // empty mailbox
-		MailboxState_setMsginfo(M, msginfo);
-		db_commit_transaction(c);
-		db_con_close(c);
-		return M;
-	}
+	if (i) {
+		db_con_clear(c);
 
-	db_con_clear(c);
+		memset(query,0,sizeof(query));
+		snprintf(query, DEF_QUERYSIZE,
+			"SELECT k.message_idnr, keyword FROM %skeywords k "
+			"LEFT JOIN %smessages m ON k.message_idnr=m.message_idnr "
+			"LEFT JOIN %smailboxes b ON m.mailbox_idnr=b.mailbox_idnr "
+			"WHERE b.mailbox_idnr = %llu AND m.status < %d %s",
+			DBPFX, DBPFX, DBPFX,
+			M->id, MESSAGE_STATUS_DELETE, since ? filter : "");
+
+		TRY
+			nrows = 0;
+			r = db_query(c,query);
+			while (db_result_next(r)) {
+				nrows++;
+				id = db_result_get_u64(r,0);
+				keyword = db_result_get(r,1);
+				if (keyword && messages_find(&s, id, &pos))
+					messages_add_keyword(&s, pos, keyword);
+			}
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			t = DM_EQUERY;
+		END_TRY;
 
-	memset(query,0,sizeof(query));
-	snprintf(query, DEF_QUERYSIZE,
-		"SELECT k.message_idnr, keyword FROM %skeywords k "
-		"LEFT JOIN %smessages m ON k.message_idnr=m.message_idnr "
-		"LEFT JOIN %smailboxes b ON m.mailbox_idnr=b.mailbox_idnr "
-		"WHERE b.mailbox_idnr = %llu AND m.status < %d",
-		DBPFX, DBPFX, DBPFX,
-		M->id, MESSAGE_STATUS_DELETE);
+		if (! nrows) TRACE(TRACE_DEBUG, "no keywords");
+	}
 
-	TRY
-		nrows = 0;
-		r = db_query(c,query);
-		while (db_result_next(r)) {
-			nrows++;
-			id = db_result_get_u64(r,0);
-			keyword = db_result_get(r,1);
-			if ((result = g_tree_lookup(msginfo, &id)) != NULL)
-				result->keywords = g_list_append(result->keywords, g_strdup(keyword));
-		}
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		t = DM_EQUERY;
-	FINALLY
-		db_commit_transaction(c);
-		db_con_close(c);
-	END_TRY;
+	db_commit_transaction(c);
+	db_con_close(c);
 
 	if (t == DM_EQUERY) {
-		g_tree_destroy(msginfo);
-		return M;
+		messages_free(&s);
+		return t;
 	}
 
-	if (! nrows) TRACE(TRACE_DEBUG, "no keywords");
-
-	MailboxState_setMsginfo(M, msginfo);
+	s.loaded = TRUE;
+	messages_free(&M->messages);
+	M->messages = s;
 
-	return M;
+	return t;
 }
 
 
@@ -199,84 +456,663 @@ T MailboxState_new(u64_t id)
 
 	M->keywords = g_tree_new_full((GCompareDataFunc)dm_strcasecmpdata, NULL,(GDestroyNotify)g_free,NULL);
 	MailboxState_reload(M);
-	MailboxState_getMessageState(M);
+	MailboxState_getMessageState(M, NULL);
 
 	return M;
 }
 
-void MailboxState_remap(T M)
+/*
+ * Incremental counterpart of MailboxState_new: returns NULL if the mailbox
+ * seq didn't move since M was loaded. Otherwise the new state holds fresh
+ * counters and only the messages that changed; feed it to MailboxState_merge.
+ *
+ * Every statement that changes or moves messages stamps them, and new
+ * messages always get a uid at or past uidnext, so every arrival and change
+ * is fetched. Rows can only disappear unseen: deleted outright, or moved
+ * out of the mailbox. Both leave fewer messages than the changes add up to,
+ * in which case a complete state is loaded instead and
+ * MailboxState_isPartial returns FALSE.
+ */
+T MailboxState_update(T M)
 {
-	GList *ids = NULL;
-	u64_t *uid, *msn = NULL, rows = 1;
-	MessageInfo *msginfo;
+	T N;
+	unsigned count, i;
+
+	N = g_malloc0(sizeof(*N));
+	N->id = M->id;
+	N->keywords = g_tree_new_full((GCompareDataFunc)dm_strcasecmpdata, NULL,(GDestroyNotify)g_free,NULL);
+
+	if ((db_getmailbox_seq(N) != DM_SUCCESS) || (N->seq == M->seq)) {
+		MailboxState_free(&N);
+		return NULL;
+	}
 
-	MailboxState_uid_msn_new(M);
+	if (MailboxState_reload(N) != DM_SUCCESS) {
+		MailboxState_free(&N);
+		return NULL;
+	}
 
-	ids = g_tree_keys(M->msginfo);
-	ids = g_list_first(ids);
-	while (ids) {
-		uid = (u64_t *)ids->data;
+	N->partial = TRUE;
+	if (M->messages.loaded)
+		MailboxState_getMessageState(N, M);
 
-		msginfo = g_tree_lookup(M->msginfo, uid);
+	count = 0;
+	if (N->messages.loaded) {
+		count = M->messages.count - g_list_length(N->expunged);
+		for (i = 0; i < N->messages.count; i++) {
+			if (! messages_find(&M->messages, N->messages.uid[i], NULL))
+				count++;
+		}
+	}
 
-		msn = g_new0(u64_t,1);
-		*msn = msginfo->msn = rows++;
+	TRACE(TRACE_DEBUG, "seq [%llu -> %llu] changed [%u] expunged [%d] exists [%u/%u]", 
+			M->seq, N->seq, N->messages.count, 
+			g_list_length(N->expunged), count, N->exists);
+
+	if ((! N->messages.loaded) || (count != N->exists)) {
+		TRACE(TRACE_DEBUG, "incremental update mismatch, loading full state");
+		messages_free(&N->messages);
+		g_list_destroy(N->expunged);
+		N->expunged = NULL;
+		N->partial = FALSE;
+		MailboxState_getMessageState(N, NULL);
+	}
 
-		g_tree_insert(M->ids, uid, msn);
-		g_tree_insert(M->msn, msn, uid);
+	return N;
+}
 
-		if (! g_list_next(ids)) break;
-		ids = g_list_next(ids);
+/*
+ * apply the changes in partial state N to M, leaving N empty
+ */
+void MailboxState_merge(T M, T N)
+{
+	GList *uids;
+	GTree *keywords;
+	unsigned i, pos;
+	msgstate_t *s = &M->messages, *n = &N->messages;
+
+	assert(N->partial);
+
+	for (i = 0; i < n->count; i++) {
+		if (! messages_find(s, n->uid[i], &pos))
+			messages_insert(s, pos, n->uid[i]);
+		g_free(s->keywords[pos]);
+		s->rfcsize[pos] = n->rfcsize[i];
+		s->internaldate[pos] = n->internaldate[i];
+		s->flags[pos] = n->flags[i];
+		s->keywords[pos] = n->keywords[i];
+		n->keywords[i] = NULL;
+	}
+	messages_free(n);
+
+	uids = g_list_first(N->expunged);
+	while (uids) {
+		if (messages_find(s, *(u64_t *)uids->data, &pos))
+			messages_remove(s, pos);
+		if (M->threads)
+			Thread_remove(M->threads, *(u64_t *)uids->data);
+		if (! g_list_next(uids)) break;
+		uids = g_list_next(uids);
 	}
 
-	g_list_free(g_list_first(ids));
+	M->seq = N->seq;
+	M->uidnext = N->uidnext;
+	M->exists = N->exists;
+	M->recent = N->recent;
+	M->unseen = N->unseen;
+	M->permission = N->permission;
+	M->no_select = N->no_select;
+	M->no_children = N->no_children;
+	M->no_inferiors = N->no_inferiors;
+
+	keywords = M->keywords;
+	M->keywords = N->keywords;
+	N->keywords = keywords;
+}
 
-	TRACE(TRACE_DEBUG,"total [%d] UIDs [%d] MSNs", g_tree_nnodes(M->ids), g_tree_nnodes(M->msn));
+gboolean MailboxState_isPartial(T M)
+{
+	return M->partial;
 }
-	
-GTree * MailboxState_getMsginfo(T M)
+
+GList * MailboxState_getExpunged(T M)
 {
-	return M->msginfo;
+	return M->expunged;
 }
 
-void MailboxState_setMsginfo(T M, GTree *msginfo)
+/*
+ * number of messages held; for a partial state only the changed ones
+ */
+unsigned MailboxState_count(T M)
 {
-	GTree *oldmsginfo = M->msginfo;
-	M->msginfo = msginfo;
-	MailboxState_remap(M);
-	if (oldmsginfo) g_tree_destroy(oldmsginfo);
+	return M->messages.count;
 }
 
-void MailboxState_addMsginfo(T M, u64_t uid, MessageInfo *msginfo)
+gboolean MailboxState_isLoaded(T M)
 {
-	u64_t *id = g_new0(u64_t,1);
-	*id = uid;
-	g_tree_insert(M->msginfo, id, msginfo); 
-	MailboxState_remap(M);
+	return M->messages.loaded;
 }
 
-int MailboxState_removeUid(T M, u64_t uid)
+u64_t MailboxState_msnToUid(T M, u64_t msn)
 {
-	if (! g_tree_remove(M->msginfo, &uid)) {
-		TRACE(TRACE_WARNING,"trying to remove unknown UID [%llu]", uid);
-		return DM_EGENERAL;
+	if ((! msn) || (msn > M->messages.count))
+		return 0;
+	return M->messages.uid[msn - 1];
+}
+
+u64_t MailboxState_uidToMsn(T M, u64_t uid)
+{
+	unsigned pos;
+	if (! messages_find(&M->messages, uid, &pos))
+		return 0;
+	return pos + 1;
+}
+
+/*
+ * find the msns of the first and last message with a uid between lo and hi
+ */
+gboolean MailboxState_uidRange(T M, u64_t lo, u64_t hi, u64_t *first, u64_t *last)
+{
+	unsigned l, r;
+
+	messages_find(&M->messages, lo, &l);
+	if (! messages_find(&M->messages, hi, &r)) {
+		if (! r) return FALSE;
+		r--;
 	}
+	if ((l >= M->messages.count) || (l > r))
+		return FALSE;
 
-	M->exists--;
+	*first = l + 1;
+	*last = r + 1;
+
+	return TRUE;
+}
 
-	MailboxState_remap(M);
+gboolean MailboxState_hasFlag(T M, u64_t uid, int flag)
+{
+	unsigned pos;
+	if (! messages_find(&M->messages, uid, &pos))
+		return FALSE;
+	return (M->messages.flags[pos] & (1 << flag)) ? TRUE : FALSE;
+}
+
+void MailboxState_setFlag(T M, u64_t uid, int flag, gboolean set)
+{
+	unsigned pos;
+	if (! messages_find(&M->messages, uid, &pos))
+		return;
+	if (set)
+		M->messages.flags[pos] |= (1 << flag);
+	else
+		M->messages.flags[pos] &= ~(1 << flag);
+}
+
+/*
+ * fill info with a copy of the state of message uid. Release it with
+ * MessageInfo_clear.
+ */
+gboolean MailboxState_getInfo(T M, u64_t uid, MessageInfo *info)
+{
+	unsigned pos, j;
+	msgstate_t *s = &M->messages;
+
+	memset(info, 0, sizeof(MessageInfo));
+
+	if (! messages_find(s, uid, &pos))
+		return FALSE;
+
+	info->mailbox_id = M->id;
+	info->msn = pos + 1;
+	info->uid = uid;
+	info->rfcsize = s->rfcsize[pos];
+	internaldate_unpack(s->internaldate[pos], info->internaldate);
+	for (j = 0; j < IMAP_NFLAGS; j++)
+		info->flags[j] = (s->flags[pos] & (1 << j)) ? 1 : 0;
+	info->keywords = keywords_unpack(s->keywords[pos]);
+
+	return TRUE;
+}
+
+/*
+ * store the flags and keywords in info
+ */
+void MailboxState_setInfo(T M, const MessageInfo *info)
+{
+	unsigned pos, j;
+	msgstate_t *s = &M->messages;
+
+	if (! messages_find(s, info->uid, &pos)) {
+		TRACE(TRACE_WARNING,"trying to update unknown UID [%llu]", info->uid);
+		return;
+	}
+
+	s->flags[pos] = 0;
+	for (j = 0; j < IMAP_NFLAGS; j++)
+		if (info->flags[j])
+			s->flags[pos] |= (1 << j);
+
+	g_free(s->keywords[pos]);
+	s->keywords[pos] = keywords_pack(info->keywords);
+}
+
+void MessageInfo_clear(MessageInfo *info)
+{
+	g_list_destroy(info->keywords);
+	info->keywords = NULL;
+}
+
+static gboolean messages_has_keyword(msgstate_t *s, unsigned pos, guint32 id)
+{
+	guint32 *ids = s->keywords[pos];
+	while (ids && *ids)
+		if (*ids++ == id) return TRUE;
+	return FALSE;
+}
+
+/*
+ * evaluate a flag, keyword, size or internaldate search key against the
+ * loaded messages. Returns the matches indexed by msn, or NULL if the key
+ * can't be resolved without the database.
+ */
+Bitset_T MailboxState_search(T M, search_key_t *k)
+{
+	msgstate_t *s = &M->messages;
+	gint64 lo = G_MININT64, hi = G_MAXINT64;
+	guint32 keyword = 0;
+	gboolean match;
+	unsigned i;
+	char *date;
+	Bitset_T found;
+
+	switch (k->type) {
+		case IST_FLAG:
+		case IST_SIZE_LARGER:
+		case IST_SIZE_SMALLER:
+			break;
+		case IST_KEYWORD:
+			keyword = keyword_lookup(k->search);
+			break;
+		case IST_IDATE_BEFORE:
+		case IST_IDATE_ON:
+		case IST_IDATE_SINCE:
+			date = date_imap2sql(k->search);
+			lo = internaldate_pack(date);
+			g_free(date);
+			if (lo == INTERNALDATE_UNKNOWN) {
+				/* matches nothing */
+				hi = lo;
+				lo = G_MAXINT64;
+			} else if (k->type == IST_IDATE_BEFORE) {
+				hi = lo - 1;
+				lo = G_MININT64;
+			} else if (k->type == IST_IDATE_ON) {
+				hi = lo + 86399;
+			}
+			break;
+		default:
+			return NULL;
+	}
+
+	found = Bitset_new(s->count + 1);
+
+	for (i = 0; i < s->count; i++) {
+		switch (k->type) {
+			case IST_FLAG:
+				match = ((s->flags[i] & k->flags_set) == k->flags_set) && (! (s->flags[i] & k->flags_unset));
+				break;
+			case IST_KEYWORD:
+				match = (keyword && messages_has_keyword(s, i, keyword));
+				if (! k->match) match = ! match;
+				break;
+			case IST_SIZE_LARGER:
+				match = (s->rfcsize[i] > k->size);
+				break;
+			case IST_SIZE_SMALLER:
+				match = (s->rfcsize[i] < k->size);
+				break;
+			default:
+				match = (s->internaldate[i] != INTERNALDATE_UNKNOWN) && 
+					(s->internaldate[i] >= lo) && (s->internaldate[i] <= hi);
+				break;
+		}
+		if (match)
+			Bitset_add(found, i + 1);
+	}
+
+	return found;
+}
+
+static sortkeys_t * sortkeys_new(const char *subject, const char *from, const char *to, const char *cc, const char *sentdate)
+{
+	sortkeys_t *k;
+	size_t ls, lf, lt, lc;
+	char *p;
+
+	ls = subject ? strlen(subject) : 0;
+	lf = from ? strlen(from) : 0;
+	lt = to ? strlen(to) : 0;
+	lc = cc ? strlen(cc) : 0;
+
+	k = g_malloc(sizeof(sortkeys_t) + ls + lf + lt + lc + 4);
+	p = (char *)(k + 1);
+
+#define SORTKEY_COPY(f, v, l) k->f = p; if (l) memcpy(p, v, l); p[l] = '\0'; p += l + 1
+	SORTKEY_COPY(subject, subject, ls);
+	SORTKEY_COPY(from, from, lf);
+	SORTKEY_COPY(to, to, lt);
+	SORTKEY_COPY(cc, cc, lc);
+#undef SORTKEY_COPY
+
+	k->sentdate = internaldate_pack(sentdate);
+
+	return k;
+}
+
+/*
+ * fetch the sort keys for the messages that don't have them yet. Keys
+ * never change, so after the first SORT only new arrivals are loaded.
+ */
+static int messages_load_sortkeys(T M)
+{
+	msgstate_t *s = &M->messages;
+	unsigned i, pos;
+	u64_t uid;
+	C c; R r; volatile int t = DM_SUCCESS;
+	field_t frag;
+	INIT_QUERY;
+
+	for (i = 0; i < s->count; i++)
+		if (! s->sortkeys[i]) break;
+	if (i == s->count)
+		return DM_SUCCESS;
+
+	date2char_str("k.sentdate", &frag);
+	snprintf(query, DEF_QUERYSIZE,
+			"SELECT m.message_idnr, k.subject, k.fromaddr, k.toaddr, k.ccaddr, %s "
+			"FROM %smessages m "
+			"LEFT JOIN %ssortkeys k ON k.physmessage_id = m.physmessage_id "
+			"WHERE m.mailbox_idnr = %llu AND m.message_idnr >= %llu AND m.status IN (%d,%d)",
+			frag, DBPFX, DBPFX, M->id, s->uid[i], MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, query);
+		while (db_result_next(r)) {
+			uid = db_result_get_u64(r, 0);
+			if ((! messages_find(s, uid, &pos)) || s->sortkeys[pos])
+				continue;
+			s->sortkeys[pos] = sortkeys_new(db_result_get(r, 1), db_result_get(r, 2),
+					db_result_get(r, 3), db_result_get(r, 4), db_result_get(r, 5));
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY)
+		return t;
+
+	/* gone since the state was loaded */
+	for (; i < s->count; i++)
+		if (! s->sortkeys[i])
+			s->sortkeys[i] = sortkeys_new(NULL, NULL, NULL, NULL, NULL);
+
+	return t;
+}
+
+typedef struct {
+	msgstate_t *s;
+	const guint8 *criteria;
+} sort_context_t;
+
+#define SORT_CMP(a, b) ((a) < (b) ? -1 : ((a) > (b) ? 1 : 0))
+
+static int messages_sort_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+	sort_context_t *ctx = (sort_context_t *)data;
+	msgstate_t *s = ctx->s;
+	unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+	const sortkeys_t *kx = s->sortkeys[x], *ky = s->sortkeys[y];
+	const guint8 *k;
+	gint64 dx, dy;
+	int r = 0;
+
+	for (k = ctx->criteria; *k; k++) {
+		switch (*k & ~SORT_REVERSE) {
+			case SORT_ARRIVAL:
+				r = SORT_CMP(s->internaldate[x], s->internaldate[y]);
+				break;
+			case SORT_SIZE:
+				r = SORT_CMP(s->rfcsize[x], s->rfcsize[y]);
+				break;
+			case SORT_DATE:
+				/* RFC 5256: fall back to the internal date */
+				dx = (kx->sentdate == INTERNALDATE_UNKNOWN) ? s->internaldate[x] : kx->sentdate;
+				dy = (ky->sentdate == INTERNALDATE_UNKNOWN) ? s->internaldate[y] : ky->sentdate;
+				r = SORT_CMP(dx, dy);
+				break;
+			case SORT_SUBJECT:
+				r = g_ascii_strcasecmp(kx->subject, ky->subject);
+				break;
+			case SORT_FROM:
+				r = g_ascii_strcasecmp(kx->from, ky->from);
+				break;
+			case SORT_TO:
+				r = g_ascii_strcasecmp(kx->to, ky->to);
+				break;
+			case SORT_CC:
+				r = g_ascii_strcasecmp(kx->cc, ky->cc);
+				break;
+		}
+		if (r)
+			return (*k & SORT_REVERSE) ? -r : r;
+	}
+
+	/* ties are broken by sequence number, regardless of REVERSE */
+	return SORT_CMP(x, y);
+}
+
+/*
+ * order the messages in found (indexed by msn) by the 0-terminated list
+ * of criteria. uids is set to the ordered list of uids.
+ */
+int MailboxState_sort(T M, Bitset_T found, const guint8 *criteria, GList **uids)
+{
+	msgstate_t *s = &M->messages;
+	const guint8 *k;
+	sort_context_t ctx;
+	unsigned *msgs, n = 0, i;
+	size_t msn;
+	u64_t *id;
+	int t;
+
+	*uids = NULL;
+
+	for (k = criteria; *k; k++) {
+		switch (*k & ~SORT_REVERSE) {
+			case SORT_ARRIVAL:
+			case SORT_SIZE:
+				break;
+			default:
+				if ((t = messages_load_sortkeys(M)) != DM_SUCCESS)
+					return t;
+				break;
+		}
+	}
+
+	msgs = g_new0(unsigned, s->count + 1);
+	for (msn = 1; Bitset_next(found, &msn) && msn <= s->count; msn++)
+		msgs[n++] = msn - 1;
+
+	ctx.s = s;
+	ctx.criteria = criteria;
+	g_qsort_with_data(msgs, n, sizeof(unsigned), (GCompareDataFunc)messages_sort_cmp, &ctx);
+
+	for (i = n; i > 0; i--) {
+		id = g_new0(u64_t,1);
+		*id = s->uid[msgs[i - 1]];
+		*uids = g_list_prepend(*uids, id);
+	}
+	g_free(msgs);
 
 	return DM_SUCCESS;
 }
 
-GTree * MailboxState_getIds(T M)
+/*
+ * a reply or forward if extracting the base subject removed more than
+ * white space
+ */
+static gboolean subject_is_reply(const char *subject, const char *base)
 {
-	return M->ids;
+	char *tmp;
+	gboolean res;
+
+	if (! subject)
+		return FALSE;
+
+	tmp = g_strdup(subject);
+	dm_pack_spaces(tmp);
+	g_strstrip(tmp);
+	res = (strlen(base) < strlen(tmp));
+	g_free(tmp);
+
+	return res;
 }
 
-GTree * MailboxState_getMsn(T M)
+/*
+ * add the messages that are not in the thread graph yet
+ */
+static int messages_load_threads(T M)
 {
-	return M->msn;
+	msgstate_t *s = &M->messages;
+	unsigned i, pos;
+	const char *name;
+	const void *blob;
+	char *value, **msgids, **subjects;
+	GList **refs;
+	u64_t uid;
+	gint64 date;
+	int l;
+	C c; R r; volatile int t = DM_SUCCESS;
+	INIT_QUERY;
+
+	if (! M->threads)
+		M->threads = Thread_new();
+
+	for (i = 0; i < s->count; i++)
+		if (! Thread_has(M->threads, s->uid[i])) break;
+	if (i == s->count)
+		return DM_SUCCESS;
+
+	/* base subjects and sent dates come with the sort keys */
+	if ((t = messages_load_sortkeys(M)) != DM_SUCCESS)
+		return t;
+
+	msgids = g_new0(char *, s->count);
+	subjects = g_new0(char *, s->count);
+	refs = g_new0(GList *, s->count);
+
+	snprintf(query, DEF_QUERYSIZE,
+			"SELECT m.message_idnr, n.headername, v.headervalue FROM %smessages m "
+			"JOIN %sheader h ON h.physmessage_id = m.physmessage_id "
+			"JOIN %sheadername n ON h.headername_id = n.id "
+			"JOIN %sheadervalue v ON h.headervalue_id = v.id "
+			"WHERE m.mailbox_idnr = %llu AND m.message_idnr >= %llu AND m.status IN (%d,%d) "
+			"AND lower(n.headername) IN ('message-id','subject')",
+			DBPFX, DBPFX, DBPFX, DBPFX, M->id, s->uid[i], 
+			MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, query);
+		while (db_result_next(r)) {
+			uid = db_result_get_u64(r, 0);
+			if ((! messages_find(s, uid, &pos)) || Thread_has(M->threads, uid))
+				continue;
+			name = db_result_get(r, 1);
+			blob = db_result_get_blob(r, 2, &l);
+			value = g_strndup(blob ? blob : "", l);
+			if (g_ascii_strcasecmp(name, "subject") == 0) {
+				g_free(subjects[pos]);
+				subjects[pos] = value;
+			} else {
+				g_free(msgids[pos]);
+				msgids[pos] = g_mime_utils_decode_message_id(value);
+				g_free(value);
+			}
+		}
+
+		db_con_clear(c);
+
+		/* stored in order of appearance */
+		r = db_query(c, "SELECT m.message_idnr, f.referencesfield FROM %smessages m "
+				"JOIN %sreferencesfield f ON f.physmessage_id = m.physmessage_id "
+				"WHERE m.mailbox_idnr = %llu AND m.message_idnr >= %llu AND m.status IN (%d,%d) "
+				"ORDER BY m.message_idnr, f.id",
+				DBPFX, DBPFX, M->id, s->uid[i], MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+		while (db_result_next(r)) {
+			uid = db_result_get_u64(r, 0);
+			if ((! messages_find(s, uid, &pos)) || Thread_has(M->threads, uid))
+				continue;
+			refs[pos] = g_list_prepend(refs[pos], g_strdup(db_result_get(r, 1)));
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	for (; i < s->count; i++) {
+		if ((t == DM_SUCCESS) && (! Thread_has(M->threads, s->uid[i]))) {
+			date = s->sortkeys[i]->sentdate;
+			if (date == INTERNALDATE_UNKNOWN)
+				date = s->internaldate[i];
+			refs[i] = g_list_reverse(refs[i]);
+			Thread_add(M->threads, s->uid[i], msgids[i], refs[i], s->sortkeys[i]->subject, 
+					subject_is_reply(subjects[i], s->sortkeys[i]->subject), date);
+		}
+		g_free(msgids[i]);
+		g_free(subjects[i]);
+		g_list_destroy(refs[i]);
+	}
+	g_free(msgids);
+	g_free(subjects);
+	g_free(refs);
+
+	return t;
+}
+
+/*
+ * the thread graph of the mailbox, brought up to date with the
+ * loaded message state
+ */
+Thread_T MailboxState_getThreads(T M)
+{
+	if (messages_load_threads(M) != DM_SUCCESS)
+		return NULL;
+	return M->threads;
+}
+
+int MailboxState_removeUid(T M, u64_t uid)
+{
+	unsigned pos;
+
+	if (! messages_find(&M->messages, uid, &pos)) {
+		TRACE(TRACE_WARNING,"trying to remove unknown UID [%llu]", uid);
+		return DM_EGENERAL;
+	}
+
+	messages_remove(&M->messages, pos);
+	if (M->threads)
+		Thread_remove(M->threads, uid);
+
+	M->exists--;
+
+	return DM_SUCCESS;
 }
 
 void MailboxState_setId(T M, u64_t id)
@@ -295,7 +1131,7 @@ u64_t MailboxState_getSeq(T M)
 
 unsigned MailboxState_getExists(T M)
 {
-	int real = g_tree_nnodes(M->msginfo);
+	int real = M->messages.count;
 	if (real > (int)M->exists)
 		M->exists = (unsigned)real;
 	return M->exists;
@@ -421,14 +1257,13 @@ void MailboxState_free(T *M)
 	g_tree_destroy(s->keywords);
 	s->keywords = NULL;
 
-	if (s->msn) g_tree_destroy(s->msn);
-	s->msn = NULL;
+	messages_free(&s->messages);
 
-	if (s->ids) g_tree_destroy(s->ids);		
-	s->ids = NULL;
+	g_list_destroy(s->expunged);
+	s->expunged = NULL;
 
-	if (s->msginfo) g_tree_destroy(s->msginfo);
-	s->msginfo = NULL;
+	if (s->threads)
+		Thread_free(&s->threads);
 
 	s->id = 0;
 	s->name = NULL;
@@ -28,16 +28,28 @@
 typedef struct T *T;
 
 extern T            MailboxState_new(u64_t id);
+extern T            MailboxState_update(T);
+extern void         MailboxState_merge(T, T);
+extern gboolean     MailboxState_isPartial(T);
+extern GList *      MailboxState_getExpunged(T);
 
 extern int          MailboxState_preload(T);
 extern int          MailboxState_reload(T);
-extern void         MailboxState_remap(T);
 extern int          MailboxState_removeUid(T, u64_t);
-extern GTree *      MailboxState_getMsginfo(T);
-extern void         MailboxState_setMsginfo(T, GTree *);
-extern void         MailboxState_addMsginfo(T, u64_t, MessageInfo *);
-extern GTree *      MailboxState_getIds(T);
-extern GTree *      MailboxState_getMsn(T);
+
+extern unsigned     MailboxState_count(T);
+extern gboolean     MailboxState_isLoaded(T);
+extern u64_t        MailboxState_msnToUid(T, u64_t msn);
+extern u64_t        MailboxState_uidToMsn(T, u64_t uid);
+extern gboolean     MailboxState_uidRange(T, u64_t lo, u64_t hi, u64_t *first, u64_t *last);
+extern gboolean     MailboxState_hasFlag(T, u64_t uid, int flag);
+extern void         MailboxState_setFlag(T, u64_t uid, int flag, gboolean);
+extern gboolean     MailboxState_getInfo(T, u64_t uid, MessageInfo *);
+extern void         MailboxState_setInfo(T, const MessageInfo *);
+extern void         MessageInfo_clear(MessageInfo *);
+extern Bitset_T     MailboxState_search(T, search_key_t *);
+extern int          MailboxState_sort(T, Bitset_T found, const guint8 *criteria, GList **uids);
+extern Thread_T     MailboxState_getThreads(T);
 
 
 extern void         MailboxState_setId(T, u64_t);
@@ -97,7 +97,8 @@ int Mem_write(T M, const void *data, int size)
 int Mem_read(T M, void *data, int size)
 {
 	assert(M);
-	int read = min((int)M->data->len, size);
+	int read = min((int)M->data->len - M->pos, size);
+	if (read <= 0) return 0;
 	memmove(data, M->data->data+M->pos, read);
 	Mem_seek(M, read, SEEK_CUR);
 	return read;
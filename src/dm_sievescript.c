@@ -28,6 +28,174 @@
 
 extern db_param_t _db_params;
 
+/* seconds a cached lookup is trusted, see dm_sievescript_get_active */
+#define SIEVESCRIPT_CACHE_TTL 60
+
+/*
+ * cached active scripts
+ *
+ * delivery needs the active script of every recipient, so the
+ * lookups are cached per process by user_idnr, including the users
+ * that have no active script at all. Changes made through this
+ * process drop the entry right away and bump the "sieve" generation in
+ * the database; every process compares that generation at most once a
+ * second and drops its cache when it moved, so changes made by
+ * timsieved or dbmail-sievecmd reach delivery within a second. Entries
+ * older than SIEVE_CACHE_TTL seconds are loaded again regardless.
+ */
+typedef struct {
+	char *name;		/* NULL if the user has no active script */
+	char *script;
+	char *hash;
+	time_t loaded;
+} sievescript_cached_t;
+
+static GTree *sievescript_cache = NULL;
+static u64_t sievescript_cache_gen = 0;
+static u64_t sievescript_cache_shared = 0;	/* last seen "sieve" generation */
+static time_t sievescript_cache_checked = 0;	/* when it was last compared */
+static GStaticMutex sievescript_cache_lock = G_STATIC_MUTEX_INIT;
+
+static void sievescript_cached_free(sievescript_cached_t *E)
+{
+	g_free(E->name);
+	g_free(E->script);
+	g_free(E->hash);
+	g_free(E);
+}
+
+static void sievescript_cached_copy(sievescript_cached_t *E, char **scriptname, char **script, char **hash)
+{
+	if (scriptname) *scriptname = g_strdup(E->name);
+	if (script) *script = g_strdup(E->script);
+	if (hash) *hash = g_strdup(E->hash);
+}
+
+static int sievescript_load(u64_t user_idnr, sievescript_cached_t *E)
+{
+	C c; R r; S s; volatile int t = DM_SUCCESS;
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT name, script FROM %ssievescripts WHERE owner_idnr = ? AND active = 1", DBPFX);
+		db_stmt_set_u64(s, 1, user_idnr);
+
+		r = db_stmt_query(s);
+		if (db_result_next(r)) {
+			E->name = g_strdup(db_result_get(r,0));
+			E->script = g_strdup(db_result_get(r,1));
+			E->hash = dm_md5(E->script);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+/* call with sievescript_cache_lock held */
+static void sievescript_cache_clear(void)
+{
+	if (sievescript_cache) {
+		g_tree_destroy(sievescript_cache);
+		sievescript_cache = NULL;
+	}
+	sievescript_cache_gen++;
+}
+
+/* drop the cache if another process changed a script; the
+ * database is asked at most once a second and never under the lock */
+static void sievescript_cache_sync(time_t now)
+{
+	u64_t generation = 0;
+	gboolean check;
+	int t;
+
+	g_static_mutex_lock(&sievescript_cache_lock);
+	if ((check = (sievescript_cache_checked != now)))
+		sievescript_cache_checked = now;
+	g_static_mutex_unlock(&sievescript_cache_lock);
+
+	if (! check)
+		return;
+
+	t = db_generation_get("sieve", &generation);
+
+	g_static_mutex_lock(&sievescript_cache_lock);
+	if (t != DM_SUCCESS || generation != sievescript_cache_shared) {
+		sievescript_cache_shared = generation;
+		sievescript_cache_clear();
+	}
+	g_static_mutex_unlock(&sievescript_cache_lock);
+}
+
+int dm_sievescript_get_active(u64_t user_idnr, char **scriptname, char **script, char **hash)
+{
+	sievescript_cached_t *E;
+	long ttl = config_get_int("SIEVE_CACHE_TTL", "DELIVERY", SIEVESCRIPT_CACHE_TTL);
+	time_t now = time(NULL);
+	u64_t gen, *key;
+	int t;
+
+	if (ttl > 0)
+		sievescript_cache_sync(now);
+
+	g_static_mutex_lock(&sievescript_cache_lock);
+	if (ttl > 0 && sievescript_cache && (E = g_tree_lookup(sievescript_cache, &user_idnr)) 
+			&& (now - E->loaded) < ttl) {
+		sievescript_cached_copy(E, scriptname, script, hash);
+		t = E->name ? TRUE : FALSE;
+		g_static_mutex_unlock(&sievescript_cache_lock);
+		return t;
+	}
+	gen = sievescript_cache_gen;
+	g_static_mutex_unlock(&sievescript_cache_lock);
+
+	E = g_new0(sievescript_cached_t, 1);
+	if (sievescript_load(user_idnr, E) == DM_EQUERY) {
+		sievescript_cached_free(E);
+		return DM_EQUERY;
+	}
+	E->loaded = now;
+
+	sievescript_cached_copy(E, scriptname, script, hash);
+	t = E->name ? TRUE : FALSE;
+
+	g_static_mutex_lock(&sievescript_cache_lock);
+	/* don't store what may have changed while we were loading it */
+	if (ttl > 0 && gen == sievescript_cache_gen) {
+		if (! sievescript_cache)
+			sievescript_cache = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, 
+					(GDestroyNotify)g_free, (GDestroyNotify)sievescript_cached_free);
+		key = g_new0(u64_t,1);
+		*key = user_idnr;
+		g_tree_replace(sievescript_cache, key, E);
+		E = NULL;
+	}
+	g_static_mutex_unlock(&sievescript_cache_lock);
+
+	if (E)
+		sievescript_cached_free(E);
+
+	TRACE(TRACE_DEBUG, "user [%llu] active script [%s]", user_idnr, t ? "yes" : "no");
+
+	return t;
+}
+
+void dm_sievescript_forget(u64_t user_idnr)
+{
+	g_static_mutex_lock(&sievescript_cache_lock);
+	if (sievescript_cache)
+		g_tree_remove(sievescript_cache, &user_idnr);
+	sievescript_cache_gen++;
+	g_static_mutex_unlock(&sievescript_cache_lock);
+
+	db_generation_bump("sieve");
+}
+
 int dm_sievescript_getbyname(u64_t user_idnr, char *scriptname, char **script)
 {
 	C c; R r; S s; volatile int t = FALSE;
@@ -54,7 +222,7 @@ int dm_sievescript_getbyname(u64_t user_idnr, char *scriptname, char **script)
 
 int dm_sievescript_isactive(u64_t user_idnr)
 {
-	return dm_sievescript_isactive_byname(user_idnr, NULL);
+	return dm_sievescript_get_active(user_idnr, NULL, NULL, NULL);
 }
 
 int dm_sievescript_isactive_byname(u64_t user_idnr, const char *scriptname)
@@ -179,6 +347,8 @@ int dm_sievescript_rename(u64_t user_idnr, char *scriptname, char *newname)
 		db_con_close(c);
 	END_TRY;
 
+	dm_sievescript_forget(user_idnr);
+
 	return t;
 }
 
@@ -225,6 +395,8 @@ int dm_sievescript_add(u64_t user_idnr, char *scriptname, char *script)
 		db_con_close(c);
 	END_TRY;
 
+	dm_sievescript_forget(user_idnr);
+
 	return t;
 }
 
@@ -245,6 +417,8 @@ int dm_sievescript_deactivate(u64_t user_idnr, char *scriptname)
 		db_con_close(c);
 	END_TRY;
 
+	dm_sievescript_forget(user_idnr);
+
 	return t;
 }
 
@@ -277,6 +451,8 @@ int dm_sievescript_activate(u64_t user_idnr, char *scriptname)
 		db_con_close(c);
 	END_TRY;
 
+	dm_sievescript_forget(user_idnr);
+
 	return t;
 }
 
@@ -297,6 +473,8 @@ int dm_sievescript_delete(u64_t user_idnr, char *scriptname)
 		db_con_close(c);
 	END_TRY;
 
+	dm_sievescript_forget(user_idnr);
+
 	return t;
 }
 
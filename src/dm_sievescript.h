@@ -51,6 +51,25 @@ int dm_sievescript_getbyname(u64_t user_idnr, char *scriptname, char **script);
  */
 int dm_sievescript_isactive(u64_t user_idnr);
 int dm_sievescript_isactive_byname(u64_t user_idnr, const char *scriptname);
+/**
+ * \brief get the active sieve script of a user, through the cache
+ * \param user_idnr user id
+ * \param scriptname if not NULL, will hold the name of the script
+ * \param script if not NULL, will hold the script itself
+ * \param hash if not NULL, will hold the md5 hash of the script
+ * \return
+ *        - -1 on database failure
+ *        - 1 when user has an active script
+ *        - 0 when user doesn't have an active script
+ * \attention caller should free the returned strings
+ */
+int dm_sievescript_get_active(u64_t user_idnr, char **scriptname, char **script, char **hash);
+/**
+ * \brief drop the cached active script of a user, and tell
+ * other processes to drop theirs
+ * \param user_idnr user id
+ */
+void dm_sievescript_forget(u64_t user_idnr);
 /**
  * \brief get the name of the active sieve script for a user
  * \param user_idnr user id
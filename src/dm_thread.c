@@ -0,0 +1,522 @@
+/*
+
+ Copyright (c) 2010-2011 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+
+#define THIS_MODULE "thread"
+
+/*
+ * implements the Thread interface with the containers of the REFERENCES
+ * algorithm (RFC 5256, section 4). Step 1 of the algorithm runs as
+ * messages are added; the remaining steps run on a copy of the graph
+ * that only holds the requested messages.
+ */
+
+#define T Thread_T
+
+/* expunged messages leave dummy containers and links behind; once
+ * there are enough of them the graph is rebuilt from scratch */
+#define THREAD_REBUILD 256
+
+typedef struct container container_t;
+
+typedef struct {
+	u64_t uid;
+	char *msgid;
+	char **refs;
+	char *subject;		// base subject
+	gboolean isreply;
+	gint64 date;		// sent date
+	container_t *container;
+} message_t;
+
+struct container {
+	container_t *parent;
+	container_t *child;
+	container_t *next;
+	message_t *message;	// NULL for a dummy
+};
+
+struct T {
+	GHashTable *ids;	// Message-ID -> container_t
+	GTree *messages;	// uid -> message_t
+	GPtrArray *containers;	// owns all containers
+	unsigned removed;	// expunged since the last rebuild
+};
+
+static void message_free(message_t *m)
+{
+	g_free(m->msgid);
+	g_strfreev(m->refs);
+	g_free(m->subject);
+	g_free(m);
+}
+
+static container_t * container_new(T G)
+{
+	container_t *c = g_new0(container_t, 1);
+	g_ptr_array_add(G->containers, c);
+	return c;
+}
+
+static container_t * container_get(T G, const char *msgid)
+{
+	container_t *c;
+
+	if (! (c = g_hash_table_lookup(G->ids, msgid))) {
+		c = container_new(G);
+		g_hash_table_insert(G->ids, g_strdup(msgid), c);
+	}
+	return c;
+}
+
+/* a is b or one of its ancestors */
+static gboolean container_reaches(container_t *a, container_t *b)
+{
+	for (; b; b = b->parent)
+		if (b == a) return TRUE;
+	return FALSE;
+}
+
+static void container_link(container_t *parent, container_t *child)
+{
+	child->parent = parent;
+	child->next = parent->child;
+	parent->child = child;
+}
+
+static void container_unlink(container_t *child)
+{
+	container_t **p;
+
+	if (! child->parent)
+		return;
+
+	for (p = &child->parent->child; *p; p = &(*p)->next) {
+		if (*p == child) {
+			*p = child->next;
+			break;
+		}
+	}
+	child->parent = NULL;
+	child->next = NULL;
+}
+
+/*
+ * step 1 of the REFERENCES algorithm for a single message
+ */
+static void thread_link(T G, message_t *m)
+{
+	container_t *c, *prev = NULL;
+	char **r;
+
+	/* A: link the references in order, leaving existing links alone
+	 * and never creating a loop */
+	for (r = m->refs; r && *r; r++) {
+		c = container_get(G, *r);
+		if (prev && (! c->parent) && (! container_reaches(c, prev)))
+			container_link(prev, c);
+		prev = c;
+	}
+
+	/* B: duplicate and missing Message-IDs get a container of their own */
+	c = m->msgid ? g_hash_table_lookup(G->ids, m->msgid) : NULL;
+	if (! c) {
+		c = container_new(G);
+		if (m->msgid)
+			g_hash_table_insert(G->ids, g_strdup(m->msgid), c);
+	} else if (c->message) {
+		c = container_new(G);
+	}
+	c->message = m;
+	m->container = c;
+
+	/* C: the last reference is the parent */
+	container_unlink(c);
+	if (prev && (! container_reaches(c, prev)))
+		container_link(prev, c);
+}
+
+static gboolean thread_relink(gpointer key UNUSED, message_t *m, T G)
+{
+	thread_link(G, m);
+	return FALSE;
+}
+
+static void thread_rebuild(T G)
+{
+	unsigned i;
+
+	TRACE(TRACE_DEBUG, "[%p] messages [%d] removed [%u]", G, g_tree_nnodes(G->messages), G->removed);
+
+	g_hash_table_remove_all(G->ids);
+	for (i = 0; i < G->containers->len; i++)
+		g_free(g_ptr_array_index(G->containers, i));
+	g_ptr_array_set_size(G->containers, 0);
+	G->removed = 0;
+
+	g_tree_foreach(G->messages, (GTraverseFunc)thread_relink, G);
+}
+
+T Thread_new(void)
+{
+	T G = g_new0(struct T, 1);
+	G->ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	G->messages = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)message_free);
+	G->containers = g_ptr_array_new();
+	return G;
+}
+
+void Thread_add(T G, u64_t uid, const char *msgid, GList *refs, const char *subject, gboolean isreply, gint64 date)
+{
+	message_t *m;
+	unsigned i = 0;
+
+	if (Thread_has(G, uid))
+		return;
+
+	m = g_new0(message_t, 1);
+	m->uid = uid;
+	m->msgid = (msgid && *msgid) ? g_strdup(msgid) : NULL;
+	m->refs = g_new0(char *, g_list_length(refs) + 1);
+	for (refs = g_list_first(refs); refs; refs = g_list_next(refs))
+		if (refs->data && *(char *)refs->data)
+			m->refs[i++] = g_strdup((char *)refs->data);
+	m->subject = g_strdup(subject ? subject : "");
+	m->isreply = isreply;
+	m->date = date;
+
+	g_tree_insert(G->messages, &m->uid, m);
+	thread_link(G, m);
+}
+
+void Thread_remove(T G, u64_t uid)
+{
+	message_t *m;
+
+	if (! (m = g_tree_lookup(G->messages, &uid)))
+		return;
+
+	m->container->message = NULL;
+	g_tree_remove(G->messages, &uid);
+
+	if ((++G->removed >= THREAD_REBUILD) && (G->removed * 4 >= Thread_len(G)))
+		thread_rebuild(G);
+}
+
+gboolean Thread_has(T G, u64_t uid)
+{
+	return g_tree_lookup(G->messages, &uid) ? TRUE : FALSE;
+}
+
+unsigned Thread_len(T G)
+{
+	return (unsigned)g_tree_nnodes(G->messages);
+}
+
+/*
+ * the remaining steps work on a tree of GNodes holding the requested
+ * messages; dummies have no data
+ */
+static GNode * thread_copy(container_t *c, GTree *ids)
+{
+	GNode *n;
+	container_t *child;
+
+	n = g_node_new((c->message && g_tree_lookup(ids, &c->message->uid)) ? c->message : NULL);
+	for (child = c->child; child; child = child->next)
+		g_node_prepend(n, thread_copy(child, ids));
+
+	return n;
+}
+
+/* a dummy stands in for its first child */
+static message_t * node_message(GNode *n)
+{
+	while (n && (! n->data))
+		n = n->children;
+	return n ? (message_t *)n->data : NULL;
+}
+
+/* by sent date, then by order in the mailbox */
+static int node_cmp(const void *a, const void *b)
+{
+	message_t *x = node_message(*(GNode **)a), *y = node_message(*(GNode **)b);
+
+	if (! (x && y))
+		return x ? -1 : (y ? 1 : 0);
+	if (x->date != y->date)
+		return (x->date < y->date) ? -1 : 1;
+	if (x->uid != y->uid)
+		return (x->uid < y->uid) ? -1 : 1;
+	return 0;
+}
+
+static void node_sort_children(GNode *n)
+{
+	GNode *c, **v;
+	unsigned i, count;
+
+	if ((count = g_node_n_children(n)) < 2)
+		return;
+
+	v = g_new(GNode *, count);
+	for (i = 0, c = n->children; c; c = c->next)
+		v[i++] = c;
+
+	qsort(v, count, sizeof(GNode *), node_cmp);
+
+	n->children = v[0];
+	for (i = 0; i < count; i++) {
+		v[i]->prev = i ? v[i - 1] : NULL;
+		v[i]->next = (i + 1 < count) ? v[i + 1] : NULL;
+	}
+	g_free(v);
+}
+
+/* youngest siblings first, so dummies sort by their sorted children */
+static void node_sort(GNode *n)
+{
+	GNode *c;
+	for (c = n->children; c; c = c->next)
+		node_sort(c);
+	node_sort_children(n);
+}
+
+/*
+ * step 3: drop dummies without children, and promote the children of
+ * the others, except for a dummy with several children in the root set
+ */
+static void node_prune(GNode *parent, gboolean isroot)
+{
+	GNode *c, *next, *gc, *gnext;
+
+	for (c = parent->children; c; c = next) {
+		next = c->next;
+		node_prune(c, FALSE);
+		if (c->data)
+			continue;
+		if (! c->children) {
+			g_node_destroy(c);
+		} else if ((! isroot) || (! c->children->next)) {
+			for (gc = c->children; gc; gc = gnext) {
+				gnext = gc->next;
+				g_node_unlink(gc);
+				g_node_insert_before(parent, c, gc);
+			}
+			g_node_destroy(c);
+		}
+	}
+}
+
+/*
+ * step 5: gather the threads in the root set by base subject
+ */
+static void node_gather(GNode *root)
+{
+	GHashTable *subjects;
+	GNode *c, *old, *gc, *dummy, **v;
+	message_t *m, *o;
+	unsigned i, count;
+
+	if ((count = g_node_n_children(root)) < 2)
+		return;
+
+	subjects = g_hash_table_new(g_str_hash, g_str_equal);
+	v = g_new(GNode *, count);
+
+	for (i = 0, c = root->children; c; c = c->next) {
+		v[i++] = c;
+		if (! ((m = node_message(c)) && *m->subject))
+			continue;
+		old = g_hash_table_lookup(subjects, m->subject);
+		if ((! old) ||
+				((! c->data) && old->data) ||
+				(old->data && c->data && ((message_t *)old->data)->isreply && (! m->isreply)))
+			g_hash_table_insert(subjects, m->subject, c);
+	}
+
+	for (i = 0; i < count; i++) {
+		c = v[i];
+		if (c->parent != root)
+			continue;
+		if (! ((m = node_message(c)) && *m->subject))
+			continue;
+		if ((! (old = g_hash_table_lookup(subjects, m->subject))) || (old == c))
+			continue;
+
+		o = (message_t *)old->data;
+		if ((! o) && (! c->data)) {
+			/* both dummies: the children become siblings */
+			while ((gc = c->children)) {
+				g_node_unlink(gc);
+				g_node_prepend(old, gc);
+			}
+			g_node_destroy(c);
+		} else if ((! o) || (c->data && m->isreply && (! o->isreply))) {
+			g_node_unlink(c);
+			g_node_prepend(old, c);
+		} else {
+			dummy = g_node_new(NULL);
+			g_node_insert_before(root, old, dummy);
+			g_node_unlink(old);
+			g_node_unlink(c);
+			g_node_prepend(dummy, old);
+			g_node_prepend(dummy, c);
+			g_hash_table_insert(subjects, m->subject, dummy);
+		}
+	}
+
+	g_free(v);
+	g_hash_table_destroy(subjects);
+}
+
+static void node_format(GNode *n, GTree *ids, GString *s)
+{
+	GNode *c;
+	u64_t *id;
+
+	if (n->data) {
+		id = g_tree_lookup(ids, &((message_t *)n->data)->uid);
+		g_string_append_printf(s, "%llu", id ? *id : 0);
+		if (! n->children)
+			return;
+		g_string_append_c(s, ' ');
+		if (! n->children->next) {
+			node_format(n->children, ids, s);
+			return;
+		}
+	}
+
+	for (c = n->children; c; c = c->next) {
+		g_string_append_c(s, '(');
+		node_format(c, ids, s);
+		g_string_append_c(s, ')');
+	}
+}
+
+static char * thread_format(GNode *root, GTree *ids)
+{
+	GString *s = g_string_new("");
+	GNode *c;
+
+	for (c = root->children; c; c = c->next) {
+		g_string_append_c(s, '(');
+		node_format(c, ids, s);
+		g_string_append_c(s, ')');
+	}
+	g_node_destroy(root);
+
+	if (! s->len) {
+		g_string_free(s, TRUE);
+		return NULL;
+	}
+	return g_string_free(s, FALSE);
+}
+
+char * Thread_references(T G, GTree *ids)
+{
+	GNode *root;
+	container_t *c;
+	unsigned i;
+
+	/* step 2: the root set */
+	root = g_node_new(NULL);
+	for (i = 0; i < G->containers->len; i++) {
+		c = g_ptr_array_index(G->containers, i);
+		if (! c->parent)
+			g_node_prepend(root, thread_copy(c, ids));
+	}
+
+	node_prune(root, TRUE);
+	node_sort(root);
+	node_gather(root);
+	node_sort(root);
+
+	return thread_format(root, ids);
+}
+
+static gboolean thread_collect(u64_t *uid, gpointer value UNUSED, gpointer data)
+{
+	gpointer *args = (gpointer *)data;
+	message_t *m;
+
+	if ((m = g_tree_lookup(((T)args[0])->messages, uid)))
+		g_ptr_array_add((GPtrArray *)args[1], m);
+	return FALSE;
+}
+
+static int message_subject_cmp(const void *a, const void *b)
+{
+	message_t *x = *(message_t **)a, *y = *(message_t **)b;
+	int r;
+
+	if ((r = strcmp(x->subject, y->subject)))
+		return r;
+	if (x->date != y->date)
+		return (x->date < y->date) ? -1 : 1;
+	return (x->uid < y->uid) ? -1 : (x->uid > y->uid);
+}
+
+/*
+ * ORDEREDSUBJECT: one thread per base subject, the first message is
+ * the parent of all others
+ */
+char * Thread_orderedsubject(T G, GTree *ids)
+{
+	GPtrArray *found = g_ptr_array_new();
+	gpointer args[2] = { G, found };
+	message_t *m, *first = NULL;
+	GNode *root, *parent = NULL;
+	unsigned i;
+
+	g_tree_foreach(ids, (GTraverseFunc)thread_collect, args);
+	qsort(found->pdata, found->len, sizeof(gpointer), message_subject_cmp);
+
+	root = g_node_new(NULL);
+	for (i = 0; i < found->len; i++) {
+		m = g_ptr_array_index(found, i);
+		if ((! first) || strcmp(m->subject, first->subject)) {
+			parent = g_node_prepend_data(root, m);
+			first = m;
+		} else {
+			g_node_prepend_data(parent, m);
+		}
+	}
+	g_ptr_array_free(found, TRUE);
+
+	node_sort(root);
+
+	return thread_format(root, ids);
+}
+
+void Thread_free(T *G)
+{
+	T g = *G;
+	unsigned i;
+
+	g_hash_table_destroy(g->ids);
+	g_tree_destroy(g->messages);
+	for (i = 0; i < g->containers->len; i++)
+		g_free(g_ptr_array_index(g->containers, i));
+	g_ptr_array_free(g->containers, TRUE);
+	g_free(g);
+	*G = NULL;
+}
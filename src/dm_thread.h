@@ -0,0 +1,50 @@
+/*
+
+ Copyright (c) 2010-2011 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * ADT interface for the thread graph of a mailbox (RFC 5256)
+ *
+ * messages are linked by Message-ID and References as they are added,
+ * so a cached graph only needs to learn about arrivals and expunges.
+ * THREAD output is generated for a set of messages, given as a tree
+ * mapping uid to the number to print (uid or msn).
+ */
+
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#define T Thread_T
+
+typedef struct T *T;
+
+extern T               Thread_new(void);
+extern void            Thread_add(T, u64_t uid, const char *msgid, GList *refs,
+		const char *subject, gboolean isreply, gint64 date);
+extern void            Thread_remove(T, u64_t uid);
+extern gboolean        Thread_has(T, u64_t uid);
+extern unsigned        Thread_len(T);
+extern char *          Thread_references(T, GTree *ids);
+extern char *          Thread_orderedsubject(T, GTree *ids);
+extern void            Thread_free(T *);
+
+#undef T
+
+#endif
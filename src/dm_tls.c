@@ -27,21 +27,63 @@
 
 #include "dbmail.h"
 #include <openssl/err.h>
+#include <pthread.h>
 
 #define THIS_MODULE "tls"
 
 
 SSL_CTX *tls_context;
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* older OpenSSL needs locking callbacks to be used by more
+ * than one thread, which is the case with several reactors */
+static pthread_mutex_t *tls_locks = NULL;
+
+static void tls_locking_cb(int mode, int n, const char *file UNUSED, int line UNUSED)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&tls_locks[n]);
+	else
+		pthread_mutex_unlock(&tls_locks[n]);
+}
+
+static unsigned long tls_thread_id_cb(void)
+{
+	return (unsigned long)pthread_self();
+}
+
+static void tls_init_locks(void)
+{
+	int i;
+	if (tls_locks)
+		return;
+	tls_locks = g_new0(pthread_mutex_t, CRYPTO_num_locks());
+	for (i = 0; i < CRYPTO_num_locks(); i++)
+		pthread_mutex_init(&tls_locks[i], NULL);
+	CRYPTO_set_id_callback(tls_thread_id_cb);
+	CRYPTO_set_locking_callback(tls_locking_cb);
+}
+#endif
+
 /* Create the initial SSL context structure */
 SSL_CTX *tls_init(void) {
 	SSL_CTX *ctx;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	tls_init_locks();
+#endif
 	SSL_library_init();
 	SSL_load_error_strings();
 	/* FIXME: We need to allow for the allowed SSL/TLS versions to be */
 	/* configurable. */
 	
 	ctx = SSL_CTX_new(SSLv23_server_method());
+
+	/* ci_write hands its write buffer to SSL_write as is */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_MODE_RELEASE_BUFFERS
+	/* don't keep buffers around for idle connections */
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif
 	return ctx;
 }
 
@@ -88,6 +130,43 @@ void tls_load_certs(serverConfig_t *conf)
 		conf->ssl = TRUE;
 }
 
+/* set up session resumption
+ *
+ * sessions are cached in memory, which serves reconnects to the same
+ * process. Session tickets are encrypted with a key that is random per
+ * process, unless TLS_TICKET_KEY names a file holding the key. Daemons
+ * sharing that file accept each other's tickets, also across restarts.
+ */
+void tls_load_sessions(serverConfig_t *conf)
+{
+	gchar *key = NULL;
+	gsize len = 0;
+	GError *err = NULL;
+
+	SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(tls_context, (const unsigned char *)conf->service_name,
+			min(strlen(conf->service_name), SSL_MAX_SSL_SESSION_ID_LENGTH));
+
+	if (! strlen(conf->tls_ticket_key))
+		return;
+
+	if (! g_file_get_contents(conf->tls_ticket_key, &key, &len, &err)) {
+		TRACE(TRACE_WARNING, "Error loading ticket key file [%s]: %s",
+				conf->tls_ticket_key, err->message);
+		g_error_free(err);
+		return;
+	}
+
+	/* the size of the key depends on the OpenSSL version: 48 octets
+	 * for 1.0.x, 80 for later versions */
+	if (SSL_CTX_set_tlsext_ticket_keys(tls_context, key, len) != 1)
+		TRACE(TRACE_WARNING, "Unable to use ticket key file [%s] of [%zu] octets: %s",
+				conf->tls_ticket_key, (size_t)len, tls_get_error());
+
+	memset(key, 0, len);
+	g_free(key);
+}
+
 /* load the ciphers into the context */
 void tls_load_ciphers(serverConfig_t *conf) {
 	if (conf->tls_ciphers && strlen(conf->tls_ciphers) &&
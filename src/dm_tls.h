@@ -26,6 +26,7 @@ SSL_CTX *tls_init(void);
 SSL *tls_setup(int);
 void tls_load_certs(serverConfig_t *);
 void tls_load_ciphers(serverConfig_t *);
+void tls_load_sessions(serverConfig_t *);
 char *tls_get_error(void);
 
 #endif
@@ -128,14 +128,16 @@ static int mailbox_dump(u64_t mailbox_idnr, const char *dumpfile,
 		memset(deleted_flag, 0, IMAP_NFLAGS * sizeof(int));
 		deleted_flag[IMAP_FLAG_DELETED] = 1;
 
-		GList *ids = g_tree_keys(MailboxState_getIds(mb->mbstate));
+		u64_t msn, id, count = MailboxState_count(mb->mbstate);
+
+		for (msn = 1; msn <= count; msn++) {
+			id = MailboxState_msnToUid(mb->mbstate, msn);
 
-                while (ids) {
 			// Flag the selected messages \\Deleted
 			// Following this, dbmail-util -d sets deleted status
 			if (delete_after_dump & 1) {
-				if (db_set_msgflag(*(u64_t *)ids->data, deleted_flag, NULL, IMAPFA_ADD, NULL) < 0) {
-					qerrorf("Error setting flags for message [%llu]\n", *(u64_t *)ids->data);
+				if (db_set_msgflag(id, deleted_flag, NULL, IMAPFA_ADD, NULL) < 0) {
+					qerrorf("Error setting flags for message [%llu]\n", id);
 					result = -1;
 				}
 			}
@@ -143,18 +145,12 @@ static int mailbox_dump(u64_t mailbox_idnr, const char *dumpfile,
 			// Set deleted status on each message
 			// Following this, dbmail-util -p sets purge status
 			if (delete_after_dump & 2) {
-				if (! db_set_message_status(*(u64_t *)ids->data, MESSAGE_STATUS_DELETE)) {
-					qerrorf("Error setting status for message [%llu]\n", *(u64_t *)ids->data);
+				if (! db_set_message_status(id, MESSAGE_STATUS_DELETE)) {
+					qerrorf("Error setting status for message [%llu]\n", id);
 					result = -1;
 				}
 			}
-
-			if (!g_list_next(ids))
-				break;
-			ids = g_list_next(ids);
 		}
-
-		g_list_free(g_list_first(ids));
 	}
 
 cleanup:
@@ -44,9 +44,7 @@ const char *IMAP_COMMANDS[] = {
 	"***NOMORE***"
 };
 
-extern int selfpipe[2];
 extern serverConfig_t *server_conf;
-extern GAsyncQueue *queue;
 
 const char AcceptedTagChars[] =
     "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
@@ -87,10 +85,7 @@ static void imap_session_cleanup_enter(dm_thread_data *D)
 
 	dbmail_imap_session_set_state(session, CLIENTSTATE_QUIT_QUEUED);
 	D->session->command_state = TRUE;
-	g_async_queue_push(queue, (gpointer)D);
-	if (selfpipe[1] > -1) {
-		if (write(selfpipe[1], "Q", 1) != 1) { /* ignore */; }
-	}
+	dm_queue_push(D);
 	return;
 }
 
@@ -102,6 +97,7 @@ static void imap_session_cleanup_leave(dm_thread_data *D)
 	if (session->state != CLIENTSTATE_QUIT_QUEUED)
 		return;
 
+	imap_idle_stop(session);
 	ci_close(session->ci);
 	session->ci = NULL;
 	dbmail_imap_session_delete(&session);
@@ -182,8 +178,8 @@ void socket_read_cb(int fd UNUSED, short what, void *arg)
 }
 
 /* 
- * only the main thread may write to the network event
- * worker threads must use an async queue
+ * only the reactor thread of a session may write to the network event
+ * worker threads must use its async queue
  */
 static int imap_session_printf(ImapSession * self, char * message, ...)
 {
@@ -222,6 +218,248 @@ static void send_greeting(ImapSession *session)
 	dbmail_imap_session_set_state(session,CLIENTSTATE_NON_AUTHENTICATED);
 }
 
+/*
+ * IDLE notification
+ *
+ * idling sessions are registered per selected mailbox. Changes made in this
+ * process are announced through db_mailbox_seq_listen and wake the sessions
+ * watching that mailbox right away. Changes made elsewhere (deliveries,
+ * other daemons) are picked up by a single query for the seq of all watched
+ * mailboxes, run at most once per second instead of once per idle session.
+ *
+ * Sessions never leave the reactor thread that accepted them, so each
+ * reactor keeps a watch list of its own and is the only one to touch it.
+ * The database work, polling and refreshing the sessions, is handed to
+ * the worker pool and the results come back to the reactor.
+ */
+
+typedef struct {
+	u64_t id;
+	u64_t seq;
+	GList *sessions;
+} idle_watch_t;
+
+typedef struct {
+	GTree *watches;
+	time_t polled;
+	gboolean polling;
+} idle_state_t;
+
+typedef struct {
+	GTree *seqs;
+	int result;
+} idle_poll_t;
+
+static GStaticPrivate idle_key = G_STATIC_PRIVATE_INIT;
+
+static void idle_watch_free(idle_watch_t *w)
+{
+	g_list_free(w->sessions);
+	g_free(w);
+}
+
+/* the watch list of the calling reactor thread */
+static idle_state_t * idle_state(void)
+{
+	idle_state_t *s;
+
+	if (! (s = g_static_private_get(&idle_key))) {
+		s = g_new0(idle_state_t, 1);
+		g_static_private_set(&idle_key, s, NULL);
+	}
+	return s;
+}
+
+static void imap_idle_refresh(ImapSession *session);
+
+/* worker thread */
+static void imap_idle_refresh_enter(dm_thread_data *D)
+{
+	ImapSession *session = D->session;
+
+	if (session->state == CLIENTSTATE_QUIT_QUEUED)
+		return;
+	dbmail_imap_session_mailbox_status(session,TRUE);
+}
+
+/* reactor thread */
+static void imap_idle_refresh_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ImapSession *session = D->session;
+	idle_state_t *s = idle_state();
+	idle_watch_t *w;
+	gboolean again = (session->idle_refresh > 1);
+
+	session->idle_refresh = 0;
+	dbmail_imap_session_buff_flush(session);
+	if (session->idle_mailbox && session->mailbox && s->watches
+			&& (w = g_tree_lookup(s->watches, &session->idle_mailbox)))
+		w->seq = MailboxState_getSeq(session->mailbox->mbstate);
+	ci_uncork(session->ci);
+
+	/* the mailbox changed again while we were at it */
+	if (again)
+		imap_idle_refresh(session);
+}
+
+static void imap_idle_refresh(ImapSession *session)
+{
+	if (session->idle_refresh) {
+		session->idle_refresh = 2;
+		return;
+	}
+	session->idle_refresh = 1;
+	ci_cork(session->ci);
+	dm_thread_job_push(session, imap_idle_refresh_enter, imap_idle_refresh_leave, NULL);
+}
+
+static void imap_idle_notify(idle_watch_t *w)
+{
+	GList *sessions = g_list_copy(w->sessions);
+	ImapSession *session;
+
+	TRACE(TRACE_DEBUG, "mailbox [%llu] changed, waking [%u] sessions", w->id, g_list_length(sessions));
+
+	while (sessions) {
+		session = (ImapSession *)sessions->data;
+		if (session->command_type == IMAP_COMM_IDLE && session->command_state == IDLE)
+			imap_idle_refresh(session);
+		sessions = g_list_delete_link(sessions, sessions);
+	}
+}
+
+/* reactor thread: a mailbox was changed by this process */
+static void imap_idle_notify_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	idle_state_t *s = idle_state();
+	idle_watch_t *w;
+
+	if (s->watches && (w = g_tree_lookup(s->watches, D->data)))
+		imap_idle_notify(w);
+}
+
+/* any thread: hand the mailbox_idnr over to every reactor */
+static void imap_idle_publish(u64_t mailbox_id)
+{
+	dm_queue_broadcast(imap_idle_notify_leave, &mailbox_id, sizeof(u64_t));
+}
+
+static gboolean idle_seqs_collect(u64_t *id, idle_watch_t *w, GTree *seqs)
+{
+	u64_t *key = g_new0(u64_t, 1);
+	u64_t *seq = g_new0(u64_t, 1);
+
+	*key = *id;
+	*seq = w->seq;
+	g_tree_insert(seqs, key, seq);
+
+	return FALSE;
+}
+
+static gboolean idle_seqs_compare(u64_t *id, u64_t *seq, GList **changed)
+{
+	idle_watch_t *w = g_tree_lookup(idle_state()->watches, id);
+
+	if (w && w->seq != *seq) {
+		w->seq = *seq;
+		*changed = g_list_prepend(*changed, w);
+	}
+
+	return FALSE;
+}
+
+/* worker thread */
+static void imap_idle_poll_enter(dm_thread_data *D)
+{
+	idle_poll_t *P = (idle_poll_t *)D->data;
+	P->result = db_getmailbox_seqs(P->seqs);
+}
+
+/* reactor thread */
+static void imap_idle_poll_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	idle_poll_t *P = (idle_poll_t *)D->data;
+	idle_state_t *s = idle_state();
+	GList *changed = NULL;
+
+	s->polling = FALSE;
+	if (P->result == DM_SUCCESS && s->watches)
+		g_tree_foreach(P->seqs, (GTraverseFunc)idle_seqs_compare, &changed);
+	g_tree_destroy(P->seqs);
+
+	while (changed) {
+		imap_idle_notify((idle_watch_t *)changed->data);
+		changed = g_list_delete_link(changed, changed);
+	}
+}
+
+static void imap_idle_poll(void)
+{
+	idle_poll_t *P;
+	idle_state_t *s = idle_state();
+	time_t now = time(NULL);
+
+	if (! (s->watches && g_tree_nnodes(s->watches)))
+		return;
+	if (s->polling || now == s->polled)
+		return;
+	s->polled = now;
+	s->polling = TRUE;
+
+	P = g_new0(idle_poll_t, 1);
+	P->result = DM_EQUERY;
+	P->seqs = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+	g_tree_foreach(s->watches, (GTraverseFunc)idle_seqs_collect, P->seqs);
+
+	dm_thread_job_push(NULL, imap_idle_poll_enter, imap_idle_poll_leave, P);
+}
+
+void imap_idle_start(ImapSession *session)
+{
+	idle_state_t *s;
+	idle_watch_t *w;
+	u64_t id;
+
+	if (session->state != CLIENTSTATE_SELECTED || ! session->mailbox)
+		return;
+
+	s = idle_state();
+	if (! s->watches) {
+		s->watches = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)idle_watch_free);
+		db_mailbox_seq_listen(imap_idle_publish);
+	}
+
+	id = MailboxState_getId(session->mailbox->mbstate);
+	if (! (w = g_tree_lookup(s->watches, &id))) {
+		w = g_new0(idle_watch_t, 1);
+		w->id = id;
+		w->seq = MailboxState_getSeq(session->mailbox->mbstate);
+		g_tree_insert(s->watches, &w->id, w);
+	}
+	w->sessions = g_list_prepend(w->sessions, session);
+	session->idle_mailbox = id;
+}
+
+void imap_idle_stop(ImapSession *session)
+{
+	idle_state_t *s;
+	idle_watch_t *w;
+
+	if (! session->idle_mailbox)
+		return;
+
+	s = idle_state();
+	if (s->watches && (w = g_tree_lookup(s->watches, &session->idle_mailbox))) {
+		w->sessions = g_list_remove(w->sessions, session);
+		if (! w->sessions)
+			g_tree_remove(s->watches, &session->idle_mailbox);
+	}
+	session->idle_mailbox = 0;
+}
+
 /*
  * the default timeout callback */
 
@@ -231,13 +469,12 @@ void imap_cb_time(void *arg)
 	TRACE(TRACE_DEBUG,"[%p]", session);
 
 	if ( session->command_type == IMAP_COMM_IDLE  && session->command_state == IDLE ) { // session is in a IDLE loop
-		ci_cork(session->ci);
 		if (! (session->loop++ % 10)) {
 			imap_session_printf(session, "* OK\r\n");
 		}
-		dbmail_imap_session_mailbox_status(session,TRUE);
-		dbmail_imap_session_buff_flush(session);
-		ci_uncork(session->ci);
+		/* a session that isn't watching a mailbox has nothing to poll */
+		if (session->idle_mailbox)
+			imap_idle_poll();
 	} else {
 		dbmail_imap_session_set_state(session,CLIENTSTATE_ERROR);
 		imap_session_printf(session, "%s", IMAP_TIMEOUT_MSG);
@@ -371,6 +608,7 @@ void imap_handle_input(ImapSession *session)
 
 		// session is in a IDLE loop
 		if (session->command_type == IMAP_COMM_IDLE  && session->command_state == IDLE) { 
+			imap_idle_stop(session);
 			if (strlen(buffer) > 4 && strncasecmp(buffer,"DONE",4)==0)
 				imap_session_printf(session, "%s OK IDLE terminated\r\n", session->tag);
 			else
@@ -436,6 +674,10 @@ int imap_handle_connection(client_sock *c)
 
 	event_set(ci->rev, ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
 	event_set(ci->wev, ci->tx, EV_WRITE, socket_write_cb, (void *)session);
+	if (ci->reactor) {
+		event_base_set(ci->reactor->base, ci->rev);
+		event_base_set(ci->reactor->base, ci->wev);
+	}
 
 	session->ci = ci;
 
@@ -36,8 +36,6 @@ extern db_param_t _db_params;
 #define DBPFX _db_params.pfx
 
 extern serverConfig_t *server_conf;
-extern int selfpipe[2];
-extern GAsyncQueue *queue;
 extern const char *imap_flag_desc[];
 extern const char *imap_flag_desc_escaped[];
 extern const char AcceptedMailboxnameChars[];
@@ -67,8 +65,8 @@ void cmd_free(cmd_t *cmd)
 }
 
 /* 
- * push a message onto the queue and notify the
- * event-loop by sending a char into the selfpipe
+ * push a message onto the queue of the session's reactor
+ * and notify its event-loop through the selfpipe
  */
 
 #define SESSION_GET \
@@ -76,10 +74,7 @@ void cmd_free(cmd_t *cmd)
 
 #define SESSION_RETURN \
 	D->session->command_state = TRUE; \
-	g_async_queue_push(queue, (gpointer)D); \
-	if (selfpipe[1] > -1) { \
-		if (write(selfpipe[1], "Q", 1) != 1) { /* ignore */; } \
-	} \
+	dm_queue_push(D); \
 	return;
 
 #define SESSION_OK \
@@ -271,12 +266,14 @@ int _ic_authenticate(ImapSession *self)
  * 
  * select a specified mailbox
  */
-static gboolean mailbox_first_unseen(gpointer key, gpointer value, gpointer data)
+static u64_t mailbox_first_unseen(MailboxState_T S)
 {
-	MessageInfo *msginfo = (MessageInfo *)value;
-	if (msginfo->flags[IMAPFLAG_SEEN]) return FALSE; 
-	*(u64_t *)data = *(u64_t *)key;
-	return TRUE;
+	u64_t msn, count = MailboxState_count(S);
+	for (msn = 1; msn <= count; msn++) {
+		if (! MailboxState_hasFlag(S, MailboxState_msnToUid(S, msn), IMAP_FLAG_SEEN))
+			return msn;
+	}
+	return 0;
 }
 
 static int imap_session_mailbox_close(ImapSession *self)
@@ -308,11 +305,14 @@ static int mailbox_check_acl(ImapSession *self, MailboxState_T S, ACLRight_t acl
 }
 
 
-static gboolean mailbox_build_recent(u64_t *uid, MessageInfo *msginfo, ImapSession *self)
+static void mailbox_build_recent(ImapSession *self, MailboxState_T S)
 {
-	if (msginfo->flags[IMAP_FLAG_RECENT])
-		self->recent = g_list_prepend(self->recent, g_strdup_printf("%llu", *uid));
-	return FALSE;
+	u64_t msn, uid, count = MailboxState_count(S);
+	for (msn = 1; msn <= count; msn++) {
+		uid = MailboxState_msnToUid(S, msn);
+		if (MailboxState_hasFlag(S, uid, IMAP_FLAG_RECENT))
+			self->recent = g_list_prepend(self->recent, g_strdup_printf("%llu", uid));
+	}
 }
 
 
@@ -359,10 +359,9 @@ static int imap_session_mailbox_open(ImapSession * self, const char * mailbox)
 	if (MailboxState_noSelect(self->mailbox->mbstate)) return DM_EGENERAL;
 
 	/* build list of recent messages */
-        if (MailboxState_getPermission(self->mailbox->mbstate) == IMAPPERM_READWRITE && MailboxState_getMsginfo(self->mailbox->mbstate)) {
-		GTree *info = MailboxState_getMsginfo(self->mailbox->mbstate);
-		g_tree_foreach(info, (GTraverseFunc)mailbox_build_recent, self);
-		TRACE(TRACE_DEBUG, "build list of [%d] [%d] recent messages...", g_tree_nnodes(info), g_list_length(self->recent));
+        if (MailboxState_getPermission(self->mailbox->mbstate) == IMAPPERM_READWRITE && MailboxState_isLoaded(self->mailbox->mbstate)) {
+		mailbox_build_recent(self, self->mailbox->mbstate);
+		TRACE(TRACE_DEBUG, "build list of [%u] [%d] recent messages...", MailboxState_count(self->mailbox->mbstate), g_list_length(self->recent));
 	}
 
 	return 0;
@@ -406,12 +405,9 @@ static void _ic_select_enter(dm_thread_data *D)
 
 	if (MailboxState_getExists(S)) { 
 		/* show msn of first unseen msg (if present) */
-		GTree *uids = MailboxState_getIds(S);
-		GTree *info = MailboxState_getMsginfo(S);
-		u64_t key = 0, *msn = NULL;
-		g_tree_foreach(info, (GTraverseFunc)mailbox_first_unseen, &key);
-		if ( (key > 0) && (msn = g_tree_lookup(uids, &key)))
-			dbmail_imap_session_buff_printf(self, "* OK [UNSEEN %llu] first unseen message\r\n", *msn);
+		u64_t msn = mailbox_first_unseen(S);
+		if (msn > 0)
+			dbmail_imap_session_buff_printf(self, "* OK [UNSEEN %llu] first unseen message\r\n", msn);
 	}
 
 	if (self->command_type == IMAP_COMM_SELECT) 
@@ -545,6 +541,7 @@ void _ic_delete_enter(dm_thread_data *D)
 		{
 			C c; volatile int t = DM_SUCCESS;
 			u64_t mailbox_size;
+			char *seq;
 			MailboxState_T S = dbmail_imap_session_mbxinfo_lookup(self, mailbox_idnr, FALSE);
 
 			if (! mailbox_is_writable(mailbox_idnr)) {
@@ -558,10 +555,11 @@ void _ic_delete_enter(dm_thread_data *D)
 			}
 
 			/* update messages in this mailbox: mark as deleted (status MESSAGE_STATUS_PURGE) */
+			seq = db_message_seq();
 			c = db_con_get();
 			TRY
 				db_begin_transaction(c);
-				db_exec(c, "UPDATE %smessages SET status=%d WHERE mailbox_idnr = %llu", DBPFX, MESSAGE_STATUS_PURGE, mailbox_idnr);
+				db_exec(c, "UPDATE %smessages SET status=%d, %s WHERE mailbox_idnr = %llu", DBPFX, MESSAGE_STATUS_PURGE, seq, mailbox_idnr);
 				db_exec(c, "UPDATE %smailboxes SET no_select = 1 WHERE mailbox_idnr = %llu", DBPFX, mailbox_idnr);
 				db_commit_transaction(c);
 			CATCH(SQLException)
@@ -571,6 +569,8 @@ void _ic_delete_enter(dm_thread_data *D)
 				db_con_close(c);
 			END_TRY;
 
+			g_free(seq);
+
 			if (t == DM_EQUERY) {
 				D->status=t;
 				SESSION_RETURN;
@@ -1110,13 +1110,11 @@ int _ic_idle(ImapSession *self)
 {
 	if (!check_state_and_args(self, 0, 0, CLIENTSTATE_AUTHENTICATED)) return 1;
 
-	int idle_timeout = IDLE_TIMEOUT;
-	field_t val;
+	int idle_timeout;
 
 	ci_cork(self->ci);
-	GETCONFIGVALUE("idle_timeout", "IMAP", val);
-	if ( strlen(val) && (idle_timeout = atoi(val)) <= 0 ) {
-		TRACE(TRACE_ERR, "[%p] illegal value for idle_timeout [%s]", self, val);
+	if ((idle_timeout = (int)config_get_int("idle_timeout", "IMAP", IDLE_TIMEOUT)) <= 0) {
+		TRACE(TRACE_ERR, "[%p] illegal value for idle_timeout [%d]", self, idle_timeout);
 		idle_timeout = IDLE_TIMEOUT;	
 	}
 	
@@ -1126,6 +1124,7 @@ int _ic_idle(ImapSession *self)
 	dbmail_imap_session_buff_printf(self, "+ idling\r\n");
 	dbmail_imap_session_mailbox_status(self,TRUE);
 	dbmail_imap_session_buff_flush(self);
+	imap_idle_start(self);
 	ci_uncork(self->ci);
 
 	return 0;
@@ -1479,7 +1478,7 @@ static void sorted_search_enter(dm_thread_data *D)
 				s = dbmail_mailbox_orderedsubject(mb);
 			break;
 			case SEARCH_THREAD_REFERENCES:
-				s = NULL; // TODO: unsupported
+				s = dbmail_mailbox_references(mb);
 			break;
 		}
 	} else {
@@ -1521,8 +1520,7 @@ int _ic_thread(ImapSession *self)
 	if (MATCH(self->args[0],"ORDEREDSUBJECT"))
 		return sorted_search(self,SEARCH_THREAD_ORDEREDSUBJECT);
 	if (MATCH(self->args[0],"REFERENCES"))
-		dbmail_imap_session_buff_printf(self, "%s BAD THREAD=REFERENCES not supported\r\n",self->tag);
-		//return sorted_search(self,SEARCH_THREAD_REFERENCES);
+		return sorted_search(self,SEARCH_THREAD_REFERENCES);
 
 	return 1;
 }
@@ -1582,7 +1580,7 @@ static void _ic_fetch_enter(dm_thread_data *D)
 
 	result = DM_SUCCESS;
 
-  	if (g_tree_nnodes(MailboxState_getIds(self->mailbox->mbstate)) > 0) {
+  	if (MailboxState_count(self->mailbox->mbstate) > 0) {
  		if (_dm_imapsession_get_ids(self, self->args[setidx]) == DM_SUCCESS) {
   			self->ids_list = g_tree_keys(self->ids);
   			result = dbmail_imap_session_fetch_get_items(self);
@@ -1620,67 +1618,58 @@ static gboolean _do_store(u64_t *id, gpointer UNUSED value, dm_thread_data *D)
 	ImapSession *self = D->session;
 	cmd_t cmd = self->cmd;
 
-	u64_t *msn;
-	MessageInfo *msginfo = NULL;
+	MessageInfo msginfo;
 	char *s;
 	int i;
 
-	if (self->mailbox && MailboxState_getMsginfo(self->mailbox->mbstate))
-		msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), id);
-
-	if (! msginfo) {
+	if (! (self->mailbox && MailboxState_getInfo(self->mailbox->mbstate, *id, &msginfo))) {
 		TRACE(TRACE_WARNING, "[%p] unable to lookup msginfo struct for [%llu]", self, *id);
 		return TRUE;
 	}
 
-	msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), id);
-
-	if (MailboxState_getPermission(self->mailbox->mbstate) == IMAPPERM_READWRITE) {
-		if (db_set_msgflag(*id, cmd->flaglist, cmd->keywords, cmd->action, msginfo) < 0) {
-			dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
-			D->status = TRUE;
-			return TRUE;
-		}
-	}
-
-	// Set the system flags
+	// Set the system flags, the database was updated by db_set_msgflags
 	for (i = 0; i < IMAP_NFLAGS; i++) {
 		
-		if (i == IMAP_FLAG_RECENT) // Skip recent_flag because it is already part of the query.
+		// recent_flag is never changed by STORE
+		if (i == IMAP_FLAG_RECENT)
 			continue;
 
 		switch (cmd->action) {
 			case IMAPFA_ADD:
 				if (cmd->flaglist[i])
-					msginfo->flags[i] = 1;
+					msginfo.flags[i] = 1;
 			break;
 			case IMAPFA_REMOVE:
 				if (cmd->flaglist[i]) 
-					msginfo->flags[i] = 0;
+					msginfo.flags[i] = 0;
 			break;
 			case IMAPFA_REPLACE:
 				if (cmd->flaglist[i]) 
-					msginfo->flags[i] = 1;
+					msginfo.flags[i] = 1;
 				else
-					msginfo->flags[i] = 0;
+					msginfo.flags[i] = 0;
 			break;
 		}
 	}
 
 	// Set the user keywords as labels
-	g_list_merge(&(msginfo->keywords), cmd->keywords, cmd->action, (GCompareFunc)g_ascii_strcasecmp);
+	g_list_merge(&(msginfo.keywords), cmd->keywords, cmd->action, (GCompareFunc)g_ascii_strcasecmp);
+
+	MailboxState_setInfo(self->mailbox->mbstate, &msginfo);
 
 	// reporting callback
 	if (! cmd->silent) {
 		char *uid = NULL;
 		if (self->use_uid)
 			uid = g_strdup_printf("UID %llu ", *id);
-		s = imap_flags_as_string(self->mailbox->mbstate, msginfo);
-		dbmail_imap_session_buff_printf(self,"* %llu FETCH (%sFLAGS %s)\r\n", *msn, uid?uid:"", s);
+		s = imap_flags_as_string(self->mailbox->mbstate, &msginfo);
+		dbmail_imap_session_buff_printf(self,"* %llu FETCH (%sFLAGS %s)\r\n", msginfo.msn, uid?uid:"", s);
 		if (uid) g_free(uid);
 		g_free(s);
 	}
 
+	MessageInfo_clear(&msginfo);
+
 	return FALSE;
 }
 
@@ -1801,10 +1790,17 @@ static void _ic_store_enter(dm_thread_data *D)
 		g_free(flags);
 	}
 
-	if (g_tree_nnodes(MailboxState_getIds(self->mailbox->mbstate)) > 0) {
- 		if ((result = _dm_imapsession_get_ids(self, self->args[k])) == DM_SUCCESS)
- 			g_tree_foreach(self->ids, (GTraverseFunc) _do_store, D);
-		else
+	if (MailboxState_count(self->mailbox->mbstate) > 0) {
+ 		if ((result = _dm_imapsession_get_ids(self, self->args[k])) == DM_SUCCESS) {
+			if ((MailboxState_getPermission(self->mailbox->mbstate) == IMAPPERM_READWRITE) && 
+					(db_set_msgflags(MailboxState_getId(self->mailbox->mbstate), self->ids, 
+						 cmd->flaglist, cmd->keywords, cmd->action) < 0)) {
+				dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
+				D->status = TRUE;
+			} else {
+ 				g_tree_foreach(self->ids, (GTraverseFunc) _do_store, D);
+			}
+		} else
 			dbmail_imap_session_buff_printf(self, "%s NO STORE failed: Sequence invalid.\r\n", self->tag);
   	}	
 
@@ -1835,32 +1831,13 @@ int _ic_store(ImapSession *self)
  * copy a message to another mailbox
  */
 
-static gboolean _do_copy(u64_t *id, gpointer UNUSED value, ImapSession *self)
-{
-	cmd_t cmd = self->cmd;
-	u64_t newid;
-	int result;
-
-	result = db_copymsg(*id, cmd->mailbox_id, self->userid, &newid);
-	if (result == -1) {
-		dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
-		return TRUE;
-	}
-	if (result == -2) {
-		dbmail_imap_session_buff_printf(self, "%s NO quotum would exceed\r\n", self->tag);
-		return TRUE;
-	}
-	return FALSE;
-}
-
-
 static void _ic_copy_enter(dm_thread_data *D)
 {
 	SESSION_GET;
 	u64_t destmboxid;
 	int result;
 	MailboxState_T S;
-	cmd_t cmd;
+	GTree *newids = NULL;
 
 	/* check if destination mailbox exists */
 	if (! db_findmailbox(self->args[self->args_idx+1], self->userid, &destmboxid)) {
@@ -1881,22 +1858,28 @@ static void _ic_copy_enter(dm_thread_data *D)
 		SESSION_RETURN;
 	}
 
-	cmd = g_malloc0(sizeof(*cmd));
-	cmd->mailbox_id = destmboxid;
-	self->cmd = cmd;
-
-	if (g_tree_nnodes(MailboxState_getIds(self->mailbox->mbstate)) > 0) {
- 		if ((_dm_imapsession_get_ids(self, self->args[self->args_idx]) == DM_SUCCESS))
- 			g_tree_foreach(self->ids, (GTraverseFunc) _do_copy, self);
+	if (MailboxState_count(self->mailbox->mbstate) > 0) {
+ 		if ((_dm_imapsession_get_ids(self, self->args[self->args_idx]) == DM_SUCCESS)) {
+			result = db_copymsgs(MailboxState_getId(self->mailbox->mbstate), self->ids, 
+					destmboxid, self->userid, &newids);
+			if (result == -1) {
+				dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
+				D->status = result;
+				SESSION_RETURN;
+			}
+			if (result == -2) {
+				dbmail_imap_session_buff_printf(self, "%s NO quotum would exceed\r\n", self->tag);
+				D->status = 1;
+				SESSION_RETURN;
+			}
+		}
   	}	
-	g_free(self->cmd);
-	self->cmd = NULL;
-
-	db_mailbox_seq_update(destmboxid);
 
 	if (MailboxState_getId(self->mailbox->mbstate) == destmboxid)
 		dbmail_imap_session_mailbox_status(self, TRUE);
 
+	if (newids) g_tree_destroy(newids);
+
 	SESSION_OK;
 	SESSION_RETURN;
 }
@@ -28,6 +28,9 @@
 #define QUIT 3
 #define MAX_ERRORS 3
 
+/* messages up to this size are spooled in memory, larger ones on disk */
+#define SPOOL_MEMORY (1024*1024)
+
 extern serverConfig_t *server_conf;
 
 /* allowed lmtp commands */
@@ -59,9 +62,24 @@ typedef enum {
 	LMTP_END
 } command_t;
 
+/* a message on its way to the mailboxes */
+typedef struct {
+	GMimeStream *spool;
+	char *from;
+	GList *rcpt;
+} lmtp_delivery_t;
+
 int lmtp(ClientSession_t *session);
 
 static int lmtp_tokenizer(ClientSession_t *session, char *buffer);
+static int lmtp_dispatch(ClientSession_t *session);
+
+/* the SIZE limit, 0 for none */
+static size_t lmtp_max_size(void)
+{
+	long size = config_get_int("max_message_size", "LMTP", 0);
+	return size > 0 ? (size_t)size : 0;
+}
 
 void send_greeting(ClientSession_t *session)
 {
@@ -92,6 +110,18 @@ static void lmtp_handle_input(void *arg)
 	char buffer[MAX_LINESIZE];	/* connection buffer */
 	ClientSession_t *session = (ClientSession_t *)arg;
 	while (TRUE) {
+		if (session->parser_state) {
+			/* a parsed command is waiting for the worker pool */
+			if ((l = lmtp_dispatch(session)) == -3) {
+				client_session_bailout(&session);
+				return;
+			}
+			if (l == 0)
+				return;
+
+			client_session_reset_parser(session);
+		}
+
 		memset(buffer, 0, sizeof(buffer));
 
 		l = ci_readln(session->ci, buffer);
@@ -104,14 +134,6 @@ static void lmtp_handle_input(void *arg)
 				return;
 			}
 
-			if (l > 0) {
-				if (lmtp(session) == -3) {
-					client_session_bailout(&session);
-					return;
-				}
-				client_session_reset_parser(session);
-			}
-
 			if (l < 0) {
 				client_session_reset_parser(session);
 			}
@@ -196,6 +218,65 @@ int lmtp_error(ClientSession_t * session, const char *formatstring, ...)
 	return -1;
 }
 
+/*
+ * message spooling
+ *
+ * DATA lines go straight into a GMime stream, which the parser reads
+ * from once the message is complete. Large messages are moved to an
+ * anonymous file, and the parser leaves their parts there. Once a
+ * message is over the size limit the rest is only counted.
+ */
+static GMimeStream * lmtp_spill(GMimeStream *spool)
+{
+	GMimeStream *file;
+	FILE *f;
+
+	if (! (f = tmpfile())) {
+		TRACE(TRACE_ERR, "unable to create spool file [%s]", strerror(errno));
+		return spool;
+	}
+
+	file = g_mime_stream_file_new(f);
+	g_mime_stream_reset(spool);
+	if (g_mime_stream_write_to_stream(spool, file) < 0) {
+		TRACE(TRACE_ERR, "unable to write spool file");
+		g_object_unref(file);
+		return spool;
+	}
+	g_object_unref(spool);
+
+	return file;
+}
+
+static void lmtp_spool(ClientSession_t *session, const char *line)
+{
+	size_t l = strlen(line);
+	size_t limit = session->spool_limit;
+
+	session->spool_size += l;
+
+	if (! session->spool)
+		return;
+
+	if (limit && session->spool_size > limit) {
+		TRACE(TRACE_INFO, "[%p] message exceeds [%zu] octets", session, limit);
+		g_object_unref(session->spool);
+		session->spool = NULL;
+		return;
+	}
+
+	if (session->spool_size > SPOOL_MEMORY && session->spool_size - l <= SPOOL_MEMORY)
+		session->spool = lmtp_spill(session->spool);
+
+	errno = 0;
+	if (g_mime_stream_write(session->spool, (char *)line, l) != (ssize_t)l) {
+		session->spool_error = errno ? errno : EIO;
+		TRACE(TRACE_ERR, "[%p] unable to spool message [%s]", session, strerror(session->spool_error));
+		g_object_unref(session->spool);
+		session->spool = NULL;
+	}
+}
+
 int lmtp_tokenizer(ClientSession_t *session, char *buffer)
 {
 	char *command = NULL, *value;
@@ -251,15 +332,18 @@ int lmtp_tokenizer(ClientSession_t *session, char *buffer)
 				return lmtp_error(session, "554 No valid sender.\r\n");
 			}
 			ci_write(session->ci, "354 Start mail input; end with <CRLF>.<CRLF>\r\n");
+			session->spool = g_mime_stream_mem_new();
+			session->spool_size = 0;
+			session->spool_error = 0;
 			return FALSE;
 		}
 
 		if (strncmp(buffer,".\n",2)==0 || strncmp(buffer,".\r\n",3)==0)
 			session->parser_state = TRUE;
 		else if (strncmp(buffer,".",1)==0)
-			g_string_append(session->rbuff, &buffer[1]);
+			lmtp_spool(session, &buffer[1]);
 		else
-			g_string_append(session->rbuff, buffer);
+			lmtp_spool(session, buffer);
 	} else
 		session->parser_state = TRUE;
 
@@ -271,11 +355,9 @@ int lmtp_tokenizer(ClientSession_t *session, char *buffer)
 
 int lmtp(ClientSession_t * session)
 {
-	DbmailMessage *msg;
 	clientbase_t *ci = session->ci;
 	int helpcmd;
-	const char *class, *subject, *detail;
-	size_t tmplen = 0, tmppos = 0;
+	size_t tmplen = 0, tmppos = 0, limit;
 	char *tmpaddr = NULL, *tmpbody = NULL, *arg;
 
 	switch (session->command_type) {
@@ -299,9 +381,14 @@ int lmtp(ClientSession_t * session)
 		 * The RFC requires a couple of SMTP extensions
 		 * with a MUST statement, so just hardcode them.
 		 * */
-		ci_write(ci, "250-%s\r\n250-PIPELINING\r\n"
-			"250-ENHANCEDSTATUSCODES\r\n250 SIZE\r\n", 
-			session->hostname);
+		if ((limit = lmtp_max_size()))
+			ci_write(ci, "250-%s\r\n250-PIPELINING\r\n"
+				"250-ENHANCEDSTATUSCODES\r\n250 SIZE %zu\r\n", 
+				session->hostname, limit);
+		else
+			ci_write(ci, "250-%s\r\n250-PIPELINING\r\n"
+				"250-ENHANCEDSTATUSCODES\r\n250 SIZE\r\n", 
+				session->hostname);
 				/* This is a SHOULD implement:
 				 * "250-8BITMIME\r\n"
 				 * Might as well do these, too:
@@ -394,6 +481,22 @@ int lmtp(ClientSession_t * session)
 			if (strlen(tmpbody))
 				tmpbody++;
 
+		/* Refuse a message that announces itself too big
+		 * before any of it is sent (RFC 1870) */
+		/* the limit holds for the whole transaction */
+		session->spool_limit = lmtp_max_size();
+		if ((limit = session->spool_limit)) {
+			char *params = g_ascii_strdown(arg + tmppos, -1);
+			char *size = strstr(params, "size=");
+			if (size && strtoull(size + 5, NULL, 10) > limit) {
+				ci_write(ci, "552 5.3.4 Message size exceeds fixed maximum message size\r\n");
+				g_free(params);
+				g_free(tmpaddr);
+				return 1;
+			}
+			g_free(params);
+		}
+
 		/* This is all a bit nested now... */
 		if (tmpbody) {
 			if (MATCH(tmpbody, "8BITMIME")) {   // RFC1652
@@ -459,55 +562,152 @@ int lmtp(ClientSession_t * session)
 		}
 		return 1;
 
-	/* Here's where it gets really exciting! */
-	case LMTP_DATA:
-		msg = dbmail_message_new();
-		dbmail_message_init_with_string(msg, session->rbuff);
-		dbmail_message_set_header(msg, "Return-Path", (char *)session->from->data);
-		g_string_truncate(session->rbuff,0);
-		g_string_maybe_shrink(session->rbuff);
-
-		if (insert_messages(msg, session->rcpt) == -1) {
-			ci_write(ci, "430 Message not received\r\n");
-			dbmail_message_free(msg);
-			return 1;
-		}
+	default:
+		return lmtp_error(session, "500 What are you trying to say here?\r\n");
+
+	}
+	return 1;
+}
+
+
+/*
+ * command execution
+ *
+ * RCPT looks up the recipient on the worker pool. DATA hands the
+ * message, sender and recipients to a detached job and resets the
+ * session, so a pipelining client can have the next transaction's
+ * recipients resolved while the message is still being delivered.
+ * The replies of that transaction are held until the delivery is done.
+ */
+
+static void lmtp_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ClientSession_t *session = D->client;
+
+	TRY
+		D->status = lmtp(session);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		ci_write(session->ci, "451 4.3.0 Temporary failure in recipient lookup\r\n");
+		D->status = 1;
+	END_TRY;
+	client_session_reset_parser(session);
+}
+
+static void lmtp_data_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	lmtp_delivery_t *delivery = (lmtp_delivery_t *)D->data;
+	GString *reply = g_string_new("");
+	DbmailMessage *msg;
+	GList *rcpt;
+	const char *class, *subject, *detail;
+	volatile int t = 0;
+
+	g_mime_stream_reset(delivery->spool);
+	msg = dbmail_message_new();
+	dbmail_message_init_with_stream(msg, delivery->spool);
+	g_object_unref(delivery->spool);
+	dbmail_message_set_header(msg, "Return-Path", delivery->from);
+
+	TRY
+		t = insert_messages(msg, delivery->rcpt);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = -1;
+	END_TRY;
+
+	if (t == -1) {
+		g_string_append(reply, "430 Message not received\r\n");
+	} else {
 		/* The DATA command itself it not given a reply except
 		 * that of the status of each of the remaining recipients. */
 
 		/* The replies MUST be in the order received */
-		session->rcpt = g_list_reverse(session->rcpt);
-		while (session->rcpt) {
-			deliver_to_user_t * dsnuser = (deliver_to_user_t *)session->rcpt->data;
+		delivery->rcpt = g_list_reverse(delivery->rcpt);
+		for (rcpt = delivery->rcpt; rcpt; rcpt = g_list_next(rcpt)) {
+			deliver_to_user_t * dsnuser = (deliver_to_user_t *)rcpt->data;
 			dsn_tostring(dsnuser->dsn, &class, &subject, &detail);
 
 			/* Give a simple OK, otherwise a detailed message. */
 			switch (dsnuser->dsn.class) {
 				case DSN_CLASS_OK:
-					ci_write(ci, "%d%d%d Recipient <%s> OK\r\n",
+					g_string_append_printf(reply, "%d%d%d Recipient <%s> OK\r\n",
 							dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
 							dsnuser->address);
 					break;
 				default:
-					ci_write(ci, "%d%d%d Recipient <%s> %s %s %s\r\n",
+					g_string_append_printf(reply, "%d%d%d Recipient <%s> %s %s %s\r\n",
 							dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
 							dsnuser->address, class, subject, detail);
 			}
+		}
+	}
+
+	dbmail_message_free(msg);
+	dsnuser_free_list(delivery->rcpt);
+	g_free(delivery->from);
+	g_free(delivery);
 
-			if (! g_list_next(session->rcpt)) break;
-			session->rcpt = g_list_next(session->rcpt);
+	D->data = g_string_free(reply, FALSE);
+}
+
+static void lmtp_data(ClientSession_t *session)
+{
+	lmtp_delivery_t *delivery;
+	GList *rcpt;
+
+	if (! session->spool) {
+		/* too big or not stored: refuse it for every recipient, in order */
+		session->rcpt = g_list_reverse(session->rcpt);
+		for (rcpt = session->rcpt; rcpt; rcpt = g_list_next(rcpt)) {
+			deliver_to_user_t * dsnuser = (deliver_to_user_t *)rcpt->data;
+			if (session->spool_error == ENOSPC)
+				ci_write(session->ci, "452 4.3.1 Recipient <%s> insufficient system storage\r\n",
+						dsnuser->address);
+			else if (session->spool_error)
+				ci_write(session->ci, "451 4.3.0 Recipient <%s> local error in processing\r\n",
+						dsnuser->address);
+			else
+				ci_write(session->ci, "552 5.3.4 Recipient <%s> message too big\r\n",
+						dsnuser->address);
 		}
-		dbmail_message_free(msg);
-		/* Reset the session after a successful delivery;
-		 * MTA's like Exim prefer to immediately begin the
-		 * next delivery without an RSET or a reconnect. */
 		lmtp_rset(session,TRUE);
+		return;
+	}
+
+	delivery = g_new0(lmtp_delivery_t, 1);
+	delivery->spool = session->spool;
+	session->spool = NULL;
+	delivery->from = g_strdup((char *)session->from->data);
+	delivery->rcpt = session->rcpt;
+	session->rcpt = NULL;
+
+	/* Reset the session after a successful delivery;
+	 * MTA's like Exim prefer to immediately begin the
+	 * next delivery without an RSET or a reconnect. */
+	lmtp_rset(session,TRUE);
+
+	client_session_detach(session, lmtp_data_enter, delivery);
+}
+
+/* returns 0 when the session has to wait for the worker pool */
+static int lmtp_dispatch(ClientSession_t *session)
+{
+	switch (session->command_type) {
+	case LMTP_RCPT:
+		client_session_dispatch(session, lmtp_enter, NULL);
+		return 0;
+
+	case LMTP_DATA:
+		/* one delivery at a time */
+		if (session->detached)
+			return 0;
+		lmtp_data(session);
 		return 1;
 
 	default:
-		return lmtp_error(session, "500 What are you trying to say here?\r\n");
-
+		return lmtp(session);
 	}
-	return 1;
 }
-
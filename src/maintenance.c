@@ -52,6 +52,7 @@ static int do_purge_deleted(void);
 static int do_set_deleted(void);
 static int do_dangling_aliases(void);
 static int do_header_cache(void);
+static int do_fts_index(void);
 static int do_check_iplog(const char *timespec);
 static int do_check_replycache(const char *timespec);
 static int do_vacuum_db(void);
@@ -69,7 +70,8 @@ int do_showhelp(void) {
 	"     -a        perform all checks (in this release: -ctubpds)\n"
 	"     -c        clean up database (optimize/vacuum)\n"
 	"     -t        test for message integrity\n"
-	"     -b        body/header/envelope cache check\n"
+	"     -b        body/header/envelope/sortkey cache check\n"
+	"     -F        add unindexed messages to the full-text index\n"
 	"     -p        purge messages have the DELETE status set\n"
 	"     -d        set DELETE status for deleted messages\n"
 	"     -s        remove dangling/invalid aliases and forwards\n"
@@ -102,6 +104,7 @@ int main(int argc, char *argv[])
 	int show_help = 0;
 	int do_nothing = 1;
 	int is_header = 0;
+	int fts_index = 0;
 	int migrate = 0, migrate_limit = 10000;
 	static struct option long_options[] = {
 		{ "rehash", 0, 0, 0 },
@@ -116,7 +119,7 @@ int main(int argc, char *argv[])
 
 	/* get options */
 	opterr = 0;		/* suppress error message from getopt() */
-	while ((opt = getopt_long(argc, argv, "-acbtl:r:pudsMm:" "i" "f:qnyvVh", long_options, &opt_index)) != -1) {
+	while ((opt = getopt_long(argc, argv, "-acbFtl:r:pudsMm:" "i" "f:qnyvVh", long_options, &opt_index)) != -1) {
 		/* The initial "-" of optstring allows unaccompanied
 		 * options and reports them as the optarg to opt 1 (not '1') */
 		switch (opt) {
@@ -146,6 +149,11 @@ int main(int argc, char *argv[])
 			do_nothing = 0;
 			break;
 
+		case 'F':
+			fts_index = 1;
+			do_nothing = 0;
+			break;
+
 		case 'p':
 			purge_deleted = 1;
 			do_nothing = 0;
@@ -275,6 +283,7 @@ int main(int argc, char *argv[])
 	if (check_integrity) do_check_integrity();
 	if (purge_deleted) do_purge_deleted();
 	if (is_header) do_header_cache();
+	if (fts_index) do_fts_index();
 	if (set_deleted) do_set_deleted();
 	if (dangling_aliases) do_dangling_aliases();
 	if (check_iplog) do_check_iplog(timespec_iplog);
@@ -400,7 +409,11 @@ static int db_count_deleted(u64_t * rows)
 
 static int db_set_deleted(void)
 {
-	return db_update("UPDATE %smessages SET status = %d WHERE status = %d", DBPFX, MESSAGE_STATUS_PURGE, MESSAGE_STATUS_DELETE);
+	char *seq = db_message_seq();
+	int t = db_update("UPDATE %smessages SET status = %d, %s WHERE status = %d", 
+			DBPFX, MESSAGE_STATUS_PURGE, seq, MESSAGE_STATUS_DELETE);
+	g_free(seq);
+	return t;
 }
 
 static int db_deleted_purge(void)
@@ -771,6 +784,50 @@ static int do_envelope(void)
 }
 
 
+static int do_sortkeys(void)
+{
+	time_t start, stop;
+	GList *lost = NULL;
+
+	if (no_to_all) {
+		qprintf("\nChecking DBMAIL for cached sort keys...\n");
+	}
+	if (yes_to_all) {
+		qprintf("\nRepairing DBMAIL for cached sort keys...\n");
+	}
+	time(&start);
+
+	if (db_icheck_sortkeys(&lost) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	if (g_list_length(lost) > 0) {
+		qerrorf("Ok. Found [%d] missing sort keys.\n", g_list_length(lost));
+		has_errors = 1;
+	} else {
+		qprintf("Ok. Found [%d] missing sort keys.\n", g_list_length(lost));
+	}
+
+	if (yes_to_all) {
+		if (db_set_sortkeys(lost) < 0) {
+			qerrorf("Error setting the sort keys cache");
+			has_errors = 1;
+		}
+	}
+
+	g_list_destroy(lost);
+
+	time(&stop);
+	qverbosef("--- checking sort keys cache took %g seconds\n",
+	       difftime(stop, start));
+	
+	return 0;
+
+}
+
+
 int do_header_cache(void)
 {
 	time_t start, stop;
@@ -784,6 +841,10 @@ int do_header_cache(void)
 		serious_errors = 1;
 		return -1;
 	}
+	if (do_sortkeys()) {
+		serious_errors = 1;
+		return -1;
+	}
 	
 	if (no_to_all) 
 		qprintf("\nChecking DBMAIL for cached header values...\n");
@@ -822,6 +883,53 @@ int do_header_cache(void)
 }
 
 
+int do_fts_index(void)
+{
+	time_t start, stop;
+	GList *lost = NULL;
+
+	if (! dm_fts_enabled()) {
+		qprintf("\nFull-text index not enabled. Set ftsdriver in dbmail.conf.\n");
+		return 0;
+	}
+
+	if (no_to_all) 
+		qprintf("\nChecking DBMAIL for unindexed messages...\n");
+	if (yes_to_all) 
+		qprintf("\nIndexing DBMAIL messages...\n");
+	
+	time(&start);
+
+	if (dm_fts_missing(&lost) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	if (g_list_length(lost) > 0) {
+		qerrorf("Ok. Found [%d] unindexed physmessages.\n", g_list_length(lost));
+		has_errors = 1;
+	} else {
+		qprintf("Ok. Found [%d] unindexed physmessages.\n", g_list_length(lost));
+	}
+
+	if (yes_to_all) {
+		if (dm_fts_backfill(lost) < 0) {
+			qerrorf("Error indexing messages ");
+			serious_errors = 1;
+		}
+	}
+
+	g_list_destroy(lost);
+
+	time(&stop);
+	qverbosef("--- checking full-text index took %g seconds\n",
+	       difftime(stop, start));
+
+	return 0;
+}
+
+
 int do_check_iplog(const char *timespec)
 {
 	u64_t log_count;
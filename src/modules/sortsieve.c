@@ -50,6 +50,40 @@ struct sort_result {
 	GString *errormsg;
 };
 
+/* 
+ * scripts that failed to parse, by md5 of the script text.
+ * libSieve parses a script on every sieve2_execute, so the least we
+ * can do is not feed it the same broken script for every delivery.
+ * An edited script hashes differently, so entries never go stale.
+ */
+#define SORT_BROKEN_MAX 1024
+
+static GHashTable *sort_broken = NULL;
+static GStaticMutex sort_broken_lock = G_STATIC_MUTEX_INIT;
+
+static gboolean sort_broken_lookup(const char *hash)
+{
+	gboolean broken = FALSE;
+
+	g_static_mutex_lock(&sort_broken_lock);
+	if (sort_broken)
+		broken = g_hash_table_lookup(sort_broken, hash) ? TRUE : FALSE;
+	g_static_mutex_unlock(&sort_broken_lock);
+
+	return broken;
+}
+
+static void sort_broken_insert(const char *hash)
+{
+	g_static_mutex_lock(&sort_broken_lock);
+	if (! sort_broken)
+		sort_broken = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	if (g_hash_table_size(sort_broken) >= SORT_BROKEN_MAX)
+		g_hash_table_remove_all(sort_broken);
+	g_hash_table_replace(sort_broken, g_strdup(hash), GINT_TO_POINTER(1));
+	g_static_mutex_unlock(&sort_broken_lock);
+}
+
 /* [DELIVERY] SIEVE_* settings in dbmail.conf */
 struct sort_sieve_config {
 	int vacation;
@@ -59,28 +93,11 @@ struct sort_sieve_config {
 
 static void sort_sieve_get_config(struct sort_sieve_config *sieve_config)
 {
-	field_t val;
-
 	assert(sieve_config != NULL);
 
-	sieve_config->vacation = 0;
-	sieve_config->notify = 0;
-	sieve_config->debug = 0;
-
-	config_get_value("SIEVE_VACATION", "DELIVERY", val);
-	if (strcasecmp(val, "yes") == 0) {
-		sieve_config->vacation = 1;
-	}
-
-	config_get_value("SIEVE_NOTIFY", "DELIVERY", val);
-	if (strcasecmp(val, "yes") == 0) {
-		sieve_config->notify= 1;
-	}
-
-	config_get_value("SIEVE_DEBUG", "DELIVERY", val);
-	if (strcasecmp(val, "yes") == 0) {
-		sieve_config->debug = 1;
-	}
+	sieve_config->vacation = config_get_bool("SIEVE_VACATION", "DELIVERY");
+	sieve_config->notify = config_get_bool("SIEVE_NOTIFY", "DELIVERY");
+	sieve_config->debug = config_get_bool("SIEVE_DEBUG", "DELIVERY");
 }
 
 /*
@@ -481,12 +498,15 @@ int sort_getscript(sieve2_context_t *s, void *my)
 		TRACE(TRACE_INFO, "Include requested from [%s] named [%s]", path, name);
 	} else
 	if (!strlen(path) && !strlen(name)) {
-		/* Read the script file given as an argument. */
+		/* Read the script file given as an argument,
+		 * unless sort_process already has it. */
 		TRACE(TRACE_INFO, "Getting default script named [%s]", m->script);
-		res = dm_sievescript_getbyname(m->user_idnr, m->script, &m->s_buf);
-		if (res != SIEVE2_OK) {
-			TRACE(TRACE_ERR, "sort_getscript: read_file() returns %d\n", res);
-			return SIEVE2_ERROR_FAIL;
+		if (! m->s_buf) {
+			res = dm_sievescript_getbyname(m->user_idnr, m->script, &m->s_buf);
+			if (res != SIEVE2_OK) {
+				TRACE(TRACE_ERR, "sort_getscript: read_file() returns %d\n", res);
+				return SIEVE2_ERROR_FAIL;
+			}
 		}
 		sieve2_setvalue_string(s, "script", m->s_buf);
 	} else {
@@ -878,6 +898,7 @@ sort_result_t *sort_process(u64_t user_idnr, DbmailMessage *message, const char
 	struct sort_result *result = NULL;
 	sieve2_context_t *sieve2_context;
 	struct sort_context *sort_context;
+	char *hash = NULL;
 
 	/* The contents of this function are taken from
 	 * the libSieve distribution, sv_test/example.c,
@@ -899,9 +920,9 @@ sort_result_t *sort_process(u64_t user_idnr, DbmailMessage *message, const char
 	if (mailbox)
 		sort_context->result->mailbox = mailbox;
 
-	res = dm_sievescript_get(user_idnr, &sort_context->script);
-	if (res != 0) {
-		TRACE(TRACE_ERR, "Error [%d] when calling db_getactive_sievescript", res);
+	res = dm_sievescript_get_active(user_idnr, &sort_context->script, &sort_context->s_buf, &hash);
+	if (res < 0) {
+		TRACE(TRACE_ERR, "Error [%d] when calling dm_sievescript_get_active", res);
 		exitnull = 1;
 		goto freesieve;
 	}
@@ -910,6 +931,11 @@ sort_result_t *sort_process(u64_t user_idnr, DbmailMessage *message, const char
 		exitnull = 1;
 		goto freesieve;
 	}
+	if (sort_broken_lookup(hash)) {
+		TRACE(TRACE_INFO, "Sieve script [%s] is known not to parse; skipping.", sort_context->script);
+		exitnull = 1;
+		goto freesieve;
+	}
 
 	res = sieve2_execute(sieve2_context, sort_context);
 	if (res != SIEVE2_OK) {
@@ -917,6 +943,8 @@ sort_result_t *sort_process(u64_t user_idnr, DbmailMessage *message, const char
 			res, sieve2_errstr(res));
 		exitnull = 1;
 	}
+	if (sort_context->result->error_parse)
+		sort_broken_insert(hash);
 	if (! sort_context->result->cancelkeep) {
 		TRACE(TRACE_INFO, "No actions taken; message must be kept.");
 	}
@@ -928,6 +956,7 @@ freesieve:
 		g_free(sort_context->s_buf);
 	if (sort_context->script)
 		g_free(sort_context->script);
+	g_free(hash);
 
 	if (exitnull)
 		result = NULL;
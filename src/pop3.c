@@ -218,6 +218,19 @@ static void pop3_close(ClientSession_t *session)
 }
 
 
+/* commands run on the worker pool */
+static void pop3_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+
+	TRY
+		pop3(D->client, (const char *)D->data);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		ci_write(D->client->ci, "-ERR database unavailable, try again later\r\n");
+	END_TRY;
+}
+
 /* the default pop3 read handler */
 
 static void pop3_handle_input(void *arg)
@@ -234,7 +247,13 @@ static void pop3_handle_input(void *arg)
 	if (ci_readln(session->ci, buffer) == 0)
 		return;
 
-	pop3(session, buffer);
+	/* the STLS reply has to go out before the handshake starts */
+	if (strncasecmp(buffer, "STLS", 4) == 0) {
+		pop3(session, buffer);
+		return;
+	}
+
+	client_session_dispatch(session, pop3_enter, g_strdup(buffer));
 }
 
 void pop3_cb_write(void *arg)
@@ -291,7 +310,7 @@ int pop3_error(ClientSession_t * session, const char *formatstring, ...)
 
 	if (session->error_count >= MAX_ERRORS) {
 		ci_write(ci, "-ERR too many errors\r\n");
-		client_session_bailout(&session);
+		session->state = CLIENTSTATE_QUIT;
 		return -3;
 	} else {
 		va_start(ap, formatstring);
@@ -34,20 +34,24 @@ volatile sig_atomic_t mainRestart = 0;
 volatile sig_atomic_t alarm_occurred = 0;
 
 // thread data
-int selfpipe[2];
-GAsyncQueue *queue;
 GThreadPool *tpool = NULL;
 
+// event loops: reactors[0] runs in the main thread
+static dm_reactor **reactors = NULL;
+static guint reactor_count = 0;
+static guint reactor_next = 0;
+static GStaticPrivate reactor_key = G_STATIC_PRIVATE_INIT;
+
 serverConfig_t *server_conf;
 extern db_param_t _db_params;
 
 static void server_config_load(serverConfig_t * conf, const char * const service);
 static int server_set_sighandler(void);
+static void dm_thread_dispatch(gpointer data, gpointer user_data);
 void disconnect_all(void);
 
 struct event *sig_int, *sig_hup, *sig_pipe, *sig_term;
 
-struct event *pev = NULL;
 SSL_CTX *tls_context;
 
 /* 
@@ -61,17 +65,18 @@ SSL_CTX *tls_context;
 
 
 /*
- * async queue drainage callback for the main thread
+ * async queue drainage callback for the reactor threads
  */
-void dm_queue_drain(int sock, short event UNUSED, void *arg UNUSED)
+void dm_queue_drain(int sock, short event UNUSED, void *arg)
 {
+	dm_reactor *r = (dm_reactor *)arg;
 	char buf[128];
 	gpointer data;
 
-	event_del(pev);
+	event_del(r->pev);
 
 	do {
-		data = g_async_queue_try_pop(queue);
+		data = g_async_queue_try_pop(r->queue);
 		if (data) {
 			dm_thread_data *D = (gpointer)data;
 			if (D->cb_leave) D->cb_leave(data);
@@ -82,7 +87,74 @@ void dm_queue_drain(int sock, short event UNUSED, void *arg UNUSED)
 	while ((read(sock, buf, 128)) > 0)
 		;
 
-	event_add(pev, NULL);
+	event_add(r->pev, NULL);
+}
+
+/*
+ * hand a job over to a reactor and wake up its event loop
+ */
+void dm_reactor_push(dm_reactor *r, dm_thread_data *D)
+{
+	g_async_queue_push(r->queue, (gpointer)D);
+	if (r->selfpipe[1] > -1) {
+		if (write(r->selfpipe[1], "Q", 1) != 1) { /* ignore */; }
+	}
+}
+
+/*
+ * the reactor running the calling thread, or the main reactor
+ * when called from a thread that doesn't run one
+ */
+dm_reactor * dm_reactor_current(void)
+{
+	dm_reactor *r;
+	if (! reactors)
+		return NULL;
+	if ((r = g_static_private_get(&reactor_key)))
+		return r;
+	return reactors[0];
+}
+
+/*
+ * queue a completed job for the reactor of its session
+ */
+void dm_queue_push(dm_thread_data *D)
+{
+	dm_reactor *r = NULL;
+
+	if (! reactors) {
+		/* no event loop to hand it to */
+		if (D->cb_leave) D->cb_leave(D);
+		dm_thread_data_free(D);
+		return;
+	}
+
+	if (D->reactor)
+		r = D->reactor;
+	else if (D->session && D->session->ci)
+		r = D->session->ci->reactor;
+	else if (D->client && D->client->ci)
+		r = D->client->ci->reactor;
+	if (! r)
+		r = reactors[0];
+
+	dm_reactor_push(r, D);
+}
+
+/*
+ * queue a job for every reactor; each gets its own copy of data
+ */
+void dm_queue_broadcast(void (*cb_leave)(gpointer), gconstpointer data, guint size)
+{
+	dm_thread_data *D;
+	guint i;
+
+	for (i = 0; i < reactor_count; i++) {
+		D = g_new0(dm_thread_data, 1);
+		D->cb_leave = cb_leave;
+		D->data = g_memdup(data, size);
+		dm_reactor_push(reactors[i], D);
+	}
 }
 
 /* 
@@ -122,6 +194,62 @@ void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave,
 	if (err) TRACE(TRACE_EMERG,"g_thread_pool_push failed [%s]", err->message);
 }
 
+/*
+ * push a client session job to the thread pool, or run it
+ * right away when there is no pool
+ */
+void dm_thread_pool_push(dm_thread_data *D)
+{
+	GError *err = NULL;
+
+	assert(D->client);
+	assert(D->cb_enter);
+
+	TRACE(TRACE_DEBUG,"[%p] [%p]", D, D->client);
+
+	if (! tpool) {
+		dm_thread_dispatch(D, NULL);
+		return;
+	}
+
+	g_thread_pool_push(tpool, D, &err);
+
+	if (err) TRACE(TRACE_EMERG,"g_thread_pool_push failed [%s]", err->message);
+}
+
+/*
+ * push a background job to the thread pool. It doesn't run a command,
+ * so the state of the session, if any, is left alone. cb_leave runs on
+ * the reactor of the session, or else on that of the calling thread.
+ */
+void dm_thread_job_push(ImapSession *session, gpointer cb_enter, gpointer cb_leave, gpointer data)
+{
+	GError *err = NULL;
+	dm_thread_data *D;
+
+	assert(cb_enter);
+
+	D = g_new0(dm_thread_data,1);
+	D->cb_enter	= cb_enter;
+	D->cb_leave     = cb_leave;
+	D->session	= session;
+	D->data         = data;
+	D->reactor	= (session && session->ci) ? session->ci->reactor : dm_reactor_current();
+
+	TRACE(TRACE_DEBUG,"[%p] [%p]", D, D->session);
+
+	if (! (tpool && D->reactor)) {
+		/* nobody to hand it to, run it right here */
+		D->cb_enter(D);
+		dm_queue_push(D);
+		return;
+	}
+
+	g_thread_pool_push(tpool, D, &err);
+
+	if (err) TRACE(TRACE_EMERG,"g_thread_pool_push failed [%s]", err->message);
+}
+
 void dm_thread_data_free(gpointer data)
 {
 	dm_thread_data *D = (dm_thread_data *)data;
@@ -133,7 +261,7 @@ void dm_thread_data_free(gpointer data)
 
 /* 
  * worker threads can send messages to the client
- * through the main thread async queue. This data
+ * through the async queue of its reactor. This data
  * is written directly to the output event
  */
 void dm_thread_data_sendmessage(gpointer data)
@@ -156,10 +284,80 @@ static void dm_thread_dispatch(gpointer data, gpointer user_data)
 	TRACE(TRACE_DEBUG,"data[%p], user_data[%p]", data, user_data);
 	dm_thread_data *D = (dm_thread_data *)data;
 	ImapSession *session = (ImapSession *)D->session;
+
+	if (D->client || D->reactor) {
+		TRY
+			D->cb_enter(D);
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			D->status = -3;
+		END_TRY;
+		dm_queue_push(D);
+		return;
+	}
+
 	if (session->state == CLIENTSTATE_QUIT_QUEUED)
 		return;
 
-	D->cb_enter(D);
+	TRY
+		D->cb_enter(D);
+	CATCH(SQLException)
+		/* no database connection came free: fail this command
+		 * instead of the whole daemon */
+		LOG_SQLERROR;
+		dbmail_imap_session_buff_clear(session);
+		dbmail_imap_session_buff_printf(session, "%s NO database unavailable, try again later\r\n", session->tag);
+		D->status = 1;
+		session->command_state = TRUE;
+		dm_queue_push(D);
+	END_TRY;
+}
+
+/*
+ * event loop of the I/O threads
+ */
+static gpointer dm_reactor_run(gpointer data)
+{
+	dm_reactor *r = (dm_reactor *)data;
+
+	g_static_private_set(&reactor_key, r, NULL);
+
+	TRACE(TRACE_DEBUG, "reactor [%p] dispatching event loop...", r);
+	event_base_dispatch(r->base);
+
+	return NULL;
+}
+
+static dm_reactor * dm_reactor_new(struct event_base *base)
+{
+	dm_reactor *r = g_new0(dm_reactor, 1);
+
+	r->base = base;
+	r->queue = g_async_queue_new();
+
+	// self-pipe used to push the event-loop
+	if (pipe(r->selfpipe))
+		TRACE(TRACE_EMERG, "selfpipe setup failed");
+
+	UNBLOCK(r->selfpipe[0]);
+	UNBLOCK(r->selfpipe[1]);
+
+	r->pev = g_new0(struct event, 1);
+	event_set(r->pev, r->selfpipe[0], EV_READ, dm_queue_drain, r);
+	event_base_set(r->base, r->pev);
+	event_add(r->pev, NULL);
+
+	return r;
+}
+
+/*
+ * pick the reactor for a new connection, round-robin
+ */
+static dm_reactor * dm_reactor_next(void)
+{
+	if (! reactors)
+		return NULL;
+	return reactors[reactor_next++ % reactor_count];
 }
 
 /*
@@ -167,39 +365,45 @@ static void dm_thread_dispatch(gpointer data, gpointer user_data)
  * basic server setup
  *
  */
-static int server_setup(serverConfig_t *conf)
+static int server_setup(serverConfig_t *conf, struct event_base *base)
 {
 	GError *err = NULL;
 	guint tpool_size = _db_params.max_db_connections;
+	guint i;
 
 	server_set_sighandler();
 
-	if (! MATCH(conf->service_name,"IMAP")) 
+	if (MATCH(conf->service_name,"HTTP")) 
 		return 0;
 
 	if (! g_thread_supported () ) g_thread_init (NULL);
-	// Asynchronous message queue for receiving messages
-	// from worker threads in the main thread. 
-	//
-	// Only the main thread is allowed to do network IO.
-	// see the libevent docs for the ratio and a work-around.
-	// Dbmail only needs and uses a single eventbase for now.
-	queue = g_async_queue_new();
+
+	trace_start_flusher();
 
 	// Create the thread pool
 	if (! (tpool = g_thread_pool_new((GFunc)dm_thread_dispatch,NULL,tpool_size,TRUE,&err)))
 		TRACE(TRACE_DEBUG,"g_thread_pool creation failed [%s]", err->message);
 
-	// self-pipe used to push the event-loop
-	if (pipe(selfpipe))
-		TRACE(TRACE_EMERG, "selfpipe setup failed");
+	// Network IO for a client is only done by the reactor that
+	// owns it. Each reactor has an event base and an asynchronous
+	// queue for receiving messages from the worker threads. 
+	// libevent bases are not thread-safe, so all but the first
+	// reactor run their base in a thread of their own.
+	reactor_count = max(conf->io_threads, 1);
+	reactors = g_new0(dm_reactor *, reactor_count);
+
+	reactors[0] = dm_reactor_new(base);
+	g_static_private_set(&reactor_key, reactors[0], NULL);
+
+	for (i = 1; i < reactor_count; i++) {
+		reactors[i] = dm_reactor_new(event_base_new());
+		if (! (reactors[i]->thread = g_thread_create((GThreadFunc)dm_reactor_run, reactors[i], FALSE, &err))) {
+			TRACE(TRACE_EMERG, "reactor thread creation failed [%s]", err->message);
+			return -1;
+		}
+	}
 
-	UNBLOCK(selfpipe[0]);
-	UNBLOCK(selfpipe[1]);
-	
-	pev = g_new0(struct event, 1);
-	event_set(pev, selfpipe[0], EV_READ, dm_queue_drain, NULL);
-	event_add(pev, NULL);
+	TRACE(TRACE_INFO, "running [%u] reactors", reactor_count);
 
 	return 0;
 }
@@ -224,8 +428,9 @@ static int server_start_cli(serverConfig_t *conf)
 	if (MATCH(conf->service_name,"HTTP")) {
 		TRACE(TRACE_DEBUG,"starting httpd cli server...");
 	} else {
-		event_init();
-		if (server_setup(conf)) return -1;
+		struct event_base *base = event_init();
+		conf->io_threads = 1; // stdin/stdout is a single client
+		if (server_setup(conf, base)) return -1;
 		conf->ClientHandler(NULL);
 		event_dispatch();
 	}
@@ -442,8 +647,10 @@ static void server_create_sockets(serverConfig_t * conf)
 
 	tls_load_certs(conf);
 
-	if (conf->ssl)
+	if (conf->ssl) {
 		tls_load_ciphers(conf);
+		tls_load_sessions(conf);
+	}
 
 	if (conf->port && strlen(conf->port)) {
 		for (i = 0; i < conf->ipcount; i++) {
@@ -458,6 +665,33 @@ static void server_create_sockets(serverConfig_t * conf)
 	}
 }
 
+/*
+ * run the client handler for an accepted connection
+ * in the thread of the reactor it was assigned to
+ */
+static void server_client_handle(client_sock *c)
+{
+	/* streams are ready, perform handling */
+	server_conf->ClientHandler(c);
+
+	g_free(c->caddr);
+	g_free(c->saddr);
+
+	if (c->ssl) {
+		SSL_shutdown(c->ssl);
+		SSL_free(c->ssl);
+	}
+
+	g_free(c);
+}
+
+static void server_client_handle_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	server_client_handle((client_sock *)D->data);
+	D->data = NULL;
+}
+
 static void _sock_cb(int sock, short event, void *arg, gboolean ssl)
 {
 	client_sock *c = g_new0(client_sock,1);
@@ -507,19 +741,17 @@ static void _sock_cb(int sock, short event, void *arg, gboolean ssl)
 
 	TRACE(TRACE_INFO, "connection accepted");
 
-	/* streams are ready, perform handling */
-	server_conf->ClientHandler((client_sock *)c);
-
-	g_free(caddr);
-	g_free(saddr);
-
-	if (c->ssl) {
-		SSL_shutdown(c->ssl);
-		SSL_free(c->ssl);
+	c->reactor = dm_reactor_next();
+	if (c->reactor && c->reactor->thread) {
+		/* leave the client to an I/O thread */
+		dm_thread_data *D = g_new0(dm_thread_data, 1);
+		D->cb_leave = server_client_handle_leave;
+		D->data = c;
+		dm_reactor_push(c->reactor, D);
+	} else {
+		server_client_handle(c);
 	}
 
-	g_free(c);
-
 	/* reschedule */
 	event_add(ev, NULL);
 
@@ -536,6 +768,19 @@ static void server_sock_ssl_cb(int sock, short event, void *arg)
 }
 
 
+/* re-read the config file; runs on the main reactor */
+static void server_sighup(void)
+{
+	TRACE(TRACE_NOTICE, "reloading config [%s]", configFile);
+	if (config_reload(configFile) == 0) {
+		SetTraceLevel(server_conf->service_name);
+		/* Override SetTraceLevel. */
+		if (server_conf->log_verbose)
+			configure_debug(5,5);
+	}
+	auth_cache_flush();
+}
+
 void server_sig_cb(int fd, short event, void *arg)
 {
 	struct event *ev = arg;
@@ -543,8 +788,9 @@ void server_sig_cb(int fd, short event, void *arg)
 	TRACE(TRACE_DEBUG,"fd [%d], event [%d], signal [%d]", fd, event, EVENT_SIGNAL(ev));
 
 	switch (EVENT_SIGNAL(ev)) {
-		case SIGHUP: // TODO: reload config
-			mainRestart = 1;
+		case SIGHUP:
+			server_sighup();
+		break;
 		case SIGPIPE: // ignore
 		break;
 		default:
@@ -620,6 +866,7 @@ int server_run(serverConfig_t *conf)
 {
 	int i;
 	struct event *evsock;
+	struct event_base *base;
 
 	mainRestart = 0;
 
@@ -644,9 +891,9 @@ int server_run(serverConfig_t *conf)
 
 	server_conf = conf;
 
-	event_init();
+	base = event_init();
 
-	if (server_setup(conf)) return -1;
+	if (server_setup(conf, base)) return -1;
 
 	if (conf->port) {
 
@@ -847,8 +1094,7 @@ void server_config_load(serverConfig_t * config, const char * const service)
 	field_t val, val_ssl;
 
 	TRACE(TRACE_DEBUG, "reading config [%s]", configFile);
-	config_free();
-	config_read(configFile);
+	config_reload(configFile);
 
 	SetTraceLevel(service);
 	/* Override SetTraceLevel. */
@@ -933,6 +1179,20 @@ void server_config_load(serverConfig_t * config, const char * const service)
 	} else if ((config->backlog = atoi(val)) <= 0)
 		TRACE(TRACE_EMERG, "value for BACKLOG is invalid: [%d]", config->backlog);
 
+	/* read items: IO_THREADS */
+	config_get_value("IO_THREADS", service, val);
+	if (strlen(val) == 0) {
+		TRACE(TRACE_DEBUG, "no value for IO_THREADS in config file. Using default value [1]");
+		config->io_threads = 1;
+	} else if ((config->io_threads = atoi(val)) == 0) {
+		/* one reactor per core */
+		if ((config->io_threads = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			config->io_threads = 1;
+	} else if (config->io_threads < 0)
+		TRACE(TRACE_EMERG, "value for IO_THREADS is invalid: [%d]", config->io_threads);
+
+	TRACE(TRACE_DEBUG, "io_threads [%d]", config->io_threads);
+
 	/* read items: RESOLVE_IP */
 	config_get_value("RESOLVE_IP", service, val);
 	if (strlen(val) == 0)
@@ -1013,6 +1273,15 @@ void server_config_load(serverConfig_t * config, const char * const service)
 
         TRACE(TRACE_DEBUG, "Cipher string is set to [%s]", config->tls_ciphers);
 
+	/* read items: TLS_TICKET_KEY */
+	config_get_value("TLS_TICKET_KEY", service, val);
+	if(strlen(val) == 0)
+		TRACE(TRACE_INFO, "no value for TLS_TICKET_KEY in config file");
+	strncpy(config->tls_ticket_key, val, FIELDSIZE);
+        config->tls_ticket_key[FIELDSIZE - 1] = '\0';
+
+        TRACE(TRACE_DEBUG, "Ticket key file is set to [%s]", config->tls_ticket_key);
+
 	strncpy(config->service_name, service, FIELDSIZE);
 
 	GetDBParams();
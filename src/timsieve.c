@@ -66,6 +66,22 @@ extern serverConfig_t *server_conf;
 static int tims(ClientSession_t *session);
 static int tims_tokenizer(ClientSession_t *session, char *buffer);
 
+/* commands run on the worker pool */
+static void tims_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ClientSession_t *session = D->client;
+
+	TRY
+		D->status = tims(session);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		ci_write(session->ci, "NO \"database unavailable, try again later\"\r\n");
+		D->status = 1;
+	END_TRY;
+	client_session_reset_parser(session);
+}
+
 static void send_greeting(ClientSession_t *session)
 {
 	field_t banner;
@@ -104,11 +120,8 @@ static void tims_handle_input(void *arg)
 				client_session_bailout(&session);
 				return;
 			}
-			if (tims(session) == -3) {
-				client_session_bailout(&session);
-				return;
-			}
-			client_session_reset_parser(session);
+			client_session_dispatch(session, tims_enter, NULL);
+			return;
 		}
 	}
 
@@ -37,9 +37,12 @@
 #include "dm_cram.h"
 
 extern char *configFile;
+extern db_param_t _db_params;
 extern int quiet;
 extern int reallyquiet;
 
+#define DBPFX _db_params.pfx
+
 static clientbase_t * ci_new(void)
 {
 	clientbase_t *ci = g_new0(clientbase_t,1);
@@ -85,6 +88,51 @@ START_TEST(test_auth_validate)
 }
 END_TEST
 
+START_TEST(test_auth_cache)
+{
+	u64_t user_idnr, user_idnr_check;
+	int result;
+	char *userid = "testauthcache";
+	clientbase_t *ci = ci_new();
+
+	if (!auth_user_exists(userid, &user_idnr))
+		auth_adduser(userid,"initialpassword","", 101, 1002400, &user_idnr);
+
+	result = auth_validate(ci, userid, "initialpassword", &user_idnr_check);
+	fail_unless(result==1,"auth_validate failed [%d]", result);
+	/* served from the cache */
+	result = auth_validate(ci, userid, "initialpassword", &user_idnr_check);
+	fail_unless(result==1,"auth_validate failed [%d]", result);
+	fail_unless(user_idnr_check == user_idnr, "User ID number mismatch from auth_validate.");
+	fail_unless(auth_user_exists(userid, &user_idnr_check) == 1, "auth_user_exists failed");
+	fail_unless(user_idnr_check == user_idnr, "User ID number mismatch from auth_user_exists.");
+	result = auth_validate(ci, userid, "wrongpassword", &user_idnr_check);
+	fail_unless(result==0,"auth_validate accepted a wrong password");
+
+	/* a new password must not leave the old one usable */
+	auth_change_password(user_idnr, "newpassword", "");
+	result = auth_validate(ci, userid, "initialpassword", &user_idnr_check);
+	fail_unless(result==0,"auth_validate accepted a changed password");
+	result = auth_validate(ci, userid, "newpassword", &user_idnr_check);
+	fail_unless(result==1,"auth_validate failed [%d]", result);
+
+	/* a change made by another process reaches this one
+	 * through the generation counter */
+	db_update("UPDATE %susers SET passwd = 'otherpassword', encryption_type = '' "
+			"WHERE user_idnr = %llu", DBPFX, user_idnr);
+	db_generation_bump("auth");
+	sleep(1);
+	result = auth_validate(ci, userid, "newpassword", &user_idnr_check);
+	fail_unless(result==0,"auth_validate accepted a password changed elsewhere");
+	result = auth_validate(ci, userid, "otherpassword", &user_idnr_check);
+	fail_unless(result==1,"auth_validate failed [%d]", result);
+
+	/* a deleted user is gone */
+	auth_delete_user(userid);
+	fail_unless(auth_user_exists(userid, &user_idnr_check) == 0, "auth_user_exists found a deleted user");
+}
+END_TEST
+
 START_TEST(test_auth_change_password)
 {
 	u64_t user_idnr, user_idnr_check;
@@ -206,6 +254,7 @@ Suite *dbmail_common_suite(void)
 	
 	tcase_add_checked_fixture(tc_auth, setup, teardown);
 	tcase_add_test(tc_auth, test_auth_validate);
+	tcase_add_test(tc_auth, test_auth_cache);
 	tcase_add_test(tc_auth, test_auth_change_password);
 	tcase_add_test(tc_auth, test_auth_change_password_raw);
 	tcase_add_test(tc_auth, test_auth_cram_md5);
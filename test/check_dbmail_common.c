@@ -72,6 +72,38 @@ START_TEST(test_read_config)
 }
 END_TEST
 
+START_TEST(test_config_get_value)
+{
+	field_t a, b, c;
+
+	/* keys and sections are matched regardless of case */
+	config_get_value("driver", "DBMAIL", a);
+	config_get_value("DRIVER", "dbmail", b);
+	fail_unless(strlen(a) > 0, "driver not set");
+	fail_unless(MATCH(a,b), "case sensitive lookup [%s] [%s]", a, b);
+
+	/* falls back to the DBMAIL section */
+	config_get_value("Driver", "IMAP", c);
+	fail_unless(MATCH(a,c), "no fallback to DBMAIL [%s] [%s]", a, c);
+
+	config_get_value("no_such_key", "IMAP", c);
+	fail_unless(c[0] == '\0', "unknown key has a value");
+
+	fail_unless(config_get_int("no_such_key", "IMAP", 42) == 42, "config_get_int ignores fallback");
+	fail_unless(config_get_bool("no_such_key", "IMAP") == FALSE, "config_get_bool failed");
+
+	/* reloading swaps in a new snapshot */
+	fail_unless(config_reload(configFile) == 0, "config_reload failed");
+	config_get_value("driver", "DBMAIL", b);
+	fail_unless(MATCH(a,b), "reloaded config differs [%s] [%s]", a, b);
+
+	/* an unreadable file keeps the current one */
+	fail_unless(config_reload("/nonexistent/dbmail.conf") == -1, "config_reload should fail");
+	config_get_value("driver", "DBMAIL", b);
+	fail_unless(MATCH(a,b), "failed reload lost the config [%s] [%s]", a, b);
+}
+END_TEST
+
 START_TEST(test_db_connect)
 {
 	int res;
@@ -99,6 +131,7 @@ Suite *dbmail_common_suite(void)
 	
 	tcase_add_checked_fixture(tc_config, setup, teardown);
 	tcase_add_test(tc_config, test_read_config);
+	tcase_add_test(tc_config, test_config_get_value);
 	tcase_add_test(tc_config, test_db_connect);
 	tcase_add_test(tc_config, test_glog);
 	
@@ -37,9 +37,12 @@
 #include "check_dbmail.h"
 
 extern char *configFile;
+extern db_param_t _db_params;
 extern int quiet;
 extern int reallyquiet;
 
+#define DBPFX _db_params.pfx
+
 u64_t useridnr = 0;
 u64_t useridnr_domain = 0;
 
@@ -132,6 +135,115 @@ START_TEST(test_db_stmt_prepare)
 }
 END_TEST
 
+START_TEST(test_db_stmt_cache)
+{
+	C c; S s, t; R r;
+	u64_t hits, misses, h, m;
+
+	c = db_con_get();
+	s = db_stmt_prepare(c, "SELECT %d=?", 1);
+	db_stmt_set_int(s, 1, 1);
+	r = db_stmt_query(s);
+	fail_unless(db_result_next(r), "db_stmt_query failed");
+
+	/* the result set is still open */
+	t = db_stmt_prepare(c, "SELECT %d=?", 1);
+	fail_unless(s != t, "db_stmt_prepare handed out a statement in use");
+
+	/* read to the end */
+	fail_unless(! db_result_next(r), "too many rows");
+	db_stmt_cache_stats(&hits, &misses);
+	t = db_stmt_prepare(c, "SELECT %d=?", 1);
+	db_stmt_cache_stats(&h, &m);
+	fail_unless(s == t, "db_stmt_prepare should return the cached statement");
+	fail_unless(h == hits + 1 && m == misses, "db_stmt_prepare cache hit not counted");
+	db_stmt_set_int(t, 1, 1);
+	db_stmt_exec(t);
+
+	db_con_clear(c);
+	db_stmt_prepare(c, "SELECT %d=?", 1);
+	db_stmt_cache_stats(&hits, &misses);
+	fail_unless(misses == m + 1, "db_con_clear should drop cached statements");
+	db_con_close(c);
+}
+END_TEST
+
+START_TEST(test_db_con_get)
+{
+	C c;
+	u64_t waits[DB_CON_WAIT_BUCKETS], saturated, timeouts;
+	u64_t before;
+
+	db_con_stats(waits, &saturated, &timeouts);
+	before = waits[0];
+	c = db_con_get();
+	fail_unless(c != NULL, "db_con_get failed");
+	db_con_close(c);
+	db_con_stats(waits, &saturated, &timeouts);
+	fail_unless(waits[0] == before + 1, "db_con_get should count an immediate connection");
+	fail_unless(timeouts == 0, "db_con_get should not time out");
+}
+END_TEST
+
+START_TEST(test_db_getmailbox_seqs)
+{
+	GTree *seqs;
+	u64_t userid, *id, *seq, before;
+
+	seqs = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free,(GDestroyNotify)g_free);
+	id = g_new0(u64_t,1);
+	seq = g_new0(u64_t,1);
+	*id = get_mailbox_id("INBOX", &userid);
+	g_tree_insert(seqs, id, seq);
+
+	fail_unless(db_getmailbox_seqs(seqs) == DM_SUCCESS, "db_getmailbox_seqs failed");
+	before = *seq;
+	db_mailbox_seq_update(*id);
+	fail_unless(db_getmailbox_seqs(seqs) == DM_SUCCESS, "db_getmailbox_seqs failed");
+	fail_unless(*seq == before + 1, "db_getmailbox_seqs didn't pick up the new seq");
+
+	g_tree_destroy(seqs);
+}
+END_TEST
+
+START_TEST(test_dm_sievescript_get_active)
+{
+	char *name = NULL, *script = NULL, *hash = NULL;
+	u64_t userid;
+
+	auth_user_exists("testuser1", &userid);
+
+	dm_sievescript_add(userid, "testcache", "keep;");
+	dm_sievescript_activate(userid, "testcache");
+	fail_unless(dm_sievescript_get_active(userid, &name, &script, &hash) == TRUE, "dm_sievescript_get_active failed");
+	fail_unless(name && MATCH(name, "testcache"), "dm_sievescript_get_active returned the wrong script");
+	fail_unless(script && MATCH(script, "keep;"), "dm_sievescript_get_active returned the wrong script");
+	fail_unless(hash != NULL, "dm_sievescript_get_active didn't hash the script");
+	g_free(name); g_free(script); g_free(hash);
+
+	/* served from the cache */
+	fail_unless(dm_sievescript_isactive(userid) == TRUE, "dm_sievescript_isactive failed");
+
+	/* a change made by another process reaches this one
+	 * through the generation counter */
+	db_update("UPDATE %ssievescripts SET script = 'discard;' "
+			"WHERE owner_idnr = %llu AND name = 'testcache'", DBPFX, userid);
+	db_generation_bump("sieve");
+	sleep(1);
+	script = NULL;
+	fail_unless(dm_sievescript_get_active(userid, NULL, &script, NULL) == TRUE, "dm_sievescript_get_active failed");
+	fail_unless(script && MATCH(script, "discard;"), "dm_sievescript_get_active missed a change made elsewhere");
+	g_free(script);
+
+	/* dropped from the cache */
+	dm_sievescript_delete(userid, "testcache");
+	fail_unless(dm_sievescript_isactive(userid) == FALSE, "dm_sievescript_delete didn't invalidate the cache");
+	name = NULL;
+	fail_unless(dm_sievescript_get_active(userid, &name, NULL, NULL) == FALSE, "dm_sievescript_get_active failed");
+	fail_unless(name == NULL, "dm_sievescript_get_active returned a deleted script");
+}
+END_TEST
+
 START_TEST(test_db_stmt_set_int)
 {
 
@@ -1206,6 +1318,10 @@ Suite *dbmail_db_suite(void)
 	tcase_add_test(tc_db, test_db_stmt_set_str);
 //	tcase_add_test(tc_db, test_db_stmt_set_blob);
 	tcase_add_test(tc_db, test_db_stmt_exec);
+	tcase_add_test(tc_db, test_db_stmt_cache);
+	tcase_add_test(tc_db, test_db_con_get);
+	tcase_add_test(tc_db, test_db_getmailbox_seqs);
+	tcase_add_test(tc_db, test_dm_sievescript_get_active);
 
 	tcase_add_test(tc_db, test_Connection_executeQuery);
 	tcase_add_test(tc_db, test_db_createmailbox);
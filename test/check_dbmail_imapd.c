@@ -33,6 +33,7 @@
 
 #include <check.h>
 #include "check_dbmail.h"
+#include "dm_cache.h"
 
 extern char *configFile;
 extern db_param_t _db_params;
@@ -257,6 +258,50 @@ START_TEST(test_imap_get_structure)
 }
 END_TEST
 
+START_TEST(test_imap_cache)
+{
+	DbmailMessage *message;
+	Cache_T C1, C2;
+	CacheStats_t before, after;
+	const char *data;
+	u64_t size, hdrsize, bodysize;
+	char *crlf;
+
+	message = dbmail_message_new();
+	message = dbmail_message_init_with_string(message, g_string_new(multipart_message));
+	message->id = 987654321;
+
+	Cache_get_stats(&before);
+
+	C1 = Cache_new();
+	size = Cache_update(C1, message, DBMAIL_MESSAGE_FILTER_FULL);
+	crlf = get_crlf_encoded(message->raw_content);
+	fail_unless(size == strlen(crlf), "Cache_update failed [%llu] != [%zu]", size, strlen(crlf));
+	data = Cache_get_data(C1, DBMAIL_MESSAGE_FILTER_FULL, &size);
+	fail_unless(strncmp(data, crlf, size) == 0, "Cache_get_data failed");
+
+	data = Cache_get_data(C1, DBMAIL_MESSAGE_FILTER_HEAD, &hdrsize);
+	data = Cache_get_data(C1, DBMAIL_MESSAGE_FILTER_BODY, &bodysize);
+	fail_unless(hdrsize + bodysize == size, "header/body split failed");
+	fail_unless(strncmp(data, crlf + hdrsize, bodysize) == 0, "body offset failed");
+
+	/* a second session shares the rendered message */
+	C2 = Cache_new();
+	fail_unless(Cache_lookup(C2, 987654321, DBMAIL_MESSAGE_FILTER_FULL, &size), "Cache_lookup failed");
+	fail_unless(size == strlen(crlf), "Cache_lookup size failed");
+	fail_if(Cache_lookup(C2, 987654322, DBMAIL_MESSAGE_FILTER_FULL, &size), "Cache_lookup should miss");
+
+	Cache_get_stats(&after);
+	fail_unless(after.hits == before.hits + 1, "hit counter failed");
+	fail_unless(after.misses == before.misses + 2, "miss counter failed");
+
+	Cache_free(&C1);
+	Cache_free(&C2);
+	g_free(crlf);
+	dbmail_message_free(message);
+}
+END_TEST
+
 START_TEST(test_internet_address_list_parse_string)
 {
 	char * trythese [][2] = { 
@@ -891,6 +936,7 @@ Suite *dbmail_suite(void)
 	tcase_add_test(tc_session, test_imap_get_envelope_koi);
 	tcase_add_test(tc_session, test_imap_get_envelope_latin);
 	tcase_add_test(tc_session, test_imap_get_partspec);
+	tcase_add_test(tc_session, test_imap_cache);
 	
 	tcase_add_checked_fixture(tc_mime, setup, teardown);
 
@@ -247,6 +247,52 @@ START_TEST(test_dbmail_mailbox_sort)
 }
 END_TEST
 
+START_TEST(test_dbmail_mailbox_sort_keys)
+{
+	u64_t idx = 0, last = 0;
+	char **array;
+	GList *l;
+	MessageInfo info;
+	DbmailMailbox *mb;
+	guint8 date_keys[] = { SORT_DATE | SORT_REVERSE, SORT_CC, 0 };
+	
+	mb = dbmail_mailbox_new(get_mailbox_id("INBOX"));
+	array = g_strsplit("( SIZE ) us-ascii 1:*"," ",0);
+	dbmail_mailbox_build_imap_search(mb, array, &idx, SEARCH_SORTED);
+	dbmail_mailbox_search(mb);
+	dbmail_mailbox_sort(mb);
+
+	fail_unless(g_list_length(mb->sorted) == Bitset_len(mb->found), "dbmail_mailbox_sort failed: result size");
+
+	for (l = g_list_first(mb->sorted); l; l = g_list_next(l)) {
+		fail_unless(MailboxState_getInfo(mb->mbstate, *(u64_t *)l->data, &info), "dbmail_mailbox_sort failed: unknown uid");
+		fail_unless(info.rfcsize >= last, "dbmail_mailbox_sort failed: SIZE order");
+		last = info.rfcsize;
+		MessageInfo_clear(&info);
+	}
+
+	dbmail_mailbox_free(mb);
+	g_strfreev(array);
+
+	idx = 0;
+	mb = dbmail_mailbox_new(get_mailbox_id("INBOX"));
+	array = g_strsplit("( REVERSE SUBJECT FROM ) us-ascii 1:*"," ",0);
+	dbmail_mailbox_build_imap_search(mb, array, &idx, SEARCH_SORTED);
+	dbmail_mailbox_search(mb);
+	dbmail_mailbox_sort(mb);
+	fail_unless(g_list_length(mb->sorted) == Bitset_len(mb->found), "dbmail_mailbox_sort failed: SUBJECT");
+
+	/* a second sort runs off the keys cached in the mailbox state */
+	l = NULL;
+	fail_unless(MailboxState_sort(mb->mbstate, mb->found, date_keys, &l) == DM_SUCCESS, "MailboxState_sort failed");
+	fail_unless(g_list_length(l) == Bitset_len(mb->found), "MailboxState_sort failed: DATE");
+	g_list_destroy(l);
+
+	dbmail_mailbox_free(mb);
+	g_strfreev(array);
+}
+END_TEST
+
 START_TEST(test_dbmail_mailbox_search)
 {
 	char *args;
@@ -281,7 +327,7 @@ START_TEST(test_dbmail_mailbox_search)
 	
 	dbmail_mailbox_build_imap_search(mb, array, &idx, sorted);
 	dbmail_mailbox_search(mb);
-	all = g_tree_nnodes(mb->found);
+	all = Bitset_len(mb->found);
 	
 	dbmail_mailbox_free(mb);
 	g_strfreev(array);
@@ -295,7 +341,7 @@ START_TEST(test_dbmail_mailbox_search)
 	
 	dbmail_mailbox_build_imap_search(mb, array, &idx, sorted);
 	dbmail_mailbox_search(mb);
-	found = g_tree_nnodes(mb->found);
+	found = Bitset_len(mb->found);
 	
 	dbmail_mailbox_free(mb);
 	g_strfreev(array);
@@ -309,7 +355,7 @@ START_TEST(test_dbmail_mailbox_search)
 	
 	dbmail_mailbox_build_imap_search(mb, array, &idx, sorted);
 	dbmail_mailbox_search(mb);
-	notfound = g_tree_nnodes(mb->found);
+	notfound = Bitset_len(mb->found);
 	
 	dbmail_mailbox_free(mb);
 	g_strfreev(array);
@@ -340,7 +386,7 @@ START_TEST(test_dbmail_mailbox_search)
 	
 	dbmail_mailbox_build_imap_search(mb, array, &idx, sorted);
 	dbmail_mailbox_search(mb);
-	found = g_tree_nnodes(mb->found);
+	found = Bitset_len(mb->found);
 	fail_unless(found==1,"dbmail_mailbox_search failed: SEARCH UID 1");
 	
 	dbmail_mailbox_free(mb);
@@ -366,6 +412,39 @@ START_TEST(test_dbmail_mailbox_search)
 }
 END_TEST
 
+static int search_count(const char *query)
+{
+	u64_t idx = 0;
+	int found;
+	DbmailMailbox *mb = dbmail_mailbox_new(get_mailbox_id("INBOX"));
+	char **array = g_strsplit(query," ",0);
+
+	dbmail_mailbox_build_imap_search(mb, array, &idx, 0);
+	dbmail_mailbox_search(mb);
+	found = mb->found ? (int)Bitset_len(mb->found) : -1;
+	dbmail_mailbox_free(mb);
+	g_strfreev(array);
+
+	return found;
+}
+
+START_TEST(test_dbmail_mailbox_search_state)
+{
+	int all = search_count("1:*");
+
+	fail_unless(all > 0, "dbmail_mailbox_search failed: empty INBOX");
+	fail_unless(search_count("SEEN") + search_count("UNSEEN") == all, "dbmail_mailbox_search failed: SEEN/UNSEEN");
+	fail_unless(search_count("NEW") + search_count("NOT NEW") == all, "dbmail_mailbox_search failed: NEW/NOT NEW");
+	fail_unless(search_count("KEYWORD $nosuchkeyword") == 0, "dbmail_mailbox_search failed: KEYWORD");
+	fail_unless(search_count("UNKEYWORD $nosuchkeyword") == all, "dbmail_mailbox_search failed: UNKEYWORD");
+	fail_unless(search_count("LARGER 0") == all, "dbmail_mailbox_search failed: LARGER");
+	fail_unless(search_count("SMALLER 1") == 0, "dbmail_mailbox_search failed: SMALLER");
+	fail_unless(search_count("BEFORE 1-Jan-2037") == all, "dbmail_mailbox_search failed: BEFORE");
+	fail_unless(search_count("SINCE 1-Jan-1971 BEFORE 1-Jan-1971") == 0, "dbmail_mailbox_search failed: SINCE BEFORE");
+	fail_unless(search_count("OR SEEN UNSEEN") == all, "dbmail_mailbox_search failed: OR SEEN UNSEEN");
+}
+END_TEST
+
 START_TEST(test_dbmail_mailbox_search_parsed_1)
 {
 	u64_t idx=0;
@@ -426,6 +505,32 @@ START_TEST(test_dbmail_mailbox_orderedsubject)
 
 }
 END_TEST
+START_TEST(test_dbmail_mailbox_references)
+{
+	char *res, *again;
+	char **array;
+	u64_t idx = 0;
+	DbmailMailbox *mb = dbmail_mailbox_new(get_mailbox_id("INBOX"));
+	
+	array = g_strsplit("REFERENCES utf-8 1:*"," ",0);
+	dbmail_mailbox_build_imap_search(mb, array, &idx, SEARCH_THREAD_REFERENCES);
+	dbmail_mailbox_search(mb);
+	
+	dbmail_mailbox_set_uid(mb,TRUE);
+	res = dbmail_mailbox_references(mb);
+	fail_unless(res != NULL, "dbmail_mailbox_references failed");
+
+	/* the second run uses the cached thread graph */
+	again = dbmail_mailbox_references(mb);
+	fail_unless(MATCH(res, again), "dbmail_mailbox_references failed [%s] != [%s]", res, again);
+	g_free(res);
+	g_free(again);
+	
+	dbmail_mailbox_free(mb);
+	g_strfreev(array);
+}
+END_TEST
+
 START_TEST(test_dbmail_mailbox_get_set)
 {
 	guint c, d;
@@ -522,10 +627,13 @@ Suite *dbmail_mailbox_suite(void)
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_dump);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_build_imap_search);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_sort);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_sort_keys);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_state);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_1);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_2);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_orderedsubject);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_references);
 	
 	return s;
 }
@@ -103,6 +103,207 @@ START_TEST(test_mbxinfo)
 }
 END_TEST
 
+START_TEST(test_update)
+{
+	MailboxState_T M, N;
+	MessageInfo info;
+	u64_t uid;
+	int flags[IMAP_NFLAGS];
+	u64_t id = get_mailbox_id("INBOX");
+
+	M = MailboxState_new(id);
+	N = MailboxState_update(M);
+	fail_unless(N == NULL, "MailboxState_update should not find changes");
+
+	if ((uid = MailboxState_msnToUid(M, 1))) {
+		memset(flags, 0, sizeof(flags));
+		flags[IMAP_FLAG_FLAGGED] = 1;
+		db_set_msgflag(uid, flags, NULL, IMAPFA_ADD, NULL);
+		db_mailbox_seq_update(id);
+
+		N = MailboxState_update(M);
+		fail_unless(N != NULL, "MailboxState_update missed a change");
+		if (MailboxState_isPartial(N)) {
+			fail_unless(MailboxState_uidToMsn(N, uid) > 0, "changed message not in update");
+			MailboxState_merge(M, N);
+			fail_unless(MailboxState_hasFlag(M, uid, IMAP_FLAG_FLAGGED), "update not merged");
+			fail_unless(MailboxState_getInfo(M, uid, &info), "message lost in merge");
+			fail_unless(info.msn == 1 && info.flags[IMAP_FLAG_FLAGGED], "update not merged");
+			MessageInfo_clear(&info);
+			fail_unless(MailboxState_getSeq(M) == MailboxState_getSeq(N), "seq not merged");
+		}
+		MailboxState_free(&N);
+
+		db_set_msgflag(uid, flags, NULL, IMAPFA_REMOVE, NULL);
+		db_mailbox_seq_update(id);
+	}
+
+	MailboxState_free(&M);
+}
+END_TEST
+
+START_TEST(test_msn)
+{
+	MailboxState_T M;
+	MessageInfo info;
+	GList *keywords;
+	u64_t msn, uid, first, last, count;
+	u64_t id = get_mailbox_id("INBOX");
+
+	M = MailboxState_new(id);
+	count = MailboxState_count(M);
+
+	fail_unless(MailboxState_msnToUid(M, 0) == 0, "msn 0 should not map");
+	fail_unless(MailboxState_msnToUid(M, count + 1) == 0, "msn past the end should not map");
+
+	for (msn = 1; msn <= count; msn++) {
+		uid = MailboxState_msnToUid(M, msn);
+		fail_unless(uid > MailboxState_msnToUid(M, msn - 1), "uids not ascending");
+		fail_unless(MailboxState_uidToMsn(M, uid) == msn, "uid/msn mapping broken");
+	}
+
+	if (count) {
+		fail_unless(MailboxState_uidRange(M, 0, G_MAXUINT64, &first, &last), "uidRange failed");
+		fail_unless(first == 1 && last == count, "uidRange should span the mailbox");
+		fail_unless(! MailboxState_uidRange(M, MailboxState_getUidnext(M), G_MAXUINT64, &first, &last),
+				"uidRange found uids at uidnext");
+
+		uid = MailboxState_msnToUid(M, count);
+		fail_unless(MailboxState_getInfo(M, uid, &info), "getInfo failed");
+		fail_unless(info.uid == uid && info.msn == count, "getInfo wrong message");
+
+		keywords = g_list_append(NULL, g_strdup("$Label1"));
+		keywords = g_list_append(keywords, g_strdup("$label1"));
+		MessageInfo_clear(&info);
+		info.keywords = keywords;
+		info.flags[IMAP_FLAG_SEEN] = 1;
+		MailboxState_setInfo(M, &info);
+		MessageInfo_clear(&info);
+
+		fail_unless(MailboxState_hasFlag(M, uid, IMAP_FLAG_SEEN), "setInfo lost a flag");
+		MailboxState_getInfo(M, uid, &info);
+		fail_unless(g_list_length(info.keywords) == 1, "keywords should be interned case-insensitively");
+		fail_unless(MATCH((char *)info.keywords->data, "$Label1"), "keyword name lost");
+		MessageInfo_clear(&info);
+
+		fail_unless(MailboxState_removeUid(M, uid) == DM_SUCCESS, "removeUid failed");
+		fail_unless(MailboxState_count(M) == count - 1, "removeUid didn't shrink the state");
+		fail_unless(MailboxState_uidToMsn(M, uid) == 0, "removed uid still mapped");
+	}
+
+	MailboxState_free(&M);
+}
+END_TEST
+
+START_TEST(test_set_msgflags)
+{
+	MailboxState_T M, N;
+	MessageInfo info;
+	GList *keywords;
+	GTree *ids;
+	u64_t msn, uid, count, *k, *v;
+	int flags[IMAP_NFLAGS];
+	u64_t id = get_mailbox_id("INBOX");
+
+	M = MailboxState_new(id);
+	count = MailboxState_count(M);
+
+	// every message but the second, to get both a range and a loner
+	ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free,(GDestroyNotify)g_free);
+	for (msn = 1; msn <= count; msn++) {
+		if (msn == 2) continue;
+		k = g_new0(u64_t,1);
+		v = g_new0(u64_t,1);
+		*k = MailboxState_msnToUid(M, msn);
+		*v = msn;
+		g_tree_insert(ids, k, v);
+	}
+
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_FLAGGED] = 1;
+	keywords = g_list_append(NULL, g_strdup("$SetMsgflags"));
+
+	fail_unless(db_set_msgflags(id, ids, flags, keywords, IMAPFA_ADD) == DM_SUCCESS, "db_set_msgflags failed");
+	db_mailbox_seq_update(id);
+
+	N = MailboxState_new(id);
+	for (msn = 1; msn <= count; msn++) {
+		uid = MailboxState_msnToUid(N, msn);
+		if (msn == 2) continue;
+		fail_unless(MailboxState_hasFlag(N, uid, IMAP_FLAG_FLAGGED), "flag not set on [%llu]", uid);
+		MailboxState_getInfo(N, uid, &info);
+		fail_unless(g_list_length(info.keywords) > 0, "keyword not set on [%llu]", uid);
+		MessageInfo_clear(&info);
+	}
+	MailboxState_free(&N);
+
+	// again: existing keywords must not collide
+	fail_unless(db_set_msgflags(id, ids, flags, keywords, IMAPFA_ADD) == DM_SUCCESS, "db_set_msgflags failed");
+	fail_unless(db_set_msgflags(id, ids, flags, keywords, IMAPFA_REMOVE) == DM_SUCCESS, "db_set_msgflags failed");
+	db_mailbox_seq_update(id);
+
+	N = MailboxState_new(id);
+	for (msn = 1; msn <= count; msn++) {
+		uid = MailboxState_msnToUid(N, msn);
+		if (msn == 2)
+			fail_unless(MailboxState_hasFlag(N, uid, IMAP_FLAG_FLAGGED) == MailboxState_hasFlag(M, uid, IMAP_FLAG_FLAGGED), 
+					"message outside the set changed [%llu]", uid);
+		else
+			fail_unless(! MailboxState_hasFlag(N, uid, IMAP_FLAG_FLAGGED), "flag not removed from [%llu]", uid);
+	}
+	MailboxState_free(&N);
+
+	g_list_destroy(keywords);
+	g_tree_destroy(ids);
+	MailboxState_free(&M);
+}
+END_TEST
+
+START_TEST(test_copymsgs)
+{
+	MailboxState_T M, N;
+	GTree *ids, *newids = NULL;
+	u64_t msn, count, *k, *v, *newid;
+	u64_t id = get_mailbox_id("INBOX");
+	u64_t copy = get_mailbox_id("CopyMsgs");
+	u64_t owner;
+
+	auth_user_exists("testuser1",&owner);
+
+	M = MailboxState_new(id);
+	count = MailboxState_count(M);
+
+	ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free,(GDestroyNotify)g_free);
+	for (msn = 1; msn <= count; msn++) {
+		k = g_new0(u64_t,1);
+		v = g_new0(u64_t,1);
+		*k = MailboxState_msnToUid(M, msn);
+		*v = msn;
+		g_tree_insert(ids, k, v);
+	}
+
+	fail_unless(db_copymsgs(id, ids, copy, owner, &newids) == DM_SUCCESS, "db_copymsgs failed");
+
+	if (count) {
+		fail_unless(newids != NULL, "db_copymsgs returned no uid map");
+		fail_unless((u64_t)g_tree_nnodes(newids) == count, "uid map incomplete");
+		for (msn = 1; msn <= count; msn++) {
+			u64_t uid = MailboxState_msnToUid(M, msn);
+			newid = g_tree_lookup(newids, &uid);
+			fail_unless(newid && *newid > uid, "uid [%llu] not mapped", uid);
+		}
+
+		N = MailboxState_new(copy);
+		fail_unless(MailboxState_count(N) == count, "copies missing");
+		MailboxState_free(&N);
+		g_tree_destroy(newids);
+	}
+
+	g_tree_destroy(ids);
+	MailboxState_free(&M);
+	db_delete_mailbox(copy, 0, 1);
+}
+END_TEST
 
 Suite *dbmail_common_suite(void)
 {
@@ -114,6 +315,10 @@ Suite *dbmail_common_suite(void)
 	tcase_add_checked_fixture(tc_state, setup, teardown);
 	tcase_add_test(tc_state, test_createdestroy);
 	tcase_add_test(tc_state, test_mbxinfo);
+	tcase_add_test(tc_state, test_update);
+	tcase_add_test(tc_state, test_msn);
+	tcase_add_test(tc_state, test_set_msgflags);
+	tcase_add_test(tc_state, test_copymsgs);
 
 	return s;
 }
@@ -110,6 +110,32 @@ START_TEST(test_mem_read)
 }
 END_TEST
 
+START_TEST(test_mem_read_chunked)
+{
+	char *instr = "abcdefghijklmnopqrstuvwxyz";
+	char out[32];
+	int l;
+
+	Mem_T M = Mem_open();
+	Mem_write(M, instr, 26);
+	Mem_rewind(M);
+
+	memset(out, 0, sizeof(out));
+	l = Mem_read(M, out, 20);
+	fail_unless(l == 20, "Mem_read failed: %d != 20", l);
+
+	memset(out, 0, sizeof(out));
+	l = Mem_read(M, out, 20);
+	fail_unless(l == 6, "Mem_read failed: %d != 6", l);
+	fail_unless(MATCH(out,"uvwxyz"), "Mem_read failed [%s]", out);
+
+	l = Mem_read(M, out, 20);
+	fail_unless(l == 0, "Mem_read past end failed: %d != 0", l);
+
+	Mem_close(&M);
+}
+END_TEST
+
 Suite *dbmail_memblock_suite(void)
 {
 	Suite *s = suite_create("Dbmail Memblock");
@@ -121,6 +147,7 @@ Suite *dbmail_memblock_suite(void)
 	tcase_add_test(tc_memblock, test_mem_open);
 	tcase_add_test(tc_memblock, test_mem_write);
 	tcase_add_test(tc_memblock, test_mem_read);
+	tcase_add_test(tc_memblock, test_mem_read_chunked);
 	
 	return s;
 }
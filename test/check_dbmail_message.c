@@ -426,6 +426,40 @@ START_TEST(test_dbmail_message_init_with_string)
 }
 END_TEST
 
+START_TEST(test_dbmail_message_init_with_stream)
+{
+	DbmailMessage *m, *n;
+	GMimeStream *stream;
+	GString *s;
+	char *result, *expect;
+
+	s = g_string_new(rfc822);
+	stream = g_mime_stream_mem_new_with_buffer(s->str, s->len);
+
+	m = dbmail_message_new();
+	m = dbmail_message_init_with_stream(m, stream);
+	g_object_unref(stream);
+
+	n = dbmail_message_new();
+	n = dbmail_message_init_with_string(n, s);
+
+	/* From_ contains: Wed Sep 14 16:47:48 2005 */
+	result = dbmail_message_get_internal_date(m, 0);
+	fail_unless(MATCH("2005-09-14 16:47:48",result),"dbmail_message_init_with_stream failed got [%s]", result);
+	g_free(result);
+
+	result = dbmail_message_to_string(m);
+	expect = dbmail_message_to_string(n);
+	fail_unless(MATCH(expect,result),"dbmail_message_init_with_stream failed\n[%s] !=\n[%s]\n", expect, result);
+	g_free(result);
+	g_free(expect);
+
+	g_string_free(s,TRUE);
+	dbmail_message_free(m);
+	dbmail_message_free(n);
+}
+END_TEST
+
 START_TEST(test_dbmail_message_get_internal_date)
 {
 	DbmailMessage *m;
@@ -493,13 +527,6 @@ START_TEST(test_dbmail_message_to_string)
 }
 END_TEST
     
-//DbmailMessage * dbmail_message_init_with_stream(DbmailMessage *self, GMimeStream *stream, int type);
-/*
-START_TEST(test_dbmail_message_init_with_stream)
-{
-}
-END_TEST
-*/
 //gchar * dbmail_message_hdrs_to_string(DbmailMessage *self);
 
 START_TEST(test_dbmail_message_hdrs_to_string)
@@ -833,8 +860,8 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_dbmail_message_store2);
 	tcase_add_test(tc_message, test_dbmail_message_retrieve);
 	tcase_add_test(tc_message, test_dbmail_message_init_with_string);
+	tcase_add_test(tc_message, test_dbmail_message_init_with_stream);
 	tcase_add_test(tc_message, test_dbmail_message_to_string);
-//	tcase_add_test(tc_message, test_dbmail_message_init_with_stream);
 	tcase_add_test(tc_message, test_dbmail_message_hdrs_to_string);
 	tcase_add_test(tc_message, test_dbmail_message_body_to_string);
 	tcase_add_test(tc_message, test_dbmail_message_set_header);
@@ -318,6 +318,121 @@ START_TEST(test_g_list_merge)
 }
 END_TEST
 
+START_TEST(test_bitset)
+{
+	Bitset_T a, b;
+	size_t i, n = 0;
+
+	a = Bitset_new(300);
+	fail_unless(Bitset_len(a) == 0, "Bitset_new failed");
+	Bitset_fill(a, 3, 200);
+	fail_unless(Bitset_len(a) == 198, "Bitset_fill failed [%zu]", Bitset_len(a));
+	fail_unless(! Bitset_has(a, 2) && Bitset_has(a, 3) && Bitset_has(a, 200) && ! Bitset_has(a, 201));
+
+	b = Bitset_new(300);
+	Bitset_fill(b, 0, 1000);
+	fail_unless(Bitset_len(b) == 300, "Bitset_fill out of range failed");
+	Bitset_not(b, a);
+	fail_unless(Bitset_len(b) == 102, "Bitset_not failed");
+
+	for (i = 0; Bitset_next(b, &i); i++)
+		n++;
+	fail_unless(n == 102, "Bitset_next failed [%zu]", n);
+
+	Bitset_and(b, a);
+	fail_unless(Bitset_len(b) == 0, "Bitset_and failed");
+
+	Bitset_add(b, 299);
+	Bitset_or(b, a);
+	fail_unless(Bitset_len(b) == 199, "Bitset_or failed");
+	Bitset_del(b, 299);
+	fail_unless(Bitset_len(b) == 198, "Bitset_del failed");
+
+	Bitset_free(&a);
+	Bitset_free(&b);
+	fail_unless(a == NULL && b == NULL, "Bitset_free failed");
+}
+END_TEST
+
+static void _thread_ids(GTree *ids, u64_t uid)
+{
+	u64_t *k = g_new0(u64_t,1), *v = g_new0(u64_t,1);
+	*k = *v = uid;
+	g_tree_insert(ids, k, v);
+}
+
+START_TEST(test_thread)
+{
+	Thread_T t;
+	GTree *ids;
+	GList *refs = NULL;
+	char *s;
+	u64_t i;
+
+	t = Thread_new();
+	Thread_add(t, 1, "a@x", NULL, "hello", FALSE, 100);
+	refs = g_list_append(refs, "a@x");
+	Thread_add(t, 2, "b@x", refs, "hello", TRUE, 200);
+	Thread_add(t, 3, "c@x", refs, "hello", TRUE, 300);
+	refs = g_list_append(refs, "c@x");
+	Thread_add(t, 5, "e@x", refs, "hello", TRUE, 400);
+	g_list_free(refs);
+	refs = g_list_append(NULL, "missing@x");
+	Thread_add(t, 4, "d@x", refs, "other", FALSE, 50);
+	g_list_free(refs);
+	Thread_add(t, 6, "f@x", NULL, "other", TRUE, 60);
+	fail_unless(Thread_len(t) == 6, "Thread_add failed");
+
+	ids = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+	for (i = 1; i <= 6; i++)
+		_thread_ids(ids, i);
+
+	s = Thread_references(t, ids);
+	fail_unless(MATCH(s, "(4 6)(1 (2)(3 5))"), "Thread_references failed [%s]", s);
+	g_free(s);
+	s = Thread_orderedsubject(t, ids);
+	fail_unless(MATCH(s, "(4 6)(1 (2)(3)(5))"), "Thread_orderedsubject failed [%s]", s);
+	g_free(s);
+
+	/* the children of an expunged message move up */
+	Thread_remove(t, 3);
+	fail_unless(! Thread_has(t, 3), "Thread_remove failed");
+	s = Thread_references(t, ids);
+	fail_unless(MATCH(s, "(4 6)(1 (2)(5))"), "Thread_references failed [%s]", s);
+	g_free(s);
+
+	/* only the requested messages are threaded */
+	i = 1;
+	g_tree_remove(ids, &i);
+	s = Thread_references(t, ids);
+	fail_unless(MATCH(s, "(4 6)((2)(5))"), "Thread_references failed [%s]", s);
+	g_free(s);
+
+	g_tree_destroy(ids);
+	Thread_free(&t);
+	fail_unless(t == NULL, "Thread_free failed");
+}
+END_TEST
+
+START_TEST(test_dm_fts_terms)
+{
+	GList *terms;
+	char *s;
+	const char *text = "Hello, World! hello\tA b-side x1 "
+		"abcdefghijklmnopqrstuvwxyz0123456789";
+
+	terms = dm_fts_terms(text, strlen(text));
+	s = dbmail_imap_plist_as_string(terms);
+	fail_unless(MATCH(s, "(abcdefghijklmnopqrstuvwxyz012345 hello side world x1)"), 
+			"dm_fts_terms failed [%s]", s);
+	g_free(s);
+	g_list_destroy(terms);
+
+	terms = dm_fts_terms("- a -", 5);
+	fail_unless(terms == NULL, "dm_fts_terms failed");
+}
+END_TEST
+
 START_TEST(test_dm_strtoull)
 {
 	fail_unless(dm_strtoull("10",NULL,10)==10);
@@ -530,6 +645,9 @@ Suite *dbmail_misc_suite(void)
 	tcase_add_test(tc_misc, test_dbmail_iconv_decode_address);
 	tcase_add_test(tc_misc, test_create_unique_id);
 	tcase_add_test(tc_misc, test_g_list_merge);
+	tcase_add_test(tc_misc, test_bitset);
+	tcase_add_test(tc_misc, test_thread);
+	tcase_add_test(tc_misc, test_dm_fts_terms);
  	tcase_add_test(tc_misc, test_dm_strtoull);
 	tcase_add_test(tc_misc, test_base64_decode);
 	tcase_add_test(tc_misc, test_base64_decodev);